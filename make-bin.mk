@@ -182,6 +182,25 @@ DLIBS += --specs=rdimon.specs -lc -lc -lrdimon
 DDEFS += -DUSE_SEMIHOSTING -DDEBUG
 endif
 
+# Build with MSG_STATS=1 to collect message bus statistics
+ifeq ($(MSG_STATS),1)
+DDEFS += -DMSG_STATS
+endif
+
+# Build with LAN_API_PORT=<port> to accept API clients on the local network.
+ifneq ($(LAN_API_PORT),)
+DDEFS += -DLAN_API_PORT=$(LAN_API_PORT)
+endif
+
+# Build with TELEMETRY_PORT=<port> to broadcast sensor telemetry over UDP.
+# TELEMETRY_GROUP=<address> sends it to a multicast group instead.
+ifneq ($(TELEMETRY_PORT),)
+DDEFS += -DTELEMETRY_PORT=$(TELEMETRY_PORT)
+endif
+ifneq ($(TELEMETRY_GROUP),)
+DDEFS += -DTELEMETRY_GROUP=$(TELEMETRY_GROUP)
+endif
+
 #
 # End of default section
 ##############################################################################
@@ -246,6 +265,9 @@ $(AUTOGEN_DIR)/image_resources.c $(AUTOGEN_DIR)/image_resources.h: scripts/imgco
 $(AUTOGEN_DIR)/bbmt.pb: $(BBMT_MSGS)/bbmt.proto | $(AUTOGEN_DIR)
 	@protoc $(BBMT_MSGS_INCLUDES) -o$@ --python_out=$(AUTOGEN_DIR) $(BBMT_MSGS)/bbmt.proto
 	
-$(AUTOGEN_DIR)/bbmt.pb.c $(AUTOGEN_DIR)/bbmt.pb.h: $(AUTOGEN_DIR)/bbmt.pb | $(AUTOGEN_DIR)
-	@python $(NANOPB)/generator/nanopb_generator.py $(AUTOGEN_DIR)/bbmt.pb
+# A project may change how fields are generated in its own bbmt.options
+BBMT_OPTIONS = $(wildcard $(PROJECT_SRC_DIR)/bbmt.options)
+
+$(AUTOGEN_DIR)/bbmt.pb.c $(AUTOGEN_DIR)/bbmt.pb.h: $(AUTOGEN_DIR)/bbmt.pb $(BBMT_OPTIONS) | $(AUTOGEN_DIR)
+	@python $(NANOPB)/generator/nanopb_generator.py $(addprefix -f ,$(BBMT_OPTIONS)) $(AUTOGEN_DIR)/bbmt.pb
 
@@ -10,6 +10,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
 
 
 typedef struct {
@@ -26,6 +27,10 @@ typedef struct {
   char auth_token[64];
   net_settings_t net_settings;
   fault_data_t fault;
+
+  /* Not in the legacy record, so new fields go here */
+  net_lease_t net_lease;
+  uint32_t server_addr;
 } app_cfg_data_t;
 
 typedef struct {
@@ -33,27 +38,112 @@ typedef struct {
   uint32_t crc;
 } app_cfg_rec_t;
 
+/* Record written by older firmware, a raw copy of app_cfg_data_t up to the
+ * fields added since, followed by a CRC32 of it
+ */
+#define APP_CFG_LEGACY_LEN offsetof(app_cfg_data_t, net_lease)
+
+/* Settings are stored on flash as a header, a list of tagged records and a
+ * CRC32 of everything before it. Each record is a one byte tag, a two byte
+ * little endian length and its payload. Empty sensor configs and unused
+ * profile steps are not stored, and strings are stored with a length prefix.
+ * Unknown tags are skipped and short records leave the remaining fields at
+ * their defaults, so fields can be added without resetting the settings.
+ */
+#define APP_CFG_MAGIC 0x47464342 // "BCFG"
+#define APP_CFG_FORMAT_VERSION 1
+#define APP_CFG_MAX_ENCODED (sizeof(app_cfg_data_t) + 256)
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t length;
+} app_cfg_header_t;
+
+/* Record tags. These are stored on flash so must never be renumbered. */
+typedef enum {
+  CFG_TAG_RESET_COUNT = 1,
+  CFG_TAG_TEMP_UNIT = 2,
+  CFG_TAG_CONTROL_MODE = 3,
+  CFG_TAG_HYSTERESIS = 4,
+  CFG_TAG_SCREEN_SAVER = 5,
+  CFG_TAG_SENSOR_CONFIG = 6,
+  CFG_TAG_TOUCH_CALIB = 7,
+  CFG_TAG_CONTROLLER_SETTINGS = 8,
+  CFG_TAG_PROFILE_CHECKPOINT = 9,
+  CFG_TAG_OTA_CHECKPOINT = 10,
+  CFG_TAG_AUTH_TOKEN = 11,
+  CFG_TAG_NET_SETTINGS = 12,
+  CFG_TAG_FAULT = 13,
+  CFG_TAG_NET_LEASE = 14,
+  CFG_TAG_SERVER_ADDR = 15,
+} cfg_tag_t;
+
+typedef struct {
+  uint8_t* buf;
+  uint32_t size;
+  uint32_t len;
+  bool overflow;
+} cfg_writer_t;
+
+typedef struct {
+  const uint8_t* buf;
+  uint32_t len;
+  uint32_t pos;
+  bool underflow;
+} cfg_reader_t;
+
 
 static msg_t app_cfg_thread(void* arg);
-static app_cfg_rec_t* app_cfg_load(sxfs_part_id_t* loaded_from);
-static app_cfg_rec_t* app_cfg_load_from(sxfs_part_id_t part);
+static void app_cfg_set_defaults(void);
+static bool app_cfg_load(sxfs_part_id_t* loaded_from);
+static bool app_cfg_load_from(sxfs_part_id_t part);
+static bool app_cfg_load_legacy(sxfs_part_id_t part);
+static bool app_cfg_stored_matches(sxfs_part_id_t part, const uint8_t* rec, uint32_t rec_len);
+static uint32_t app_cfg_encode(const app_cfg_data_t* data, uint8_t* rec, uint32_t size);
+static bool app_cfg_decode(app_cfg_data_t* data, const uint8_t* payload, uint32_t len);
+static void encode_controller_settings(cfg_writer_t* w, const controller_settings_t* cs);
+static bool decode_controller_settings(cfg_reader_t* r, app_cfg_data_t* data);
+static bool sensor_config_empty(const sensor_config_t* config);
+static void put_bytes(cfg_writer_t* w, const void* data, uint32_t len);
+static void put_u8(cfg_writer_t* w, uint8_t value);
+static void put_u16(cfg_writer_t* w, uint16_t value);
+static void put_u32(cfg_writer_t* w, uint32_t value);
+static void put_string(cfg_writer_t* w, const char* s, uint32_t max_len);
+static uint32_t put_record_start(cfg_writer_t* w, cfg_tag_t tag);
+static void put_record_end(cfg_writer_t* w, uint32_t len_pos);
+static void get_bytes(cfg_reader_t* r, void* data, uint32_t len);
+static void get_blob(cfg_reader_t* r, void* data, uint32_t size);
+static uint8_t get_u8(cfg_reader_t* r);
+static uint16_t get_u16(cfg_reader_t* r);
+static uint32_t get_u32(cfg_reader_t* r);
+static void get_string(cfg_reader_t* r, char* s, uint32_t size);
+static void app_cfg_write_begin(void);
+static void app_cfg_write_end(void);
+static uint32_t app_cfg_read(void* dst, const void* src, size_t size);
 
 
 /* Local RAM copy of app_cfg */
 static app_cfg_rec_t app_cfg_local;
 static Mutex app_cfg_mtx;
 
+/* Partition holding the most recently written settings */
+static sxfs_part_id_t app_cfg_part = SP_APP_CFG_1;
+
+/* Sequence count of writes to app_cfg_local. It is odd while a write is in
+ * progress, so readers can copy settings without taking the mutex and retry
+ * if the count changed underneath them.
+ */
+static volatile uint32_t app_cfg_seq;
+
 
 void
 app_cfg_init()
 {
   chMtxInit(&app_cfg_mtx);
 
-  app_cfg_rec_t* app_cfg = app_cfg_load(NULL);
-  if (app_cfg != NULL) {
-    app_cfg_local = *app_cfg;
+  if (app_cfg_load(&app_cfg_part)) {
     app_cfg_local.data.reset_count++;
-    free(app_cfg);
   }
   else {
     app_cfg_reset();
@@ -62,6 +152,62 @@ app_cfg_init()
   chThdCreateFromHeap(NULL, 1024, LOWPRIO, app_cfg_thread, NULL);
 }
 
+static void
+app_cfg_write_begin()
+{
+  chMtxLock(&app_cfg_mtx);
+  app_cfg_seq++;
+  __asm volatile ("" ::: "memory");
+}
+
+static void
+app_cfg_write_end()
+{
+  __asm volatile ("" ::: "memory");
+  app_cfg_seq++;
+  chMtxUnlock();
+}
+
+/* Copies size bytes of app_cfg_local from src without taking the mutex.
+ * If a writer keeps getting in the way, which happens when this thread has
+ * preempted it mid write, falls back to the mutex so the writer can finish.
+ * Returns the version of the settings copied.
+ */
+static uint32_t
+app_cfg_read(void* dst, const void* src, size_t size)
+{
+  int attempt;
+  uint32_t seq;
+
+  for (attempt = 0; attempt < 3; ++attempt) {
+    seq = app_cfg_seq;
+    if ((seq & 1) == 0) {
+      __asm volatile ("" ::: "memory");
+      memcpy(dst, src, size);
+      __asm volatile ("" ::: "memory");
+      if (app_cfg_seq == seq)
+        return seq;
+    }
+    chThdYield();
+  }
+
+  chMtxLock(&app_cfg_mtx);
+  memcpy(dst, src, size);
+  seq = app_cfg_seq;
+  chMtxUnlock();
+
+  return seq;
+}
+
+/* Returns a number which changes every time any setting is written, so
+ * readers can cheaply tell whether a copy they hold is still current.
+ */
+uint32_t
+app_cfg_get_version()
+{
+  return app_cfg_seq & ~1;
+}
+
 static msg_t
 app_cfg_thread(void* arg)
 {
@@ -78,6 +224,13 @@ app_cfg_thread(void* arg)
 
 void
 app_cfg_reset()
+{
+  app_cfg_set_defaults();
+  app_cfg_flush();
+}
+
+static void
+app_cfg_set_defaults()
 {
   memset(&app_cfg_local.data, 0, sizeof(app_cfg_local.data));
 
@@ -131,52 +284,546 @@ app_cfg_reset()
   app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_2].function = OUTPUT_FUNC_HEATING;
   app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_2].cycle_delay.unit = UNIT_TIME_MIN;
   app_cfg_local.data.controller_settings[CONTROLLER_2].output_settings[OUTPUT_2].cycle_delay.value = 3;
-
-  app_cfg_local.crc = crc32_block(0, &app_cfg_local.data, sizeof(app_cfg_data_t));
-  app_cfg_flush();
 }
 
-static app_cfg_rec_t*
+static bool
 app_cfg_load(sxfs_part_id_t* loaded_from)
 {
-  app_cfg_rec_t* app_cfg = app_cfg_load_from(SP_APP_CFG_1);
-  if (app_cfg != NULL) {
-    if (loaded_from != NULL)
-      *loaded_from = SP_APP_CFG_1;
+  int i;
+  static const sxfs_part_id_t parts[] = { SP_APP_CFG_1, SP_APP_CFG_2 };
 
-    return app_cfg;
+  for (i = 0; i < 2; ++i) {
+    if (app_cfg_load_from(parts[i])) {
+      *loaded_from = parts[i];
+      return true;
+    }
   }
 
-  app_cfg = app_cfg_load_from(SP_APP_CFG_2);
-  if (app_cfg != NULL) {
-    if (loaded_from != NULL)
-      *loaded_from = SP_APP_CFG_2;
-
-    return app_cfg;
+  /* Settings saved by firmware which wrote the raw struct are converted to
+   * the new format on the next flush.
+   */
+  for (i = 0; i < 2; ++i) {
+    if (app_cfg_load_legacy(parts[i])) {
+      *loaded_from = parts[i];
+      return true;
+    }
   }
 
-  return NULL;
+  return false;
 }
 
-static app_cfg_rec_t*
+static bool
 app_cfg_load_from(sxfs_part_id_t part)
 {
   bool ret;
-  app_cfg_rec_t* app_cfg = malloc(sizeof(app_cfg_rec_t));
+  app_cfg_header_t hdr;
 
-  ret = sxfs_read(part, 0, (uint8_t*)app_cfg, sizeof(app_cfg_rec_t));
-  if (!ret) {
-    free(app_cfg);
-    return NULL;
+  ret = sxfs_read(part, 0, (uint8_t*)&hdr, sizeof(hdr));
+  if (!ret || hdr.magic != APP_CFG_MAGIC || hdr.length > APP_CFG_MAX_ENCODED)
+    return false;
+
+  uint32_t rec_len = sizeof(hdr) + hdr.length + sizeof(uint32_t);
+  uint8_t* rec = malloc(rec_len);
+
+  ret = sxfs_read(part, 0, rec, rec_len);
+  if (ret) {
+    uint32_t crc;
+    memcpy(&crc, rec + rec_len - sizeof(uint32_t), sizeof(crc));
+    ret = (crc32_block(0, rec, rec_len - sizeof(uint32_t)) == crc);
   }
 
-  uint32_t calc_crc = crc32_block(0, &app_cfg->data, sizeof(app_cfg_data_t));
-  if (calc_crc != app_cfg->crc) {
-    free(app_cfg);
-    return NULL;
+  if (ret) {
+    app_cfg_set_defaults();
+    ret = app_cfg_decode(&app_cfg_local.data, rec + sizeof(hdr), hdr.length);
+  }
+
+  free(rec);
+  return ret;
+}
+
+static bool
+app_cfg_load_legacy(sxfs_part_id_t part)
+{
+  bool ret;
+  uint8_t* rec = malloc(APP_CFG_LEGACY_LEN + sizeof(uint32_t));
+
+  ret = sxfs_read(part, 0, rec, APP_CFG_LEGACY_LEN + sizeof(uint32_t));
+  if (ret) {
+    uint32_t crc;
+    memcpy(&crc, rec + APP_CFG_LEGACY_LEN, sizeof(crc));
+    ret = (crc32_block(0, rec, APP_CFG_LEGACY_LEN) == crc);
+  }
+
+  if (ret) {
+    app_cfg_set_defaults();
+    memcpy(&app_cfg_local.data, rec, APP_CFG_LEGACY_LEN);
   }
 
-  return app_cfg;
+  free(rec);
+  return ret;
+}
+
+static bool
+app_cfg_stored_matches(sxfs_part_id_t part, const uint8_t* rec, uint32_t rec_len)
+{
+  uint8_t buf[64];
+  uint32_t offset;
+
+  for (offset = 0; offset < rec_len; offset += sizeof(buf)) {
+    uint32_t chunk = MIN(sizeof(buf), rec_len - offset);
+    if (!sxfs_read(part, offset, buf, chunk) ||
+        memcmp(buf, rec + offset, chunk) != 0)
+      return false;
+  }
+  return true;
+}
+
+/* Encodes the settings into rec and returns the encoded length, or 0 if
+ * they don't fit in size bytes.
+ */
+static uint32_t
+app_cfg_encode(const app_cfg_data_t* data, uint8_t* rec, uint32_t size)
+{
+  int i;
+  uint32_t pos;
+  cfg_writer_t w = {
+      .buf = rec,
+      .size = size,
+      .len = sizeof(app_cfg_header_t),
+      .overflow = false
+  };
+
+  pos = put_record_start(&w, CFG_TAG_RESET_COUNT);
+  put_u32(&w, data->reset_count);
+  put_record_end(&w, pos);
+
+  pos = put_record_start(&w, CFG_TAG_TEMP_UNIT);
+  put_u8(&w, data->temp_unit);
+  put_record_end(&w, pos);
+
+  pos = put_record_start(&w, CFG_TAG_CONTROL_MODE);
+  put_u8(&w, data->control_mode);
+  put_record_end(&w, pos);
+
+  pos = put_record_start(&w, CFG_TAG_HYSTERESIS);
+  put_bytes(&w, &data->hysteresis, sizeof(quantity_t));
+  put_record_end(&w, pos);
+
+  pos = put_record_start(&w, CFG_TAG_SCREEN_SAVER);
+  put_bytes(&w, &data->screen_saver, sizeof(quantity_t));
+  put_record_end(&w, pos);
+
+  for (i = 0; i < MAX_NUM_SENSOR_CONFIGS; ++i) {
+    const sensor_config_t* config = &data->sensor_configs[i];
+    if (sensor_config_empty(config))
+      continue;
+
+    pos = put_record_start(&w, CFG_TAG_SENSOR_CONFIG);
+    put_bytes(&w, config->sensor_serial, sizeof(sensor_serial_t));
+    put_bytes(&w, &config->offset, sizeof(quantity_t));
+    put_record_end(&w, pos);
+  }
+
+  pos = put_record_start(&w, CFG_TAG_TOUCH_CALIB);
+  put_bytes(&w, &data->touch_calib, sizeof(matrix_t));
+  put_record_end(&w, pos);
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    pos = put_record_start(&w, CFG_TAG_CONTROLLER_SETTINGS);
+    encode_controller_settings(&w, &data->controller_settings[i]);
+    put_record_end(&w, pos);
+
+    pos = put_record_start(&w, CFG_TAG_PROFILE_CHECKPOINT);
+    put_u8(&w, i);
+    put_bytes(&w, &data->temp_profile_checkpoints[i], sizeof(temp_profile_checkpoint_t));
+    put_record_end(&w, pos);
+  }
+
+  pos = put_record_start(&w, CFG_TAG_OTA_CHECKPOINT);
+  put_bytes(&w, &data->ota_update_checkpoint, sizeof(ota_update_checkpoint_t));
+  put_record_end(&w, pos);
+
+  pos = put_record_start(&w, CFG_TAG_AUTH_TOKEN);
+  put_string(&w, data->auth_token, sizeof(data->auth_token));
+  put_record_end(&w, pos);
+
+  pos = put_record_start(&w, CFG_TAG_NET_SETTINGS);
+  put_string(&w, data->net_settings.ssid, sizeof(data->net_settings.ssid));
+  put_string(&w, data->net_settings.passphrase, sizeof(data->net_settings.passphrase));
+  put_u32(&w, data->net_settings.security_mode);
+  put_u8(&w, data->net_settings.ip_config);
+  put_u32(&w, data->net_settings.ip);
+  put_u32(&w, data->net_settings.subnet_mask);
+  put_u32(&w, data->net_settings.gateway);
+  put_u32(&w, data->net_settings.dns_server);
+  put_record_end(&w, pos);
+
+  if (data->net_lease.ip != 0) {
+    pos = put_record_start(&w, CFG_TAG_NET_LEASE);
+    put_string(&w, data->net_lease.ssid, sizeof(data->net_lease.ssid));
+    put_u32(&w, data->net_lease.ip);
+    put_u32(&w, data->net_lease.subnet_mask);
+    put_u32(&w, data->net_lease.gateway);
+    put_u32(&w, data->net_lease.dns_server);
+    put_record_end(&w, pos);
+  }
+
+  if (data->server_addr != 0) {
+    pos = put_record_start(&w, CFG_TAG_SERVER_ADDR);
+    put_u32(&w, data->server_addr);
+    put_record_end(&w, pos);
+  }
+
+  if (data->fault.type != FAULT_NONE) {
+    /* Fault data is mostly zero padding */
+    uint32_t fault_len = MAX_FAULT_DATA;
+    while (fault_len > 0 && data->fault.data[fault_len - 1] == 0)
+      fault_len--;
+
+    pos = put_record_start(&w, CFG_TAG_FAULT);
+    put_u8(&w, data->fault.type);
+    put_bytes(&w, data->fault.data, fault_len);
+    put_record_end(&w, pos);
+  }
+
+  if (w.overflow || (w.len + sizeof(uint32_t) > size))
+    return 0;
+
+  app_cfg_header_t hdr = {
+      .magic = APP_CFG_MAGIC,
+      .version = APP_CFG_FORMAT_VERSION,
+      .length = w.len - sizeof(app_cfg_header_t)
+  };
+  memcpy(rec, &hdr, sizeof(hdr));
+
+  put_u32(&w, crc32_block(0, rec, w.len));
+
+  return w.len;
+}
+
+static void
+encode_controller_settings(cfg_writer_t* w, const controller_settings_t* cs)
+{
+  uint32_t i;
+  const temp_profile_t* profile = &cs->temp_profile;
+  uint32_t num_steps = MIN(profile->num_steps, 32);
+
+  put_u8(w, cs->controller);
+  put_u8(w, cs->setpoint_type);
+  put_bytes(w, &cs->static_setpoint, sizeof(quantity_t));
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    put_u8(w, cs->output_settings[i].enabled);
+    put_u8(w, cs->output_settings[i].function);
+    put_bytes(w, &cs->output_settings[i].cycle_delay, sizeof(quantity_t));
+  }
+  put_u8(w, cs->session_action);
+
+  put_u32(w, profile->id);
+  put_string(w, profile->name, sizeof(profile->name));
+  put_bytes(w, &profile->start_value, sizeof(quantity_t));
+  put_u32(w, profile->start_point);
+  put_u8(w, profile->completion_action);
+  put_u8(w, num_steps);
+  for (i = 0; i < num_steps; ++i) {
+    put_u32(w, profile->steps[i].duration);
+    put_bytes(w, &profile->steps[i].value, sizeof(quantity_t));
+    put_u8(w, profile->steps[i].type);
+  }
+}
+
+static bool
+app_cfg_decode(app_cfg_data_t* data, const uint8_t* payload, uint32_t len)
+{
+  int num_sensor_configs = 0;
+  cfg_reader_t r = {
+      .buf = payload,
+      .len = len,
+      .pos = 0,
+      .underflow = false
+  };
+
+  while (r.pos < r.len) {
+    uint8_t tag = get_u8(&r);
+    uint16_t rec_len = get_u16(&r);
+    if (r.underflow || rec_len > (r.len - r.pos))
+      return false;
+
+    cfg_reader_t rr = {
+        .buf = r.buf + r.pos,
+        .len = rec_len,
+        .pos = 0,
+        .underflow = false
+    };
+    r.pos += rec_len;
+
+    switch (tag) {
+      case CFG_TAG_RESET_COUNT:
+        data->reset_count = get_u32(&rr);
+        break;
+
+      case CFG_TAG_TEMP_UNIT:
+        data->temp_unit = get_u8(&rr);
+        break;
+
+      case CFG_TAG_CONTROL_MODE:
+        data->control_mode = get_u8(&rr);
+        break;
+
+      case CFG_TAG_HYSTERESIS:
+        get_blob(&rr, &data->hysteresis, sizeof(quantity_t));
+        break;
+
+      case CFG_TAG_SCREEN_SAVER:
+        get_blob(&rr, &data->screen_saver, sizeof(quantity_t));
+        break;
+
+      case CFG_TAG_SENSOR_CONFIG:
+        if (num_sensor_configs < MAX_NUM_SENSOR_CONFIGS) {
+          sensor_config_t* config = &data->sensor_configs[num_sensor_configs++];
+          get_bytes(&rr, config->sensor_serial, sizeof(sensor_serial_t));
+          get_bytes(&rr, &config->offset, sizeof(quantity_t));
+        }
+        break;
+
+      case CFG_TAG_TOUCH_CALIB:
+        get_blob(&rr, &data->touch_calib, sizeof(matrix_t));
+        break;
+
+      case CFG_TAG_CONTROLLER_SETTINGS:
+        if (!decode_controller_settings(&rr, data))
+          return false;
+        break;
+
+      case CFG_TAG_PROFILE_CHECKPOINT:
+      {
+        uint8_t controller = get_u8(&rr);
+        if (controller < NUM_CONTROLLERS)
+          get_blob(&rr, &data->temp_profile_checkpoints[controller], sizeof(temp_profile_checkpoint_t));
+        break;
+      }
+
+      case CFG_TAG_OTA_CHECKPOINT:
+        get_blob(&rr, &data->ota_update_checkpoint, sizeof(ota_update_checkpoint_t));
+        break;
+
+      case CFG_TAG_AUTH_TOKEN:
+        get_string(&rr, data->auth_token, sizeof(data->auth_token));
+        break;
+
+      case CFG_TAG_NET_SETTINGS:
+        get_string(&rr, data->net_settings.ssid, sizeof(data->net_settings.ssid));
+        get_string(&rr, data->net_settings.passphrase, sizeof(data->net_settings.passphrase));
+        data->net_settings.security_mode = get_u32(&rr);
+        data->net_settings.ip_config = get_u8(&rr);
+        data->net_settings.ip = get_u32(&rr);
+        data->net_settings.subnet_mask = get_u32(&rr);
+        data->net_settings.gateway = get_u32(&rr);
+        data->net_settings.dns_server = get_u32(&rr);
+        break;
+
+      case CFG_TAG_NET_LEASE:
+        get_string(&rr, data->net_lease.ssid, sizeof(data->net_lease.ssid));
+        data->net_lease.ip = get_u32(&rr);
+        data->net_lease.subnet_mask = get_u32(&rr);
+        data->net_lease.gateway = get_u32(&rr);
+        data->net_lease.dns_server = get_u32(&rr);
+        break;
+
+      case CFG_TAG_SERVER_ADDR:
+        data->server_addr = get_u32(&rr);
+        break;
+
+      case CFG_TAG_FAULT:
+        data->fault.type = get_u8(&rr);
+        get_blob(&rr, data->fault.data, MAX_FAULT_DATA);
+        break;
+
+      default:
+        /* Written by newer firmware */
+        break;
+    }
+
+    if (rr.underflow)
+      return false;
+  }
+
+  return true;
+}
+
+static bool
+decode_controller_settings(cfg_reader_t* r, app_cfg_data_t* data)
+{
+  uint32_t i;
+  uint8_t controller = get_u8(r);
+  if (controller >= NUM_CONTROLLERS)
+    return true;
+
+  controller_settings_t* cs = &data->controller_settings[controller];
+  temp_profile_t* profile = &cs->temp_profile;
+
+  cs->controller = controller;
+  cs->setpoint_type = get_u8(r);
+  get_bytes(r, &cs->static_setpoint, sizeof(quantity_t));
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    cs->output_settings[i].enabled = get_u8(r);
+    cs->output_settings[i].function = get_u8(r);
+    get_bytes(r, &cs->output_settings[i].cycle_delay, sizeof(quantity_t));
+  }
+  cs->session_action = get_u8(r);
+
+  profile->id = get_u32(r);
+  get_string(r, profile->name, sizeof(profile->name));
+  get_bytes(r, &profile->start_value, sizeof(quantity_t));
+  profile->start_point = get_u32(r);
+  profile->completion_action = get_u8(r);
+  profile->num_steps = get_u8(r);
+  if (profile->num_steps > 32)
+    return false;
+
+  for (i = 0; i < profile->num_steps; ++i) {
+    profile->steps[i].duration = get_u32(r);
+    get_bytes(r, &profile->steps[i].value, sizeof(quantity_t));
+    profile->steps[i].type = get_u8(r);
+  }
+
+  return !r->underflow;
+}
+
+static bool
+sensor_config_empty(const sensor_config_t* config)
+{
+  static const sensor_serial_t empty_serial;
+  return memcmp(config->sensor_serial, empty_serial, sizeof(sensor_serial_t)) == 0;
+}
+
+static void
+put_bytes(cfg_writer_t* w, const void* data, uint32_t len)
+{
+  if (w->overflow || (len > (w->size - w->len))) {
+    w->overflow = true;
+    return;
+  }
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+}
+
+static void
+put_u8(cfg_writer_t* w, uint8_t value)
+{
+  put_bytes(w, &value, 1);
+}
+
+static void
+put_u16(cfg_writer_t* w, uint16_t value)
+{
+  put_u8(w, value & 0xFF);
+  put_u8(w, value >> 8);
+}
+
+static void
+put_u32(cfg_writer_t* w, uint32_t value)
+{
+  put_u16(w, value & 0xFFFF);
+  put_u16(w, value >> 16);
+}
+
+static void
+put_string(cfg_writer_t* w, const char* s, uint32_t max_len)
+{
+  uint32_t len = strnlen(s, max_len);
+  if (len > 0xFF)
+    len = 0xFF;
+
+  put_u8(w, len);
+  put_bytes(w, s, len);
+}
+
+/* Writes a record tag and a placeholder length. Returns the position of the
+ * length, to be filled in by put_record_end().
+ */
+static uint32_t
+put_record_start(cfg_writer_t* w, cfg_tag_t tag)
+{
+  put_u8(w, tag);
+  uint32_t len_pos = w->len;
+  put_u16(w, 0);
+  return len_pos;
+}
+
+static void
+put_record_end(cfg_writer_t* w, uint32_t len_pos)
+{
+  if (w->overflow)
+    return;
+
+  uint16_t len = w->len - len_pos - 2;
+  w->buf[len_pos] = len & 0xFF;
+  w->buf[len_pos + 1] = len >> 8;
+}
+
+static void
+get_bytes(cfg_reader_t* r, void* data, uint32_t len)
+{
+  if (r->underflow || (len > (r->len - r->pos))) {
+    r->underflow = true;
+    memset(data, 0, len);
+    return;
+  }
+  memcpy(data, r->buf + r->pos, len);
+  r->pos += len;
+}
+
+/* Copies the rest of the record into a struct of size bytes. A shorter
+ * record leaves the remaining fields alone and a longer one is truncated.
+ */
+static void
+get_blob(cfg_reader_t* r, void* data, uint32_t size)
+{
+  uint32_t len = MIN(size, r->len - r->pos);
+  memcpy(data, r->buf + r->pos, len);
+  r->pos = r->len;
+}
+
+static uint8_t
+get_u8(cfg_reader_t* r)
+{
+  uint8_t value;
+  get_bytes(r, &value, 1);
+  return value;
+}
+
+static uint16_t
+get_u16(cfg_reader_t* r)
+{
+  uint16_t lo = get_u8(r);
+  uint16_t hi = get_u8(r);
+  return lo | (hi << 8);
+}
+
+static uint32_t
+get_u32(cfg_reader_t* r)
+{
+  uint32_t lo = get_u16(r);
+  uint32_t hi = get_u16(r);
+  return lo | (hi << 16);
+}
+
+static void
+get_string(cfg_reader_t* r, char* s, uint32_t size)
+{
+  uint32_t len = get_u8(r);
+  uint32_t copy_len = MIN(len, size - 1);
+
+  get_bytes(r, s, copy_len);
+  s[copy_len] = 0;
+
+  /* Skip anything which doesn't fit */
+  if (len > copy_len) {
+    if ((len - copy_len) > (r->len - r->pos))
+      r->underflow = true;
+    else
+      r->pos += len - copy_len;
+  }
 }
 
 unit_t
@@ -195,9 +842,9 @@ app_cfg_set_temp_unit(unit_t temp_unit)
   if (temp_unit == app_cfg_local.data.temp_unit)
     return;
 
-  chMtxLock(&app_cfg_mtx);
+  app_cfg_write_begin();
   app_cfg_local.data.temp_unit = temp_unit;
-  chMtxUnlock();
+  app_cfg_write_end();
 
   msg_send(MSG_TEMP_UNIT, &app_cfg_local.data.temp_unit);
 }
@@ -218,9 +865,9 @@ app_cfg_set_control_mode(output_ctrl_t control_mode)
   if (control_mode == app_cfg_local.data.control_mode)
     return;
 
-  chMtxLock(&app_cfg_mtx);
+  app_cfg_write_begin();
   app_cfg_local.data.control_mode = control_mode;
-  chMtxUnlock();
+  app_cfg_write_end();
 
   msg_send(MSG_CONTROL_MODE, &app_cfg_local.data.control_mode);
 }
@@ -228,7 +875,9 @@ app_cfg_set_control_mode(output_ctrl_t control_mode)
 quantity_t
 app_cfg_get_hysteresis(void)
 {
-  return app_cfg_local.data.hysteresis;
+  quantity_t hysteresis;
+  app_cfg_read(&hysteresis, &app_cfg_local.data.hysteresis, sizeof(hysteresis));
+  return hysteresis;
 }
 
 void
@@ -242,9 +891,9 @@ app_cfg_set_hysteresis(quantity_t hysteresis)
     hysteresis.unit = UNIT_TEMP_DEG_F;
   }
 
-  chMtxLock(&app_cfg_mtx);
+  app_cfg_write_begin();
   app_cfg_local.data.hysteresis = hysteresis;
-  chMtxUnlock();
+  app_cfg_write_end();
 }
 
 quantity_t
@@ -259,9 +908,9 @@ app_cfg_set_screen_saver(quantity_t screen_saver)
   if (memcmp(&screen_saver, &app_cfg_local.data.screen_saver, sizeof(quantity_t)) == 0)
     return;
 
-  chMtxLock(&app_cfg_mtx);
+  app_cfg_write_begin();
   app_cfg_local.data.screen_saver = screen_saver;
-  chMtxUnlock();
+  app_cfg_write_end();
 }
 
 quantity_t
@@ -314,10 +963,10 @@ app_cfg_set_probe_offset(quantity_t probe_offset, sensor_serial_t sensor_serial)
     probe_offset.unit = UNIT_TEMP_DEG_F;
   }
 
-  chMtxLock(&app_cfg_mtx);
+  app_cfg_write_begin();
   memcpy(app_cfg_local.data.sensor_configs[idx].sensor_serial, sensor_serial, sizeof(sensor_serial_t));
   app_cfg_local.data.sensor_configs[idx].offset = probe_offset;
-  chMtxUnlock();
+  app_cfg_write_end();
 }
 
 const matrix_t*
@@ -329,11 +978,15 @@ app_cfg_get_touch_calib(void)
 void
 app_cfg_set_touch_calib(matrix_t* touch_calib)
 {
-  chMtxLock(&app_cfg_mtx);
+  app_cfg_write_begin();
   app_cfg_local.data.touch_calib = *touch_calib;
-  chMtxUnlock();
+  app_cfg_write_end();
 }
 
+/* Returns the live settings, which another thread may be updating. Callers
+ * outside the thread which writes them should copy them with
+ * app_cfg_read_controller_settings() instead.
+ */
 const controller_settings_t*
 app_cfg_get_controller_settings(temp_controller_id_t controller)
 {
@@ -343,6 +996,20 @@ app_cfg_get_controller_settings(temp_controller_id_t controller)
   return &app_cfg_local.data.controller_settings[controller];
 }
 
+/* Copies a consistent snapshot of the controller settings and returns its
+ * version, as from app_cfg_get_version().
+ */
+uint32_t
+app_cfg_read_controller_settings(temp_controller_id_t controller, controller_settings_t* settings)
+{
+  if (controller >= NUM_CONTROLLERS)
+    return 0;
+
+  return app_cfg_read(settings,
+      &app_cfg_local.data.controller_settings[controller],
+      sizeof(controller_settings_t));
+}
+
 void
 app_cfg_set_controller_settings(
     temp_controller_id_t controller,
@@ -354,9 +1021,9 @@ app_cfg_set_controller_settings(
 
   if ((source == SS_SERVER) ||
       memcmp(settings, &app_cfg_local.data.controller_settings[controller], sizeof(controller_settings_t)) != 0) {
-    chMtxLock(&app_cfg_mtx);
+    app_cfg_write_begin();
     app_cfg_local.data.controller_settings[controller] = *settings;
-    chMtxUnlock();
+    app_cfg_write_end();
 
     msg_id_t msg_id;
     if (source == SS_DEVICE)
@@ -364,7 +1031,7 @@ app_cfg_set_controller_settings(
     else
       msg_id = MSG_API_CONTROLLER_SETTINGS;
 
-    msg_send(msg_id, settings);
+    msg_send_keyed(msg_id, controller, settings);
   }
 }
 
@@ -385,9 +1052,9 @@ app_cfg_set_temp_profile_checkpoint(temp_controller_id_t controller, temp_profil
       return;
 
   if (memcmp(checkpoint, &app_cfg_local.data.temp_profile_checkpoints[controller], sizeof(temp_profile_checkpoint_t)) != 0) {
-    chMtxLock(&app_cfg_mtx);
+    app_cfg_write_begin();
     app_cfg_local.data.temp_profile_checkpoints[controller] = *checkpoint;
-    chMtxUnlock();
+    app_cfg_write_end();
   }
 }
 
@@ -400,11 +1067,11 @@ app_cfg_get_auth_token()
 void
 app_cfg_set_auth_token(const char* auth_token)
 {
-  chMtxLock(&app_cfg_mtx);
+  app_cfg_write_begin();
   strncpy(app_cfg_local.data.auth_token,
       auth_token,
       sizeof(app_cfg_local.data.auth_token));
-  chMtxUnlock();
+  app_cfg_write_end();
 }
 
 const net_settings_t*
@@ -417,14 +1084,49 @@ void
 app_cfg_set_net_settings(const net_settings_t* settings)
 {
   if (memcmp(settings, &app_cfg_local.data.net_settings, sizeof(net_settings_t)) != 0) {
-    chMtxLock(&app_cfg_mtx);
+    app_cfg_write_begin();
     app_cfg_local.data.net_settings = *settings;
-    chMtxUnlock();
+    app_cfg_write_end();
 
     msg_send(MSG_NET_NETWORK_SETTINGS, NULL);
   }
 }
 
+const net_lease_t*
+app_cfg_get_net_lease()
+{
+  return &app_cfg_local.data.net_lease;
+}
+
+/* The lease is given out again on every connect, so it is only written when
+ * it changes
+ */
+void
+app_cfg_set_net_lease(const net_lease_t* lease)
+{
+  if (memcmp(lease, &app_cfg_local.data.net_lease, sizeof(net_lease_t)) != 0) {
+    app_cfg_write_begin();
+    app_cfg_local.data.net_lease = *lease;
+    app_cfg_write_end();
+  }
+}
+
+uint32_t
+app_cfg_get_server_addr()
+{
+  return app_cfg_local.data.server_addr;
+}
+
+void
+app_cfg_set_server_addr(uint32_t server_addr)
+{
+  if (server_addr != app_cfg_local.data.server_addr) {
+    app_cfg_write_begin();
+    app_cfg_local.data.server_addr = server_addr;
+    app_cfg_write_end();
+  }
+}
+
 const ota_update_checkpoint_t*
 app_cfg_get_ota_update_checkpoint(void)
 {
@@ -434,9 +1136,9 @@ app_cfg_get_ota_update_checkpoint(void)
 void
 app_cfg_set_ota_update_checkpoint(const ota_update_checkpoint_t* checkpoint)
 {
-  chMtxLock(&app_cfg_mtx);
+  app_cfg_write_begin();
   app_cfg_local.data.ota_update_checkpoint = *checkpoint;
-  chMtxUnlock();
+  app_cfg_write_end();
 }
 
 uint32_t
@@ -470,22 +1172,29 @@ app_cfg_set_fault_data(fault_type_t fault_type, void* data, uint32_t data_size)
 void
 app_cfg_flush()
 {
-  chMtxLock(&app_cfg_mtx);
+  uint8_t* rec = malloc(APP_CFG_MAX_ENCODED);
+  if (rec == NULL)
+    return;
 
-  sxfs_part_id_t used_app_cfg_part = SP_APP_CFG_1;
-  app_cfg_rec_t* app_cfg = app_cfg_load(&used_app_cfg_part);
+  chMtxLock(&app_cfg_mtx);
 
-  app_cfg_local.crc = crc32_block(0, &app_cfg_local.data, sizeof(app_cfg_data_t));
+  sxfs_part_id_t used_app_cfg_part = app_cfg_part;
+  uint32_t rec_len = app_cfg_encode(&app_cfg_local.data, rec, APP_CFG_MAX_ENCODED);
 
-  if (app_cfg == NULL || memcmp(&app_cfg_local, app_cfg, sizeof(app_cfg_rec_t)) != 0) {
+  if (rec_len == 0) {
+    printf("app cfg encode failed!\r\n");
+  }
+  else if (!app_cfg_stored_matches(used_app_cfg_part, rec, rec_len)) {
     bool ret;
     sxfs_part_id_t unused_app_cfg_part =
         (used_app_cfg_part == SP_APP_CFG_1) ? SP_APP_CFG_2 : SP_APP_CFG_1;
 
     ret = sxfs_erase_all(unused_app_cfg_part);
     if (ret) {
-      ret = sxfs_write(unused_app_cfg_part, 0, (uint8_t*)&app_cfg_local, sizeof(app_cfg_local));
+      ret = sxfs_write(unused_app_cfg_part, 0, rec, rec_len);
       if (ret) {
+        app_cfg_part = unused_app_cfg_part;
+
         ret = sxfs_erase_all(used_app_cfg_part);
         if (!ret)
           printf("used app cfg erase failed! %d\r\n", used_app_cfg_part);
@@ -500,6 +1209,5 @@ app_cfg_flush()
   }
   chMtxUnlock();
 
-  if (app_cfg != NULL)
-    free(app_cfg);
+  free(rec);
 }
@@ -9,7 +9,6 @@
 #include "web_api.h"
 #include "net.h"
 #include "fault.h"
-#include "offset.h"
 #include "sensor.h"
 #include "ota_update.h"
 
@@ -26,6 +25,9 @@ app_cfg_init(void);
 void
 app_cfg_reset(void);
 
+uint32_t
+app_cfg_get_version(void);
+
 unit_t
 app_cfg_get_temp_unit(void);
 
@@ -65,6 +67,9 @@ app_cfg_set_touch_calib(matrix_t* touch_calib);
 const controller_settings_t*
 app_cfg_get_controller_settings(temp_controller_id_t controller);
 
+uint32_t
+app_cfg_read_controller_settings(temp_controller_id_t controller, controller_settings_t* settings);
+
 void
 app_cfg_set_controller_settings(
     temp_controller_id_t controller,
@@ -95,6 +100,18 @@ app_cfg_get_net_settings(void);
 void
 app_cfg_set_net_settings(const net_settings_t* settings);
 
+const net_lease_t*
+app_cfg_get_net_lease(void);
+
+void
+app_cfg_set_net_lease(const net_lease_t* lease);
+
+uint32_t
+app_cfg_get_server_addr(void);
+
+void
+app_cfg_set_server_addr(uint32_t server_addr);
+
 const ota_update_checkpoint_t*
 app_cfg_get_ota_update_checkpoint(void);
 
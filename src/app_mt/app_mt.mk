@@ -41,11 +41,19 @@ PROJECT_CSRC = \
        recovery_img.c \
        sensor.c \
        temp_control.c \
+       temp_history.c \
+       history_log.c \
        temp_profile.c \
+       temp_profile_store.c \
+       telemetry.c \
        thread_watchdog.c \
        touch.c \
        touch_calib.c \
        web_api.c \
+       web_api_msg.c \
+       web_api_backlog.c \
+       web_api_report.c \
+       lan_api.c \
        ch/iwdg.c \
        ch/iwdg_lld.c \
        gui/gui.c \
@@ -2,6 +2,14 @@
 #include "common.h"
 #include <stdlib.h>
 
+
+static uint32_t
+text_hash(const char* str, uint16_t* len);
+
+
+static text_layout_stats_t layout_stats;
+
+
 const glyph_t*
 font_find_glyph(const font_t* font, char ch)
 {
@@ -34,3 +42,121 @@ font_text_extents(const font_t* font, const char* str)
 
   return e;
 }
+
+/* Returns true if the layout had to be recomputed, false if the cached
+ * layout was still valid for the given font and string. If there is no
+ * memory for the glyph positions only the extents are filled in, and the
+ * layout is left uncached so that the next call tries again.
+ */
+bool
+text_layout_update(text_layout_t* layout, const font_t* font, const char* str)
+{
+  uint16_t len;
+  uint16_t i;
+
+  if (str == NULL)
+    str = "";
+
+  uint32_t hash = text_hash(str, &len);
+
+  if ((layout->glyph_x != NULL) &&
+      (layout->font == font) &&
+      (layout->hash == hash) &&
+      (layout->len == len)) {
+    layout_stats.layout_hits++;
+    return false;
+  }
+
+  if ((layout->glyph_x == NULL) || (layout->capacity < (len + 1))) {
+    free(layout->glyph_x);
+    layout->glyph_x = malloc((len + 1) * sizeof(int16_t));
+    if (layout->glyph_x == NULL) {
+      layout->capacity = 0;
+      layout->font = NULL;
+      layout->len = len;
+      layout->extents = font_text_extents(font, str);
+      layout_stats.layouts_uncached++;
+      return true;
+    }
+    layout->capacity = len + 1;
+  }
+
+  int x = 0;
+  int min_y = 0;
+  int max_y = 0;
+  for (i = 0; i < len; ++i) {
+    const glyph_t* g = font_find_glyph(font, str[i]);
+    layout->glyph_x[i] = x;
+    x += g->advance;
+
+    min_y = MIN(g->yoffset, min_y);
+    max_y = MAX(g->height + g->yoffset, max_y);
+  }
+  layout->glyph_x[len] = x;
+
+  layout->font = font;
+  layout->hash = hash;
+  layout->len = len;
+  layout->extents.width = x;
+  layout->extents.height = max_y - min_y;
+
+  layout_stats.layouts_computed++;
+
+  return true;
+}
+
+/* Returns the width of the substring [start, end) of the string last given
+ * to text_layout_update(). Without cached glyph positions the glyphs are
+ * measured again.
+ */
+int
+text_layout_width(const text_layout_t* layout, const font_t* font, const char* str,
+    uint16_t start, uint16_t end)
+{
+  int width = 0;
+
+  if (layout->glyph_x != NULL)
+    return layout->glyph_x[end] - layout->glyph_x[start];
+
+  while (start < end)
+    width += font_find_glyph(font, str[start++])->advance;
+
+  return width;
+}
+
+void
+text_layout_invalidate(text_layout_t* layout)
+{
+  layout->font = NULL;
+}
+
+void
+text_layout_release(text_layout_t* layout)
+{
+  free(layout->glyph_x);
+  layout->glyph_x = NULL;
+  layout->capacity = 0;
+  layout->font = NULL;
+}
+
+text_layout_stats_t
+text_layout_get_stats()
+{
+  return layout_stats;
+}
+
+/* FNV-1a */
+static uint32_t
+text_hash(const char* str, uint16_t* len)
+{
+  uint32_t hash = 2166136261u;
+  const char* p;
+
+  for (p = str; *p; ++p) {
+    hash ^= (uint8_t)*p;
+    hash *= 16777619u;
+  }
+  *len = p - str;
+
+  return hash;
+}
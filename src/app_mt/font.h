@@ -5,10 +5,48 @@
 #include "common.h"
 #include "types.h"
 
+/* Cached layout of a string rendered in a particular font.
+ * glyph_x[i] holds the pen position of glyph i relative to the start of the
+ * string, and glyph_x[len] holds the total advance, so the width of any
+ * substring [a, b) is glyph_x[b] - glyph_x[a]. glyph_x is NULL if it could
+ * not be allocated, so use text_layout_width() for substring widths.
+ */
+typedef struct {
+  const font_t* font;
+  uint32_t hash;
+  uint16_t len;
+  uint16_t capacity;
+  Extents_t extents;
+  int16_t* glyph_x;
+} text_layout_t;
+
+typedef struct {
+  uint32_t layouts_computed;
+  uint32_t layout_hits;
+  uint32_t layouts_uncached;
+} text_layout_stats_t;
+
+
 const glyph_t*
 font_find_glyph(const font_t* font, char ch);
 
 Extents_t
 font_text_extents(const font_t* font, const char* str);
 
+bool
+text_layout_update(text_layout_t* layout, const font_t* font, const char* str);
+
+int
+text_layout_width(const text_layout_t* layout, const font_t* font, const char* str,
+    uint16_t start, uint16_t end);
+
+void
+text_layout_invalidate(text_layout_t* layout);
+
+void
+text_layout_release(text_layout_t* layout);
+
+text_layout_stats_t
+text_layout_get_stats(void);
+
 #endif
@@ -49,6 +49,8 @@ typedef struct gfx_ctx_s {
 
 gfx_ctx_t* ctx;
 
+static gfx_render_stats_t render_stats;
+
 
 void
 gfx_init()
@@ -271,6 +273,8 @@ gfx_draw_glyph(const glyph_t* g, int x, int y)
 {
   uint16_t j;
 
+  render_stats.glyphs_drawn++;
+
   gfx_set_cursor(x, y, x + g->width - 1, y + g->height - 1);
 
   for (j = 0; j < (g->width * g->height); j++) {
@@ -303,6 +307,8 @@ gfx_draw_str(const char *str, int n, int x, int y)
   if (n == -1)
     n = INT_MAX;
 
+  render_stats.strs_drawn++;
+
   while ((*str != 0) &&
          (n-- > 0)) {
     char c = *str++;
@@ -423,3 +429,8 @@ gfx_tile_bitmap(const Image_t* img, rect_t rect)
   lcd_clr_cursor();
 }
 
+gfx_render_stats_t
+gfx_get_render_stats()
+{
+  return render_stats;
+}
@@ -44,6 +44,12 @@
 #define PURPLE     COLOR24(167, 0, 174)
 
 
+typedef struct {
+  uint32_t glyphs_drawn;
+  uint32_t strs_drawn;
+} gfx_render_stats_t;
+
+
 void
 gfx_init(void);
 
@@ -95,4 +101,7 @@ gfx_draw_bitmap(int x, int y, const Image_t* img);
 void
 gfx_tile_bitmap(const Image_t* img, rect_t rect);
 
+gfx_render_stats_t
+gfx_get_render_stats(void);
+
 #endif
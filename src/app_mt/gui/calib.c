@@ -8,6 +8,7 @@
 #include "button.h"
 #include "label.h"
 
+#include <stdio.h>
 #include <string.h>
 
 
@@ -27,6 +28,7 @@ typedef struct {
   widget_t* recal_button;
   widget_t* complete_button;
   widget_t* lbl_instructions;
+  widget_t* lbl_residuals;
 } calib_screen_t;
 
 
@@ -43,10 +45,15 @@ static void calib_touch_down(calib_screen_t* s, point_t p);
 static void calib_touch_up(calib_screen_t* s, point_t p);
 
 
+/* Points near all four corners plus the center, so the least squares fit
+ * is constrained across the whole panel.
+ */
 static const point_t ref_pts[NUM_CALIB_POINTS] = {
-    {  50,  50 },
-    { 270, 120 },
-    { 170, 190 },
+    {  40,  40 },
+    { 280,  40 },
+    { 280, 200 },
+    {  40, 200 },
+    { 160, 120 },
 };
 
 static const widget_class_t calib_widget_class = {
@@ -95,6 +102,12 @@ calib_screen_create()
   rect.width = 175;
   s->lbl_instructions = label_create(s->widget, rect, "Touch and hold the marker until it turns green", font_opensans_regular_18, WHITE, 3);
 
+  rect.x = 80;
+  rect.y = 30;
+  rect.width = 160;
+  s->lbl_residuals = label_create(s->widget, rect, "", font_opensans_regular_18, WHITE, 2);
+  widget_hide(s->lbl_residuals);
+
   gui_msg_subscribe(MSG_TOUCH_INPUT, s->widget);
 
   return s->widget;
@@ -131,6 +144,7 @@ restart_calib(button_event_t* event)
     memset(s->sample_count, 0, sizeof(s->sample_count));
 
     widget_show(s->lbl_instructions);
+    widget_hide(s->lbl_residuals);
     widget_hide(s->recal_button);
     widget_hide(s->complete_button);
     widget_invalidate(screen_widget);
@@ -235,11 +249,23 @@ calib_touch_up(calib_screen_t* s, point_t p)
       avg_sample[i].x /= s->sample_count[i];
       avg_sample[i].y /= s->sample_count[i];
     }
-    touch_set_calib(ref_pts, avg_sample);
+
+    char str[64];
+    calib_residuals_t residuals;
+    if (touch_set_calib(ref_pts, avg_sample, NUM_CALIB_POINTS, &residuals)) {
+      snprintf(str, sizeof(str), "Error: %.1f px avg, %.1f px max",
+          residuals.rms, residuals.max);
+      printf("touch calib residuals: rms %f max %f\r\n", residuals.rms, residuals.max);
+      widget_show(s->complete_button);
+    }
+    else {
+      snprintf(str, sizeof(str), "Calibration failed, please try again");
+    }
+    label_set_text(s->lbl_residuals, str);
 
     widget_hide(s->lbl_instructions);
+    widget_show(s->lbl_residuals);
     widget_show(s->recal_button);
-    widget_show(s->complete_button);
   }
 }
 
@@ -23,6 +23,7 @@ typedef struct {
   systime_t next_event_time;
   char* text;
   const font_t* font;
+  text_layout_t text_layout;
 
   button_event_handler_t evt_handler;
 } button_t;
@@ -155,11 +156,13 @@ button_set_text(widget_t* w, const char* text)
   else {
     if (text != NULL) {
       if (strcmp(text, b->text) != 0) {
+        free(b->text);
         b->text = strdup(text);
         widget_invalidate(w);
       }
     }
     else {
+      free(b->text);
       b->text = NULL;
       widget_invalidate(w);
     }
@@ -191,6 +194,7 @@ button_destroy(widget_t* w)
   if (b->text != NULL)
     free(b->text);
 
+  text_layout_release(&b->text_layout);
   free(b);
 }
 
@@ -275,9 +279,10 @@ button_paint(paint_event_t* event)
         center.y - (b->icon->height / 2),
         b->icon);
   }
-
+
   if (b->text != NULL && b->font != NULL) {
-    Extents_t x = font_text_extents(b->font, b->text);
+    text_layout_update(&b->text_layout, b->font, b->text);
+    Extents_t x = b->text_layout.extents;
     gfx_set_font(b->font);
     gfx_draw_str(b->text, -1,
         center.x - (x.width / 2),
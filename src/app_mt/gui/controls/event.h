@@ -27,6 +27,7 @@ typedef struct {
 typedef struct {
   event_id_t id;
   widget_t* widget;
+  bool cleared; // false if only widget_repaint() was requested
 } paint_event_t;
 
 typedef struct {
@@ -7,16 +7,30 @@
 #include <string.h>
 
 
+typedef struct {
+  uint16_t start;
+  uint16_t len;
+  bool ellipsize;
+} label_row_t;
+
 typedef struct {
   char* text;
   const font_t* font;
   color_t color;
   uint8_t rows;
+
+  text_layout_t layout;
+  int16_t ellipsis_width;
+  int32_t row_width;
+  bool rows_valid;
+  label_row_t* row_cache;
 } label_t;
 
 
 static void label_paint(paint_event_t* event);
 static void label_destroy(widget_t* w);
+static void layout_rows(label_t* l, int width);
+static int text_width(label_t* l, int start, int end);
 
 
 static const widget_class_t label_widget_class = {
@@ -29,11 +43,12 @@ label_create(widget_t* parent, rect_t rect, const char* text, const font_t* font
 {
   label_t* l = calloc(1, sizeof(label_t));
 
-  if (text != NULL)
-    l->text = strdup(text);
+  l->text = strdup((text != NULL) ? text : "");
   l->font = font;
   l->color = color;
   l->rows = rows;
+  l->row_cache = calloc(rows, sizeof(label_row_t));
+  l->ellipsis_width = font_text_extents(font, "...").width;
 
   rect.height = (font->line_height * rows);
   return widget_create(parent, &label_widget_class, l, rect);
@@ -43,10 +58,13 @@ void
 label_set_text(widget_t* w, const char* text)
 {
   label_t* l = widget_get_instance_data(w);
+  if (text == NULL)
+    text = "";
+
   if (strcmp(l->text, text) != 0) {
-    if (l->text != NULL)
-      free(l->text);
+    free(l->text);
     l->text = strdup(text);
+    l->rows_valid = false;
     widget_invalidate(w);
   }
 }
@@ -65,45 +83,71 @@ static void
 label_destroy(widget_t* w)
 {
   label_t* l = widget_get_instance_data(w);
+  text_layout_release(&l->layout);
+  free(l->row_cache);
+  free(l->text);
   free(l);
 }
 
-static char*
-get_row_text(label_t* l, const char* text, int width, bool ellipsize)
+static int
+text_width(label_t* l, int start, int end)
 {
-  char* str = strdup(text);
-  Extents_t e = font_text_extents(l->font, str);
-  if (e.width < width)
-    return str;
-
-  if (ellipsize)
-    width -= font_text_extents(l->font, "...").width;
-
-  do {
-    char* last_space = strrchr(str, ' ');
-    if (last_space != NULL) {
-      // chop off the last word and see if the string will fit.
-      *last_space = '\0';
-      e = font_text_extents(l->font, str);
-    }
-    else {
-      // There is no whitespace, so just start chopping characters until it fits.
+  return text_layout_width(&l->layout, l->font, l->text, start, end);
+}
+
+/* Splits the text into rows which fit in the given width using the cached
+ * glyph positions, so no glyph metrics are looked up while breaking lines.
+ */
+static void
+layout_rows(label_t* l, int width)
+{
+  int i;
+  int len = l->layout.len;
+  int start = 0;
+
+  for (i = 0; i < l->rows; ++i) {
+    label_row_t* row = &l->row_cache[i];
+    bool ellipsize = (i == (l->rows - 1));
+    int end = len;
+
+    row->start = start;
+    row->ellipsize = false;
+
+    if (text_width(l, start, end) >= width) {
+      int avail = width;
+      if (ellipsize) {
+        avail -= l->ellipsis_width;
+        row->ellipsize = true;
+      }
+
       do {
-        str[strlen(str) - 1] = '\0';
-        e = font_text_extents(l->font, str);
-      } while (e.width > width);
+        const char* last_space = NULL;
+        int j;
+        for (j = end - 1; j > start; --j) {
+          if (l->text[j] == ' ') {
+            last_space = &l->text[j];
+            break;
+          }
+        }
+
+        if (last_space != NULL) {
+          // chop off the last word and see if the string will fit.
+          end = last_space - l->text;
+        }
+        else {
+          // There is no whitespace, so just start chopping characters until it fits.
+          while ((end > start) && (text_width(l, start, end) > avail))
+            end--;
+        }
+      } while ((end > start) && (text_width(l, start, end) > avail));
     }
-  } while (e.width > width);
-
-  if (ellipsize) {
-    char* estr = malloc(strlen(str) + 3 + 1);
-    strcpy(estr, str);
-    strcat(estr, "...");
-    free(str);
-    str = estr;
-  }
 
-  return str;
+    row->len = end - start;
+
+    start = end;
+    while (l->text[start] == ' ')
+      start++;
+  }
 }
 
 static void
@@ -113,25 +157,26 @@ label_paint(paint_event_t* event)
   label_t* l = widget_get_instance_data(event->widget);
   rect_t rect = widget_get_rect(event->widget);
 
+  if (text_layout_update(&l->layout, l->font, l->text) ||
+      !l->rows_valid ||
+      (l->row_width != rect.width)) {
+    layout_rows(l, rect.width);
+    l->row_width = rect.width;
+    l->rows_valid = true;
+  }
+
   gfx_set_font(l->font);
   gfx_set_fg_color(l->color);
 
-  const char* text = l->text;
   for (i = 0; i < l->rows; ++i) {
-    char* row_text = get_row_text(l, text, rect.width, (i == (l->rows - 1)));
+    label_row_t* row = &l->row_cache[i];
+    int y = rect.y + (i * l->font->line_height);
 
-//    if ((i == (l->rows - 1)) &&
-//        (l->ellipsize == ELLIPSIZE_END) &&
-//        (strlen(row_text) < strlen(text))) {
-//
-//    }
+    gfx_draw_str(l->text + row->start, row->len, rect.x, y);
 
-    gfx_draw_str(row_text, -1, rect.x, rect.y + (i * l->font->line_height));
-
-    text += strlen(row_text);
-    while (*text == ' ')
-      text++;
-
-    free(row_text);
+    if (row->ellipsize) {
+      int x = text_width(l, row->start, row->start + row->len);
+      gfx_draw_str("...", -1, rect.x + x, y);
+    }
   }
 }
@@ -19,11 +19,18 @@ typedef struct {
   int value;
   unit_t unit;
   widget_t* widget;
+
+  text_layout_t value_layout;
+  text_layout_t unit_layout;
+  char drawn_value_str[16];
+  int drawn_value_x;
 } quantity_widget_t;
 
 
 static void quantity_widget_destroy(widget_t* w);
 static void quantity_widget_paint(paint_event_t* event);
+static bool repaint_changed_digits(quantity_widget_t* s, const char* value_str, rect_t rect);
+static bool glyph_fits_cell(const glyph_t* g, int line_height);
 
 
 static const widget_class_t quantity_widget_class = {
@@ -50,6 +57,8 @@ quantity_widget_destroy(widget_t* w)
 {
   quantity_widget_t* s = widget_get_instance_data(w);
 
+  text_layout_release(&s->value_layout);
+  text_layout_release(&s->unit_layout);
   free(s);
 }
 
@@ -104,8 +113,19 @@ quantity_widget_paint(paint_event_t* event)
         ABS(s->value) / 10,
         ABS(s->value) % 10);
 
-  Extents_t value_ext = font_text_extents(font_opensans_regular_62, value_str);
-  Extents_t unit_ext = font_text_extents(font_opensans_regular_22, unit_str);
+  /* If only the value changed, try to redraw just the digits which differ
+   * from what is already on screen.
+   */
+  if (!event->cleared) {
+    if (repaint_changed_digits(s, value_str, rect))
+      return;
+    gfx_clear_rect(rect);
+  }
+
+  text_layout_update(&s->value_layout, font_opensans_regular_62, value_str);
+  text_layout_update(&s->unit_layout, font_opensans_regular_22, unit_str);
+  Extents_t value_ext = s->value_layout.extents;
+  Extents_t unit_ext = s->unit_layout.extents;
 
   point_t center = rect_center(rect);
 
@@ -118,6 +138,66 @@ quantity_widget_paint(paint_event_t* event)
   gfx_set_fg_color(DARK_GRAY);
   gfx_set_font(font_opensans_regular_22);
   gfx_draw_str(unit_str, -1, value_x + value_ext.width + SPACE, rect.y);
+
+  strncpy(s->drawn_value_str, value_str, sizeof(s->drawn_value_str));
+  s->drawn_value_x = value_x;
+}
+
+/* Redraws only the glyphs of value_str which differ from the last string
+ * drawn. This is only possible if every changed glyph has the same advance
+ * as the one it replaces and stays inside its own cell, so that the rest of
+ * the string does not move. Returns false if a full repaint is required.
+ */
+static bool
+repaint_changed_digits(quantity_widget_t* s, const char* value_str, rect_t rect)
+{
+  int i;
+  const font_t* font = font_opensans_regular_62;
+  int len = strlen(value_str);
+
+  if ((s->value_layout.font != font) ||
+      (s->value_layout.len != len))
+    return false;
+
+  for (i = 0; i < len; ++i) {
+    if (value_str[i] != s->drawn_value_str[i]) {
+      const glyph_t* old_g = font_find_glyph(font, s->drawn_value_str[i]);
+      const glyph_t* new_g = font_find_glyph(font, value_str[i]);
+      if ((old_g->advance != new_g->advance) ||
+          !glyph_fits_cell(old_g, rect.height) ||
+          !glyph_fits_cell(new_g, rect.height))
+        return false;
+    }
+  }
+
+  gfx_set_fg_color(WHITE);
+  for (i = 0; i < len; ++i) {
+    if (value_str[i] != s->drawn_value_str[i]) {
+      const glyph_t* g = font_find_glyph(font, value_str[i]);
+      rect_t cell = {
+          .x = s->drawn_value_x + s->value_layout.glyph_x[i],
+          .y = rect.y,
+          .width = g->advance,
+          .height = rect.height
+      };
+      gfx_clear_rect(cell);
+      gfx_draw_glyph(g, cell.x + g->xoffset, cell.y + g->yoffset);
+    }
+  }
+
+  strncpy(s->drawn_value_str, value_str, sizeof(s->drawn_value_str));
+  text_layout_update(&s->value_layout, font, value_str);
+
+  return true;
+}
+
+static bool
+glyph_fits_cell(const glyph_t* g, int line_height)
+{
+  return ((g->xoffset >= 0) &&
+          ((g->xoffset + g->width) <= g->advance) &&
+          (g->yoffset >= 0) &&
+          ((g->yoffset + g->height) <= line_height));
 }
 
 void
@@ -131,7 +211,7 @@ quantity_widget_set_value(widget_t* w, quantity_t sample)
 
   if (value != s->value) {
     s->value = value;
-    widget_invalidate(s->widget);
+    widget_repaint(s->widget);
   }
 }
 
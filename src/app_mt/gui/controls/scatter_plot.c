@@ -1,50 +1,248 @@
 
 #include "scatter_plot.h"
+#include "gui.h"
 #include "gfx.h"
+#include "app_cfg.h"
 
+#include <stdio.h>
 #include <string.h>
 
 
+#define OUTPUT_BAR_HEIGHT 4
+#define MIN_TEMP_RANGE    20
+
+
+typedef struct {
+  history_channel_t channel;
+  color_t color;
+} plot_series_t;
+
 typedef struct {
   widget_t* widget;
+  history_span_t span;
+  systime_t last_paint_time;
+  history_envelope_t* env;
+  int env_cols;
 } scatter_plot_t;
 
 
 static void
 scatter_plot_paint(paint_event_t* event);
 
+static void
+scatter_plot_msg(msg_event_t* event);
+
 static void
 scatter_plot_destroy(widget_t* w);
 
+static void
+draw_envelope(const history_envelope_t* env, int num_cols, rect_t area, int16_t y_min, int16_t y_max);
+
+static void
+draw_axis_label(int16_t value, int x, int y);
+
 
 static const widget_class_t scatter_plot_widget_class = {
     .on_paint   = scatter_plot_paint,
+    .on_msg     = scatter_plot_msg,
     .on_destroy = scatter_plot_destroy
 };
 
+/* Setpoints are drawn first so the probe readings end up on top. */
+static const plot_series_t temp_series[] = {
+    { HISTORY_CH_SETPOINT_1, STEEL },
+    { HISTORY_CH_SETPOINT_2, TAUPE },
+    { HISTORY_CH_TEMP_1,     CYAN },
+    { HISTORY_CH_TEMP_2,     AMBER },
+};
+#define NUM_TEMP_SERIES (sizeof(temp_series) / sizeof(temp_series[0]))
+
+static const plot_series_t output_series[] = {
+    { HISTORY_CH_OUTPUT_1, CRIMSON },
+    { HISTORY_CH_OUTPUT_2, MAGENTA },
+};
+#define NUM_OUTPUT_SERIES (sizeof(output_series) / sizeof(output_series[0]))
+
 
 widget_t*
 scatter_plot_create(widget_t* parent, rect_t rect)
 {
   scatter_plot_t* s = calloc(1, sizeof(scatter_plot_t));
 
+  s->span = HISTORY_SPAN_HOUR;
   s->widget = widget_create(parent, &scatter_plot_widget_class, s, rect);
 
+  gui_msg_subscribe(MSG_SENSOR_SAMPLE, s->widget);
+
   return s->widget;
 }
 
+void
+scatter_plot_set_span(widget_t* w, history_span_t span)
+{
+  scatter_plot_t* s = widget_get_instance_data(w);
+
+  if (s->span != span) {
+    s->span = span;
+    widget_invalidate(w);
+  }
+}
+
+history_span_t
+scatter_plot_get_span(widget_t* w)
+{
+  scatter_plot_t* s = widget_get_instance_data(w);
+  return s->span;
+}
+
 static void
 scatter_plot_destroy(widget_t* w)
 {
   scatter_plot_t* s = widget_get_instance_data(w);
+
+  gui_msg_unsubscribe(MSG_SENSOR_SAMPLE, w);
+
+  free(s->env);
   free(s);
 }
 
+static void
+scatter_plot_msg(msg_event_t* event)
+{
+  scatter_plot_t* s = widget_get_instance_data(event->widget);
+
+  if (event->msg_id != MSG_SENSOR_SAMPLE)
+    return;
+
+  /* Only repaint once enough time has passed to shift the plot by a column */
+  rect_t rect = widget_get_rect(event->widget);
+  systime_t col_period = S2ST(temp_history_get_span_seconds(s->span)) / MAX(rect.width, 1);
+  if ((chTimeNow() - s->last_paint_time) >= MAX(col_period, S2ST(1)))
+    widget_invalidate(event->widget);
+}
+
 static void
 scatter_plot_paint(paint_event_t* event)
 {
+  unsigned int i;
+  int c;
+  scatter_plot_t* s = widget_get_instance_data(event->widget);
   rect_t rect = widget_get_rect(event->widget);
 
+  s->last_paint_time = chTimeNow();
+
   gfx_set_fg_color(WHITE);
   gfx_draw_rect(rect);
+
+  rect_t plot_area = {
+      .x = rect.x + 1,
+      .y = rect.y + 1,
+      .width = rect.width - 2,
+      .height = rect.height - 2 - (NUM_OUTPUT_SERIES * OUTPUT_BAR_HEIGHT),
+  };
+  int num_cols = plot_area.width;
+
+  /* The envelope buffer is kept between paints and only reallocated if the
+   * plot changes size.
+   */
+  if (s->env_cols != num_cols) {
+    free(s->env);
+    s->env = malloc(NUM_TEMP_SERIES * num_cols * sizeof(history_envelope_t));
+    s->env_cols = (s->env != NULL) ? num_cols : 0;
+  }
+  if (s->env == NULL)
+    return;
+
+  history_envelope_t* env = s->env;
+
+  /* Fetch every series first to find the vertical range of the plot */
+  int16_t y_min = INT16_MAX;
+  int16_t y_max = INT16_MIN;
+  for (i = 0; i < NUM_TEMP_SERIES; ++i) {
+    history_envelope_t* series_env = &env[i * num_cols];
+    if (temp_history_get_envelope(s->span, temp_series[i].channel, series_env, num_cols) == 0)
+      continue;
+
+    for (c = 0; c < num_cols; ++c) {
+      if (series_env[c].min <= series_env[c].max) {
+        y_min = MIN(y_min, series_env[c].min);
+        y_max = MAX(y_max, series_env[c].max);
+      }
+    }
+  }
+
+  if (y_min <= y_max) {
+    if ((y_max - y_min) < MIN_TEMP_RANGE) {
+      int16_t pad = (MIN_TEMP_RANGE - (y_max - y_min) + 1) / 2;
+      y_min -= pad;
+      y_max += pad;
+    }
+
+    for (i = 0; i < NUM_TEMP_SERIES; ++i) {
+      gfx_set_fg_color(temp_series[i].color);
+      draw_envelope(&env[i * num_cols], num_cols, plot_area, y_min, y_max);
+    }
+
+    gfx_set_font(font_opensans_regular_12);
+    gfx_set_fg_color(LIGHT_GRAY);
+    draw_axis_label(y_max, plot_area.x + 2, plot_area.y + 1);
+    draw_axis_label(y_min, plot_area.x + 2,
+        plot_area.y + plot_area.height - font_opensans_regular_12->line_height - 1);
+  }
+
+  /* Output activity is drawn as a bar per output along the bottom */
+  for (i = 0; i < NUM_OUTPUT_SERIES; ++i) {
+    rect_t bar = {
+        .x = plot_area.x,
+        .y = plot_area.y + plot_area.height + (i * OUTPUT_BAR_HEIGHT),
+        .width = 1,
+        .height = OUTPUT_BAR_HEIGHT
+    };
+
+    temp_history_get_envelope(s->span, output_series[i].channel, env, num_cols);
+
+    gfx_set_fg_color(output_series[i].color);
+    for (c = 0; c < num_cols; ++c) {
+      if ((env[c].min <= env[c].max) && (env[c].max > 0)) {
+        bar.x = plot_area.x + c;
+        gfx_fill_rect(bar);
+      }
+    }
+  }
+}
+
+static void
+draw_envelope(const history_envelope_t* env, int num_cols, rect_t area, int16_t y_min, int16_t y_max)
+{
+  int c;
+  int32_t range = y_max - y_min;
+
+  for (c = 0; c < num_cols; ++c) {
+    if (env[c].min > env[c].max)
+      continue;
+
+    int top = area.y + area.height - 1 - (((env[c].max - y_min) * (area.height - 1)) / range);
+    int bottom = area.y + area.height - 1 - (((env[c].min - y_min) * (area.height - 1)) / range);
+    rect_t col = {
+        .x = area.x + c,
+        .y = top,
+        .width = 1,
+        .height = bottom - top + 1
+    };
+    gfx_fill_rect(col);
+  }
+}
+
+static void
+draw_axis_label(int16_t value, int x, int y)
+{
+  char str[16];
+  quantity_t q = {
+      .value = value / 10.0f,
+      .unit = UNIT_TEMP_DEG_F
+  };
+  q = quantity_convert(q, app_cfg_get_temp_unit());
+
+  snprintf(str, sizeof(str), "%d", (int)q.value);
+  gfx_draw_str(str, -1, x, y);
 }
@@ -1,10 +1,16 @@
-
 #ifndef SCATTER_PLOT_H
 #define SCATTER_PLOT_H
 
 #include "widget.h"
+#include "temp_history.h"
 
 widget_t*
 scatter_plot_create(widget_t* parent, rect_t rect);
 
+void
+scatter_plot_set_span(widget_t* w, history_span_t span);
+
+history_span_t
+scatter_plot_get_span(widget_t* w);
+
 #endif
@@ -3,12 +3,37 @@
 #include "widget.h"
 #include "common.h"
 #include "gfx.h"
+#include "gui.h"
 
 #include <string.h>
 
 
 #define CALL_WC(w, m)   if ((w)->widget_class != NULL && (w)->widget_class->m != NULL) (w)->widget_class->m
 
+#define MIN_CHILDREN_CAPACITY   4
+
+
+/* Flattened list of the visible widgets in a screen, in the order
+ * widget_hit_test() has to try them, with their rects translated to screen
+ * coordinates. Rebuilt on the next hit test after anything in the tree is
+ * added, removed, moved, shown or hidden.
+ */
+typedef struct {
+  struct widget_s* widget;
+  rect_t abs_rect;
+} hit_entry_t;
+
+typedef struct {
+  hit_entry_t* entries;
+  uint16_t len;
+  uint16_t capacity;
+  bool dirty;
+} hit_list_t;
+
+typedef struct {
+  hit_list_t* list;
+  point_t offset;
+} hit_list_build_t;
 
 typedef struct widget_s {
   const widget_class_t* widget_class;
@@ -23,9 +48,16 @@ typedef struct widget_s {
   struct widget_s* next_sibling;
   struct widget_s* prev_sibling;
 
+  struct widget_s** children;
+  uint16_t num_children;
+  uint16_t children_capacity;
+
+  hit_list_t* hit_list;
+
   rect_t rect;
   bool needs_layout;
   bool needs_paint;
+  bool needs_clear;
   bool visible;
   bool enabled;
   color_t bg_color;
@@ -47,6 +79,12 @@ widget_destroy_predicate(widget_t* w, widget_traversal_event_t event, void* data
 static void
 widget_enable_predicate(widget_t* w, widget_traversal_event_t event, void* data);
 
+static void
+hit_list_build_predicate(widget_t* w, widget_traversal_event_t event, void* data);
+
+static void
+invalidate_hit_list(widget_t* w);
+
 static void
 dispatch_touch(widget_t* w, touch_event_t* event);
 
@@ -65,6 +103,7 @@ widget_create(widget_t* parent, const widget_class_t* widget_class, void* instan
   w->rect = rect;
   w->needs_layout = true;
   w->needs_paint = true;
+  w->needs_clear = true;
   w->visible = true;
   w->enabled = true;
   w->bg_color = (parent == NULL) ? BLACK : TRANSPARENT;
@@ -78,6 +117,9 @@ widget_create(widget_t* parent, const widget_class_t* widget_class, void* instan
 void
 widget_destroy(widget_t* w)
 {
+  if (w->parent != NULL)
+    widget_unparent(w);
+
   widget_for_each(w, widget_destroy_predicate, NULL);
 }
 
@@ -88,6 +130,10 @@ widget_destroy_predicate(widget_t* w, widget_traversal_event_t event, void* data
 
   if (event == WIDGET_TRAVERSAL_AFTER_CHILDREN) {
     CALL_WC(w, on_destroy)(w);
+    if (w->hit_list != NULL)
+      free(w->hit_list->entries);
+    free(w->hit_list);
+    free(w->children);
     free(w);
   }
 }
@@ -109,6 +155,7 @@ widget_set_rect(widget_t* w, rect_t rect)
 {
   if (memcmp(&rect, &w->rect, sizeof(rect_t)) != 0) {
     w->rect = rect;
+    invalidate_hit_list(w);
     widget_invalidate(w->parent);
   }
 }
@@ -145,38 +192,53 @@ widget_add_child(widget_t* parent, widget_t* child)
     parent->first_child = parent->last_child = child;
   }
 
+  if (parent->num_children >= parent->children_capacity) {
+    parent->children_capacity = MAX(MIN_CHILDREN_CAPACITY, parent->children_capacity * 2);
+    parent->children = realloc(parent->children,
+        parent->children_capacity * sizeof(widget_t*));
+  }
+  parent->children[parent->num_children++] = child;
+
   child->parent = parent;
+
+  invalidate_hit_list(parent);
+  gui_request_paint();
 }
 
 int
 widget_num_children(widget_t* w)
 {
-  widget_t* child;
-  int i = 0;
-  for (child = w->first_child; child != NULL; child = child->next_sibling) {
-    i++;
-  }
-
-  return i;
+  return w->num_children;
 }
 
-// TODO use an arraylist to speed this up...
 widget_t*
 widget_get_child(widget_t* w, int idx)
 {
-  widget_t* child;
-  int i = 0;
-  for (child = w->first_child; child != NULL; child = child->next_sibling) {
-    if (i++ == idx)
-      return child;
-  }
+  if ((idx < 0) || (idx >= w->num_children))
+    return NULL;
 
-  return NULL;
+  return w->children[idx];
 }
 
 void
 widget_unparent(widget_t* w)
 {
+  if (w->parent != NULL) {
+    widget_t* parent = w->parent;
+    int i;
+
+    invalidate_hit_list(parent);
+
+    for (i = 0; i < parent->num_children; ++i) {
+      if (parent->children[i] == w) {
+        memmove(&parent->children[i], &parent->children[i + 1],
+            (parent->num_children - i - 1) * sizeof(widget_t*));
+        parent->num_children--;
+        break;
+      }
+    }
+  }
+
   if (w->prev_sibling != NULL)
     w->prev_sibling->next_sibling = w->next_sibling;
   if (w->next_sibling != NULL)
@@ -213,27 +275,83 @@ widget_for_each(widget_t* w, widget_predicate_t pred, void* data)
   pred(w, WIDGET_TRAVERSAL_AFTER_CHILDREN, data);
 }
 
+/* Returns the widget under the given point. Children are tried before their
+ * parent and earlier siblings before later ones. The tree is only walked when
+ * the screen's hit list is out of date, otherwise this is a linear scan of
+ * the visible widgets with no recursion.
+ */
 widget_t*
 widget_hit_test(widget_t* root, point_t p)
 {
-  widget_t* w;
+  int i;
 
-  for (w = root->first_child; w != NULL; w = w->next_sibling) {
-    point_t translated_p = {
-        .x = p.x - root->rect.x,
-        .y = p.y - root->rect.y,
+  if (root->hit_list == NULL) {
+    root->hit_list = calloc(1, sizeof(hit_list_t));
+    root->hit_list->dirty = true;
+  }
+
+  hit_list_t* list = root->hit_list;
+  if (list->dirty) {
+    hit_list_build_t build = {
+        .list = list,
     };
-    widget_t* w_hit = widget_hit_test(w, translated_p);
-    if (w_hit != NULL)
-      return w_hit;
+
+    list->len = 0;
+    widget_for_each(root, hit_list_build_predicate, &build);
+    list->dirty = false;
   }
 
-  if (widget_is_visible(root) && rect_inside(root->rect, p))
-    return root;
+  for (i = 0; i < list->len; ++i) {
+    if (rect_inside(list->entries[i].abs_rect, p))
+      return list->entries[i].widget;
+  }
 
   return NULL;
 }
 
+static void
+hit_list_build_predicate(widget_t* w, widget_traversal_event_t event, void* data)
+{
+  hit_list_build_t* build = data;
+  hit_list_t* list = build->list;
+
+  /* The offset accumulates the positions of every ancestor, and is the
+   * screen position of the widget's parent once its children are done.
+   */
+  if (event == WIDGET_TRAVERSAL_BEFORE_CHILDREN) {
+    build->offset.x += w->rect.x;
+    build->offset.y += w->rect.y;
+    return;
+  }
+
+  build->offset.x -= w->rect.x;
+  build->offset.y -= w->rect.y;
+
+  if (!widget_is_visible(w))
+    return;
+
+  if (list->len >= list->capacity) {
+    list->capacity = MAX(16, list->capacity * 2);
+    list->entries = realloc(list->entries, list->capacity * sizeof(hit_entry_t));
+  }
+
+  hit_entry_t* entry = &list->entries[list->len++];
+  entry->widget = w;
+  entry->abs_rect = w->rect;
+  entry->abs_rect.x += build->offset.x;
+  entry->abs_rect.y += build->offset.y;
+}
+
+static void
+invalidate_hit_list(widget_t* w)
+{
+  while (w->parent != NULL)
+    w = w->parent;
+
+  if (w->hit_list != NULL)
+    w->hit_list->dirty = true;
+}
+
 point_t
 widget_rel_pos(widget_t* w, point_t abs_pos)
 {
@@ -325,13 +443,16 @@ widget_paint_predicate(widget_t* w, widget_traversal_event_t event, void* data)
       paint_event_t event = {
           .id = EVT_PAINT,
           .widget = w,
+          .cleared = w->needs_clear,
       };
 
-      gfx_clear_rect(w->rect);
+      if (w->needs_clear)
+        gfx_clear_rect(w->rect);
 
       CALL_WC(w, on_paint)(&event);
 
       w->needs_paint = false;
+      w->needs_clear = false;
     }
 
     gfx_push_translation(w->rect.x, w->rect.y);
@@ -348,6 +469,7 @@ widget_invalidate(widget_t* w)
     return;
 
   widget_for_each(w, widget_invalidate_predicate, NULL);
+  gui_request_paint();
 }
 
 static void
@@ -357,15 +479,30 @@ widget_invalidate_predicate(widget_t* w, widget_traversal_event_t event, void* d
 
   if (event == WIDGET_TRAVERSAL_BEFORE_CHILDREN) {
     w->needs_paint = true;
+    w->needs_clear = true;
     w->needs_layout = true;
   }
 }
 
+/* Schedules a paint of the widget without clearing its background first.
+ * The paint handler is responsible for overdrawing whatever changed.
+ */
+void
+widget_repaint(widget_t* w)
+{
+  if (w == NULL)
+    return;
+
+  w->needs_paint = true;
+  gui_request_paint();
+}
+
 void
 widget_hide(widget_t* w)
 {
   if (w->visible) {
     w->visible = false;
+    invalidate_hit_list(w);
     widget_invalidate(w->parent);
   }
 }
@@ -375,6 +512,7 @@ widget_show(widget_t* w)
 {
   if (!w->visible) {
     w->visible = true;
+    invalidate_hit_list(w);
     widget_invalidate(w);
   }
 }
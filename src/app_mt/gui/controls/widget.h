@@ -73,6 +73,9 @@ widget_paint(widget_t* screen);
 void
 widget_invalidate(widget_t* screen);
 
+void
+widget_repaint(widget_t* w);
+
 void
 widget_hide(widget_t* w);
 
@@ -4,6 +4,21 @@
 #include "touch.h"
 #include "message.h"
 #include "screen_saver.h"
+#include "common.h"
+
+
+/* Invalidated widgets are painted at most once per frame period. The period
+ * is shortened while the user is interacting with the screen so that touch
+ * feedback is snappy, and painting stops entirely while the screen saver is
+ * up. When nothing is dirty the GUI thread sleeps until the next message,
+ * but wakes at least every WATCHDOG_KICK_PERIOD so that a static screen does
+ * not trip its thread watchdog.
+ */
+#define FRAME_PERIOD_IDLE         100
+#define FRAME_PERIOD_INTERACTIVE  33
+#define INTERACTIVE_HOLDOFF       MS2ST(500)
+#define WATCHDOG_PERIOD           5000
+#define WATCHDOG_KICK_PERIOD      1000
 
 
 typedef struct widget_stack_elem_s {
@@ -17,20 +32,26 @@ static void dispatch_push_screen(widget_t* screen);
 static void dispatch_pop_screen(bool destroy);
 static void gui_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
 static void dispatch_msg_to_widget(widget_t* w, msg_id_t id, void* msg_data);
+static void update_display(void);
+static bool is_interactive(void);
 
 
 static msg_listener_t* gui_msg_listener;
 static widget_t* touch_capture_widget;
 static widget_stack_elem_t* screen_stack = NULL;
 static systime_t last_paint_time;
+static systime_t last_touch_time;
+static bool touch_down;
+static volatile bool paint_pending;
+static gui_stats_t stats;
 
 
 void
 gui_init()
 {
   gui_msg_listener = msg_listener_create("gui", 2048, gui_dispatch, NULL);
-  msg_listener_set_idle_timeout(gui_msg_listener, 100);
-  msg_listener_enable_watchdog(gui_msg_listener, 5000);
+  msg_listener_set_idle_timeout(gui_msg_listener, WATCHDOG_KICK_PERIOD);
+  msg_listener_enable_watchdog(gui_msg_listener, WATCHDOG_PERIOD);
 
   msg_subscribe(gui_msg_listener, MSG_TOUCH_INPUT, NULL);
   msg_subscribe(gui_msg_listener, MSG_GUI_PUSH_SCREEN, NULL);
@@ -70,6 +91,26 @@ gui_release_touch_capture(void)
   touch_capture_widget = NULL;
 }
 
+/* Called whenever a widget is invalidated. Invalidations made outside of the
+ * GUI thread have to wake it up since it may be sleeping until its next
+ * watchdog kick.
+ */
+void
+gui_request_paint()
+{
+  paint_pending = true;
+
+  if ((gui_msg_listener != NULL) &&
+      (chThdSelf()->msg_listener != gui_msg_listener))
+    msg_listener_wake(gui_msg_listener);
+}
+
+gui_stats_t
+gui_get_stats()
+{
+  return stats;
+}
+
 void
 gui_msg_subscribe(msg_id_t id, widget_t* w)
 {
@@ -93,6 +134,8 @@ gui_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
 {
   (void)listener_data;
 
+  stats.dispatches++;
+
   if (sub_data != NULL) {
     dispatch_msg_to_widget(sub_data, id, msg_data);
   }
@@ -111,21 +154,59 @@ gui_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
       break;
 
     case MSG_TOUCH_INPUT:
+      touch_down = ((touch_msg_t*)msg_data)->touch_down;
+      last_touch_time = chTimeNow();
       if (!screen_saver_is_active())
     	dispatch_touch(msg_data);
       break;
 
+    case MSG_IDLE:
+      stats.idle_wakeups++;
+      break;
+
     default:
       break;
     }
   }
 
-  if ((chTimeNow() - last_paint_time) >= MS2ST(100)) {
-    if (screen_stack != NULL) {
-      widget_paint(screen_stack->widget);
+  update_display();
+}
+
+static void
+update_display()
+{
+  uint32_t idle_timeout = WATCHDOG_KICK_PERIOD;
+
+  if (paint_pending && !screen_saver_is_active()) {
+    uint32_t frame_period = is_interactive() ?
+        FRAME_PERIOD_INTERACTIVE : FRAME_PERIOD_IDLE;
+    systime_t elapsed = chTimeNow() - last_paint_time;
+
+    if (elapsed >= MS2ST(frame_period)) {
+      /* Clear the flag before painting so that invalidations made while
+       * painting schedule another frame.
+       */
+      paint_pending = false;
+      if (screen_stack != NULL) {
+        widget_paint(screen_stack->widget);
+        stats.paints++;
+      }
+      last_paint_time = chTimeNow();
+    }
+    else {
+      idle_timeout = MIN(frame_period - (elapsed * 1000 / CH_FREQUENCY),
+          WATCHDOG_KICK_PERIOD);
     }
-    last_paint_time = chTimeNow();
   }
+
+  msg_listener_set_idle_timeout(gui_msg_listener, idle_timeout);
+}
+
+static bool
+is_interactive()
+{
+  return touch_down ||
+      ((chTimeNow() - last_touch_time) < INTERACTIVE_HOLDOFF);
 }
 
 static void
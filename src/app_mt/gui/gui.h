@@ -4,6 +4,14 @@
 
 #include "widget.h"
 
+
+typedef struct {
+  uint32_t dispatches;
+  uint32_t idle_wakeups;
+  uint32_t paints;
+} gui_stats_t;
+
+
 void
 gui_init(void);
 
@@ -22,6 +30,12 @@ gui_acquire_touch_capture(widget_t* widget);
 void
 gui_release_touch_capture(void);
 
+void
+gui_request_paint(void);
+
+gui_stats_t
+gui_get_stats(void);
+
 void
 gui_msg_subscribe(msg_id_t id, widget_t* w);
 
@@ -10,11 +10,22 @@
 
 typedef struct {
   widget_t* widget;
+  widget_t* plot;
+  widget_t* span_btn;
 } history_screen_t;
 
 
 static void history_screen_destroy(widget_t* w);
 static void back_button_clicked(button_event_t* event);
+static void span_button_clicked(button_event_t* event);
+static void set_span(history_screen_t* s, history_span_t span);
+
+
+static const char* span_names[NUM_HISTORY_SPANS] = {
+    [HISTORY_SPAN_HOUR] = "1 hr",
+    [HISTORY_SPAN_DAY]  = "1 day",
+    [HISTORY_SPAN_WEEK] = "1 wk",
+};
 
 static const widget_class_t history_widget_class = {
     .on_destroy = history_screen_destroy,
@@ -41,16 +52,24 @@ history_screen_create()
   button_set_disabled_bg_color(back_btn, BLACK);
   button_set_disabled_icon_color(back_btn, DARK_GRAY);
 
-  rect.x = 85;
+  rect.x = DISP_WIDTH - 15 - 80;
+  rect.width = 80;
+  s->span_btn = button_create(s->widget, rect, NULL, WHITE, STEEL, span_button_clicked);
+  button_set_font(s->span_btn, font_opensans_regular_18);
+  widget_set_user_data(s->span_btn, s);
+
+  rect.x = 80;
   rect.y = 26;
-  rect.width = 220;
+  rect.width = DISP_WIDTH - 15 - 80 - 5 - 80;
   label_create(s->widget, rect, "Temp History", font_opensans_regular_22, WHITE, 1);
 
   rect.x = 5;
   rect.y = 80;
   rect.width = DISP_WIDTH - 10;
   rect.height = DISP_HEIGHT - 88;
-  scatter_plot_create(s->widget, rect);
+  s->plot = scatter_plot_create(s->widget, rect);
+
+  set_span(s, HISTORY_SPAN_HOUR);
 
   return s->widget;
 }
@@ -68,3 +87,20 @@ back_button_clicked(button_event_t* event)
   if (event->id == EVT_BUTTON_CLICK)
     gui_pop_screen();
 }
+
+static void
+span_button_clicked(button_event_t* event)
+{
+  if (event->id == EVT_BUTTON_CLICK) {
+    history_screen_t* s = widget_get_user_data(event->widget);
+    history_span_t span = scatter_plot_get_span(s->plot);
+    set_span(s, (span + 1) % NUM_HISTORY_SPANS);
+  }
+}
+
+static void
+set_span(history_screen_t* s, history_span_t span)
+{
+  scatter_plot_set_span(s->plot, span);
+  button_set_text(s->span_btn, span_names[span]);
+}
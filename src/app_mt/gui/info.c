@@ -9,6 +9,7 @@
 #include "bootloader_api.h"
 #include "web_api.h"
 
+#include <stdio.h>
 #include <string.h>
 
 
@@ -27,6 +28,11 @@ back_button_clicked(button_event_t* event);
 static void
 add_info(widget_t* lb, const char* title, const char* version);
 
+#ifdef MSG_STATS
+static void
+add_msg_stats(widget_t* lb);
+#endif
+
 
 static const widget_class_t info_screen_widget_class = {
     .on_destroy = info_screen_destroy
@@ -87,6 +93,11 @@ info_screen_create()
   }
   add_info(lb, "MAC Addr", ns->mac_addr);
 
+#ifdef MSG_STATS
+  add_msg_stats(lb);
+  msg_stats_dump();
+#endif
+
   return s->widget;
 }
 
@@ -120,6 +131,32 @@ add_info(widget_t* lb, const char* name, const char* value)
   listbox_add_item(lb, info_panel);
 }
 
+#ifdef MSG_STATS
+/* One row per message listener with its dispatch count, slowest dispatch
+ * and mailbox high water mark. The full histograms go to the console.
+ */
+static void
+add_msg_stats(widget_t* lb)
+{
+  int i;
+  int n;
+  char str[48];
+  msg_listener_stats_t* stats = calloc(16, sizeof(msg_listener_stats_t));
+
+  n = msg_stats_get_listeners(stats, 16);
+  for (i = 0; i < n; ++i) {
+    snprintf(str, sizeof(str), "%u disp, %u max, hw %u, blk %u",
+        (unsigned int)stats[i].dispatches,
+        (unsigned int)stats[i].dispatch_max,
+        stats[i].mb_high_water,
+        (unsigned int)stats[i].send_block_max);
+    add_info(lb, stats[i].name, str);
+  }
+
+  free(stats);
+}
+#endif
+
 static void
 back_button_clicked(button_event_t* event)
 {
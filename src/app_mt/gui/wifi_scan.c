@@ -37,6 +37,9 @@ dispatch_network_update(wifi_scan_screen_t* s, network_t* network);
 static void
 dispatch_network_timeout(wifi_scan_screen_t* s, network_t* network);
 
+static widget_t*
+find_network_item(wifi_scan_screen_t* s, network_t* network);
+
 
 static const widget_class_t wifi_scan_screen_widget_class = {
     .on_destroy = wifi_scan_screen_destroy,
@@ -130,6 +133,9 @@ dispatch_new_network(wifi_scan_screen_t* s, network_t* network)
 //  printf("  security mode: %d\r\n", network->security_mode);
 //  printf("  rssi: %d\r\n", network->rssi);
 
+  if (find_network_item(s, network) != NULL)
+    return;
+
   rect_t rect = {
       .x = 0,
       .y = 0,
@@ -162,14 +168,22 @@ dispatch_network_timeout(wifi_scan_screen_t* s, network_t* network)
 //  printf("  security mode: %d\r\n", network->security_mode);
 //  printf("  rssi: %d\r\n", network->rssi);
 
+  widget_t* item = find_network_item(s, network);
+  if (item != NULL)
+    listbox_delete_item(item);
+}
+
+static widget_t*
+find_network_item(wifi_scan_screen_t* s, network_t* network)
+{
   int i;
   for (i = 0; i < listbox_num_items(s->net_list); ++i) {
     widget_t* item = listbox_get_item(s->net_list, i);
-    if (network == widget_get_user_data(item)) {
-      listbox_delete_item(item);
-      break;
-    }
+    if (network == widget_get_user_data(item))
+      return item;
   }
+
+  return NULL;
 }
 
 static void
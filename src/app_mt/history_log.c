@@ -0,0 +1,783 @@
+
+#include "ch.h"
+#include "history_log.h"
+#include "sxfs.h"
+#include "xflash.h"
+#include "common.h"
+#include "crc/crc32.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* The log partition is used as a ring of flash sectors. Each sector starts
+ * with a small header holding a sequence number, followed by an index with
+ * the log time at which each page in the sector was opened, followed by the
+ * pages themselves which hold fixed size 8 byte records.
+ *
+ * Records are delta encoded. Every page starts with a keyframe holding
+ * absolute values, and the records after it hold the number of seconds since
+ * the previous record and the change in each value. A page can therefore be
+ * decoded on its own, and seeking to a time takes a scan of the sector table
+ * kept in RAM, a binary search of one sector's page index and the decode of a
+ * single page, no matter how much history has been kept.
+ *
+ * Flash is only ever programmed from the erased state, one record at a time,
+ * and each sector is erased once per trip around the ring. A power cut can at
+ * worst leave the last record half written. Decoding a page stops at the
+ * first damaged record, and after a reboot the writer moves on to a fresh
+ * page if the last one was left damaged.
+ *
+ * Each record's body is programmed before its flags and check byte. So a
+ * write cut off in the body always leaves erased flags, which no complete
+ * record has. Only a cut between the flags and the check byte relies on the
+ * check byte, which is never 0xFF, and so is caught unless the cut leaves
+ * it partly programmed. The check byte is 8 bits of a CRC, so other damage
+ * to a record, such as a bit flip in its dt field, slips through 1 time in
+ * 256.
+ */
+#define LOG_MAGIC               0x32545348 // "HST2"
+#define SECTOR_SIZE             XFLASH_SECTOR_SIZE
+#define PAGE_SIZE               HISTORY_LOG_PAGE_SIZE
+#define PAGE_INDEX_OFFSET       sizeof(sector_header_t)
+#define HEADER_SIZE             (4 * PAGE_SIZE)
+#define PAGES_PER_SECTOR        ((SECTOR_SIZE - HEADER_SIZE) / PAGE_SIZE)
+#define RECORDS_PER_PAGE        (PAGE_SIZE / (int)sizeof(log_record_t))
+#define MAX_SECTORS             16
+#define NUM_VALUES              (NUM_SENSORS + NUM_CONTROLLERS)
+#define ERASED_WORD             0xFFFFFFFF
+
+/* Record flags: kind in bits 0-1, output states in bits 2-3 and a bit for
+ * each of temp 1, temp 2, setpoint 1 and setpoint 2 in bits 4-7 which is set
+ * if that value is valid.
+ */
+#define REC_KIND(f)             ((f) & 0x03)
+#define REC_OUTPUTS(f)          (((f) >> 2) & 0x03)
+#define REC_VALID(f)            (((f) >> 4) & 0x0F)
+#define REC_FLAGS(k, o, v)      ((k) | ((o) << 2) | ((v) << 4))
+
+/* A keyframe is a REC_KEY_TEMP record immediately followed by a
+ * REC_KEY_SETPOINT record. The dt field of the second half holds these.
+ */
+#define KEY_FLAG_BOOT           0x0001
+
+
+typedef enum {
+  REC_KEY_TEMP,
+  REC_KEY_SETPOINT,
+  REC_DELTA,
+  REC_ERASED
+} record_kind_t;
+
+typedef enum {
+  DECODE_OK,
+  DECODE_END,
+  DECODE_BAD
+} decode_result_t;
+
+typedef struct {
+  uint8_t flags;
+  uint8_t check;
+  uint16_t dt;
+  union {
+    int8_t delta[NUM_VALUES];
+    int16_t value[2];
+  };
+} log_record_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t first_time;
+  uint32_t crc;
+} sector_header_t;
+
+typedef struct {
+  bool valid;
+  uint32_t seq;
+  uint32_t first_time;
+} sector_info_t;
+
+
+static void read_sector_info(uint8_t sector, sector_info_t* info);
+static void recover_write_pos(uint8_t sector);
+static bool append(const history_log_record_t* rec);
+static bool encode_delta(const history_log_record_t* rec, uint16_t dt, log_record_t* r);
+static bool write_keyframe(const history_log_record_t* rec, uint16_t dt);
+static bool write_record(log_record_t* r);
+static bool open_page(uint32_t time);
+static bool open_sector(uint32_t time);
+static bool read_next(history_log_cursor_t* c, history_log_record_t* rec);
+static bool load_page(history_log_cursor_t* c, uint8_t page);
+static bool reload_page(history_log_cursor_t* c);
+static bool is_write_page(const history_log_cursor_t* c);
+static decode_result_t decode_record(const log_record_t* recs, uint8_t* slot, history_log_record_t* state);
+static int16_t* state_value(history_log_record_t* state, int i);
+static uint8_t valid_mask(const history_log_record_t* state);
+static uint8_t record_check(const log_record_t* r);
+static bool record_erased(const log_record_t* r);
+static uint32_t header_crc(const sector_header_t* hdr);
+static uint32_t last_page(uint8_t sector);
+static uint32_t read_page_time(uint8_t sector, uint32_t page);
+static uint32_t sector_offset(uint8_t sector);
+
+
+static Mutex log_mutex;
+static sector_info_t sectors[MAX_SECTORS];
+static uint8_t num_sectors;
+
+static bool have_sector;
+static uint8_t write_sector;
+static uint8_t write_page;
+static uint8_t write_slot;
+static bool page_open;
+static bool boot_pending = true;
+static history_log_record_t last;
+
+static uint32_t time_base;
+static systime_t time_base_ticks;
+
+
+void
+history_log_init()
+{
+  int i;
+  int newest = -1;
+
+  chMtxInit(&log_mutex);
+
+  num_sectors = MIN(sxfs_get_size(SP_TEMP_HISTORY) / SECTOR_SIZE, MAX_SECTORS);
+
+  for (i = 0; i < num_sectors; ++i) {
+    read_sector_info(i, &sectors[i]);
+    if (sectors[i].valid &&
+        ((newest < 0) || (sectors[i].seq > sectors[newest].seq)))
+      newest = i;
+  }
+
+  if (newest >= 0) {
+    recover_write_pos(newest);
+    time_base = last.time + 1;
+  }
+
+  time_base_ticks = chTimeNow();
+}
+
+/* Returns the current time on the log clock. The clock is re-anchored on
+ * every call so it stays correct across systime_t wraps as long as it is
+ * read at least once every 49 days.
+ */
+uint32_t
+history_log_time()
+{
+  uint32_t t;
+
+  chSysLock();
+  uint32_t secs = (chTimeNow() - time_base_ticks) / S2ST(1);
+  time_base += secs;
+  time_base_ticks += secs * S2ST(1);
+  t = time_base;
+  chSysUnlock();
+
+  return t;
+}
+
+static void
+read_sector_info(uint8_t sector, sector_info_t* info)
+{
+  sector_header_t hdr;
+
+  sxfs_read(SP_TEMP_HISTORY, sector_offset(sector), (uint8_t*)&hdr, sizeof(hdr));
+
+  info->valid = (hdr.magic == LOG_MAGIC) && (hdr.crc == header_crc(&hdr));
+  info->seq = hdr.seq;
+  info->first_time = hdr.first_time;
+}
+
+/* Finds where the last boot left off by decoding the last page opened in
+ * the newest sector. Appending continues in that page only if it decoded
+ * cleanly up to the first erased slot.
+ */
+static void
+recover_write_pos(uint8_t sector)
+{
+  uint32_t page = last_page(sector);
+
+  have_sector = true;
+  write_sector = sector;
+  last.time = sectors[sector].first_time;
+
+  if (page >= PAGES_PER_SECTOR) {
+    write_page = 0;
+    page_open = false;
+    return;
+  }
+
+  history_log_cursor_t* c = calloc(1, sizeof(history_log_cursor_t));
+  c->sector = sector;
+  c->seq = sectors[sector].seq;
+  c->valid = true;
+
+  if (load_page(c, page)) {
+    const log_record_t* recs = (const log_record_t*)c->page_buf;
+    decode_result_t result;
+
+    while ((result = decode_record(recs, &c->slot, &c->state)) == DECODE_OK)
+      last = c->state;
+    last.time = MAX(last.time, c->state.time);
+
+    page_open = (result == DECODE_END) &&
+                (c->slot < RECORDS_PER_PAGE) &&
+                record_erased(&recs[c->slot]);
+  }
+  else {
+    page_open = false;
+  }
+
+  write_page = page_open ? page : (page + 1);
+  write_slot = c->slot;
+
+  free(c);
+}
+
+bool
+history_log_append(const history_log_record_t* rec)
+{
+  bool ret;
+
+  chMtxLock(&log_mutex);
+  ret = append(rec);
+  chMtxUnlock();
+
+  return ret;
+}
+
+static bool
+append(const history_log_record_t* rec)
+{
+  log_record_t r;
+  history_log_record_t entry = *rec;
+
+  if (num_sectors == 0)
+    return false;
+
+  /* The log is kept in time order, so a record stamped before the last one
+   * is logged at the time of the last one.
+   */
+  entry.time = MAX(rec->time, last.time);
+  entry.boot = boot_pending;
+
+  uint32_t dt = entry.time - last.time;
+
+  if (page_open && (write_slot > 0) && (write_slot < RECORDS_PER_PAGE) &&
+      !entry.boot && (dt <= UINT16_MAX) && encode_delta(&entry, dt, &r)) {
+    if (!write_record(&r))
+      return false;
+  }
+  else {
+    if (!page_open || (dt > UINT16_MAX) || (write_slot + 2 > RECORDS_PER_PAGE)) {
+      if (!open_page(entry.time))
+        return false;
+      dt = 0;
+    }
+
+    if (!write_keyframe(&entry, dt))
+      return false;
+  }
+
+  last = entry;
+  boot_pending = false;
+
+  return true;
+}
+
+/* Encodes a record as the change from the last one. Returns false if any
+ * value changed by too much or became valid or invalid, in which case a
+ * keyframe has to be written instead.
+ */
+static bool
+encode_delta(const history_log_record_t* rec, uint16_t dt, log_record_t* r)
+{
+  int i;
+  history_log_record_t entry = *rec;
+
+  if (valid_mask(&entry) != valid_mask(&last))
+    return false;
+
+  for (i = 0; i < NUM_VALUES; ++i) {
+    int16_t v = *state_value(&entry, i);
+    int16_t prev = *state_value(&last, i);
+    int32_t delta = (v == HISTORY_LOG_NO_DATA) ? 0 : (v - prev);
+
+    if ((delta < INT8_MIN) || (delta > INT8_MAX))
+      return false;
+
+    r->delta[i] = delta;
+  }
+
+  r->flags = REC_FLAGS(REC_DELTA, rec->outputs & 0x03, valid_mask(&entry));
+  r->dt = dt;
+
+  return true;
+}
+
+static bool
+write_keyframe(const history_log_record_t* rec, uint16_t dt)
+{
+  int i;
+  log_record_t r;
+  history_log_record_t entry = *rec;
+  uint8_t flags = REC_FLAGS(0, rec->outputs & 0x03, valid_mask(&entry));
+
+  r.flags = flags | REC_KEY_TEMP;
+  r.dt = dt;
+  for (i = 0; i < 2; ++i)
+    r.value[i] = *state_value(&entry, i);
+  if (!write_record(&r))
+    return false;
+
+  r.flags = flags | REC_KEY_SETPOINT;
+  r.dt = rec->boot ? KEY_FLAG_BOOT : 0;
+  for (i = 0; i < 2; ++i)
+    r.value[i] = *state_value(&entry, i + 2);
+  return write_record(&r);
+}
+
+/* Programs the next free slot in the open page. If the write fails the page
+ * is abandoned, since the slot can no longer be trusted to be erased.
+ */
+static bool
+write_record(log_record_t* r)
+{
+  uint32_t offset = sector_offset(write_sector) + HEADER_SIZE +
+      (write_page * PAGE_SIZE) + (write_slot * sizeof(log_record_t));
+
+  r->check = record_check(r);
+
+  if (!sxfs_write(SP_TEMP_HISTORY, offset + offsetof(log_record_t, dt),
+          (uint8_t*)&r->dt, sizeof(log_record_t) - offsetof(log_record_t, dt)) ||
+      !sxfs_write(SP_TEMP_HISTORY, offset, (uint8_t*)r, offsetof(log_record_t, dt))) {
+    page_open = false;
+    write_page++;
+    return false;
+  }
+
+  write_slot++;
+  return true;
+}
+
+static bool
+open_page(uint32_t time)
+{
+  if (page_open) {
+    page_open = false;
+    write_page++;
+  }
+
+  if (!have_sector || (write_page >= PAGES_PER_SECTOR)) {
+    if (!open_sector(time))
+      return false;
+  }
+
+  uint32_t offset = sector_offset(write_sector) + PAGE_INDEX_OFFSET +
+      (write_page * sizeof(uint32_t));
+  if (!sxfs_write(SP_TEMP_HISTORY, offset, (uint8_t*)&time, sizeof(time))) {
+    write_page++;
+    return false;
+  }
+
+  page_open = true;
+  write_slot = 0;
+  last.time = time;
+
+  return true;
+}
+
+/* Erases the oldest sector and makes it the newest. Readers positioned in
+ * it notice the change of sequence number and stop.
+ */
+static bool
+open_sector(uint32_t time)
+{
+  uint8_t sector = have_sector ? ((write_sector + 1) % num_sectors) : 0;
+  sector_header_t hdr = {
+      .magic = LOG_MAGIC,
+      .seq = have_sector ? (sectors[write_sector].seq + 1) : 1,
+      .first_time = time,
+  };
+  hdr.crc = header_crc(&hdr);
+
+  sectors[sector].valid = false;
+
+  if (!sxfs_erase(SP_TEMP_HISTORY, sector_offset(sector), SECTOR_SIZE))
+    return false;
+
+  if (!sxfs_write(SP_TEMP_HISTORY, sector_offset(sector), (uint8_t*)&hdr, sizeof(hdr)))
+    return false;
+
+  sectors[sector].valid = true;
+  sectors[sector].seq = hdr.seq;
+  sectors[sector].first_time = time;
+
+  have_sector = true;
+  write_sector = sector;
+  write_page = 0;
+  page_open = false;
+
+  return true;
+}
+
+/* Positions the cursor at the first record logged at or after the given
+ * time, or at the oldest record if the log does not go back that far.
+ * Returns false if the log is empty.
+ */
+bool
+history_log_seek(history_log_cursor_t* c, uint32_t time)
+{
+  int i;
+  int sector = -1;
+  int oldest = -1;
+  history_log_record_t rec;
+
+  memset(c, 0, sizeof(history_log_cursor_t));
+
+  chMtxLock(&log_mutex);
+  for (i = 0; i < num_sectors; ++i) {
+    if (!sectors[i].valid)
+      continue;
+
+    if ((sectors[i].first_time <= time) &&
+        ((sector < 0) || (sectors[i].seq > sectors[sector].seq)))
+      sector = i;
+
+    if ((oldest < 0) || (sectors[i].seq < sectors[oldest].seq))
+      oldest = i;
+  }
+  if (sector < 0)
+    sector = oldest;
+  if (sector >= 0) {
+    c->sector = sector;
+    c->seq = sectors[sector].seq;
+    c->valid = true;
+  }
+  chMtxUnlock();
+
+  if (!c->valid)
+    return false;
+
+  /* Pages are opened in time order and unopened pages read as 0xFFFFFFFF,
+   * so the page index can be binary searched directly.
+   */
+  int lo = 0;
+  int hi = PAGES_PER_SECTOR - 1;
+  int page = 0;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    uint32_t page_time = read_page_time(c->sector, mid);
+    if ((page_time != ERASED_WORD) && (page_time <= time)) {
+      page = mid;
+      lo = mid + 1;
+    }
+    else {
+      hi = mid - 1;
+    }
+  }
+
+  if (!load_page(c, page))
+    return c->valid;
+
+  while (read_next(c, &rec)) {
+    if (rec.time >= time) {
+      c->pending = true;
+      break;
+    }
+  }
+
+  return c->valid;
+}
+
+/* Returns the next record after the cursor, or false if there are no more.
+ * A cursor which has reached the end of the log can be polled, and will
+ * return new records as they are appended.
+ */
+bool
+history_log_next(history_log_cursor_t* c, history_log_record_t* rec)
+{
+  if (c->pending) {
+    c->pending = false;
+    *rec = c->state;
+    return true;
+  }
+
+  return read_next(c, rec);
+}
+
+static bool
+read_next(history_log_cursor_t* c, history_log_record_t* rec)
+{
+  while (c->valid) {
+    if (c->slot < RECORDS_PER_PAGE) {
+      decode_result_t result = decode_record(
+          (const log_record_t*)c->page_buf, &c->slot, &c->state);
+
+      if (result == DECODE_OK) {
+        *rec = c->state;
+        return true;
+      }
+
+      /* The page may have been appended to since it was read. Pages are
+       * only closed once the writer is done with them, so if this is not
+       * the page being written nothing more will show up in it.
+       */
+      if (result == DECODE_END) {
+        bool writing = is_write_page(c);
+        if (reload_page(c))
+          continue;
+        if (writing)
+          return false;
+      }
+
+      c->slot = RECORDS_PER_PAGE;
+    }
+
+    if ((c->page + 1) < PAGES_PER_SECTOR) {
+      if (load_page(c, c->page + 1))
+        continue;
+      return false;
+    }
+
+    chMtxLock(&log_mutex);
+    uint8_t next = (c->sector + 1) % num_sectors;
+    bool have_next = sectors[next].valid && (sectors[next].seq == (c->seq + 1));
+    chMtxUnlock();
+
+    if (!have_next)
+      return false;
+
+    c->sector = next;
+    c->seq++;
+    if (!load_page(c, 0))
+      return false;
+  }
+
+  return false;
+}
+
+/* Reads a page into the cursor. Returns false if the page has not been
+ * opened yet. If the sector has been erased and reused since the cursor
+ * entered it, the cursor is invalidated.
+ */
+static bool
+load_page(history_log_cursor_t* c, uint8_t page)
+{
+  uint32_t page_time = read_page_time(c->sector, page);
+  if (page_time == ERASED_WORD)
+    return false;
+
+  sxfs_read(SP_TEMP_HISTORY,
+      sector_offset(c->sector) + HEADER_SIZE + (page * PAGE_SIZE),
+      c->page_buf, PAGE_SIZE);
+
+  chMtxLock(&log_mutex);
+  c->valid = sectors[c->sector].valid && (sectors[c->sector].seq == c->seq);
+  chMtxUnlock();
+
+  c->page = page;
+  c->slot = 0;
+  c->state.time = page_time;
+
+  return c->valid;
+}
+
+/* Re-reads the remainder of the page from the cursor's slot onward. Returns
+ * true if a record has been written there since the page was loaded.
+ */
+static bool
+reload_page(history_log_cursor_t* c)
+{
+  uint32_t offset = c->slot * sizeof(log_record_t);
+
+  sxfs_read(SP_TEMP_HISTORY,
+      sector_offset(c->sector) + HEADER_SIZE + (c->page * PAGE_SIZE) + offset,
+      &c->page_buf[offset], PAGE_SIZE - offset);
+
+  const log_record_t* recs = (const log_record_t*)c->page_buf;
+  return !record_erased(&recs[c->slot]) &&
+      ((REC_KIND(recs[c->slot].flags) != REC_KEY_TEMP) ||
+       ((c->slot + 1) < RECORDS_PER_PAGE && !record_erased(&recs[c->slot + 1])));
+}
+
+static bool
+is_write_page(const history_log_cursor_t* c)
+{
+  bool ret;
+
+  chMtxLock(&log_mutex);
+  ret = page_open &&
+      (sectors[write_sector].seq == c->seq) &&
+      (write_page == c->page);
+  chMtxUnlock();
+
+  return ret;
+}
+
+/* Applies the record in the given slot to the decoded state and advances
+ * the slot past it. Returns DECODE_END at an erased slot, or at a keyframe
+ * whose second half has not been written yet.
+ */
+static decode_result_t
+decode_record(const log_record_t* recs, uint8_t* slot, history_log_record_t* state)
+{
+  int i;
+  const log_record_t* r = &recs[*slot];
+
+  if (record_erased(r))
+    return DECODE_END;
+
+  if (r->check != record_check(r))
+    return DECODE_BAD;
+
+  switch (REC_KIND(r->flags)) {
+  case REC_KEY_TEMP:
+  {
+    if ((*slot + 1) >= RECORDS_PER_PAGE)
+      return DECODE_BAD;
+
+    const log_record_t* r2 = &recs[*slot + 1];
+    if (record_erased(r2))
+      return DECODE_END;
+    if ((r2->check != record_check(r2)) ||
+        (REC_KIND(r2->flags) != REC_KEY_SETPOINT))
+      return DECODE_BAD;
+
+    state->time += r->dt;
+    for (i = 0; i < 2; ++i) {
+      *state_value(state, i) = r->value[i];
+      *state_value(state, i + 2) = r2->value[i];
+    }
+    state->outputs = REC_OUTPUTS(r->flags);
+    state->boot = (r2->dt & KEY_FLAG_BOOT) != 0;
+    *slot += 2;
+    return DECODE_OK;
+  }
+
+  case REC_DELTA:
+    /* A delta is only valid following a keyframe in the same page */
+    if ((*slot == 0) || (REC_VALID(r->flags) != valid_mask(state)))
+      return DECODE_BAD;
+
+    state->time += r->dt;
+    for (i = 0; i < NUM_VALUES; ++i) {
+      if (REC_VALID(r->flags) & (1 << i))
+        *state_value(state, i) += r->delta[i];
+    }
+    state->outputs = REC_OUTPUTS(r->flags);
+    state->boot = false;
+    *slot += 1;
+    return DECODE_OK;
+
+  default:
+    return DECODE_BAD;
+  }
+}
+
+static int16_t*
+state_value(history_log_record_t* state, int i)
+{
+  if (i < NUM_SENSORS)
+    return &state->temp[i];
+  return &state->setpoint[i - NUM_SENSORS];
+}
+
+static uint8_t
+valid_mask(const history_log_record_t* state)
+{
+  int i;
+  uint8_t mask = 0;
+
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    if (state->temp[i] != HISTORY_LOG_NO_DATA)
+      mask |= (1 << i);
+  }
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    if (state->setpoint[i] != HISTORY_LOG_NO_DATA)
+      mask |= (1 << (NUM_SENSORS + i));
+  }
+
+  return mask;
+}
+
+static uint8_t
+record_check(const log_record_t* r)
+{
+  log_record_t tmp = *r;
+  tmp.check = 0;
+  uint8_t check = crc32_block(ERASED_WORD, &tmp, sizeof(tmp)) & 0xFF;
+
+  /* An erased check byte always marks a torn record */
+  return (check == 0xFF) ? 0 : check;
+}
+
+static bool
+record_erased(const log_record_t* r)
+{
+  const uint8_t* p = (const uint8_t*)r;
+  unsigned int i;
+
+  for (i = 0; i < sizeof(log_record_t); ++i) {
+    if (p[i] != 0xFF)
+      return false;
+  }
+
+  return true;
+}
+
+static uint32_t
+header_crc(const sector_header_t* hdr)
+{
+  return crc32_block(0, (void*)hdr, offsetof(sector_header_t, crc));
+}
+
+/* Returns the last page opened in the sector, or PAGES_PER_SECTOR if no
+ * page has been opened.
+ */
+static uint32_t
+last_page(uint8_t sector)
+{
+  int lo = 0;
+  int hi = PAGES_PER_SECTOR - 1;
+  uint32_t page = PAGES_PER_SECTOR;
+
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (read_page_time(sector, mid) != ERASED_WORD) {
+      page = mid;
+      lo = mid + 1;
+    }
+    else {
+      hi = mid - 1;
+    }
+  }
+
+  return page;
+}
+
+static uint32_t
+read_page_time(uint8_t sector, uint32_t page)
+{
+  uint32_t page_time = ERASED_WORD;
+
+  sxfs_read(SP_TEMP_HISTORY,
+      sector_offset(sector) + PAGE_INDEX_OFFSET + (page * sizeof(uint32_t)),
+      (uint8_t*)&page_time, sizeof(page_time));
+
+  return page_time;
+}
+
+static uint32_t
+sector_offset(uint8_t sector)
+{
+  return sector * SECTOR_SIZE;
+}
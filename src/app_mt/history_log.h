@@ -0,0 +1,61 @@
+
+#ifndef HISTORY_LOG_H
+#define HISTORY_LOG_H
+
+#include "sensor.h"
+#include "temp_control.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define HISTORY_LOG_PAGE_SIZE     256
+#define HISTORY_LOG_NO_DATA       INT16_MIN
+
+
+/* One decoded entry from the log. Times are in seconds on the log clock,
+ * which keeps counting from the last record written before a reboot, so
+ * time spent powered off is not represented. Temperatures and setpoints are
+ * in tenths of a degree F, or HISTORY_LOG_NO_DATA. Bit n of outputs is set
+ * if output n was on. The values hold until the time of the next record.
+ */
+typedef struct {
+  uint32_t time;
+  int16_t temp[NUM_SENSORS];
+  int16_t setpoint[NUM_CONTROLLERS];
+  uint8_t outputs;
+  bool boot;
+} history_log_record_t;
+
+/* Read position in the log. Cursors are owned by the reader and hold a copy
+ * of the flash page being decoded, so any number of them can be open while
+ * the log is being appended to.
+ */
+typedef struct {
+  uint8_t sector;
+  uint8_t page;
+  uint8_t slot;
+  bool valid;
+  bool pending;
+  uint32_t seq;
+  history_log_record_t state;
+  uint8_t page_buf[HISTORY_LOG_PAGE_SIZE];
+} history_log_cursor_t;
+
+
+void
+history_log_init(void);
+
+uint32_t
+history_log_time(void);
+
+bool
+history_log_append(const history_log_record_t* rec);
+
+bool
+history_log_seek(history_log_cursor_t* c, uint32_t time);
+
+bool
+history_log_next(history_log_cursor_t* c, history_log_record_t* rec);
+
+#endif
@@ -0,0 +1,719 @@
+#include <ch.h>
+#include <hal.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <pb_encode.h>
+
+#include "lan_api.h"
+#include "web_api_msg.h"
+#include "bbmt.pb.h"
+#include "message.h"
+#include "net.h"
+#include "sensor.h"
+#include "app_cfg.h"
+#include "temp_control.h"
+
+
+/* A TCP server for clients on the local network, speaking the same length
+ * prefixed ApiMessage framing as the web API. It is only started when the
+ * firmware is built with LAN_API_PORT set.
+ *
+ * A client's first message must be an AUTH_REQUEST carrying the device's
+ * auth token, the one it was given by the web API on activation. Clients
+ * which don't authenticate in time are disconnected. Until then a client
+ * may only send a message the size of an auth request, and has to send all
+ * of it promptly, so that an unknown client can't hold up the listener
+ * thread. Each failed attempt locks out new attempts for twice as long as
+ * the last, up to a limit, until a client succeeds. Once authenticated, a
+ * client is sent a report as each sensor sample arrives and the settings
+ * whenever they change, and may change the device and controller settings.
+ *
+ * Each client has a bounded queue of encoded messages. A message for all
+ * clients is encoded once and shared between their queues. If a client falls
+ * behind, the oldest queued messages are dropped, as newer reports and
+ * settings supersede them.
+ */
+
+#ifndef LAN_API_PORT
+#define LAN_API_PORT 31338
+#endif
+
+#define CLIENT_QUEUE_LEN       8
+
+#define SERVICE_INTERVAL_MS    500
+#define LISTEN_RETRY_INTERVAL  S2ST(5)
+#define KEEPALIVE_INTERVAL     S2ST(10)
+#define AUTH_TIMEOUT           S2ST(10)
+#define AUTH_RECV_TIMEOUT      MS2ST(500)
+#define AUTH_BACKOFF_MIN       S2ST(1)
+#define AUTH_BACKOFF_MAX       S2ST(60)
+#define MAX_SEND_ERRS          25
+
+/* Room for the message type and the auth request's tag and length */
+#define AUTH_MSG_MAX_SIZE      (AuthRequest_size + 8)
+
+
+typedef struct {
+  uint32_t refs;
+  uint32_t len;
+  uint8_t data[];
+} lan_frame_t;
+
+typedef struct {
+  int32_t sd;
+  bool authenticated;
+  bool auth_failed;
+  systime_t connect_time;
+  systime_t last_send_time;
+  uint32_t send_errors;
+  web_api_msg_reader_t reader;
+
+  lan_frame_t* queue[CLIENT_QUEUE_LEN];
+  uint32_t queue_head;
+  uint32_t queue_count;
+  uint32_t frame_pos;
+  uint32_t frames_dropped;
+} lan_client_t;
+
+typedef struct {
+  msg_listener_t* msg_listener;
+  BinarySemaphore net_up;
+  int32_t listen_sd;
+  systime_t last_service_time;
+  uint32_t num_clients;
+  lan_client_t clients[LAN_API_MAX_CLIENTS];
+
+  systime_t auth_fail_time;
+  systime_t auth_backoff;
+} lan_api_t;
+
+
+static msg_t
+lan_api_accept_thread(void* arg);
+
+static bool
+listen_start(lan_api_t* lan);
+
+static void
+lan_api_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+
+static void
+lan_api_service(lan_api_t* lan);
+
+static void
+dispatch_net_status(lan_api_t* lan, net_status_t* ns);
+
+static void
+dispatch_client_connect(lan_api_t* lan, int32_t* sd);
+
+static void
+dispatch_socket_ready(lan_api_t* lan, int32_t* sd);
+
+static void
+dispatch_sensor_sample(lan_api_t* lan, sensor_msg_t* sample);
+
+static void
+send_device_settings(lan_api_t* lan, lan_client_t* c);
+
+static void
+send_controller_settings(lan_api_t* lan, lan_client_t* c,
+    temp_controller_id_t controller);
+
+static void
+send_api_msg(lan_api_t* lan, lan_client_t* c, ApiMessage* msg);
+
+static lan_frame_t*
+frame_alloc(uint32_t len);
+
+static void
+frame_release(lan_frame_t* f);
+
+static void
+client_queue_frame(lan_client_t* c, lan_frame_t* f);
+
+static void
+client_flush(lan_api_t* lan, lan_client_t* c);
+
+static void
+client_close(lan_api_t* lan, lan_client_t* c);
+
+static lan_client_t*
+find_client(lan_api_t* lan, int32_t sd);
+
+static bool
+client_poll(lan_api_t* lan, lan_client_t* c);
+
+static void
+dispatch_api_msg(ApiMessage* msg, void* arg);
+
+static void
+dispatch_auth_request(lan_client_t* c, AuthRequest* request);
+
+static bool
+auth_locked_out(lan_api_t* lan);
+
+static bool
+token_matches(const char* token, const char* expected, size_t size);
+
+
+static lan_api_t* lan;
+
+
+void
+lan_api_init()
+{
+  int i;
+
+  lan = calloc(1, sizeof(lan_api_t));
+  lan->listen_sd = -1;
+  for (i = 0; i < LAN_API_MAX_CLIENTS; ++i)
+    lan->clients[i].sd = -1;
+
+  chBSemInit(&lan->net_up, TRUE);
+
+  lan->msg_listener = msg_listener_create("lan_api", 2048, lan_api_dispatch, lan);
+  msg_listener_set_idle_timeout(lan->msg_listener, SERVICE_INTERVAL_MS);
+  msg_listener_set_priority(lan->msg_listener, MSG_PRIO_LOW);
+
+  msg_subscribe(lan->msg_listener, MSG_NET_STATUS, NULL);
+  msg_subscribe(lan->msg_listener, MSG_LAN_API_CLIENT, NULL);
+  msg_subscribe(lan->msg_listener, MSG_CONTROL_MODE, NULL);
+  msg_subscribe(lan->msg_listener, MSG_CONTROLLER_SETTINGS, NULL);
+  msg_subscribe(lan->msg_listener, MSG_API_CONTROLLER_SETTINGS, NULL);
+  msg_subscribe_lossy(lan->msg_listener, MSG_SENSOR_SAMPLE, NULL, sizeof(sensor_msg_t));
+  msg_subscribe_coalesced(lan->msg_listener, MSG_WLAN_SOCKET_READY, NULL, sizeof(int32_t));
+
+  /* accept() blocks until a client connects, so it gets its own thread */
+  chThdCreateFromHeap(NULL, 1024, NORMALPRIO, lan_api_accept_thread, lan);
+}
+
+static msg_t
+lan_api_accept_thread(void* arg)
+{
+  lan_api_t* lan = arg;
+
+  chRegSetThreadName("lan_accept");
+
+  while (1) {
+    const net_status_t* ns = net_get_status();
+    if (ns->net_state != NS_CONNECTED || !ns->dhcp_resolved) {
+      chBSemWait(&lan->net_up);
+      continue;
+    }
+
+    if (listen_start(lan)) {
+      printf("LAN API listening on port %d\r\n", LAN_API_PORT);
+
+      while (1) {
+        sockaddr addr;
+        socklen_t addrlen = sizeof(addr);
+        int32_t sd = accept(lan->listen_sd, &addr, &addrlen);
+        if (sd < 0)
+          break;
+
+        /* Clients are owned by the listener thread from here on */
+        msg_send(MSG_LAN_API_CLIENT, &sd);
+      }
+
+      printf("LAN API accept failed\r\n");
+      closesocket(lan->listen_sd);
+      lan->listen_sd = -1;
+    }
+
+    chThdSleep(LISTEN_RETRY_INTERVAL);
+  }
+
+  return 0;
+}
+
+static bool
+listen_start(lan_api_t* lan)
+{
+  lan->listen_sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (lan->listen_sd < 0) {
+    printf("LAN API socket failed %d\r\n", (int)lan->listen_sd);
+    return false;
+  }
+
+  sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(LAN_API_PORT),
+    .sin_addr.s_addr = htonl(INADDR_ANY)
+  };
+  int ret = bind(lan->listen_sd, (sockaddr*)&addr, sizeof(addr));
+  if (ret == 0)
+    ret = listen(lan->listen_sd, 1);
+
+  if (ret < 0) {
+    printf("LAN API listen failed %d\r\n", ret);
+    closesocket(lan->listen_sd);
+    lan->listen_sd = -1;
+    return false;
+  }
+
+  return true;
+}
+
+static void
+lan_api_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  (void)sub_data;
+
+  lan_api_t* lan = listener_data;
+
+  switch (id) {
+    case MSG_NET_STATUS:
+      dispatch_net_status(lan, msg_data);
+      break;
+
+    case MSG_LAN_API_CLIENT:
+      dispatch_client_connect(lan, msg_data);
+      break;
+
+    case MSG_WLAN_SOCKET_READY:
+      dispatch_socket_ready(lan, msg_data);
+      break;
+
+    case MSG_SENSOR_SAMPLE:
+      dispatch_sensor_sample(lan, msg_data);
+      break;
+
+    case MSG_CONTROL_MODE:
+      if (lan->num_clients > 0)
+        send_device_settings(lan, NULL);
+      break;
+
+    case MSG_CONTROLLER_SETTINGS:
+    case MSG_API_CONTROLLER_SETTINGS:
+      if (lan->num_clients > 0)
+        send_controller_settings(lan, NULL,
+            ((controller_settings_t*)msg_data)->controller);
+      break;
+
+    default:
+      break;
+  }
+
+  if ((chTimeNow() - lan->last_service_time) >= MS2ST(SERVICE_INTERVAL_MS))
+    lan_api_service(lan);
+}
+
+static void
+lan_api_service(lan_api_t* lan)
+{
+  int i;
+
+  lan->last_service_time = chTimeNow();
+
+  for (i = 0; i < LAN_API_MAX_CLIENTS; ++i) {
+    lan_client_t* c = &lan->clients[i];
+    if (c->sd < 0)
+      continue;
+
+    /* Data is normally read as soon as select reports it, this catches
+     * anything which arrived before the client was being watched
+     */
+    while (client_poll(lan, c)) {
+    }
+    if (c->sd < 0)
+      continue;
+
+    if (!c->authenticated) {
+      if ((chTimeNow() - c->connect_time) > AUTH_TIMEOUT) {
+        printf("LAN API client did not authenticate %d\r\n", (int)c->sd);
+        client_close(lan, c);
+      }
+      continue;
+    }
+
+    /* A zero length message lets a quiet client know the device is still
+     * there, and lets us find out if the client is not
+     */
+    if ((c->queue_count == 0) &&
+        (chTimeNow() - c->last_send_time) > KEEPALIVE_INTERVAL) {
+      lan_frame_t* f = frame_alloc(0);
+      client_queue_frame(c, f);
+      frame_release(f);
+    }
+
+    client_flush(lan, c);
+  }
+}
+
+static void
+dispatch_net_status(lan_api_t* lan, net_status_t* ns)
+{
+  int i;
+
+  if (ns->net_state == NS_CONNECTED &&
+      ns->dhcp_resolved) {
+    chBSemSignal(&lan->net_up);
+  }
+  else {
+    for (i = 0; i < LAN_API_MAX_CLIENTS; ++i) {
+      if (lan->clients[i].sd >= 0)
+        client_close(lan, &lan->clients[i]);
+    }
+  }
+}
+
+static void
+dispatch_client_connect(lan_api_t* lan, int32_t* sd)
+{
+  if (auth_locked_out(lan)) {
+    printf("LAN API auth locked out\r\n");
+    closesocket(*sd);
+    return;
+  }
+
+  lan_client_t* c = find_client(lan, -1);
+  if (c == NULL) {
+    printf("LAN API client limit reached\r\n");
+    closesocket(*sd);
+    return;
+  }
+
+  memset(c, 0, sizeof(lan_client_t));
+  c->sd = *sd;
+  c->connect_time = chTimeNow();
+  c->last_send_time = chTimeNow();
+  web_api_msg_reader_init(&c->reader, c->sd);
+  web_api_msg_reader_set_limits(&c->reader, AUTH_MSG_MAX_SIZE, AUTH_RECV_TIMEOUT);
+
+  lan->num_clients++;
+  printf("LAN API client connected %d\r\n", (int)c->sd);
+
+  /* The client may have sent something before it was being watched */
+  while ((c->sd >= 0) && client_poll(lan, c)) {
+  }
+}
+
+static void
+dispatch_socket_ready(lan_api_t* lan, int32_t* sd)
+{
+  lan_client_t* c = find_client(lan, *sd);
+  if (c == NULL)
+    return;
+
+  /* Read until the data select reported has been consumed */
+  while (client_poll(lan, c)) {
+  }
+}
+
+static void
+dispatch_sensor_sample(lan_api_t* lan, sensor_msg_t* sample)
+{
+  if ((lan->num_clients == 0) ||
+      (sample->sensor >= NUM_SENSORS))
+    return;
+
+  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+  msg->type = ApiMessage_Type_DEVICE_REPORT;
+  msg->has_deviceReport = true;
+  msg->deviceReport.controller_reports_count = 1;
+
+  web_api_msg_controller_report(&msg->deviceReport.controller_reports[0],
+      (temp_controller_id_t)sample->sensor, sample->sample.value);
+
+  send_api_msg(lan, NULL, msg);
+
+  free(msg);
+}
+
+static void
+send_device_settings(lan_api_t* lan, lan_client_t* c)
+{
+  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+  msg->type = ApiMessage_Type_DEVICE_SETTINGS;
+  msg->has_deviceSettings = true;
+
+  web_api_msg_device_settings(&msg->deviceSettings);
+
+  send_api_msg(lan, c, msg);
+
+  free(msg);
+}
+
+static void
+send_controller_settings(lan_api_t* lan, lan_client_t* c,
+    temp_controller_id_t controller)
+{
+  if (controller >= NUM_CONTROLLERS)
+    return;
+
+  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+  msg->type = ApiMessage_Type_CONTROLLER_SETTINGS;
+  msg->has_controllerSettings = true;
+
+  web_api_msg_controller_settings(&msg->controllerSettings, controller);
+
+  send_api_msg(lan, c, msg);
+
+  free(msg);
+}
+
+/* Encodes a message once and queues it for one client, or for every
+ * authenticated client if c is NULL.
+ */
+static void
+send_api_msg(lan_api_t* lan, lan_client_t* c, ApiMessage* msg)
+{
+  int i;
+  uint8_t* buffer = malloc(WEB_API_MSG_MAX_SIZE);
+
+  pb_ostream_t stream = pb_ostream_from_buffer(buffer, WEB_API_MSG_MAX_SIZE);
+  bool encoded_ok = pb_encode(&stream, ApiMessage_fields, msg);
+
+  if (encoded_ok) {
+    lan_frame_t* f = frame_alloc(stream.bytes_written);
+    memcpy(f->data + sizeof(uint32_t), buffer, stream.bytes_written);
+
+    for (i = 0; i < LAN_API_MAX_CLIENTS; ++i) {
+      lan_client_t* client = &lan->clients[i];
+      if ((client->sd >= 0) &&
+          ((c == client) || (c == NULL && client->authenticated))) {
+        client_queue_frame(client, f);
+        client_flush(lan, client);
+      }
+    }
+
+    frame_release(f);
+  }
+  else {
+    printf("LAN API encode failed\r\n");
+  }
+
+  free(buffer);
+}
+
+/* Allocates a frame with room for a message of the given length after its
+ * length prefix. The caller holds the only reference.
+ */
+static lan_frame_t*
+frame_alloc(uint32_t len)
+{
+  lan_frame_t* f = malloc(sizeof(lan_frame_t) + sizeof(uint32_t) + len);
+
+  uint32_t prefix = htonl(len);
+  memcpy(f->data, &prefix, sizeof(prefix));
+  f->len = sizeof(uint32_t) + len;
+  f->refs = 1;
+
+  return f;
+}
+
+static void
+frame_release(lan_frame_t* f)
+{
+  if (--f->refs == 0)
+    free(f);
+}
+
+static void
+client_queue_frame(lan_client_t* c, lan_frame_t* f)
+{
+  uint32_t i;
+
+  if (c->queue_count == CLIENT_QUEUE_LEN) {
+    /* Drop the oldest frame which has not started to go out. A frame which
+     * is part way out has to be finished to keep the framing intact.
+     */
+    uint32_t drop = (c->frame_pos > 0) ? 1 : 0;
+    frame_release(c->queue[(c->queue_head + drop) % CLIENT_QUEUE_LEN]);
+
+    for (i = drop; i < c->queue_count - 1; ++i)
+      c->queue[(c->queue_head + i) % CLIENT_QUEUE_LEN] =
+          c->queue[(c->queue_head + i + 1) % CLIENT_QUEUE_LEN];
+
+    c->queue_count--;
+    c->frames_dropped++;
+  }
+
+  f->refs++;
+  c->queue[(c->queue_head + c->queue_count) % CLIENT_QUEUE_LEN] = f;
+  c->queue_count++;
+}
+
+static void
+client_flush(lan_api_t* lan, lan_client_t* c)
+{
+  while (c->queue_count > 0) {
+    lan_frame_t* f = c->queue[c->queue_head];
+
+    int ret = send(c->sd, f->data + c->frame_pos, f->len - c->frame_pos, 0);
+    if (ret <= 0) {
+      printf("LAN API send failed %d %d\r\n", ret, errno);
+      if ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+          (++c->send_errors > MAX_SEND_ERRS))
+        client_close(lan, c);
+      return;
+    }
+
+    c->send_errors = 0;
+    c->last_send_time = chTimeNow();
+    c->frame_pos += ret;
+    if (c->frame_pos == f->len) {
+      frame_release(f);
+      c->queue_head = (c->queue_head + 1) % CLIENT_QUEUE_LEN;
+      c->queue_count--;
+      c->frame_pos = 0;
+    }
+  }
+}
+
+static void
+client_close(lan_api_t* lan, lan_client_t* c)
+{
+  printf("LAN API client disconnected %d (%d dropped)\r\n",
+      (int)c->sd, (int)c->frames_dropped);
+
+  closesocket(c->sd);
+  c->sd = -1;
+
+  while (c->queue_count > 0) {
+    frame_release(c->queue[c->queue_head]);
+    c->queue_head = (c->queue_head + 1) % CLIENT_QUEUE_LEN;
+    c->queue_count--;
+  }
+
+  lan->num_clients--;
+}
+
+static lan_client_t*
+find_client(lan_api_t* lan, int32_t sd)
+{
+  int i;
+
+  for (i = 0; i < LAN_API_MAX_CLIENTS; ++i) {
+    if (lan->clients[i].sd == sd)
+      return &lan->clients[i];
+  }
+
+  return NULL;
+}
+
+/* Reads what is available from a client. Returns true if data was read and
+ * the client is still connected.
+ */
+static bool
+client_poll(lan_api_t* lan, lan_client_t* c)
+{
+  web_api_msg_read_t ret = web_api_msg_read(&c->reader, dispatch_api_msg, c);
+
+  /* A failed send while handling the message may have closed it already */
+  if (c->sd < 0)
+    return false;
+
+  if ((ret == WMR_DISCONNECTED) || c->auth_failed) {
+    client_close(lan, c);
+    return false;
+  }
+
+  return (ret != WMR_NO_DATA);
+}
+
+static void
+dispatch_api_msg(ApiMessage* msg, void* arg)
+{
+  lan_client_t* c = arg;
+
+  if (!c->authenticated) {
+    if ((msg->type == ApiMessage_Type_AUTH_REQUEST) && msg->has_authRequest)
+      dispatch_auth_request(c, &msg->authRequest);
+    else
+      c->auth_failed = true;
+    return;
+  }
+
+  switch (msg->type) {
+  case ApiMessage_Type_DEVICE_SETTINGS:
+    web_api_msg_apply_device_settings(&msg->deviceSettings);
+    break;
+
+  /* Settings changed on the LAN are treated like changes made on the device
+   * itself, so they are passed on to the server and back to every client.
+   */
+  case ApiMessage_Type_CONTROLLER_SETTINGS:
+    web_api_msg_apply_controller_settings(&msg->controllerSettings, SS_DEVICE);
+    break;
+
+  default:
+    printf("Unsupported LAN API message: %d\r\n", msg->type);
+    break;
+  }
+}
+
+static void
+dispatch_auth_request(lan_client_t* c, AuthRequest* request)
+{
+  int i;
+  const char* auth_token = app_cfg_get_auth_token();
+
+  /* A device which has not been activated has no token to check against */
+  c->authenticated = !auth_locked_out(lan) &&
+      (auth_token[0] != 0) &&
+      token_matches(request->auth_token, auth_token, sizeof(request->auth_token));
+
+  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+  msg->type = ApiMessage_Type_AUTH_RESPONSE;
+  msg->has_authResponse = true;
+  msg->authResponse.authenticated = c->authenticated;
+
+  if (c->authenticated) {
+    printf("LAN API client authenticated %d\r\n", (int)c->sd);
+    lan->auth_backoff = 0;
+    web_api_msg_reader_set_limits(&c->reader, WEB_API_MSG_MAX_SIZE,
+        MS2ST(WEB_API_MSG_RECV_TIMEOUT_MS));
+    send_api_msg(lan, c, msg);
+
+    /* Bring the new client up to date with the current settings */
+    send_device_settings(lan, c);
+    for (i = 0; i < NUM_CONTROLLERS; ++i)
+      send_controller_settings(lan, c, i);
+  }
+  else {
+    /* Tell the client why before it is disconnected */
+    printf("LAN API client auth failed %d\r\n", (int)c->sd);
+    send_api_msg(lan, c, msg);
+    c->auth_failed = true;
+
+    if (!auth_locked_out(lan)) {
+      lan->auth_fail_time = chTimeNow();
+      lan->auth_backoff = (lan->auth_backoff == 0) ? AUTH_BACKOFF_MIN :
+          MIN(2 * lan->auth_backoff, AUTH_BACKOFF_MAX);
+    }
+  }
+
+  free(msg);
+}
+
+static bool
+auth_locked_out(lan_api_t* lan)
+{
+  return (lan->auth_backoff > 0) &&
+      ((chTimeNow() - lan->auth_fail_time) < lan->auth_backoff);
+}
+
+/* Compares the whole of both tokens whatever they hold, so that the time
+ * taken says nothing about how much of a guess was right. Bytes after the
+ * end of either string are treated as zero.
+ */
+static bool
+token_matches(const char* token, const char* expected, size_t size)
+{
+  size_t i;
+  size_t token_len = strnlen(token, size);
+  size_t expected_len = strnlen(expected, size);
+  uint8_t diff = (token_len != expected_len);
+
+  for (i = 0; i < size; ++i) {
+    uint8_t a = (i < token_len) ? token[i] : 0;
+    uint8_t b = (i < expected_len) ? expected[i] : 0;
+    diff |= a ^ b;
+  }
+
+  return (diff == 0);
+}
@@ -0,0 +1,20 @@
+
+#ifndef LAN_API_H
+#define LAN_API_H
+
+/* The CC3000 has four sockets. One is used by the web API and one listens
+ * for LAN clients, leaving two for clients. Telemetry needs one for each
+ * frame it sends, so builds with TELEMETRY_PORT set take one LAN client
+ * fewer. A client which connects while the server is full is disconnected
+ * straight away.
+ */
+#ifdef TELEMETRY_PORT
+#define LAN_API_MAX_CLIENTS    1
+#else
+#define LAN_API_MAX_CLIENTS    2
+#endif
+
+void
+lan_api_init(void);
+
+#endif
@@ -6,6 +6,8 @@
 #include "lcd.h"
 #include "image.h"
 #include "web_api.h"
+#include "lan_api.h"
+#include "telemetry.h"
 #include "touch.h"
 #include "gui.h"
 #include "temp_control.h"
@@ -21,6 +23,9 @@
 #include "screen_saver.h"
 #include "xflash.h"
 #include "recovery_img.h"
+#include "temp_history.h"
+#include "history_log.h"
+#include "temp_profile_store.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -100,12 +105,23 @@ main(void)
   sensor_init(SENSOR_1, SD_OW1);
   sensor_init(SENSOR_2, SD_OW2);
 
+  temp_profile_store_init();
+
   temp_control_init(CONTROLLER_1);
   temp_control_init(CONTROLLER_2);
 
+  history_log_init();
+  temp_history_init();
+
   ota_update_init();
   net_init();
   web_api_init();
+#ifdef LAN_API_PORT
+  lan_api_init();
+#endif
+#ifdef TELEMETRY_PORT
+  telemetry_init();
+#endif
   gui_init();
   thread_watchdog_init();
 
@@ -5,31 +5,65 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #define MAX_MAILBOX_MSGS 32
+#define LOSSY_QUEUE_LEN 8
+
+typedef struct {
+  msg_listener_t* sender;
+  msg_id_t id;
+  void* user_data;
+  void* msg_data;
+  bool processed;
+} thread_msg_t;
+
+typedef struct {
+  msg_id_t id;
+  void* user_data;
+  bool coalesce;
+  uint8_t data[MSG_LOSSY_MAX_SIZE];
+} lossy_entry_t;
+
+/* Messages for lossy and coalesced subscriptions are copied into this ring
+ * instead of blocking the sender. When it is full the oldest lossy message
+ * is dropped, and if every entry is a coalesced one the new message is
+ * dropped instead. A single token in the mailbox tells the listener to
+ * dispatch the oldest entry, and is posted again while entries remain so
+ * that urgent messages are never queued behind more than one of them.
+ */
+typedef struct {
+  lossy_entry_t entries[LOSSY_QUEUE_LEN];
+  uint8_t head;
+  uint8_t count;
+  bool pending;
+  thread_msg_t token;
+} lossy_queue_t;
 
 typedef struct msg_listener_s {
+#ifdef MSG_STATS
+  struct msg_listener_s* next;
+  msg_listener_stats_t stats;
+#endif
   Thread* thread;
   const char* name;
   thread_msg_dispatch_t dispatch;
   systime_t timeout;
   void* user_data;
   bool watchdog_enabled;
+  tprio_t prio;
+  bool prio_changed;
+  lossy_queue_t* lossy;
   Mailbox mb;
   msg_t mb_buf[MAX_MAILBOX_MSGS];
 } msg_listener_t;
 
-typedef struct {
-  msg_listener_t* sender;
-  msg_id_t id;
-  void* user_data;
-  void* msg_data;
-  bool processed;
-} thread_msg_t;
-
 typedef struct msg_subscription_s {
   msg_listener_t* listener;
   void* user_data;
+  size_t msg_size; // 0 for synchronous delivery
+  bool coalesce;
+  uint32_t key;
   struct msg_subscription_s* next;
 } msg_subscription_t;
 
@@ -46,9 +80,64 @@ msg_get(msg_listener_t* l);
 static void
 msg_release(thread_msg_t* msg);
 
+static void
+msg_dispatch(msg_listener_t* l, msg_id_t id, void* msg_data, void* sub_data);
+
+static void
+add_subscription(msg_listener_t* l, msg_id_t id, uint32_t key, void* user_data, size_t msg_size, bool coalesce);
+
+static void
+lossy_post(msg_subscription_t* sub, msg_id_t id, void* msg_data);
+
+static void
+lossy_drain(msg_listener_t* l);
+
+static void
+lossy_repost(msg_listener_t* l);
+
+#ifdef MSG_STATS
+static void
+stats_record_post(msg_listener_t* l);
+
+static void
+stats_record_dispatch(msg_listener_t* l, systime_t elapsed);
+
+static void
+stats_record_send(msg_listener_t* sender, systime_t blocked);
+#endif
+
 
 static msg_subscription_t* subs[NUM_THREAD_MSGS];
 
+static const tprio_t listener_prio[] = {
+    [MSG_PRIO_LOW]    = NORMALPRIO - 2,
+    [MSG_PRIO_NORMAL] = NORMALPRIO,
+    [MSG_PRIO_HIGH]   = NORMALPRIO + 2,
+};
+
+/* Urgent messages are posted to the front of the listener's mailbox so they
+ * are dispatched before anything already queued. Urgent messages queued
+ * behind each other are therefore dispatched newest first.
+ */
+static const bool msg_urgent[NUM_THREAD_MSGS] = {
+    [MSG_SENSOR_SAMPLE]           = true,
+    [MSG_SENSOR_TIMEOUT]          = true,
+    [MSG_CONTROLLER_SETTINGS]     = true,
+    [MSG_OUTPUT_STATUS]           = true,
+    [MSG_OUTPUT_OVRD]             = true,
+    [MSG_API_CONTROLLER_SETTINGS] = true,
+    [MSG_SHUTDOWN]                = true,
+};
+
+#ifdef MSG_STATS
+static msg_listener_t* listeners;
+static uint32_t publish_count[NUM_THREAD_MSGS];
+static uint32_t filtered_count[NUM_THREAD_MSGS];
+static msg_listener_stats_t external_sender_stats = {
+    .name = "(other threads)"
+};
+#endif
+
 
 msg_listener_t*
 msg_listener_create(const char* name, int stack_size, thread_msg_dispatch_t dispatch, void* user_data)
@@ -61,7 +150,17 @@ msg_listener_create(const char* name, int stack_size, thread_msg_dispatch_t disp
   l->timeout = TIME_INFINITE;
   l->user_data = user_data;
   l->watchdog_enabled = false;
+  l->prio = NORMALPRIO;
   chMBInit(&l->mb, l->mb_buf, MAX_MAILBOX_MSGS);
+
+#ifdef MSG_STATS
+  l->stats.name = name;
+  chSysLock();
+  l->next = listeners;
+  listeners = l;
+  chSysUnlock();
+#endif
+
   l->thread = chThdCreateFromHeap(NULL, stack_size, NORMALPRIO, msg_thread_func, l);
   return l;
 }
@@ -76,7 +175,44 @@ msg_listener_enable_watchdog(msg_listener_t* l, uint32_t period)
 void
 msg_listener_set_idle_timeout(msg_listener_t* l, uint32_t idle_timeout)
 {
-  l->timeout = MS2ST(idle_timeout);
+  if (idle_timeout == TIME_INFINITE)
+    l->timeout = TIME_INFINITE;
+  else
+    l->timeout = MS2ST(idle_timeout);
+}
+
+/* Sets the thread priority of the listener. When called from another thread
+ * the new priority takes effect once the listener next receives a message.
+ */
+void
+msg_listener_set_priority(msg_listener_t* l, msg_priority_t prio)
+{
+  l->prio = listener_prio[prio];
+
+  if (chThdSelf() == l->thread)
+    chThdSetPriority(l->prio);
+  else
+    l->prio_changed = true;
+}
+
+/* Wakes the listener thread without blocking the caller. The listener will
+ * be dispatched an MSG_IDLE as if its idle timeout had expired.
+ */
+void
+msg_listener_wake(msg_listener_t* l)
+{
+  static thread_msg_t wake_msg = {
+      .id = MSG_IDLE,
+      .msg_data = NULL,
+      .user_data = NULL,
+      .sender = NULL,
+      .processed = true
+  };
+  chMBPost(&l->mb, (msg_t)&wake_msg, TIME_IMMEDIATE);
+
+#ifdef MSG_STATS
+  stats_record_post(l);
+#endif
 }
 
 static msg_t
@@ -101,20 +237,87 @@ msg_loop_exec(msg_listener_t* l)
 {
   thread_msg_t* msg = msg_get(l);
 
-  if (msg != NULL) {
-    l->dispatch(msg->id, msg->msg_data, l->user_data, msg->user_data);
+  if (l->prio_changed) {
+    l->prio_changed = false;
+    chThdSetPriority(l->prio);
+  }
 
-    msg_release(msg);
+  if (msg == NULL) {
+    l->dispatch(MSG_IDLE, NULL, l->user_data, NULL);
+  }
+  else if ((l->lossy != NULL) && (msg == &l->lossy->token)) {
+    lossy_drain(l);
   }
   else {
-    l->dispatch(MSG_IDLE, NULL, l->user_data, NULL);
+    msg_dispatch(l, msg->id, msg->msg_data, msg->user_data);
+    msg_release(msg);
   }
+  if (l->lossy != NULL)
+    lossy_repost(l);
   if (l->watchdog_enabled)
     thread_watchdog_kick();
 }
 
+static void
+msg_dispatch(msg_listener_t* l, msg_id_t id, void* msg_data, void* sub_data)
+{
+#ifdef MSG_STATS
+  systime_t start = chTimeNow();
+  l->dispatch(id, msg_data, l->user_data, sub_data);
+  stats_record_dispatch(l, chTimeNow() - start);
+#else
+  l->dispatch(id, msg_data, l->user_data, sub_data);
+#endif
+}
+
 void
 msg_subscribe(msg_listener_t* l, msg_id_t id, void* user_data)
+{
+  add_subscription(l, id, MSG_KEY_ANY, user_data, 0, false);
+}
+
+/* Subscribes to only those messages sent with a matching key, such as the
+ * sensor a sample came from. Messages sent without a key are delivered to
+ * all subscribers.
+ */
+void
+msg_subscribe_keyed(msg_listener_t* l, msg_id_t id, uint32_t key, void* user_data)
+{
+  add_subscription(l, id, key, user_data, 0, false);
+}
+
+/* Subscribes to a message without ever blocking its sender. Messages are
+ * copied and queued for the listener, and the oldest queued message is
+ * dropped when the queue is full. Meant for low priority listeners which
+ * only need the most recent values of a frequently sent message.
+ */
+void
+msg_subscribe_lossy(msg_listener_t* l, msg_id_t id, void* user_data, size_t msg_size)
+{
+  chDbgAssert(msg_size > 0 && msg_size <= MSG_LOSSY_MAX_SIZE,
+      "msg_subscribe_lossy(),#1", "message too large");
+
+  add_subscription(l, id, MSG_KEY_ANY, user_data, msg_size, false);
+}
+
+/* Subscribes to a message without ever blocking its sender, like a lossy
+ * subscription, but the messages are never dropped to make room. A message
+ * equal to one still queued is merged with it instead. Meant for messages
+ * which report a state, such as a socket having data waiting, where only
+ * a few distinct messages can be outstanding at once. If the queue is full
+ * of such messages a new one is dropped, and counted with the lossy drops.
+ */
+void
+msg_subscribe_coalesced(msg_listener_t* l, msg_id_t id, void* user_data, size_t msg_size)
+{
+  chDbgAssert(msg_size > 0 && msg_size <= MSG_LOSSY_MAX_SIZE,
+      "msg_subscribe_coalesced(),#1", "message too large");
+
+  add_subscription(l, id, MSG_KEY_ANY, user_data, msg_size, true);
+}
+
+static void
+add_subscription(msg_listener_t* l, msg_id_t id, uint32_t key, void* user_data, size_t msg_size, bool coalesce)
 {
   if (id >= NUM_THREAD_MSGS)
     return;
@@ -122,6 +325,15 @@ msg_subscribe(msg_listener_t* l, msg_id_t id, void* user_data)
   msg_subscription_t* sub = calloc(1, sizeof(msg_subscription_t));
   sub->listener = l;
   sub->user_data = user_data;
+  sub->msg_size = msg_size;
+  sub->coalesce = coalesce;
+  sub->key = key;
+
+  if ((msg_size > 0) && (l->lossy == NULL)) {
+    lossy_queue_t* q = calloc(1, sizeof(lossy_queue_t));
+    q->token.processed = true;
+    l->lossy = q;
+  }
 
   chSysLock();
   sub->next = subs[id];
@@ -151,10 +363,34 @@ msg_unsubscribe(msg_listener_t* l, msg_id_t id, void* user_data)
     }
     prev_sub = sub;
   }
+
+  /* Discard anything still queued for the subscription */
+  if (l->lossy != NULL) {
+    int i;
+    lossy_queue_t* q = l->lossy;
+
+    chSysLock();
+    for (i = 0; i < q->count; ++i) {
+      lossy_entry_t* e = &q->entries[(q->head + i) % LOSSY_QUEUE_LEN];
+      if ((e->id == id) && (e->user_data == user_data))
+        e->id = NUM_THREAD_MSGS;
+    }
+    chSysUnlock();
+  }
 }
 
 void
 msg_send(msg_id_t id, void* msg_data)
+{
+  msg_send_keyed(id, MSG_KEY_ANY, msg_data);
+}
+
+/* Sends a message to the subscribers of id whose key matches. Subscribers
+ * which don't match are skipped before anything is posted, so they cost the
+ * sender nothing.
+ */
+void
+msg_send_keyed(msg_id_t id, uint32_t key, void* msg_data)
 {
   msg_subscription_t* sub;
 
@@ -163,10 +399,30 @@ msg_send(msg_id_t id, void* msg_data)
 
   msg_listener_t* self = chThdSelf()->msg_listener;
 
+#ifdef MSG_STATS
+  chSysLock();
+  publish_count[id]++;
+  chSysUnlock();
+#endif
+
   for (sub = subs[id]; sub != NULL; sub = sub->next) {
+    if ((key != MSG_KEY_ANY) &&
+        (sub->key != MSG_KEY_ANY) &&
+        (sub->key != key)) {
+#ifdef MSG_STATS
+      chSysLock();
+      filtered_count[id]++;
+      chSysUnlock();
+#endif
+      continue;
+    }
+
     if (sub->listener == self) {
       sub->listener->dispatch(id, msg_data, sub->listener->user_data, sub->user_data);
     }
+    else if (sub->msg_size > 0) {
+      lossy_post(sub, id, msg_data);
+    }
     else {
       thread_msg_t msg = {
         .id = id,
@@ -176,7 +432,18 @@ msg_send(msg_id_t id, void* msg_data)
         .processed = false
       };
 
-      chMBPost(&sub->listener->mb, (msg_t)&msg, TIME_INFINITE);
+#ifdef MSG_STATS
+      systime_t start = chTimeNow();
+#endif
+
+      if (msg_urgent[id])
+        chMBPostAhead(&sub->listener->mb, (msg_t)&msg, TIME_INFINITE);
+      else
+        chMBPost(&sub->listener->mb, (msg_t)&msg, TIME_INFINITE);
+
+#ifdef MSG_STATS
+      stats_record_post(sub->listener);
+#endif
 
       while (!msg.processed) {
         if (self != NULL)
@@ -184,6 +451,10 @@ msg_send(msg_id_t id, void* msg_data)
         else
           chThdSleepMilliseconds(10);
       }
+
+#ifdef MSG_STATS
+      stats_record_send(self, chTimeNow() - start);
+#endif
     }
   }
 }
@@ -213,3 +484,305 @@ msg_release(thread_msg_t* msg)
     chMBPost(&msg->sender->mb, (msg_t)&release_msg, TIME_INFINITE);
   }
 }
+
+static void
+lossy_post(msg_subscription_t* sub, msg_id_t id, void* msg_data)
+{
+  int i;
+  lossy_entry_t* e;
+  msg_listener_t* l = sub->listener;
+  lossy_queue_t* q = l->lossy;
+
+  chSysLock();
+
+  if (sub->coalesce) {
+    for (i = 0; i < q->count; ++i) {
+      e = &q->entries[(q->head + i) % LOSSY_QUEUE_LEN];
+      if ((e->id == id) &&
+          (e->user_data == sub->user_data) &&
+          (memcmp(e->data, msg_data, sub->msg_size) == 0)) {
+        chSysUnlock();
+        return;
+      }
+    }
+  }
+
+  if (q->count == LOSSY_QUEUE_LEN) {
+    /* Drop the oldest lossy entry and close the gap. Coalesced entries are
+     * never dropped, so if there are only those the new message is.
+     */
+    int drop = -1;
+    for (i = 0; i < q->count; ++i) {
+      if (!q->entries[(q->head + i) % LOSSY_QUEUE_LEN].coalesce) {
+        drop = i;
+        break;
+      }
+    }
+    if (drop < 0) {
+#ifdef MSG_STATS
+      l->stats.lossy_dropped++;
+#endif
+      chSysUnlock();
+      return;
+    }
+    for (i = drop; i > 0; --i)
+      q->entries[(q->head + i) % LOSSY_QUEUE_LEN] =
+          q->entries[(q->head + i - 1) % LOSSY_QUEUE_LEN];
+
+    q->head = (q->head + 1) % LOSSY_QUEUE_LEN;
+    q->count--;
+#ifdef MSG_STATS
+    l->stats.lossy_dropped++;
+#endif
+  }
+
+  e = &q->entries[(q->head + q->count) % LOSSY_QUEUE_LEN];
+  e->id = id;
+  e->user_data = sub->user_data;
+  e->coalesce = sub->coalesce;
+  memcpy(e->data, msg_data, sub->msg_size);
+  q->count++;
+
+  /* If the mailbox is full the token is posted by the next send, or by the
+   * listener once it has fetched a message.
+   */
+  if (!q->pending &&
+      (chMBPostI(&l->mb, (msg_t)&q->token) == RDY_OK)) {
+    q->pending = true;
+    chSchRescheduleS();
+  }
+
+  chSysUnlock();
+}
+
+/* Dispatches the oldest queued entry. The token is posted again for the
+ * rest by lossy_repost(), behind anything which arrived in the meantime.
+ */
+static void
+lossy_drain(msg_listener_t* l)
+{
+  lossy_entry_t e;
+  lossy_queue_t* q = l->lossy;
+
+  chSysLock();
+  q->pending = false;
+  if (q->count == 0) {
+    chSysUnlock();
+    return;
+  }
+  e = q->entries[q->head];
+  q->head = (q->head + 1) % LOSSY_QUEUE_LEN;
+  q->count--;
+  chSysUnlock();
+
+  /* Entries of removed subscriptions are marked with an invalid id */
+  if (e.id < NUM_THREAD_MSGS)
+    msg_dispatch(l, e.id, e.data, e.user_data);
+}
+
+/* Posts the token for entries still queued, including those queued while
+ * the mailbox was full. Called from the listener's own thread after each
+ * fetch, which has just freed a mailbox slot.
+ */
+static void
+lossy_repost(msg_listener_t* l)
+{
+  lossy_queue_t* q = l->lossy;
+
+  chSysLock();
+  if ((q->count > 0) && !q->pending &&
+      (chMBPostI(&l->mb, (msg_t)&q->token) == RDY_OK))
+    q->pending = true;
+  chSysUnlock();
+}
+
+
+#ifdef MSG_STATS
+static void
+stats_record_post(msg_listener_t* l)
+{
+  chSysLock();
+  uint16_t used = chMBGetUsedCountI(&l->mb);
+  if (used > l->stats.mb_high_water)
+    l->stats.mb_high_water = used;
+  chSysUnlock();
+}
+
+/* Only called from the listener's own thread, so no locking is needed.
+ * Nested dispatches made while the listener is blocked in msg_send() are
+ * included in the time of the outer dispatch.
+ */
+static void
+stats_record_dispatch(msg_listener_t* l, systime_t elapsed)
+{
+  int bucket = 0;
+  systime_t t = elapsed;
+
+  while ((t > 0) && (bucket < (MSG_STATS_NUM_BUCKETS - 1))) {
+    t >>= 1;
+    bucket++;
+  }
+
+  l->stats.dispatches++;
+  l->stats.dispatch_hist[bucket]++;
+  if (elapsed > l->stats.dispatch_max)
+    l->stats.dispatch_max = elapsed;
+}
+
+static void
+stats_record_send(msg_listener_t* sender, systime_t blocked)
+{
+  msg_listener_stats_t* stats = (sender != NULL) ?
+      &sender->stats : &external_sender_stats;
+
+  chSysLock();
+  stats->sends++;
+  stats->send_block_total += blocked;
+  if (blocked > stats->send_block_max)
+    stats->send_block_max = blocked;
+  chSysUnlock();
+}
+
+uint32_t
+msg_stats_get_publish_count(msg_id_t id)
+{
+  if (id >= NUM_THREAD_MSGS)
+    return 0;
+
+  return publish_count[id];
+}
+
+/* Returns the number of deliveries of a message which were skipped because
+ * the subscription key did not match.
+ */
+uint32_t
+msg_stats_get_filtered_count(msg_id_t id)
+{
+  if (id >= NUM_THREAD_MSGS)
+    return 0;
+
+  return filtered_count[id];
+}
+
+/* Copies the stats of up to max_listeners listeners, followed by the send
+ * stats of threads which are not listeners. Returns the number copied.
+ */
+int
+msg_stats_get_listeners(msg_listener_stats_t* stats, int max_listeners)
+{
+  int n = 0;
+  msg_listener_t* l;
+
+  chSysLock();
+  for (l = listeners; (l != NULL) && (n < max_listeners); l = l->next)
+    stats[n++] = l->stats;
+  if (n < max_listeners)
+    stats[n++] = external_sender_stats;
+  chSysUnlock();
+
+  return n;
+}
+
+void
+msg_stats_dump()
+{
+  int i;
+  msg_listener_t* l;
+
+  printf("msg bus stats\r\n");
+  printf("  publishes:\r\n");
+  for (i = 0; i < NUM_THREAD_MSGS; ++i) {
+    if (publish_count[i] > 0)
+      printf("    msg %d: %u, %u filtered\r\n", i,
+          (unsigned int)publish_count[i], (unsigned int)filtered_count[i]);
+  }
+
+  for (l = listeners; l != NULL; l = l->next) {
+    msg_listener_stats_t stats;
+
+    chSysLock();
+    stats = l->stats;
+    chSysUnlock();
+
+    printf("  %s:\r\n", stats.name);
+    printf("    dispatches %u max %u ticks, mailbox high water %u/%u\r\n",
+        (unsigned int)stats.dispatches, (unsigned int)stats.dispatch_max,
+        stats.mb_high_water, MAX_MAILBOX_MSGS);
+    printf("    sends %u blocked %u ticks total %u max\r\n",
+        (unsigned int)stats.sends, (unsigned int)stats.send_block_total,
+        (unsigned int)stats.send_block_max);
+    if (stats.lossy_dropped > 0)
+      printf("    lossy drops %u\r\n", (unsigned int)stats.lossy_dropped);
+    printf("    dispatch hist:");
+    for (i = 0; i < MSG_STATS_NUM_BUCKETS; ++i)
+      printf(" %u", (unsigned int)stats.dispatch_hist[i]);
+    printf("\r\n");
+  }
+
+  printf("  %s: sends %u blocked %u ticks total %u max\r\n",
+      external_sender_stats.name,
+      (unsigned int)external_sender_stats.sends,
+      (unsigned int)external_sender_stats.send_block_total,
+      (unsigned int)external_sender_stats.send_block_max);
+}
+
+static void
+dump_listener_json(FILE* f, const msg_listener_stats_t* stats)
+{
+  int i;
+
+  fprintf(f, "{\"name\": \"%s\", \"dispatches\": %u, \"dispatch_max\": %u, "
+      "\"dispatch_hist\": [",
+      stats->name, (unsigned int)stats->dispatches,
+      (unsigned int)stats->dispatch_max);
+  for (i = 0; i < MSG_STATS_NUM_BUCKETS; ++i)
+    fprintf(f, "%s%u", (i > 0) ? ", " : "", (unsigned int)stats->dispatch_hist[i]);
+  fprintf(f, "], \"mb_high_water\": %u, \"mb_size\": %u, \"sends\": %u, "
+      "\"send_block_total\": %u, \"send_block_max\": %u, \"lossy_dropped\": %u}",
+      stats->mb_high_water, MAX_MAILBOX_MSGS, (unsigned int)stats->sends,
+      (unsigned int)stats->send_block_total, (unsigned int)stats->send_block_max,
+      (unsigned int)stats->lossy_dropped);
+}
+
+/* Writes the same counters as msg_stats_dump() as one JSON object, for
+ * host builds to save at exit. Times are in system ticks, and the last
+ * entry of "listeners" is the send stats of threads which are not
+ * listeners. Listener names are not escaped.
+ */
+void
+msg_stats_dump_json(FILE* f)
+{
+  int i;
+  int n;
+  bool first = true;
+  msg_listener_t* l;
+  msg_listener_stats_t stats;
+
+  fprintf(f, "{\"tick_hz\": %u, \"publishes\": [", (unsigned int)CH_FREQUENCY);
+  for (i = 0; i < NUM_THREAD_MSGS; ++i) {
+    if (publish_count[i] > 0) {
+      fprintf(f, "%s{\"msg\": %d, \"count\": %u, \"filtered\": %u}",
+          first ? "" : ", ", i,
+          (unsigned int)publish_count[i], (unsigned int)filtered_count[i]);
+      first = false;
+    }
+  }
+
+  fprintf(f, "], \"listeners\": [");
+  for (l = listeners, n = 0; l != NULL; l = l->next, ++n) {
+    chSysLock();
+    stats = l->stats;
+    chSysUnlock();
+
+    fprintf(f, "%s", (n > 0) ? ", " : "");
+    dump_listener_json(f, &stats);
+  }
+
+  chSysLock();
+  stats = external_sender_stats;
+  chSysUnlock();
+  fprintf(f, "%s", (n > 0) ? ", " : "");
+  dump_listener_json(f, &stats);
+  fprintf(f, "]}\n");
+}
+#endif
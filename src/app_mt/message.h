@@ -4,6 +4,10 @@
 
 #include "ch.h"
 #include <stdbool.h>
+#include <stddef.h>
+#ifdef MSG_STATS
+#include <stdio.h>
+#endif
 
 typedef enum {
   MSG_INIT,
@@ -31,6 +35,7 @@ typedef enum {
   MSG_WLAN_DISCONNECT,
   MSG_WLAN_DHCP,
   MSG_WLAN_PING_REPORT,
+  MSG_WLAN_SOCKET_READY,   // data is waiting on a socket, keyed by socket descriptor
 
   MSG_NET_NETWORK_SETTINGS,
   MSG_NET_STATUS,
@@ -49,6 +54,8 @@ typedef enum {
   MSG_API_FW_CHUNK,
   MSG_API_CONTROLLER_SETTINGS,
 
+  MSG_LAN_API_CLIENT,      // a LAN API client has connected, data is its socket descriptor
+
   MSG_RECOVERY_IMG_STATUS,
 
   MSG_SHUTDOWN,
@@ -63,12 +70,47 @@ typedef enum {
   RECOVERY_IMG_FAILED,
 } recovery_img_load_state_t;
 
+typedef enum {
+  MSG_PRIO_LOW,     // network and reporting work which may be delayed
+  MSG_PRIO_NORMAL,
+  MSG_PRIO_HIGH,    // temperature control
+} msg_priority_t;
+
+/* Key of messages and subscriptions which are not specific to any one
+ * sensor, controller or output.
+ */
+#define MSG_KEY_ANY 0xFFFFFFFF
+
+/* Largest message which can be queued for a lossy or coalesced subscription */
+#define MSG_LOSSY_MAX_SIZE 16
+
 struct msg_listener_s;
 typedef struct msg_listener_s msg_listener_t;
 
 
 typedef void (*thread_msg_dispatch_t)(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
 
+#ifdef MSG_STATS
+/* Dispatch times are counted in log2 buckets of system ticks. Bucket 0
+ * counts dispatches which took no ticks, and bucket n counts those which
+ * took from 2^(n-1) up to 2^n - 1 ticks. The last bucket also counts
+ * everything longer.
+ */
+#define MSG_STATS_NUM_BUCKETS 16
+
+typedef struct {
+  const char* name;
+  uint32_t dispatches;
+  uint32_t dispatch_hist[MSG_STATS_NUM_BUCKETS];
+  systime_t dispatch_max;
+  uint16_t mb_high_water;
+  uint32_t sends;
+  systime_t send_block_total;
+  systime_t send_block_max;
+  uint32_t lossy_dropped;
+} msg_listener_stats_t;
+#endif
+
 msg_listener_t*
 msg_listener_create(const char* name, int stack_size, thread_msg_dispatch_t dispatch, void* user_data);
 
@@ -78,13 +120,48 @@ msg_listener_enable_watchdog(msg_listener_t* l, uint32_t period);
 void
 msg_listener_set_idle_timeout(msg_listener_t* l, uint32_t idle_timeout);
 
+void
+msg_listener_set_priority(msg_listener_t* l, msg_priority_t prio);
+
+void
+msg_listener_wake(msg_listener_t* l);
+
 void
 msg_subscribe(msg_listener_t* l, msg_id_t id, void* user_data);
 
+void
+msg_subscribe_keyed(msg_listener_t* l, msg_id_t id, uint32_t key, void* user_data);
+
+void
+msg_subscribe_lossy(msg_listener_t* l, msg_id_t id, void* user_data, size_t msg_size);
+
+void
+msg_subscribe_coalesced(msg_listener_t* l, msg_id_t id, void* user_data, size_t msg_size);
+
 void
 msg_unsubscribe(msg_listener_t* l, msg_id_t id, void* user_data);
 
 void
 msg_send(msg_id_t id, void* msg_data);
 
+void
+msg_send_keyed(msg_id_t id, uint32_t key, void* msg_data);
+
+#ifdef MSG_STATS
+uint32_t
+msg_stats_get_publish_count(msg_id_t id);
+
+uint32_t
+msg_stats_get_filtered_count(msg_id_t id);
+
+int
+msg_stats_get_listeners(msg_listener_stats_t* stats, int max_listeners);
+
+void
+msg_stats_dump(void);
+
+void
+msg_stats_dump_json(FILE* f);
+#endif
+
 #endif
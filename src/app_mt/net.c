@@ -17,16 +17,39 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 
 #define SCAN_INTERVAL 1000
 #define SERVICE_NAME "brewbit-model-t"
 
+#define MAX_NETWORKS          16
+#define MAX_SCAN_RESULTS      16
+
+// Smoothed RSSI change (dB) needed before an update is published
+#define RSSI_UPDATE_THRESHOLD 3
+
 
 #define DHCP_TIMEOUT    S2ST(90)
 #define CONNECT_TIMEOUT S2ST(90)
 #define API_TIMEOUT     S2ST(90)
 
+/* After a link drop the CC3000 reassociates on its own from the stored
+ * profile and renews its lease. If that has not worked within these limits
+ * the full restart and connect is done instead.
+ */
+#define FAST_CONNECT_TIMEOUT S2ST(20)
+#define FAST_DHCP_TIMEOUT    S2ST(20)
+
+/* When the CC3000 is restarted, the last lease DHCP gave out on the network
+ * is set as a static address, so no DHCP exchange is needed. If the API
+ * server can't be reached with it this soon after the link comes up, the
+ * lease is forgotten and DHCP used instead. A reused lease is handed back
+ * to DHCP well within the lease time the device asks for.
+ */
+#define LEASE_REUSE_TIMEOUT  S2ST(15)
+#define LEASE_REUSE_PERIOD   S2ST(60 * 60)
+
 
 typedef struct {
   bool valid;
@@ -52,12 +75,33 @@ dispatch_dhcp(netapp_dhcp_params_t* dhcp);
 static void
 dispatch_network_settings(void);
 
+static void
+dispatch_wlan_disconnect(void);
+
+static void
+add_connection_profile(const net_settings_t* ns);
+
+static bool
+can_reuse_lease(const net_settings_t* ns);
+
+static void
+save_lease(const net_settings_t* ns, netapp_dhcp_params_t* dhcp);
+
+static void
+forget_lease(void);
+
 static void
 save_or_update_network(network_t* network);
 
 static void
 prune_networks(void);
 
+static void
+publish_networks(void);
+
+static uint32_t
+fetch_scan_results(void);
+
 static network_t*
 save_network(network_t* net);
 
@@ -72,9 +116,17 @@ get_scan_result(net_scan_result_t* result);
 
 
 static net_status_t net_status;
-static network_t networks[16];
+static network_t networks[MAX_NETWORKS];
+static long published_rssi[MAX_NETWORKS];
+static bool replay_networks;
+static net_scan_result_t scan_results[MAX_SCAN_RESULTS];
 static bool force_reconnect;
+static bool fast_reconnect;
 static bool wifi_config_applied;
+static bool lease_reused;
+static bool lease_confirmed;
+static bool lease_handback;
+static systime_t lease_reuse_start;
 static systime_t state_begin_time;
 static systime_t scan_interval_start;
 
@@ -86,6 +138,7 @@ net_init()
 
   msg_listener_t* l = msg_listener_create("net", 2048, dispatch_net_msg, NULL);
   msg_listener_set_idle_timeout(l, 500);
+  msg_listener_set_priority(l, MSG_PRIO_LOW);
   msg_subscribe(l, MSG_NET_NETWORK_SETTINGS, NULL);
   msg_subscribe(l, MSG_WLAN_CONNECT, NULL);
   msg_subscribe(l, MSG_WLAN_DISCONNECT, NULL);
@@ -98,10 +151,13 @@ net_get_status()
   return &net_status;
 }
 
+/* The network table is kept between scans, so the networks that are still
+ * fresh are republished to the new listener before scanning resumes.
+ */
 void
 net_scan_start()
 {
-  memset(networks, 0, sizeof(networks));
+  replay_networks = true;
   net_status.scan_state = SCAN_START_INTERVAL;
 }
 
@@ -141,14 +197,16 @@ dispatch_net_msg(msg_id_t id, void* msg_data, void* listener_data, void* sub_dat
       break;
 
     case MSG_WLAN_DISCONNECT:
-      net_status.dhcp_resolved = false;
-      set_state(NS_DISCONNECTED);
+      dispatch_wlan_disconnect();
       break;
 
     case MSG_WLAN_DHCP:
       dispatch_dhcp(msg_data);
-      if (net_status.dhcp_resolved)
+      if (net_status.dhcp_resolved) {
+        fast_reconnect = false;
+        save_lease(app_cfg_get_net_settings(), msg_data);
         set_state(NS_CONNECTED);
+      }
       break;
 
     case MSG_NET_NETWORK_SETTINGS:
@@ -167,6 +225,104 @@ dispatch_network_settings()
   force_reconnect = true;
 }
 
+static void
+dispatch_wlan_disconnect()
+{
+  net_status.dhcp_resolved = false;
+
+  /* Once a connection has been made with the current settings, the profile
+   * stored in the CC3000 is known to be good, so let it reassociate rather
+   * than restarting it.
+   */
+  if (wifi_config_applied &&
+      !force_reconnect &&
+      net_status.net_state == NS_CONNECTED) {
+    printf("Link lost, waiting for fast reconnect\r\n");
+    fast_reconnect = true;
+    set_state(NS_CONNECTING);
+  }
+  else {
+    set_state(NS_DISCONNECTED);
+  }
+}
+
+/* Replaces the CC3000's stored profiles with one for the configured network,
+ * so that it can reassociate after a link drop without the host.
+ */
+static void
+add_connection_profile(const net_settings_t* ns)
+{
+  wlan_ioctl_del_profile(255);
+
+  if (strlen(ns->ssid) == 0)
+    return;
+
+  uint32_t key_len = strlen(ns->passphrase);
+
+  switch (ns->security_mode) {
+    case WLAN_SEC_UNSEC:
+      wlan_add_profile(ns->security_mode, (uint8_t*)ns->ssid, strlen(ns->ssid),
+          NULL, 1, 0, 0, 0, NULL, 0);
+      break;
+
+    case WLAN_SEC_WEP:
+      wlan_add_profile(ns->security_mode, (uint8_t*)ns->ssid, strlen(ns->ssid),
+          NULL, 1, key_len, 0, 0, (uint8_t*)ns->passphrase, 0);
+      break;
+
+    case WLAN_SEC_WPA:
+    case WLAN_SEC_WPA2:
+      wlan_add_profile(ns->security_mode, (uint8_t*)ns->ssid, strlen(ns->ssid),
+          NULL, 1, 0x18, 0x1e, 2, (uint8_t*)ns->passphrase, key_len);
+      break;
+
+    default:
+      break;
+  }
+}
+
+static bool
+can_reuse_lease(const net_settings_t* ns)
+{
+  const net_lease_t* lease = app_cfg_get_net_lease();
+
+  return !lease_handback &&
+      (ns->ip_config == IP_CFG_DHCP) &&
+      (lease->ip != 0) &&
+      (strcmp(lease->ssid, ns->ssid) == 0);
+}
+
+/* Keeps a lease DHCP gave out, to be reused on the next restart */
+static void
+save_lease(const net_settings_t* ns, netapp_dhcp_params_t* dhcp)
+{
+  net_lease_t lease;
+
+  if (lease_reused || (ns->ip_config != IP_CFG_DHCP))
+    return;
+
+  memset(&lease, 0, sizeof(lease));
+  strncpy(lease.ssid, ns->ssid, sizeof(lease.ssid) - 1);
+  memcpy(&lease.ip, dhcp->ip_addr, sizeof(lease.ip));
+  memcpy(&lease.subnet_mask, dhcp->subnet_mask, sizeof(lease.subnet_mask));
+  memcpy(&lease.gateway, dhcp->default_gateway, sizeof(lease.gateway));
+  memcpy(&lease.dns_server, dhcp->dns_server, sizeof(lease.dns_server));
+
+  if (lease.ip != 0)
+    app_cfg_set_net_lease(&lease);
+
+  lease_handback = false;
+}
+
+static void
+forget_lease()
+{
+  net_lease_t lease;
+
+  memset(&lease, 0, sizeof(lease));
+  app_cfg_set_net_lease(&lease);
+}
+
 static void
 dispatch_dhcp(netapp_dhcp_params_t* dhcp)
 {
@@ -223,6 +379,12 @@ scan_exec()
     break;
 
   case SCAN_START_INTERVAL:
+    if (replay_networks) {
+      replay_networks = false;
+      prune_networks();
+      publish_networks();
+    }
+
     enable_scan(true);
     scan_interval_start = chTimeNow();
     net_status.scan_state = SCAN_WAIT_INTERVAL;
@@ -237,14 +399,14 @@ scan_exec()
 
   case SCAN_PROCESS_RESULTS:
   {
-    net_scan_result_t result;
-    do {
-      if (get_scan_result(&result) != 0)
-        break;
+    /* Drain the CC3000's result table before publishing anything, so the
+     * HCI calls are not interleaved with listener dispatches
+     */
+    uint32_t i;
+    uint32_t num_results = fetch_scan_results();
 
-      if (result.scan_status == 1 && result.valid)
-        save_or_update_network(&result.network);
-    } while (result.networks_found > 1);
+    for (i = 0; i < num_results; ++i)
+      save_or_update_network(&scan_results[i].network);
 
     prune_networks();
 
@@ -257,6 +419,24 @@ scan_exec()
   }
 }
 
+static uint32_t
+fetch_scan_results()
+{
+  uint32_t num_results = 0;
+  net_scan_result_t* result;
+
+  do {
+    result = &scan_results[num_results];
+    if (get_scan_result(result) != 0)
+      break;
+
+    if (result->scan_status == 1 && result->valid)
+      num_results++;
+  } while (result->networks_found > 1 && num_results < MAX_SCAN_RESULTS);
+
+  return num_results;
+}
+
 static long
 get_scan_result(net_scan_result_t* result)
 {
@@ -269,7 +449,7 @@ get_scan_result(net_scan_result_t* result)
   result->valid = results.valid;
   result->network.rssi = results.rssi;
   result->network.security_mode = results.security_mode;
-  int ssid_len = results.ssid_len;
+  int ssid_len = MIN(results.ssid_len, sizeof(result->network.ssid) - 1);
   memcpy(result->network.ssid, results.ssid, ssid_len);
   result->network.ssid[ssid_len] = 0;
 
@@ -284,7 +464,7 @@ static network_t*
 find_network(char* ssid)
 {
   int i;
-  for (i = 0; i < 16; ++i) {
+  for (i = 0; i < MAX_NETWORKS; ++i) {
     if (strcmp(networks[i].ssid, ssid) == 0)
       return &networks[i];
   }
@@ -299,12 +479,41 @@ save_or_update_network(network_t* network)
 
   if (saved_network == NULL) {
     saved_network = save_network(network);
-    if (saved_network != NULL)
+    if (saved_network != NULL) {
+      published_rssi[saved_network - networks] = saved_network->rssi;
       msg_send(MSG_NET_NEW_NETWORK, saved_network);
+    }
   }
   else {
-    *saved_network = *network;
-    msg_send(MSG_NET_NETWORK_UPDATED, saved_network);
+    long* last_rssi = &published_rssi[saved_network - networks];
+    bool security_changed =
+        (saved_network->security_mode != network->security_mode);
+
+    /* Smooth out the scan to scan jitter in RSSI and only publish changes
+     * which are large enough to matter
+     */
+    saved_network->rssi = ((3 * saved_network->rssi) + network->rssi) / 4;
+    saved_network->security_mode = network->security_mode;
+    memcpy(saved_network->bssid, network->bssid, sizeof(saved_network->bssid));
+    saved_network->last_seen = network->last_seen;
+
+    if (security_changed ||
+        labs(saved_network->rssi - *last_rssi) >= RSSI_UPDATE_THRESHOLD) {
+      *last_rssi = saved_network->rssi;
+      msg_send(MSG_NET_NETWORK_UPDATED, saved_network);
+    }
+  }
+}
+
+static void
+publish_networks()
+{
+  int i;
+  for (i = 0; i < MAX_NETWORKS; ++i) {
+    if (strcmp(networks[i].ssid, "") != 0) {
+      published_rssi[i] = networks[i].rssi;
+      msg_send(MSG_NET_NEW_NETWORK, &networks[i]);
+    }
   }
 }
 
@@ -312,7 +521,7 @@ static network_t*
 save_network(network_t* net)
 {
   int i;
-  for (i = 0; i < 16; ++i) {
+  for (i = 0; i < MAX_NETWORKS; ++i) {
     if (strcmp(networks[i].ssid, "") == 0) {
       networks[i] = *net;
       return &networks[i];
@@ -328,7 +537,7 @@ static void
 prune_networks()
 {
   int i;
-  for (i = 0; i < 16; ++i) {
+  for (i = 0; i < MAX_NETWORKS; ++i) {
     if ((strcmp(networks[i].ssid, "") != 0) &&
         (chTimeNow() - networks[i].last_seen) > NETWORK_TIMEOUT) {
       msg_send(MSG_NET_NETWORK_TIMEOUT, &networks[i]);
@@ -343,6 +552,7 @@ initialize_and_connect()
   const net_settings_t* ns = app_cfg_get_net_settings();
 
   net_status.dhcp_resolved = false;
+  fast_reconnect = false;
   set_state(NS_DISCONNECTED);
 
   wlan_stop();
@@ -366,24 +576,41 @@ initialize_and_connect()
     }
   }
 
-  if (!wifi_config_applied) {
-    wlan_ioctl_set_connection_policy(0, 0, 0);
+  bool reuse = can_reuse_lease(ns);
 
-    uint32_t dhcp_timeout = 14400;
-    uint32_t arp_timeout = 3600;
-    uint32_t keepalive = 10;
-    uint32_t inactivity_timeout = 0;
-    netapp_timeout_values(&dhcp_timeout, &arp_timeout, &keepalive, &inactivity_timeout);
+  if (!wifi_config_applied || (reuse != lease_reused)) {
+    if (!wifi_config_applied) {
+      add_connection_profile(ns);
+      wlan_ioctl_set_connection_policy(0, 0, 1);
 
-    netapp_dhcp(&ns->ip, &ns->subnet_mask, &ns->gateway, &ns->dns_server);
+      uint32_t dhcp_timeout = 14400;
+      uint32_t arp_timeout = 3600;
+      uint32_t keepalive = 10;
+      uint32_t inactivity_timeout = 0;
+      netapp_timeout_values(&dhcp_timeout, &arp_timeout, &keepalive, &inactivity_timeout);
+    }
+
+    if (reuse) {
+      const net_lease_t* lease = app_cfg_get_net_lease();
+      printf("Reusing last lease\r\n");
+      netapp_dhcp(&lease->ip, &lease->subnet_mask, &lease->gateway, &lease->dns_server);
+      lease_reuse_start = chTimeNow();
+    }
+    else {
+      netapp_dhcp(&ns->ip, &ns->subnet_mask, &ns->gateway, &ns->dns_server);
+    }
 
     wlan_stop();
 
     wlan_start(PATCH_LOAD_DEFAULT);
 
     wifi_config_applied = true;
+    lease_reused = reuse;
   }
 
+  /* The lease has to prove itself again after every restart */
+  lease_confirmed = false;
+
   {
     uint8_t mac[6];
     nvmem_get_mac_address(mac);
@@ -424,22 +651,39 @@ dispatch_idle()
       break;
 
     case NS_WAIT_DHCP:
-      if ((chTimeNow() - state_begin_time) > DHCP_TIMEOUT) {
+      if ((chTimeNow() - state_begin_time) >
+          (fast_reconnect ? FAST_DHCP_TIMEOUT : DHCP_TIMEOUT)) {
         printf("DHCP Timeout\r\n");
         initialize_and_connect();
       }
       break;
 
     case NS_CONNECTING:
-      if ((chTimeNow() - state_begin_time) > CONNECT_TIMEOUT) {
+      if ((chTimeNow() - state_begin_time) >
+          (fast_reconnect ? FAST_CONNECT_TIMEOUT : CONNECT_TIMEOUT)) {
         printf("Connect Timeout\r\n");
         initialize_and_connect();
       }
       break;
 
     case NS_CONNECTED:
-      if (web_api_get_status()->state > AS_CONNECTING)
+      if (web_api_get_status()->state > AS_CONNECTING) {
+        lease_confirmed = true;
         state_begin_time = chTimeNow();
+      }
+
+      if (lease_reused && !lease_confirmed &&
+          (chTimeNow() - state_begin_time) > LEASE_REUSE_TIMEOUT) {
+        printf("Reused lease failed, using DHCP\r\n");
+        forget_lease();
+        initialize_and_connect();
+      }
+      else if (lease_reused &&
+          (chTimeNow() - lease_reuse_start) > LEASE_REUSE_PERIOD) {
+        printf("Handing lease back to DHCP\r\n");
+        lease_handback = true;
+        initialize_and_connect();
+      }
       else if ((chTimeNow() - state_begin_time) > API_TIMEOUT) {
         printf("API Timeout\r\n");
         initialize_and_connect();
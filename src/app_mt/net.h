@@ -65,6 +65,17 @@ typedef struct {
   uint32_t dns_server;
 } net_settings_t;
 
+/* The last lease DHCP gave out on a network, kept so it can be reused
+ * without waiting on DHCP. Addresses are as netapp_dhcp() takes them.
+ */
+typedef struct {
+  char ssid[33];
+  uint32_t ip;
+  uint32_t subnet_mask;
+  uint32_t gateway;
+  uint32_t dns_server;
+} net_lease_t;
+
 
 void
 net_init(void);
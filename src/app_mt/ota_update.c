@@ -17,12 +17,17 @@
 #include <string.h>
 #include <stdio.h>
 
+#include <pb_decode.h>
+
 
 #define CHUNK_TIMEOUT S2ST(30)
 
 // Write a checkpoint after every 64KB downloaded
 #define UPDATE_BLOCK_SIZE 0x10000
 
+// Chunks are streamed to flash, and read back, this much at a time
+#define CHUNK_WRITE_SIZE 64
+
 
 typedef enum {
   OU_ERR_ERASE = -1,
@@ -41,6 +46,14 @@ typedef struct {
   uint32_t update_size;
   uint32_t update_downloaded;
   int error_code;
+
+  /* The chunk last asked for, written by ota_update_write_chunk() on the
+   * web API thread as it is decoded
+   */
+  bool chunk_pending;
+  uint32_t chunk_offset;
+  uint32_t chunk_written;
+  int chunk_error;
 } ota_update_t;
 
 
@@ -71,6 +84,9 @@ dispatch_chunk(FirmwareDownloadResponse* update_chunk);
 static void
 firmware_download_request(uint32_t offset);
 
+static int
+write_piece(uint32_t offset, uint8_t* data, uint32_t size);
+
 
 static ota_update_t update;
 
@@ -90,6 +106,7 @@ ota_update_init()
 
   msg_listener_t* l = msg_listener_create("ota_update", 2048, ota_update_dispatch, NULL);
   msg_listener_set_idle_timeout(l, 1000);
+  msg_listener_set_priority(l, MSG_PRIO_LOW);
 
   msg_subscribe(l, MSG_API_STATUS, NULL);
   msg_subscribe(l, MSG_OTAU_CHECK, NULL);
@@ -220,49 +237,31 @@ dispatch_update_check_response(FirmwareUpdateCheckResponse* response)
   }
 }
 
+/* The chunk's data has already been written by ota_update_write_chunk()
+ * while the message was decoded, so this only keeps track of the download.
+ */
 static void
 dispatch_chunk(FirmwareDownloadResponse* update_chunk)
 {
-  update.update_downloaded = update_chunk->offset + update_chunk->data.size;
-
-  if ((update_chunk->offset & (UPDATE_BLOCK_SIZE - 1)) == 0) {
-    update.last_block_offset = update_chunk->offset;
-    if (!sxfs_erase(SP_UPDATE_IMG, update.last_block_offset, UPDATE_BLOCK_SIZE)) {
-      update.error_code = OU_ERR_ERASE;
-      set_state(OU_FAILED);
-      return;
-    }
-
-    if (!sxfs_is_erased(SP_UPDATE_IMG, update.last_block_offset, UPDATE_BLOCK_SIZE)) {
-      update.error_code = OU_ERR_ERASE_VERIFY;
-      set_state(OU_FAILED);
-      return;
-    }
+  /* A chunk arriving after its request timed out is passed over */
+  if (!update.chunk_pending || (update_chunk->offset != update.chunk_offset))
+    return;
 
-    write_checkpoint();
-  }
+  update.chunk_pending = false;
 
-  if (!sxfs_write(SP_UPDATE_IMG,
-      update_chunk->offset,
-      update_chunk->data.bytes,
-      update_chunk->data.size)) {
-    update.error_code = OU_ERR_WRITE;
+  if (update.chunk_error != 0) {
+    update.error_code = update.chunk_error;
     set_state(OU_FAILED);
     return;
   }
 
-  uint8_t* tmp = malloc(update_chunk->data.size);
+  update.update_downloaded = update.chunk_offset + update.chunk_written;
 
-  sxfs_read(SP_UPDATE_IMG, update_chunk->offset, tmp, update_chunk->data.size);
-  if (memcmp(update_chunk->data.bytes, tmp, update_chunk->data.size)) {
-    update.error_code = OU_ERR_WRITE_VERIFY;
-    set_state(OU_FAILED);
-    free(tmp);
-    return;
+  if ((update.chunk_offset & (UPDATE_BLOCK_SIZE - 1)) == 0) {
+    update.last_block_offset = update.chunk_offset;
+    write_checkpoint();
   }
 
-  free(tmp);
-
   if (update.update_downloaded >= update.update_size) {
     update.download_in_progress = false;
     update.update_size = 0;
@@ -286,8 +285,69 @@ dispatch_chunk(FirmwareDownloadResponse* update_chunk)
     }
   }
   else {
-    firmware_download_request(update_chunk->offset + update_chunk->data.size);
+    firmware_download_request(update.update_downloaded);
+  }
+}
+
+/* nanopb decode callback for FirmwareDownloadResponse.data, set up by the
+ * web API before each message is decoded with arg pointing at the response.
+ * The chunk is copied from the socket to flash a piece at a time as it is
+ * decoded, so it is never held whole in RAM. The offset is sent ahead of
+ * the data, and only the chunk which was asked for is written. Anything
+ * else, and the rest of a chunk which failed to write, is read and passed
+ * over so the following messages can still be decoded.
+ */
+bool
+ota_update_write_chunk(pb_istream_t* stream, const pb_field_t* field, void** arg)
+{
+  const FirmwareDownloadResponse* response = *arg;
+  uint8_t buf[CHUNK_WRITE_SIZE];
+
+  if (!update.chunk_pending ||
+      (response->offset != update.chunk_offset) ||
+      (update.chunk_written > 0))
+    return pb_read(stream, NULL, stream->bytes_left);
+
+  while ((stream->bytes_left > 0) && (update.chunk_error == 0)) {
+    uint32_t offset = update.chunk_offset + update.chunk_written;
+
+    /* Pieces never cross into the next block, which is erased first */
+    uint32_t n = MIN(sizeof(buf), stream->bytes_left);
+    n = MIN(n, UPDATE_BLOCK_SIZE - (offset & (UPDATE_BLOCK_SIZE - 1)));
+
+    if (!pb_read(stream, buf, n))
+      return false;
+
+    if ((offset & (UPDATE_BLOCK_SIZE - 1)) == 0) {
+      if (!sxfs_erase(SP_UPDATE_IMG, offset, UPDATE_BLOCK_SIZE))
+        update.chunk_error = OU_ERR_ERASE;
+      else if (!sxfs_is_erased(SP_UPDATE_IMG, offset, UPDATE_BLOCK_SIZE))
+        update.chunk_error = OU_ERR_ERASE_VERIFY;
+    }
+
+    if (update.chunk_error == 0)
+      update.chunk_error = write_piece(offset, buf, n);
+
+    update.chunk_written += n;
   }
+
+  return pb_read(stream, NULL, stream->bytes_left);
+}
+
+/* Writes a piece of a chunk and reads it back. Returns 0 or the error. */
+static int
+write_piece(uint32_t offset, uint8_t* data, uint32_t size)
+{
+  uint8_t buf[CHUNK_WRITE_SIZE];
+
+  if (!sxfs_write(SP_UPDATE_IMG, offset, data, size))
+    return OU_ERR_WRITE;
+
+  if (!sxfs_read(SP_UPDATE_IMG, offset, buf, size) ||
+      memcmp(data, buf, size))
+    return OU_ERR_WRITE_VERIFY;
+
+  return 0;
 }
 
 static void
@@ -299,6 +359,10 @@ firmware_download_request(uint32_t offset)
   firmware_data->offset = offset;
   firmware_data->size = MIN(1024, (update.update_size - offset));
 
+  update.chunk_offset = offset;
+  update.chunk_written = 0;
+  update.chunk_error = 0;
+  update.chunk_pending = true;
   update.chunk_request_time = chTimeNow();
 
   msg_send(MSG_API_FW_DNLD_RQST, firmware_data);
@@ -4,6 +4,8 @@
 
 #include <stdbool.h>
 
+#include <pb.h>
+
 typedef enum {
   OU_IDLE,
   OU_WAIT_API_CONN,
@@ -43,4 +45,7 @@ ota_update_init(void);
 ota_update_status_t
 ota_update_get_status(void);
 
+bool
+ota_update_write_chunk(pb_istream_t* stream, const pb_field_t* field, void** arg);
+
 #endif
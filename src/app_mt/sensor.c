@@ -112,7 +112,7 @@ send_sensor_msg(sensor_port_t* tp, quantity_t* sample)
       .sensor = tp->sensor,
       .sample = *sample
   };
-  msg_send(MSG_SENSOR_SAMPLE, &msg);
+  msg_send_keyed(MSG_SENSOR_SAMPLE, tp->sensor, &msg);
 }
 
 static void
@@ -122,7 +122,7 @@ send_timeout_msg(sensor_port_t* tp)
       .sensor = tp->sensor
   };
   open_ports[tp->sensor]->connected = false;
-  msg_send(MSG_SENSOR_TIMEOUT, &msg);
+  msg_send_keyed(MSG_SENSOR_TIMEOUT, tp->sensor, &msg);
 }
 
 static bool
@@ -0,0 +1,232 @@
+#include <ch.h>
+#include <hal.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "telemetry.h"
+#include "message.h"
+#include "net.h"
+#include "sensor.h"
+#include "temp_control.h"
+
+#ifndef TELEMETRY_PORT
+#define TELEMETRY_PORT 31339
+#endif
+
+/* Frames go to the local broadcast address unless a multicast group is
+ * given. The CC3000 can send to a group without joining it.
+ */
+#ifndef TELEMETRY_GROUP
+#define TELEMETRY_GROUP_STR "255.255.255.255"
+#else
+#define xstr(s) str(s)
+#define str(s) #s
+#define TELEMETRY_GROUP_STR xstr(TELEMETRY_GROUP)
+#endif
+
+#ifndef TELEMETRY_INTERVAL_S
+#define TELEMETRY_INTERVAL_S 10
+#endif
+
+#define TELEMETRY_INTERVAL S2ST(TELEMETRY_INTERVAL_S)
+
+
+typedef struct {
+  bool valid;
+  float value;
+} telemetry_sample_t;
+
+typedef struct {
+  msg_listener_t* msg_listener;
+  bool net_up;
+  uint32_t group_addr;
+  uint32_t seq;
+  systime_t last_send_time;
+  telemetry_sample_t samples[NUM_SENSORS];
+} telemetry_t;
+
+
+static void
+telemetry_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+
+static void
+dispatch_net_status(telemetry_t* t, net_status_t* ns);
+
+static void
+dispatch_sensor_sample(telemetry_t* t, sensor_msg_t* sample);
+
+static void
+dispatch_sensor_timeout(telemetry_t* t, sensor_timeout_msg_t* timeout);
+
+static void
+send_frame(telemetry_t* t);
+
+static int16_t
+to_centidegrees(float value);
+
+static bool
+parse_addr(const char* str, uint32_t* addr);
+
+
+extern char device_id[32];
+
+
+void
+telemetry_init()
+{
+  telemetry_t* t = calloc(1, sizeof(telemetry_t));
+
+  if (!parse_addr(TELEMETRY_GROUP_STR, &t->group_addr)) {
+    printf("Invalid telemetry address: %s\r\n", TELEMETRY_GROUP_STR);
+    free(t);
+    return;
+  }
+
+  t->msg_listener = msg_listener_create("telemetry", 1024, telemetry_dispatch, t);
+  msg_listener_set_idle_timeout(t->msg_listener, TELEMETRY_INTERVAL_S * 1000);
+  msg_listener_set_priority(t->msg_listener, MSG_PRIO_LOW);
+
+  msg_subscribe(t->msg_listener, MSG_NET_STATUS, NULL);
+  msg_subscribe_coalesced(t->msg_listener, MSG_SENSOR_TIMEOUT, NULL, sizeof(sensor_timeout_msg_t));
+  msg_subscribe_lossy(t->msg_listener, MSG_SENSOR_SAMPLE, NULL, sizeof(sensor_msg_t));
+}
+
+static void
+telemetry_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  (void)sub_data;
+
+  telemetry_t* t = listener_data;
+
+  switch (id) {
+    case MSG_NET_STATUS:
+      dispatch_net_status(t, msg_data);
+      break;
+
+    case MSG_SENSOR_SAMPLE:
+      dispatch_sensor_sample(t, msg_data);
+      break;
+
+    case MSG_SENSOR_TIMEOUT:
+      dispatch_sensor_timeout(t, msg_data);
+      break;
+
+    default:
+      break;
+  }
+
+  if (t->net_up &&
+      (chTimeNow() - t->last_send_time) >= TELEMETRY_INTERVAL)
+    send_frame(t);
+}
+
+static void
+dispatch_net_status(telemetry_t* t, net_status_t* ns)
+{
+  t->net_up = (ns->net_state == NS_CONNECTED && ns->dhcp_resolved);
+}
+
+static void
+dispatch_sensor_sample(telemetry_t* t, sensor_msg_t* sample)
+{
+  if (sample->sensor >= NUM_SENSORS)
+    return;
+
+  t->samples[sample->sensor].valid = true;
+  t->samples[sample->sensor].value =
+      quantity_convert(sample->sample, UNIT_TEMP_DEG_F).value;
+}
+
+static void
+dispatch_sensor_timeout(telemetry_t* t, sensor_timeout_msg_t* timeout)
+{
+  if (timeout->sensor >= NUM_SENSORS)
+    return;
+
+  t->samples[timeout->sensor].valid = false;
+}
+
+/* Each frame gets a socket of its own, so that the CC3000's few sockets are
+ * not tied up between frames. The LAN API takes one client fewer in builds
+ * with telemetry to leave a socket free for this, see LAN_API_MAX_CLIENTS.
+ */
+static void
+send_frame(telemetry_t* t)
+{
+  int i;
+  telemetry_frame_t frame;
+
+  t->last_send_time = chTimeNow();
+
+  memset(&frame, 0, sizeof(frame));
+  frame.magic = htons(TELEMETRY_MAGIC);
+  frame.version = TELEMETRY_VERSION;
+  frame.num_controllers = NUM_CONTROLLERS;
+  frame.seq = htonl(t->seq);
+  frame.uptime = htonl(chTimeNow() / CH_FREQUENCY);
+  strncpy(frame.device_id, device_id, sizeof(frame.device_id));
+  t->seq++;
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    telemetry_controller_t* c = &frame.controllers[i];
+
+    c->controller = i;
+    c->setpoint = htons(to_centidegrees(temp_control_get_current_setpoint(i)));
+
+    if (i < NUM_SENSORS && t->samples[i].valid) {
+      c->flags |= TELEMETRY_SENSOR_VALID;
+      c->sensor_reading = htons(to_centidegrees(t->samples[i].value));
+    }
+
+    if (temp_control_get_status(i, OUTPUT_1).output_enabled)
+      c->flags |= TELEMETRY_OUTPUT_1_ON;
+    if (temp_control_get_status(i, OUTPUT_2).output_enabled)
+      c->flags |= TELEMETRY_OUTPUT_2_ON;
+  }
+
+  int sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sd < 0) {
+    printf("Telemetry socket failed %d\r\n", sd);
+    return;
+  }
+
+  sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(TELEMETRY_PORT),
+    .sin_addr.s_addr = htonl(t->group_addr)
+  };
+  int ret = sendto(sd, &frame, sizeof(frame), 0, (sockaddr*)&addr, sizeof(addr));
+  if (ret < 0)
+    printf("Telemetry send failed %d %d\r\n", ret, errno);
+
+  closesocket(sd);
+}
+
+static int16_t
+to_centidegrees(float value)
+{
+  value *= 100;
+
+  if (value > INT16_MAX)
+    return INT16_MAX;
+  if (value < INT16_MIN)
+    return INT16_MIN;
+
+  return (int16_t)value;
+}
+
+/* Parses a dotted quad into a host order address */
+static bool
+parse_addr(const char* str, uint32_t* addr)
+{
+  unsigned int a, b, c, d;
+
+  if (sscanf(str, "%u.%u.%u.%u", &a, &b, &c, &d) != 4 ||
+      a > 255 || b > 255 || c > 255 || d > 255)
+    return false;
+
+  *addr = (a << 24) | (b << 16) | (c << 8) | d;
+  return true;
+}
@@ -0,0 +1,42 @@
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+
+#include "temp_control.h"
+
+/* Telemetry frames are broadcast over UDP when the firmware is built with
+ * TELEMETRY_PORT set. All fields are in network byte order and temperatures
+ * are in hundredths of a degree F.
+ */
+
+#define TELEMETRY_MAGIC     0x4254  // "BT"
+#define TELEMETRY_VERSION   1
+
+#define TELEMETRY_SENSOR_VALID  0x01
+#define TELEMETRY_OUTPUT_1_ON   0x02
+#define TELEMETRY_OUTPUT_2_ON   0x04
+
+typedef struct __attribute__ ((__packed__)) {
+  uint8_t controller;
+  uint8_t flags;
+  int16_t sensor_reading;
+  int16_t setpoint;
+} telemetry_controller_t;
+
+typedef struct __attribute__ ((__packed__)) {
+  uint16_t magic;
+  uint8_t version;
+  uint8_t num_controllers;
+  uint32_t seq;
+  uint32_t uptime;
+  char device_id[24];
+  telemetry_controller_t controllers[NUM_CONTROLLERS];
+} telemetry_frame_t;
+
+
+void
+telemetry_init(void);
+
+#endif
@@ -31,6 +31,10 @@ typedef struct {
   Thread* thread;
 } relay_output_t;
 
+/* Each controller works from its own copy of its settings, which is only
+ * refreshed by the controller thread while the output threads are stopped.
+ * Other threads read it under settings_mtx.
+ */
 typedef struct temp_controller_s {
   sensor_id_t sensor;
   temp_controller_id_t controller;
@@ -38,11 +42,13 @@ typedef struct temp_controller_s {
   quantity_t last_sample;
   temp_profile_run_t temp_profile_run;
   relay_output_t outputs[NUM_OUTPUTS];
+  Mutex settings_mtx;
+  controller_settings_t settings;
 } temp_controller_t;
 
 
 static void dispatch_temp_input_msg(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
-static void dispatch_controller_settings(temp_controller_t* tc, const controller_settings_t* msg, bool resume_profile);
+static void dispatch_controller_settings(temp_controller_t* tc, bool resume_profile);
 static void dispatch_init(temp_controller_t* tc);
 static void dispatch_sensor_sample(temp_controller_t* tc, sensor_msg_t* msg);
 static void dispatch_sensor_timeout(temp_controller_t* tc, sensor_timeout_msg_t* msg);
@@ -55,6 +61,7 @@ static void relay_control(relay_output_t* output);
 static void enable_relay(relay_output_t* output, bool enabled);
 static float get_sp(temp_controller_t* tc);
 static const output_settings_t* get_output_settings(temp_controller_t* tc, output_id_t output);
+static output_settings_t read_output_settings(temp_controller_t* tc, output_id_t output);
 static void internal_temp_ovrd_check(relay_output_t* output);
 
 static temp_controller_t* controllers[NUM_CONTROLLERS];
@@ -77,13 +84,16 @@ temp_control_init(temp_controller_id_t controller)
     tc->sensor = SENSOR_2;
 
   tc->state = TC_SENSOR_TIMED_OUT;
+  chMtxInit(&tc->settings_mtx);
+  temp_profile_init(&tc->temp_profile_run);
 
   msg_listener_t* l = msg_listener_create("temp_ctrl", 1024, dispatch_temp_input_msg, tc);
+  msg_listener_set_priority(l, MSG_PRIO_HIGH);
 
-  msg_subscribe(l, MSG_SENSOR_SAMPLE,   NULL);
-  msg_subscribe(l, MSG_SENSOR_TIMEOUT,  NULL);
-  msg_subscribe(l, MSG_API_CONTROLLER_SETTINGS, NULL);
-  msg_subscribe(l, MSG_CONTROLLER_SETTINGS, NULL);
+  msg_subscribe_keyed(l, MSG_SENSOR_SAMPLE,   tc->sensor, NULL);
+  msg_subscribe_keyed(l, MSG_SENSOR_TIMEOUT,  tc->sensor, NULL);
+  msg_subscribe_keyed(l, MSG_API_CONTROLLER_SETTINGS, controller, NULL);
+  msg_subscribe_keyed(l, MSG_CONTROLLER_SETTINGS, controller, NULL);
   msg_subscribe(l, MSG_OUTPUT_OVRD, NULL);
 }
 
@@ -103,9 +113,9 @@ temp_control_get_status(temp_controller_id_t controller, output_id_t output)
 {
   temp_control_status_t status;
   temp_controller_t* tc = controllers[controller];
-  const output_settings_t* output_settings = get_output_settings(tc, output);
+  output_settings_t output_settings = read_output_settings(tc, output);
 
-  status.function = output_settings->function;
+  status.function = output_settings.function;
   status.output_enabled = tc->outputs[output].status.enabled;
   status.kp = tc->outputs[output].pid_control.kp;
   status.ki = tc->outputs[output].pid_control.ki;
@@ -123,10 +133,7 @@ temp_control_get_controller_for(output_id_t output)
     return NULL;
 
   for (i = 0; i < NUM_CONTROLLERS; ++i) {
-    const controller_settings_t* controller_settings =
-        app_cfg_get_controller_settings(i);
-
-    if (controller_settings->output_settings[output].enabled)
+    if (read_output_settings(controllers[i], output).enabled)
       return controllers[i];
   }
 
@@ -146,16 +153,30 @@ temp_control_get_output_function(output_id_t output)
 {
   temp_controller_t* tc = temp_control_get_controller_for(output);
   if (tc != NULL)
-    return get_output_settings(tc, output)->function;
+    return read_output_settings(tc, output).function;
 
   return OUTPUT_FUNC_NONE;
 }
 
+/* Only for the controller and output threads, which never run while the
+ * settings are being refreshed.
+ */
 static const output_settings_t*
 get_output_settings(temp_controller_t* tc, output_id_t output)
 {
-  const controller_settings_t* settings = app_cfg_get_controller_settings(tc->controller);
-  return &settings->output_settings[output];
+  return &tc->settings.output_settings[output];
+}
+
+static output_settings_t
+read_output_settings(temp_controller_t* tc, output_id_t output)
+{
+  output_settings_t settings;
+
+  chMtxLock(&tc->settings_mtx);
+  settings = tc->settings.output_settings[output];
+  chMtxUnlock();
+
+  return settings;
 }
 
 static void
@@ -220,7 +241,7 @@ output_thread(void* arg)
 
   while (!chThdShouldTerminate()) {
     //internal_temp_ovrd_check(output);
-
+
     if (output->controller->state != TC_ACTIVE ||
         !output_settings->enabled ||
         output->temp_ovrd)
@@ -367,7 +388,7 @@ dispatch_temp_input_msg(msg_id_t id, void* msg_data, void* listener_data, void*
 
   case MSG_CONTROLLER_SETTINGS:
   case MSG_API_CONTROLLER_SETTINGS:
-    dispatch_controller_settings(listener_data, msg_data, false);
+    dispatch_controller_settings(listener_data, false);
     break;
 
   case MSG_OUTPUT_OVRD:
@@ -383,21 +404,21 @@ static float
 get_sp(temp_controller_t* tc)
 {
   float sp;
-  const controller_settings_t* settings = app_cfg_get_controller_settings(tc->controller);
 
-  if (settings->setpoint_type == SP_STATIC)
-    return settings->static_setpoint.value;
-  else if (temp_profile_get_current_setpoint(&tc->temp_profile_run, &sp))
-    return sp;
+  chMtxLock(&tc->settings_mtx);
+  if (tc->settings.setpoint_type == SP_STATIC)
+    sp = tc->settings.static_setpoint.value;
+  else if (!temp_profile_get_current_setpoint(&tc->temp_profile_run, &sp))
+    sp = NAN;
+  chMtxUnlock();
 
-  return NAN;
+  return sp;
 }
 
 static void
 dispatch_init(temp_controller_t* tc)
 {
-  const controller_settings_t* cs = app_cfg_get_controller_settings(tc->controller);
-  dispatch_controller_settings(tc, cs, true);
+  dispatch_controller_settings(tc, true);
 }
 
 static void
@@ -412,8 +433,7 @@ dispatch_sensor_sample(temp_controller_t* tc, sensor_msg_t* msg)
   if (tc->state == TC_SENSOR_TIMED_OUT)
     tc->state = TC_ACTIVE;
 
-  const controller_settings_t* cs = app_cfg_get_controller_settings(tc->controller);
-  if (cs->setpoint_type == SP_TEMP_PROFILE)
+  if (tc->settings.setpoint_type == SP_TEMP_PROFILE)
     temp_profile_update(&tc->temp_profile_run, msg->sample);
 
   for (i = 0; i < NUM_OUTPUTS; ++i) {
@@ -438,11 +458,10 @@ dispatch_sensor_timeout(temp_controller_t* tc, sensor_timeout_msg_t* msg)
 }
 
 static void
-dispatch_controller_settings(temp_controller_t* tc, const controller_settings_t* settings, bool resume_profile)
+dispatch_controller_settings(temp_controller_t* tc, bool resume_profile)
 {
   int i;
-  if (tc->controller != settings->controller)
-    return;
+  const controller_settings_t* settings = &tc->settings;
 
   /* Stop output threads */
   for (i = 0; i < NUM_OUTPUTS; ++i) {
@@ -456,6 +475,10 @@ dispatch_controller_settings(temp_controller_t* tc, const controller_settings_t*
 
   tc->state = TC_IDLE;
 
+  chMtxLock(&tc->settings_mtx);
+  app_cfg_read_controller_settings(tc->controller, &tc->settings);
+  chMtxUnlock();
+
   for (i = 0; i < NUM_OUTPUTS; ++i) {
     if (settings->output_settings[i].enabled)
       output_init(tc, i);
@@ -464,9 +487,9 @@ dispatch_controller_settings(temp_controller_t* tc, const controller_settings_t*
   if (settings->setpoint_type == SP_TEMP_PROFILE) {
     temp_profile_run_t* tpr = &tc->temp_profile_run;
     if (resume_profile)
-      temp_profile_resume(tpr, tc->controller);
+      temp_profile_resume(tpr, tc->controller, &settings->temp_profile);
     else
-      temp_profile_start(tpr, tc->controller, settings->temp_profile.id, settings->temp_profile.start_point);
+      temp_profile_start(tpr, tc->controller, &settings->temp_profile);
   }
 
   tc->state = TC_SENSOR_TIMED_OUT;
@@ -13,8 +13,6 @@ typedef enum {
   NUM_CONTROLLERS
 } temp_controller_id_t;
 
-#include "temp_profile.h"
-
 typedef enum {
   OUTPUT_NONE = -1,
   OUTPUT_1,
@@ -0,0 +1,594 @@
+
+#include "temp_history.h"
+#include "history_log.h"
+#include "temp_control.h"
+#include "message.h"
+#include "common.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* Samples are taken once a second and accumulated into 10 second buckets
+ * covering the last hour, 5 minute buckets covering the last day and 30
+ * minute buckets covering the last week, each holding the min/max of the
+ * samples which fell into it. Envelopes for a plot are computed from
+ * whichever level matches the requested span, so the cost of a plot is
+ * bounded by the size of that level rather than the raw data.
+ *
+ * Each level has about one bucket per column of a full width plot, so none
+ * of the spans look blocky. The levels hold 984 buckets of 14 bytes, about
+ * 13.5 KB, of which the hour level is 5 KB.
+ *
+ * Once a minute, and whenever an output switches, a record is also appended
+ * to the flash history log. At boot the bucket levels are rebuilt from the
+ * log so the history survives resets and power cuts.
+ */
+#define SAMPLE_PERIOD             S2ST(1)
+
+#define HOUR_BUCKET_SECONDS       10
+#define HOUR_LEN                  ((60 * 60) / HOUR_BUCKET_SECONDS)
+#define DAY_BUCKET_SECONDS        (5 * 60)
+#define DAY_LEN                   ((24 * 60 * 60) / DAY_BUCKET_SECONDS)
+#define WEEK_BUCKET_SECONDS       (30 * 60)
+#define WEEK_LEN                  ((7 * 24 * 60 * 60) / WEEK_BUCKET_SECONDS)
+#define LOG_PERIOD_SECONDS        60
+
+#define NO_DATA                   INT16_MIN
+
+
+typedef struct {
+  int16_t temp_min[NUM_SENSORS];
+  int16_t temp_max[NUM_SENSORS];
+  int16_t setpoint[NUM_CONTROLLERS];
+  uint8_t output_duty[NUM_OUTPUTS];
+} history_bucket_t;
+
+typedef struct {
+  int32_t temp_sum[NUM_SENSORS];
+  uint16_t temp_count[NUM_SENSORS];
+  int16_t temp_min[NUM_SENSORS];
+  int16_t temp_max[NUM_SENSORS];
+  int32_t setpoint_sum[NUM_CONTROLLERS];
+  uint16_t setpoint_count[NUM_CONTROLLERS];
+  uint16_t output_on[NUM_OUTPUTS];
+  uint16_t num_samples;
+} bucket_accum_t;
+
+/* Buckets are only written when one is closed, which happens under the
+ * system lock together with an increment of seq. Readers which do not hold
+ * the lock check seq to tell whether a bucket was closed while they read.
+ */
+typedef struct {
+  uint16_t bucket_seconds;
+  uint16_t len;
+  uint16_t head;
+  uint16_t count;
+  volatile uint32_t seq;
+  bucket_accum_t accum;
+  history_bucket_t* buckets;
+} bucket_level_t;
+
+typedef struct {
+  int16_t temp[NUM_SENSORS];
+  int16_t setpoint[NUM_CONTROLLERS];
+  bool output_on[NUM_OUTPUTS];
+} history_sample_t;
+
+
+static void temp_history_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+static void dispatch_sensor_sample(sensor_msg_t* msg);
+static void dispatch_sensor_timeout(sensor_timeout_msg_t* msg);
+static void dispatch_output_status(output_status_t* msg);
+static void record_samples(void);
+static void record_sample(const history_sample_t* sample);
+static void log_sample(const history_sample_t* sample, uint8_t outputs);
+static void load_logged_history(void);
+static void replay_record(const history_log_record_t* rec, uint32_t seconds);
+static void accumulate_all(const history_sample_t* sample, uint32_t seconds);
+static void accumulate(bucket_level_t* level, const history_sample_t* sample, uint32_t seconds);
+static void summarize(const bucket_accum_t* accum, history_bucket_t* bucket);
+static void reset_accum(bucket_accum_t* accum);
+static bool bucket_entry(const history_bucket_t* b, history_channel_t channel, int16_t* min, int16_t* max);
+static uint16_t get_envelope(bucket_level_t* level, history_channel_t channel,
+    history_envelope_t* cols, uint16_t num_cols, uint32_t* seq);
+
+
+static history_bucket_t hour_buckets[HOUR_LEN];
+static history_bucket_t day_buckets[DAY_LEN];
+static history_bucket_t week_buckets[WEEK_LEN];
+static bucket_level_t hour_level = {
+    .bucket_seconds = HOUR_BUCKET_SECONDS,
+    .len = HOUR_LEN,
+    .buckets = hour_buckets
+};
+static bucket_level_t day_level = {
+    .bucket_seconds = DAY_BUCKET_SECONDS,
+    .len = DAY_LEN,
+    .buckets = day_buckets
+};
+static bucket_level_t week_level = {
+    .bucket_seconds = WEEK_BUCKET_SECONDS,
+    .len = WEEK_LEN,
+    .buckets = week_buckets
+};
+
+static history_sample_t current;
+static systime_t next_sample_time;
+static bucket_accum_t log_accum;
+static uint32_t next_log_time;
+static uint8_t logged_outputs;
+
+
+void
+temp_history_init()
+{
+  int i;
+
+  for (i = 0; i < NUM_SENSORS; ++i)
+    current.temp[i] = NO_DATA;
+
+  reset_accum(&hour_level.accum);
+  reset_accum(&day_level.accum);
+  reset_accum(&week_level.accum);
+  reset_accum(&log_accum);
+
+  load_logged_history();
+
+  next_sample_time = chTimeNow() + SAMPLE_PERIOD;
+
+  msg_listener_t* l = msg_listener_create("temp_history", 1024, temp_history_dispatch, NULL);
+  msg_listener_set_idle_timeout(l, 1000);
+
+  msg_subscribe(l, MSG_SENSOR_SAMPLE, NULL);
+  msg_subscribe(l, MSG_SENSOR_TIMEOUT, NULL);
+  msg_subscribe(l, MSG_OUTPUT_STATUS, NULL);
+}
+
+static void
+temp_history_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  (void)listener_data;
+  (void)sub_data;
+
+  switch (id) {
+  case MSG_SENSOR_SAMPLE:
+    dispatch_sensor_sample(msg_data);
+    break;
+
+  case MSG_SENSOR_TIMEOUT:
+    dispatch_sensor_timeout(msg_data);
+    break;
+
+  case MSG_OUTPUT_STATUS:
+    dispatch_output_status(msg_data);
+    break;
+
+  default:
+    break;
+  }
+
+  record_samples();
+}
+
+static void
+dispatch_sensor_sample(sensor_msg_t* msg)
+{
+  if (msg->sensor >= NUM_SENSORS)
+    return;
+
+  quantity_t sample = quantity_convert(msg->sample, UNIT_TEMP_DEG_F);
+  current.temp[msg->sensor] = lroundf(sample.value * 10);
+}
+
+static void
+dispatch_sensor_timeout(sensor_timeout_msg_t* msg)
+{
+  if (msg->sensor >= NUM_SENSORS)
+    return;
+
+  current.temp[msg->sensor] = NO_DATA;
+}
+
+static void
+dispatch_output_status(output_status_t* msg)
+{
+  if (msg->output >= NUM_OUTPUTS)
+    return;
+
+  current.output_on[msg->output] = msg->enabled;
+}
+
+/* Records one sample for every second which has elapsed since the last one.
+ * If the listener was held up the current values are repeated, but never
+ * more than an hour's worth.
+ */
+static void
+record_samples()
+{
+  int i;
+  int n = 0;
+
+  while (((int32_t)(chTimeNow() - next_sample_time) >= 0) &&
+         (n++ < (HOUR_LEN * HOUR_BUCKET_SECONDS))) {
+    for (i = 0; i < NUM_CONTROLLERS; ++i) {
+      float sp = temp_control_get_current_setpoint(i);
+      current.setpoint[i] = isnan(sp) ? NO_DATA : lroundf(sp * 10);
+    }
+
+    record_sample(&current);
+    next_sample_time += SAMPLE_PERIOD;
+  }
+
+  if (n > (HOUR_LEN * HOUR_BUCKET_SECONDS))
+    next_sample_time = chTimeNow() + SAMPLE_PERIOD;
+}
+
+static void
+record_sample(const history_sample_t* sample)
+{
+  int i;
+  uint8_t outputs = 0;
+
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    if (sample->output_on[i])
+      outputs |= (1 << i);
+  }
+
+  accumulate_all(sample, 1);
+
+  log_sample(sample, outputs);
+}
+
+/* Appends a record to the flash log holding the average temperature since
+ * the previous record, which is at most a minute. Output changes are logged
+ * as soon as they happen so that relay transitions are kept at full
+ * resolution.
+ */
+static void
+log_sample(const history_sample_t* sample, uint8_t outputs)
+{
+  int i;
+  history_log_record_t rec;
+  uint32_t now = history_log_time();
+
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    if (sample->temp[i] != NO_DATA) {
+      log_accum.temp_sum[i] += sample->temp[i];
+      log_accum.temp_count[i]++;
+    }
+  }
+
+  if ((outputs == logged_outputs) && ((int32_t)(now - next_log_time) < 0))
+    return;
+
+  rec.time = now;
+  rec.outputs = outputs;
+  rec.boot = false;
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    if (log_accum.temp_count[i] > 0)
+      rec.temp[i] = log_accum.temp_sum[i] / log_accum.temp_count[i];
+    else
+      rec.temp[i] = NO_DATA;
+  }
+  for (i = 0; i < NUM_CONTROLLERS; ++i)
+    rec.setpoint[i] = sample->setpoint[i];
+
+  history_log_append(&rec);
+
+  reset_accum(&log_accum);
+  logged_outputs = outputs;
+  next_log_time = now + LOG_PERIOD_SECONDS;
+}
+
+/* Replays the last week of the flash log into the bucket levels. Each
+ * logged record holds until the next one, or until now for the last one.
+ */
+static void
+load_logged_history()
+{
+  history_log_record_t rec;
+  history_log_record_t prev;
+  bool have_prev = false;
+  uint32_t now = history_log_time();
+  uint32_t span = temp_history_get_span_seconds(HISTORY_SPAN_WEEK);
+
+  history_log_cursor_t* c = calloc(1, sizeof(history_log_cursor_t));
+
+  if (history_log_seek(c, (now > span) ? (now - span) : 0)) {
+    while (history_log_next(c, &rec)) {
+      if (have_prev)
+        replay_record(&prev, rec.time - prev.time);
+
+      prev = rec;
+      have_prev = true;
+    }
+  }
+
+  if (have_prev) {
+    replay_record(&prev, now - prev.time);
+    logged_outputs = prev.outputs;
+  }
+
+  free(c);
+}
+
+/* A record never holds for longer than a log period. Any time beyond that
+ * is accumulated as a sample with no data, so a gap in the log stays a gap
+ * in the plot rather than being squeezed out of the buckets.
+ */
+static void
+replay_record(const history_log_record_t* rec, uint32_t seconds)
+{
+  int i;
+  history_sample_t sample;
+  uint32_t held = MIN(seconds, LOG_PERIOD_SECONDS);
+  uint32_t gap = MIN(seconds - held, temp_history_get_span_seconds(HISTORY_SPAN_WEEK));
+
+  for (i = 0; i < NUM_SENSORS; ++i)
+    sample.temp[i] = rec->temp[i];
+  for (i = 0; i < NUM_CONTROLLERS; ++i)
+    sample.setpoint[i] = rec->setpoint[i];
+  for (i = 0; i < NUM_OUTPUTS; ++i)
+    sample.output_on[i] = (rec->outputs & (1 << i)) != 0;
+
+  accumulate_all(&sample, held);
+
+  if (gap > 0) {
+    for (i = 0; i < NUM_SENSORS; ++i)
+      sample.temp[i] = NO_DATA;
+    for (i = 0; i < NUM_CONTROLLERS; ++i)
+      sample.setpoint[i] = NO_DATA;
+    for (i = 0; i < NUM_OUTPUTS; ++i)
+      sample.output_on[i] = false;
+
+    accumulate_all(&sample, gap);
+  }
+}
+
+static void
+accumulate_all(const history_sample_t* sample, uint32_t seconds)
+{
+  accumulate(&hour_level, sample, seconds);
+  accumulate(&day_level, sample, seconds);
+  accumulate(&week_level, sample, seconds);
+}
+
+/* Adds a sample which held for the given number of seconds, closing out as
+ * many buckets as it spans.
+ */
+static void
+accumulate(bucket_level_t* level, const history_sample_t* sample, uint32_t seconds)
+{
+  int i;
+  bucket_accum_t* a = &level->accum;
+
+  while (seconds > 0) {
+    uint16_t n = MIN(seconds, (uint32_t)(level->bucket_seconds - a->num_samples));
+
+    for (i = 0; i < NUM_SENSORS; ++i) {
+      int16_t t = sample->temp[i];
+      if (t != NO_DATA) {
+        a->temp_sum[i] += t * n;
+        a->temp_count[i] += n;
+        a->temp_min[i] = MIN(a->temp_min[i], t);
+        a->temp_max[i] = MAX(a->temp_max[i], t);
+      }
+    }
+
+    for (i = 0; i < NUM_CONTROLLERS; ++i) {
+      if (sample->setpoint[i] != NO_DATA) {
+        a->setpoint_sum[i] += sample->setpoint[i] * n;
+        a->setpoint_count[i] += n;
+      }
+    }
+
+    for (i = 0; i < NUM_OUTPUTS; ++i) {
+      if (sample->output_on[i])
+        a->output_on[i] += n;
+    }
+
+    a->num_samples += n;
+    seconds -= n;
+
+    if (a->num_samples >= level->bucket_seconds) {
+      history_bucket_t bucket;
+      summarize(a, &bucket);
+
+      chSysLock();
+      level->buckets[level->head] = bucket;
+      level->seq++;
+      level->head = (level->head + 1) % level->len;
+      if (level->count < level->len)
+        level->count++;
+      reset_accum(a);
+      chSysUnlock();
+    }
+  }
+}
+
+static void
+summarize(const bucket_accum_t* a, history_bucket_t* b)
+{
+  int i;
+
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    if (a->temp_count[i] > 0) {
+      b->temp_min[i] = a->temp_min[i];
+      b->temp_max[i] = a->temp_max[i];
+    }
+    else {
+      b->temp_min[i] = NO_DATA;
+      b->temp_max[i] = NO_DATA;
+    }
+  }
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    if (a->setpoint_count[i] > 0)
+      b->setpoint[i] = a->setpoint_sum[i] / a->setpoint_count[i];
+    else
+      b->setpoint[i] = NO_DATA;
+  }
+
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    if (a->num_samples > 0)
+      b->output_duty[i] = (a->output_on[i] * 100) / a->num_samples;
+    else
+      b->output_duty[i] = 0;
+  }
+}
+
+static void
+reset_accum(bucket_accum_t* a)
+{
+  int i;
+
+  memset(a, 0, sizeof(bucket_accum_t));
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    a->temp_min[i] = INT16_MAX;
+    a->temp_max[i] = INT16_MIN;
+  }
+}
+
+uint32_t
+temp_history_get_span_seconds(history_span_t span)
+{
+  switch (span) {
+  case HISTORY_SPAN_HOUR:
+    return HOUR_LEN * HOUR_BUCKET_SECONDS;
+
+  case HISTORY_SPAN_DAY:
+    return DAY_LEN * DAY_BUCKET_SECONDS;
+
+  case HISTORY_SPAN_WEEK:
+  default:
+    return WEEK_LEN * WEEK_BUCKET_SECONDS;
+  }
+}
+
+/* Fills in one envelope per column, oldest on the left and newest on the
+ * right, and returns the number of columns which had data. If a bucket is
+ * closed part way through, the envelope is computed again, which happens at
+ * most once every 10 seconds.
+ */
+uint16_t
+temp_history_get_envelope(history_span_t span, history_channel_t channel,
+    history_envelope_t* cols, uint16_t num_cols)
+{
+  int attempt;
+  uint16_t ret = 0;
+  uint32_t seq;
+  bucket_level_t* level;
+
+  if (span == HISTORY_SPAN_WEEK)
+    level = &week_level;
+  else if (span == HISTORY_SPAN_DAY)
+    level = &day_level;
+  else
+    level = &hour_level;
+
+  for (attempt = 0; attempt < 3; ++attempt) {
+    ret = get_envelope(level, channel, cols, num_cols, &seq);
+    if (level->seq == seq)
+      break;
+  }
+
+  return ret;
+}
+
+static uint16_t
+get_envelope(bucket_level_t* level, history_channel_t channel,
+    history_envelope_t* cols, uint16_t num_cols, uint32_t* seq)
+{
+  int c;
+  uint16_t cols_with_data = 0;
+  history_bucket_t partial;
+  uint32_t num_entries;
+  uint16_t head;
+  uint16_t count;
+  bool has_partial = false;
+
+  /* The bucket currently being accumulated is treated as the newest entry
+   * so the right edge of the plot is never stale.
+   */
+  chSysLock();
+  has_partial = (level->accum.num_samples > 0);
+  summarize(&level->accum, &partial);
+  num_entries = level->len;
+  head = level->head;
+  count = level->count + (has_partial ? 1 : 0);
+  *seq = level->seq;
+  chSysUnlock();
+
+  for (c = 0; c < num_cols; ++c) {
+    uint32_t first = (c * num_entries) / num_cols;
+    uint32_t last = ((c + 1) * num_entries) / num_cols;
+    uint32_t k;
+    history_envelope_t env = {
+        .min = INT16_MAX,
+        .max = INT16_MIN
+    };
+
+    if (last <= first)
+      last = first + 1;
+
+    for (k = first; k < last; ++k) {
+      uint32_t age = num_entries - 1 - k;
+      int16_t min, max;
+      const history_bucket_t* b;
+
+      if (age >= count)
+        continue;
+
+      if (has_partial) {
+        if (age == 0)
+          b = &partial;
+        else
+          b = &level->buckets[(head + level->len - age) % level->len];
+      }
+      else {
+        b = &level->buckets[(head + level->len - 1 - age) % level->len];
+      }
+
+      if (!bucket_entry(b, channel, &min, &max))
+        continue;
+
+      env.min = MIN(env.min, min);
+      env.max = MAX(env.max, max);
+    }
+
+    if (env.min <= env.max)
+      cols_with_data++;
+    cols[c] = env;
+  }
+
+  return cols_with_data;
+}
+
+static bool
+bucket_entry(const history_bucket_t* b, history_channel_t channel, int16_t* min, int16_t* max)
+{
+  switch (channel) {
+  case HISTORY_CH_TEMP_1:
+  case HISTORY_CH_TEMP_2:
+    *min = b->temp_min[channel - HISTORY_CH_TEMP_1];
+    *max = b->temp_max[channel - HISTORY_CH_TEMP_1];
+    break;
+
+  case HISTORY_CH_SETPOINT_1:
+  case HISTORY_CH_SETPOINT_2:
+    *min = *max = b->setpoint[channel - HISTORY_CH_SETPOINT_1];
+    break;
+
+  case HISTORY_CH_OUTPUT_1:
+  case HISTORY_CH_OUTPUT_2:
+    *min = *max = b->output_duty[channel - HISTORY_CH_OUTPUT_1];
+    return true;
+
+  default:
+    return false;
+  }
+
+  return (*min != NO_DATA);
+}
@@ -0,0 +1,47 @@
+
+#ifndef TEMP_HISTORY_H
+#define TEMP_HISTORY_H
+
+#include "types.h"
+
+
+typedef enum {
+  HISTORY_SPAN_HOUR,
+  HISTORY_SPAN_DAY,
+  HISTORY_SPAN_WEEK,
+
+  NUM_HISTORY_SPANS
+} history_span_t;
+
+typedef enum {
+  HISTORY_CH_TEMP_1,
+  HISTORY_CH_TEMP_2,
+  HISTORY_CH_SETPOINT_1,
+  HISTORY_CH_SETPOINT_2,
+  HISTORY_CH_OUTPUT_1,
+  HISTORY_CH_OUTPUT_2,
+
+  NUM_HISTORY_CHANNELS
+} history_channel_t;
+
+/* Range of values a channel took over one plot column. Temperatures are in
+ * tenths of a degree F, outputs are in percent on-time. If there is no data
+ * for the column min will be greater than max.
+ */
+typedef struct {
+  int16_t min;
+  int16_t max;
+} history_envelope_t;
+
+
+void
+temp_history_init(void);
+
+uint32_t
+temp_history_get_span_seconds(history_span_t span);
+
+uint16_t
+temp_history_get_envelope(history_span_t span, history_channel_t channel,
+    history_envelope_t* cols, uint16_t num_cols);
+
+#endif
@@ -1,164 +1,407 @@
-
-#include "temp_profile.h"
-#include "message.h"
-#include "app_cfg.h"
-#include <stdio.h>
-
-// 4 hours
-#define CHECKPOINT_PERIOD S2ST(4 * 60 * 60)
-
-static void write_checkpoint(temp_profile_run_t* run);
-
-
-void
-temp_profile_start(temp_profile_run_t* run, temp_controller_id_t controller, uint32_t temp_profile_id, int start_point)
-{
-  if ((temp_profile_id != run->temp_profile_id) ||
-      (start_point >= 0)) {
-    run->current_step = start_point;
-    run->current_step_start_time = chTimeNow();
-
-    if (run->current_step == 0) {
-      run->state = TPS_SEEKING_START_VALUE;
-    }
-    else {
-      run->state = TPS_RUNNING;
-    }
-  }
-
-  run->controller = controller;
-  run->temp_profile_id = temp_profile_id;
-
-  write_checkpoint(run);
-
-  printf("Starting profile\r\n");
-  printf("  controller: %d\r\n", (int)run->controller);
-  printf("  profile id: %d\r\n", (int)run->temp_profile_id);
-  printf("  state: %d\r\n", (int)run->state);
-  printf("  cur step: %d\r\n", (int)run->current_step);
-  printf("  cur step time: %d\r\n", (int)run->current_step_start_time);
-  printf("  next chkpt: %d\r\n", (int)run->next_checkpoint);
-}
-
-void
-temp_profile_resume(temp_profile_run_t* run, temp_controller_id_t controller)
-{
-  const temp_profile_checkpoint_t* checkpoint = app_cfg_get_temp_profile_checkpoint(controller);
-
-  run->controller = controller;
-  run->temp_profile_id = checkpoint->temp_profile_id;
-  run->state = checkpoint->state;
-  run->current_step = checkpoint->current_step;
-  run->current_step_start_time = chTimeNow() - checkpoint->current_step_time;
-  run->next_checkpoint = chTimeNow() + CHECKPOINT_PERIOD;
-
-  printf("Resuming profile\r\n");
-  printf("  controller: %d\r\n", (int)run->controller);
-  printf("  profile id: %d\r\n", (int)run->temp_profile_id);
-  printf("  state: %d\r\n", (int)run->state);
-  printf("  cur step: %d\r\n", (int)run->current_step);
-  printf("  cur step time: %d\r\n", (int)run->current_step_start_time);
-  printf("  next chkpt: %d\r\n", (int)run->next_checkpoint);
-}
-
-void
-temp_profile_update(temp_profile_run_t* run, quantity_t sample)
-{
-  switch (run->state) {
-    case TPS_SEEKING_START_VALUE:
-    {
-      const temp_profile_t* profile = &app_cfg_get_controller_settings(run->controller)->temp_profile;
-      float start_err = sample.value - profile->start_value.value;
-
-      if (start_err < 1 && start_err > -1) {
-        run->current_step = 0;
-        run->current_step_start_time = chTimeNow();
-        run->state = TPS_RUNNING;
-      }
-      break;
-    }
-
-    default:
-      break;
-  }
-
-  if (chTimeNow() > run->next_checkpoint)
-    write_checkpoint(run);
-}
-
-static void
-write_checkpoint(temp_profile_run_t* run)
-{
-  temp_profile_checkpoint_t checkpoint = {
-      .temp_profile_id = run->temp_profile_id,
-      .state = run->state,
-      .current_step = run->current_step,
-      .current_step_time = chTimeNow() - run->current_step_start_time
-  };
-  app_cfg_set_temp_profile_checkpoint(run->controller, &checkpoint);
-  run->next_checkpoint = chTimeNow() + CHECKPOINT_PERIOD;
-
-  printf("Saving profile checkpoint\r\n");
-  printf("  profile id: %d\r\n", (int)checkpoint.temp_profile_id);
-  printf("  state: %d\r\n", (int)checkpoint.state);
-  printf("  cur step: %d\r\n", (int)checkpoint.current_step);
-  printf("  cur step time: %d\r\n", (int)checkpoint.current_step_time);
-}
-
-bool
-temp_profile_get_current_setpoint(temp_profile_run_t* run, float* sp)
-{
-  bool ret = true;
-  const temp_profile_t* profile = &app_cfg_get_controller_settings(run->controller)->temp_profile;
-
-  if (run->state == TPS_RUNNING) {
-    if (chTimeNow() > run->current_step_start_time + S2ST(profile->steps[run->current_step].duration)) {
-      if (++run->current_step >= profile->num_steps) {
-        if (profile->completion_action == TEMP_PROFILE_COMPLETION_ACTION_START_OVER) {
-          run->current_step = 0;
-          run->current_step_start_time = chTimeNow();
-        }
-        else {
-          run->state = TPS_HOLD_LAST;
-        }
-      }
-      else {
-        run->current_step_start_time = chTimeNow();
-      }
-    }
-  }
-
-  switch (run->state) {
-    case TPS_SEEKING_START_VALUE:
-      *sp = profile->start_value.value;
-      break;
-
-    case TPS_RUNNING:
-    {
-      const temp_profile_step_t* cur_step = &profile->steps[run->current_step];
-      if (cur_step->type == STEP_HOLD) {
-        *sp = cur_step->value.value;
-      }
-      else {
-        float last_temp;
-        if (run->current_step == 0)
-          last_temp = profile->start_value.value;
-        else
-          last_temp = profile->steps[run->current_step - 1].value.value;
-
-        systime_t duration_into_step = chTimeNow() - run->current_step_start_time;
-        *sp = last_temp + ((cur_step->value.value - last_temp) * duration_into_step / S2ST(cur_step->duration));
-      }
-      break;
-    }
-
-    case TPS_HOLD_LAST:
-      if (profile->num_steps > 0)
-        *sp = profile->steps[profile->num_steps-1].value.value;
-      else
-        *sp = profile->start_value.value;
-      break;
-  }
-
-  return ret;
-}
+
+#include "temp_profile.h"
+#include "message.h"
+#include "app_cfg.h"
+#include "common.h"
+#include <stdio.h>
+
+// 4 hours
+#define CHECKPOINT_PERIOD S2ST(4 * 60 * 60)
+
+static void write_checkpoint(temp_profile_run_t* run);
+static void compile_profile(temp_profile_run_t* run, const temp_profile_t* profile);
+static bool get_step(temp_profile_run_t* run, uint32_t index, temp_profile_step_t* step, uint32_t* start);
+static void set_elapsed(temp_profile_run_t* run, uint32_t elapsed, systime_t ticks);
+static void advance_elapsed(temp_profile_run_t* run);
+static bool seek(temp_profile_run_t* run);
+static bool load_segment(temp_profile_run_t* run, uint32_t index);
+static void enter_hold_last(temp_profile_run_t* run);
+static bool compute_setpoint(temp_profile_run_t* run, float* sp);
+
+
+/* The setpoint is looked up from several threads, by every relay and PID
+ * evaluation and every report. Rather than walking the steps on each call,
+ * a run keeps its position as the time into the profile and the current step
+ * as a line. A lookup is then a multiply and add, and the result is cached
+ * for the rest of the tick. When the time passes the end of the current step
+ * the next step is tried first, otherwise the step is found by binary search
+ * of the step start times, so any gap or resume costs O(log n).
+ */
+
+void
+temp_profile_init(temp_profile_run_t* run)
+{
+  chMtxInit(&run->mtx);
+}
+
+void
+temp_profile_start(temp_profile_run_t* run, temp_controller_id_t controller, const temp_profile_t* profile)
+{
+  int start_point = profile->start_point;
+
+  chMtxLock(&run->mtx);
+
+  bool restart = (profile->id != run->temp_profile_id) || (start_point >= 0);
+
+  run->controller = controller;
+  run->temp_profile_id = profile->id;
+  compile_profile(run, profile);
+
+  if (restart) {
+    temp_profile_step_t step;
+    uint32_t step_start = 0;
+
+    run->current_step = MAX(start_point, 0);
+    if (run->current_step == 0) {
+      run->state = TPS_SEEKING_START_VALUE;
+    }
+    else {
+      run->state = TPS_RUNNING;
+      get_step(run, run->current_step, &step, &step_start);
+    }
+    set_elapsed(run, step_start, 0);
+  }
+
+  if (run->state == TPS_HOLD_LAST)
+    enter_hold_last(run);
+
+  write_checkpoint(run);
+
+  chMtxUnlock();
+
+  printf("Starting profile\r\n");
+  printf("  controller: %d\r\n", (int)run->controller);
+  printf("  profile id: %d\r\n", (int)run->temp_profile_id);
+  printf("  state: %d\r\n", (int)run->state);
+  printf("  cur step: %d\r\n", (int)run->current_step);
+  printf("  elapsed: %d\r\n", (int)run->elapsed);
+  printf("  steps: %d\r\n", (int)run->info.num_steps);
+}
+
+void
+temp_profile_resume(temp_profile_run_t* run, temp_controller_id_t controller, const temp_profile_t* profile)
+{
+  const temp_profile_checkpoint_t* checkpoint = app_cfg_get_temp_profile_checkpoint(controller);
+  temp_profile_step_t step;
+  uint32_t step_start = 0;
+
+  chMtxLock(&run->mtx);
+
+  run->controller = controller;
+  run->temp_profile_id = checkpoint->temp_profile_id;
+  run->state = checkpoint->state;
+  run->current_step = checkpoint->current_step;
+  compile_profile(run, profile);
+
+  get_step(run, run->current_step, &step, &step_start);
+  set_elapsed(run,
+      step_start + (checkpoint->current_step_time / S2ST(1)),
+      checkpoint->current_step_time % S2ST(1));
+
+  if (run->state == TPS_HOLD_LAST)
+    enter_hold_last(run);
+
+  run->last_checkpoint = chTimeNow();
+
+  chMtxUnlock();
+
+  printf("Resuming profile\r\n");
+  printf("  controller: %d\r\n", (int)run->controller);
+  printf("  profile id: %d\r\n", (int)run->temp_profile_id);
+  printf("  state: %d\r\n", (int)run->state);
+  printf("  cur step: %d\r\n", (int)run->current_step);
+  printf("  elapsed: %d\r\n", (int)run->elapsed);
+  printf("  steps: %d\r\n", (int)run->info.num_steps);
+}
+
+void
+temp_profile_update(temp_profile_run_t* run, quantity_t sample)
+{
+  chMtxLock(&run->mtx);
+
+  switch (run->state) {
+    case TPS_SEEKING_START_VALUE:
+    {
+      float start_err = sample.value - run->info.start_value.value;
+
+      if (start_err < 1 && start_err > -1) {
+        run->current_step = 0;
+        run->state = TPS_RUNNING;
+        set_elapsed(run, 0, 0);
+      }
+      break;
+    }
+
+    default:
+      break;
+  }
+
+  if ((chTimeNow() - run->last_checkpoint) >= CHECKPOINT_PERIOD)
+    write_checkpoint(run);
+
+  chMtxUnlock();
+}
+
+static void
+write_checkpoint(temp_profile_run_t* run)
+{
+  temp_profile_step_t step;
+  uint32_t step_start;
+  systime_t step_time = 0;
+
+  if ((run->state == TPS_RUNNING) &&
+      get_step(run, run->current_step, &step, &step_start) &&
+      (run->elapsed >= step_start))
+    step_time = S2ST(run->elapsed - step_start) + run->elapsed_ticks;
+
+  temp_profile_checkpoint_t checkpoint = {
+      .temp_profile_id = run->temp_profile_id,
+      .state = run->state,
+      .current_step = run->current_step,
+      .current_step_time = step_time
+  };
+  app_cfg_set_temp_profile_checkpoint(run->controller, &checkpoint);
+  run->last_checkpoint = chTimeNow();
+
+  printf("Saving profile checkpoint\r\n");
+  printf("  profile id: %d\r\n", (int)checkpoint.temp_profile_id);
+  printf("  state: %d\r\n", (int)checkpoint.state);
+  printf("  cur step: %d\r\n", (int)checkpoint.current_step);
+  printf("  cur step time: %d\r\n", (int)checkpoint.current_step_time);
+}
+
+bool
+temp_profile_get_current_setpoint(temp_profile_run_t* run, float* sp)
+{
+  bool ret = true;
+
+  chMtxLock(&run->mtx);
+
+  systime_t now = chTimeNow();
+  if (!run->sp_valid || (run->sp_time != now)) {
+    ret = compute_setpoint(run, &run->sp);
+    run->sp_valid = ret;
+    run->sp_time = now;
+  }
+  *sp = run->sp;
+
+  chMtxUnlock();
+
+  return ret;
+}
+
+static bool
+compute_setpoint(temp_profile_run_t* run, float* sp)
+{
+  switch (run->state) {
+    case TPS_SEEKING_START_VALUE:
+      *sp = run->info.start_value.value;
+      return true;
+
+    case TPS_RUNNING:
+      advance_elapsed(run);
+
+      if ((run->elapsed < run->seg_start) || (run->elapsed >= run->seg_end)) {
+        if (!seek(run))
+          return false;
+      }
+
+      if (run->state == TPS_RUNNING) {
+        float t = (run->elapsed - run->seg_start) + ((float)run->elapsed_ticks / S2ST(1));
+        *sp = run->seg_base + (run->seg_slope * t);
+      }
+      else {
+        *sp = run->seg_base;
+      }
+      return true;
+
+    case TPS_HOLD_LAST:
+      *sp = run->seg_base;
+      return true;
+  }
+
+  return false;
+}
+
+/* Picks where the steps of the profile are read from and compiles the start
+ * time of each step. Profiles in the profile store take precedence over the
+ * one in the controller settings, which is limited in length, and already
+ * hold their step start times. Otherwise the steps are copied, so the run
+ * does not depend on the settings staying put.
+ */
+static void
+compile_profile(temp_profile_run_t* run, const temp_profile_t* profile)
+{
+  run->stored = temp_profile_store_find(run->temp_profile_id, &run->info);
+
+  if (!run->stored) {
+    uint32_t i;
+    uint32_t t = 0;
+
+    run->info.id = profile->id;
+    run->info.num_steps = MIN(profile->num_steps, TEMP_PROFILE_INLINE_STEPS);
+    run->info.start_value = profile->start_value;
+    run->info.completion_action = profile->completion_action;
+
+    for (i = 0; i < run->info.num_steps; ++i) {
+      run->steps[i] = profile->steps[i];
+      run->step_start[i] = t;
+      t += profile->steps[i].duration;
+    }
+    run->info.duration = t;
+  }
+
+  run->seg_start = 0;
+  run->seg_end = 0;
+  run->sp_valid = false;
+}
+
+static bool
+get_step(temp_profile_run_t* run, uint32_t index, temp_profile_step_t* step, uint32_t* start)
+{
+  if (index >= run->info.num_steps)
+    return false;
+
+  if (run->stored)
+    return temp_profile_store_read_step(&run->info, index, step, start);
+
+  *step = run->steps[index];
+  *start = run->step_start[index];
+  return true;
+}
+
+static void
+set_elapsed(temp_profile_run_t* run, uint32_t elapsed, systime_t ticks)
+{
+  run->elapsed = elapsed;
+  run->elapsed_ticks = ticks;
+  run->last_tick = chTimeNow();
+
+  /* Force the step to be looked up again */
+  run->seg_start = 0;
+  run->seg_end = 0;
+  run->sp_valid = false;
+}
+
+/* Moves the time into the profile on by the ticks since the last call. Only
+ * the difference between tick counts is used, so it stays correct across
+ * wraps of systime_t as long as it is called at least once per wrap.
+ */
+static void
+advance_elapsed(temp_profile_run_t* run)
+{
+  systime_t now = chTimeNow();
+
+  run->elapsed_ticks += now - run->last_tick;
+  run->last_tick = now;
+
+  if (run->elapsed_ticks >= S2ST(1)) {
+    run->elapsed += run->elapsed_ticks / S2ST(1);
+    run->elapsed_ticks %= S2ST(1);
+  }
+}
+
+/* Finds the step containing the current time into the profile. */
+static bool
+seek(temp_profile_run_t* run)
+{
+  uint32_t lo, hi;
+  uint32_t num_steps = run->info.num_steps;
+
+  if (run->elapsed >= run->info.duration) {
+    if ((run->info.completion_action == TEMP_PROFILE_COMPLETION_ACTION_START_OVER) &&
+        (run->info.duration > 0)) {
+      run->elapsed %= run->info.duration;
+    }
+    else {
+      enter_hold_last(run);
+      return true;
+    }
+  }
+
+  /* Usually the profile has just moved on to the next step */
+  if ((run->current_step + 1) < num_steps) {
+    if (!load_segment(run, run->current_step + 1))
+      return false;
+
+    if ((run->elapsed >= run->seg_start) && (run->elapsed < run->seg_end))
+      return true;
+  }
+
+  /* Find the last step which starts at or before the current time */
+  lo = 0;
+  hi = num_steps - 1;
+  while (lo < hi) {
+    temp_profile_step_t step;
+    uint32_t step_start;
+    uint32_t mid = lo + ((hi - lo + 1) / 2);
+
+    if (!get_step(run, mid, &step, &step_start))
+      return false;
+
+    if (step_start <= run->elapsed)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return load_segment(run, lo);
+}
+
+static bool
+load_segment(temp_profile_run_t* run, uint32_t index)
+{
+  temp_profile_step_t step;
+  uint32_t step_start;
+
+  if (!get_step(run, index, &step, &step_start))
+    return false;
+
+  run->current_step = index;
+  run->seg_start = step_start;
+  run->seg_end = step_start + step.duration;
+
+  if ((step.type == STEP_HOLD) || (step.duration == 0)) {
+    run->seg_base = step.value.value;
+    run->seg_slope = 0;
+  }
+  else {
+    float last_temp;
+
+    if (index == 0) {
+      last_temp = run->info.start_value.value;
+    }
+    else {
+      temp_profile_step_t last_step;
+      uint32_t last_start;
+
+      if (!get_step(run, index - 1, &last_step, &last_start))
+        return false;
+      last_temp = last_step.value.value;
+    }
+
+    run->seg_base = last_temp;
+    run->seg_slope = (step.value.value - last_temp) / step.duration;
+  }
+
+  return true;
+}
+
+static void
+enter_hold_last(temp_profile_run_t* run)
+{
+  temp_profile_step_t step;
+  uint32_t step_start;
+
+  run->state = TPS_HOLD_LAST;
+  run->seg_slope = 0;
+
+  if ((run->info.num_steps > 0) &&
+      get_step(run, run->info.num_steps - 1, &step, &step_start)) {
+    run->current_step = run->info.num_steps - 1;
+    run->seg_base = step.value.value;
+  }
+  else {
+    run->seg_base = run->info.start_value.value;
+  }
+}
@@ -3,9 +3,10 @@
 #define TEMP_PROFILE_H
 
 #include "types.h"
-#include "wifi/wlan.h"
+#include "ch.h"
 #include "sensor.h"
 #include "temp_control.h"
+#include "temp_profile_store.h"
 
 
 typedef enum {
@@ -14,13 +15,44 @@ typedef enum {
   TPS_HOLD_LAST
 } temp_profile_run_state_t;
 
+#define TEMP_PROFILE_INLINE_STEPS (sizeof(((temp_profile_t*)0)->steps) / sizeof(temp_profile_step_t))
+
 typedef struct {
   temp_controller_id_t controller;
   uint32_t temp_profile_id;
   temp_profile_run_state_t state;
   uint32_t current_step;
-  systime_t current_step_start_time;
-  systime_t next_checkpoint;
+  systime_t last_checkpoint;
+  Mutex mtx;
+
+  /* Time into the profile, in seconds plus leftover ticks. It is advanced
+   * from the tick count on every update so it is unaffected by systime_t
+   * wrapping.
+   */
+  uint32_t elapsed;
+  systime_t elapsed_ticks;
+  systime_t last_tick;
+
+  /* Set if the profile is read from the profile store rather than the
+   * controller settings. Profiles from the settings are copied into steps
+   * with the start time of each step compiled into step_start, stored
+   * profiles keep them on flash.
+   */
+  bool stored;
+  temp_profile_info_t info;
+  temp_profile_step_t steps[TEMP_PROFILE_INLINE_STEPS];
+  uint32_t step_start[TEMP_PROFILE_INLINE_STEPS];
+
+  /* The current step as a line, sp = base + slope * (elapsed - seg_start) */
+  uint32_t seg_start;
+  uint32_t seg_end;
+  float seg_base;
+  float seg_slope;
+
+  /* Setpoint cached for the tick it was computed in */
+  bool sp_valid;
+  systime_t sp_time;
+  float sp;
 } temp_profile_run_t;
 
 typedef struct {
@@ -32,10 +64,13 @@ typedef struct {
 
 
 void
-temp_profile_start(temp_profile_run_t* run, temp_controller_id_t controller, uint32_t temp_profile_id, int start_point);
+temp_profile_init(temp_profile_run_t* run);
+
+void
+temp_profile_start(temp_profile_run_t* run, temp_controller_id_t controller, const temp_profile_t* profile);
 
 void
-temp_profile_resume(temp_profile_run_t* run, temp_controller_id_t controller);
+temp_profile_resume(temp_profile_run_t* run, temp_controller_id_t controller, const temp_profile_t* profile);
 
 void
 temp_profile_update(temp_profile_run_t* run, quantity_t sample);
@@ -0,0 +1,338 @@
+
+#include "ch.h"
+#include "temp_profile_store.h"
+#include "sxfs.h"
+#include "xflash.h"
+#include "common.h"
+#include "crc/crc32.h"
+
+#include <stddef.h>
+#include <string.h>
+
+
+/* Profiles too long to keep in app_cfg are stored in their own partition,
+ * one profile per flash sector. A slot holds a header at the start of the
+ * sector followed by an array of fixed size step records, so any step can be
+ * read with a single flash read at a computed offset. Each step record also
+ * holds the time its step starts, relative to the start of the profile.
+ *
+ * A profile is written by erasing a free (or the oldest) slot, appending
+ * the steps and finally writing the header. A slot without a valid header
+ * is free, so a profile which was only partly written is never used. When a
+ * profile is replaced the old copy is only erased after the new one has been
+ * committed.
+ */
+
+#define SLOT_SIZE         XFLASH_SECTOR_SIZE
+#define STEPS_OFFSET      256
+#define STORE_MAGIC       0x46525054 // "TPRF"
+#define APPEND_BATCH      8
+
+typedef struct {
+  uint32_t start;
+  temp_profile_step_t step;
+} stored_step_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t id;
+  uint32_t num_steps;
+  uint32_t duration;
+  quantity_t start_value;
+  uint32_t completion_action;
+  char name[100];
+  uint32_t crc;
+} stored_profile_hdr_t;
+
+typedef struct {
+  bool valid;
+  bool writing;
+  temp_profile_info_t info;
+} slot_t;
+
+
+static bool
+read_header(uint8_t slot, stored_profile_hdr_t* hdr);
+
+static uint32_t
+header_crc(const stored_profile_hdr_t* hdr);
+
+static void
+erase_slot(uint8_t slot);
+
+
+static slot_t slots[TEMP_PROFILE_STORE_SLOTS];
+static uint32_t next_seq;
+static Mutex store_mtx;
+
+
+void
+temp_profile_store_init()
+{
+  uint8_t i;
+
+  chMtxInit(&store_mtx);
+
+  chDbgAssert(sxfs_get_size(SP_TEMP_PROFILES) >= (TEMP_PROFILE_STORE_SLOTS * SLOT_SIZE),
+      "temp_profile_store_init(),#1", "partition too small");
+
+  for (i = 0; i < TEMP_PROFILE_STORE_SLOTS; ++i) {
+    stored_profile_hdr_t hdr;
+
+    if (!read_header(i, &hdr))
+      continue;
+
+    slots[i].valid = true;
+    slots[i].info.id = hdr.id;
+    slots[i].info.num_steps = hdr.num_steps;
+    slots[i].info.duration = hdr.duration;
+    slots[i].info.start_value = hdr.start_value;
+    slots[i].info.completion_action = hdr.completion_action;
+    slots[i].info.slot = i;
+    slots[i].info.seq = hdr.seq;
+
+    if (hdr.seq >= next_seq)
+      next_seq = hdr.seq + 1;
+  }
+}
+
+uint32_t
+temp_profile_store_max_steps()
+{
+  return (SLOT_SIZE - STEPS_OFFSET) / sizeof(stored_step_t);
+}
+
+static bool
+read_header(uint8_t slot, stored_profile_hdr_t* hdr)
+{
+  if (!sxfs_read(SP_TEMP_PROFILES, slot * SLOT_SIZE, (uint8_t*)hdr, sizeof(*hdr)))
+    return false;
+
+  return (hdr->magic == STORE_MAGIC) &&
+         (hdr->crc == header_crc(hdr)) &&
+         (hdr->num_steps <= temp_profile_store_max_steps());
+}
+
+static uint32_t
+header_crc(const stored_profile_hdr_t* hdr)
+{
+  return crc32_block(0, (void*)hdr, offsetof(stored_profile_hdr_t, crc));
+}
+
+/* Finds the most recently committed copy of a profile. */
+bool
+temp_profile_store_find(uint32_t id, temp_profile_info_t* info)
+{
+  uint8_t i;
+  bool found = false;
+
+  chMtxLock(&store_mtx);
+  for (i = 0; i < TEMP_PROFILE_STORE_SLOTS; ++i) {
+    if (slots[i].valid &&
+        (slots[i].info.id == id) &&
+        (!found || (slots[i].info.seq > info->seq))) {
+      *info = slots[i].info;
+      found = true;
+    }
+  }
+  chMtxUnlock();
+
+  return found;
+}
+
+/* Reads one step of a stored profile and the time it starts, in seconds
+ * from the start of the profile. Fails if the index is out of range or the
+ * profile has since been replaced or deleted.
+ */
+bool
+temp_profile_store_read_step(const temp_profile_info_t* info, uint32_t index, temp_profile_step_t* step, uint32_t* step_start)
+{
+  stored_step_t s;
+  bool ret;
+
+  if ((index >= info->num_steps) ||
+      (info->slot >= TEMP_PROFILE_STORE_SLOTS))
+    return false;
+
+  /* Held across the read so the slot cannot be erased underneath it */
+  chMtxLock(&store_mtx);
+  ret = slots[info->slot].valid &&
+        (slots[info->slot].info.seq == info->seq);
+  if (ret) {
+    uint32_t offset = (info->slot * SLOT_SIZE) + STEPS_OFFSET + (index * sizeof(stored_step_t));
+    ret = sxfs_read(SP_TEMP_PROFILES, offset, (uint8_t*)&s, sizeof(s));
+  }
+  chMtxUnlock();
+
+  if (!ret)
+    return false;
+
+  *step = s.step;
+  if (step_start != NULL)
+    *step_start = s.start;
+
+  return true;
+}
+
+bool
+temp_profile_store_begin(temp_profile_writer_t* w, uint32_t id)
+{
+  int i;
+  int slot = -1;
+
+  chMtxLock(&store_mtx);
+  for (i = 0; i < TEMP_PROFILE_STORE_SLOTS; ++i) {
+    if (slots[i].writing)
+      continue;
+
+    if (!slots[i].valid) {
+      slot = i;
+      break;
+    }
+
+    if ((slot < 0) || (slots[i].info.seq < slots[slot].info.seq))
+      slot = i;
+  }
+
+  if (slot >= 0) {
+    slots[slot].valid = false;
+    slots[slot].writing = true;
+  }
+  chMtxUnlock();
+
+  if (slot < 0)
+    return false;
+
+  if (!sxfs_erase(SP_TEMP_PROFILES, slot * SLOT_SIZE, SLOT_SIZE)) {
+    chMtxLock(&store_mtx);
+    slots[slot].writing = false;
+    chMtxUnlock();
+    return false;
+  }
+
+  w->slot = slot;
+  w->id = id;
+  w->num_steps = 0;
+  w->duration = 0;
+
+  return true;
+}
+
+bool
+temp_profile_store_append(temp_profile_writer_t* w, const temp_profile_step_t* steps, uint32_t num_steps)
+{
+  stored_step_t batch[APPEND_BATCH];
+
+  if ((w->num_steps + num_steps) > temp_profile_store_max_steps())
+    return false;
+
+  while (num_steps > 0) {
+    uint32_t i;
+    uint32_t n = MIN(num_steps, APPEND_BATCH);
+    uint32_t offset = (w->slot * SLOT_SIZE) + STEPS_OFFSET + (w->num_steps * sizeof(stored_step_t));
+
+    for (i = 0; i < n; ++i) {
+      batch[i].start = w->duration;
+      batch[i].step = steps[i];
+      w->duration += steps[i].duration;
+    }
+
+    if (!sxfs_write(SP_TEMP_PROFILES, offset, (uint8_t*)batch, n * sizeof(stored_step_t)))
+      return false;
+
+    w->num_steps += n;
+    steps += n;
+    num_steps -= n;
+  }
+
+  return true;
+}
+
+bool
+temp_profile_store_commit(temp_profile_writer_t* w, const char* name, quantity_t start_value, temp_profile_completion_action_t completion_action)
+{
+  uint8_t i;
+  stored_profile_hdr_t hdr;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = STORE_MAGIC;
+  hdr.id = w->id;
+  hdr.num_steps = w->num_steps;
+  hdr.duration = w->duration;
+  hdr.start_value = start_value;
+  hdr.completion_action = completion_action;
+  if (name != NULL)
+    strncpy(hdr.name, name, sizeof(hdr.name) - 1);
+
+  chMtxLock(&store_mtx);
+  hdr.seq = next_seq++;
+  chMtxUnlock();
+
+  hdr.crc = header_crc(&hdr);
+
+  bool ret = sxfs_write(SP_TEMP_PROFILES, w->slot * SLOT_SIZE, (uint8_t*)&hdr, sizeof(hdr));
+
+  chMtxLock(&store_mtx);
+  slots[w->slot].writing = false;
+  if (ret) {
+    slots[w->slot].valid = true;
+    slots[w->slot].info.id = hdr.id;
+    slots[w->slot].info.num_steps = hdr.num_steps;
+    slots[w->slot].info.duration = hdr.duration;
+    slots[w->slot].info.start_value = hdr.start_value;
+    slots[w->slot].info.completion_action = completion_action;
+    slots[w->slot].info.slot = w->slot;
+    slots[w->slot].info.seq = hdr.seq;
+  }
+  chMtxUnlock();
+
+  if (!ret)
+    return false;
+
+  /* Remove older copies of the same profile */
+  for (i = 0; i < TEMP_PROFILE_STORE_SLOTS; ++i) {
+    if ((i != w->slot) && slots[i].valid && (slots[i].info.id == w->id))
+      erase_slot(i);
+  }
+
+  return true;
+}
+
+/* Gives up on a profile being written, freeing its slot. */
+void
+temp_profile_store_abort(temp_profile_writer_t* w)
+{
+  erase_slot(w->slot);
+}
+
+bool
+temp_profile_store_delete(uint32_t id)
+{
+  uint8_t i;
+  bool found = false;
+
+  for (i = 0; i < TEMP_PROFILE_STORE_SLOTS; ++i) {
+    if (slots[i].valid && (slots[i].info.id == id)) {
+      erase_slot(i);
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+static void
+erase_slot(uint8_t slot)
+{
+  chMtxLock(&store_mtx);
+  slots[slot].valid = false;
+  slots[slot].writing = true;
+  chMtxUnlock();
+
+  sxfs_erase(SP_TEMP_PROFILES, slot * SLOT_SIZE, SLOT_SIZE);
+
+  chMtxLock(&store_mtx);
+  slots[slot].writing = false;
+  chMtxUnlock();
+}
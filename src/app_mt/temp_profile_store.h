@@ -0,0 +1,61 @@
+#ifndef TEMP_PROFILE_STORE_H
+#define TEMP_PROFILE_STORE_H
+
+#include "temp_control.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define TEMP_PROFILE_STORE_SLOTS 4
+
+/* Summary of a profile, whether stored on flash or held in app_cfg */
+typedef struct {
+  uint32_t id;
+  uint32_t num_steps;
+  uint32_t duration;      // total of all step durations, in seconds
+  quantity_t start_value;
+  temp_profile_completion_action_t completion_action;
+  uint8_t slot;
+  uint32_t seq;
+} temp_profile_info_t;
+
+/* State of a profile being written to the store. Steps are appended in
+ * order and the profile only becomes visible once it is committed.
+ */
+typedef struct {
+  uint8_t slot;
+  uint32_t id;
+  uint32_t num_steps;
+  uint32_t duration;
+} temp_profile_writer_t;
+
+
+void
+temp_profile_store_init(void);
+
+uint32_t
+temp_profile_store_max_steps(void);
+
+bool
+temp_profile_store_find(uint32_t id, temp_profile_info_t* info);
+
+bool
+temp_profile_store_read_step(const temp_profile_info_t* info, uint32_t index, temp_profile_step_t* step, uint32_t* step_start);
+
+bool
+temp_profile_store_begin(temp_profile_writer_t* w, uint32_t id);
+
+bool
+temp_profile_store_append(temp_profile_writer_t* w, const temp_profile_step_t* steps, uint32_t num_steps);
+
+bool
+temp_profile_store_commit(temp_profile_writer_t* w, const char* name, quantity_t start_value, temp_profile_completion_action_t completion_action);
+
+void
+temp_profile_store_abort(temp_profile_writer_t* w);
+
+bool
+temp_profile_store_delete(uint32_t id);
+
+#endif
@@ -9,6 +9,7 @@
 #include "app_cfg.h"
 
 #include <stdbool.h>
+#include <stdlib.h>
 
 
 #define XP 4
@@ -22,6 +23,23 @@
 #define TOUCH_THRESHOLD 950
 #define DEBOUNCE_TIME MS2ST(20)
 
+// While nobody is touching the screen the panel is only checked for contact
+// once per idle scan period, which is a single digital read. Once contact is
+// seen, full samples are taken once per active period until the touch has
+// been released.
+#define IDLE_SCAN_PERIOD MS2ST(20)
+#define ACTIVE_SAMPLE_PERIOD MS2ST(5)
+#define IDLE_HOLDOFF MS2ST(100)
+
+// Position filter parameters. Positions are first run through a median
+// filter to reject outliers, then an IIR filter whose weight depends on how
+// fast the touch is moving. Slow movement is heavily smoothed to suppress
+// jitter while fast movement is tracked closely.
+#define MEDIAN_LEN 3
+#define FILTER_FRAC_BITS 4
+#define JITTER_THRESHOLD 6
+#define FAST_THRESHOLD 24
+
 // Number of samples to collect before starting to dispatch them to the system.
 // This is mainly used because the last few samples collected on a touch up
 // event are bad. So we use the latest sample to determine if the touch has
@@ -32,6 +50,11 @@
 // ADC sample resolution
 #define Q 1024
 
+// Number of touch updates which can be waiting for delivery. Consecutive
+// move samples share a single entry, so this only fills up if transitions
+// arrive faster than the listeners can handle them.
+#define TOUCH_QUEUE_LEN 4
+
 typedef struct {
   uint16_t drive_pos_pad;
   uint16_t drive_neg_pad;
@@ -40,11 +63,32 @@ typedef struct {
   const ADCConversionGroup* conv_grp;
 } axis_cfg_t;
 
+typedef struct {
+  touch_msg_t msg;
+  bool transition;
+} touch_queue_entry_t;
+
+typedef struct {
+  int32_t history[MEDIAN_LEN];
+  uint8_t count;
+  uint8_t idx;
+  int32_t value;
+} axis_filter_t;
+
 
 static uint16_t read_axis(const axis_cfg_t* axis_cfg);
 static adcsample_t adc_avg(adcsample_t* samples, uint16_t num_samples);
 static msg_t touch_thread(void* arg);
 static void touch_dispatch(void);
+static void touch_post(const touch_msg_t* msg);
+static void touch_publisher_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
+static void touch_publish_pending(void);
+static void touch_detect_setup(void);
+static bool touch_detected(void);
+static bool touch_sample(void);
+static void filter_reset(axis_filter_t* f);
+static int32_t filter_axis(axis_filter_t* f, int32_t sample);
+static int32_t median3(int32_t a, int32_t b, int32_t c);
 
 
 static const ADCConversionGroup xp_conv_grp = {
@@ -134,11 +178,26 @@ static uint8_t sample_idx;
 static point_t touch_coord_raw[SAMPLE_DELAY];
 static point_t touch_coord_calib[SAMPLE_DELAY];
 static matrix_t calib_matrix;
+static matrix_fixed_t calib_fixed;
+static axis_filter_t x_filter;
+static axis_filter_t y_filter;
+
+static msg_listener_t* touch_publisher;
+static touch_queue_entry_t touch_queue[TOUCH_QUEUE_LEN];
+static uint8_t queue_head;
+static uint8_t queue_len;
+static bool posted_down;
+static bool publishing;
+static touch_stats_t touch_stats;
 
 void
 touch_init()
 {
   memcpy(&calib_matrix, app_cfg_get_touch_calib(), sizeof(matrix_t));
+  setFixedPointMatrix(&calib_matrix, &calib_fixed);
+
+  touch_publisher = msg_listener_create("touch_pub", 512, touch_publisher_dispatch, NULL);
+
   chThdCreateFromHeap(NULL, 1024, NORMALPRIO, touch_thread, NULL);
 }
 
@@ -150,15 +209,134 @@ touch_dispatch()
       .calib = touch_coord_calib[sample_idx],
       .touch_down = touch_down
   };
-  msg_send(MSG_TOUCH_INPUT, &msg);
+  touch_post(&msg);
+}
+
+/* Queues a touch update for the publisher thread without blocking the
+ * sampling thread. A move sample replaces a move sample which is still
+ * waiting to be delivered, so listeners which fall behind only ever see the
+ * latest position. Down and up transitions are never coalesced.
+ */
+static void
+touch_post(const touch_msg_t* msg)
+{
+  bool transition = (msg->touch_down != posted_down);
+  bool wake = false;
+
+  posted_down = msg->touch_down;
+
+  chSysLock();
+  touch_stats.samples++;
+
+  touch_queue_entry_t* newest = (queue_len > 0) ?
+      &touch_queue[(queue_head + queue_len - 1) % TOUCH_QUEUE_LEN] : NULL;
+
+  if (!transition && (newest != NULL) && !newest->transition) {
+    newest->msg = *msg;
+    touch_stats.coalesced++;
+  }
+  else if (!transition && (queue_len >= TOUCH_QUEUE_LEN)) {
+    touch_stats.dropped++;
+  }
+  else {
+    if (queue_len >= TOUCH_QUEUE_LEN) {
+      /* Make room for the transition by dropping the oldest update */
+      queue_head = (queue_head + 1) % TOUCH_QUEUE_LEN;
+      queue_len--;
+      touch_stats.dropped++;
+    }
+
+    touch_queue_entry_t* entry = &touch_queue[(queue_head + queue_len) % TOUCH_QUEUE_LEN];
+    entry->msg = *msg;
+    entry->transition = transition;
+    wake = (queue_len++ == 0);
+  }
+  chSysUnlock();
+
+  if (wake)
+    msg_listener_wake(touch_publisher);
+}
+
+static void
+touch_publisher_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  (void)msg_data;
+  (void)listener_data;
+  (void)sub_data;
+
+  if (id == MSG_IDLE)
+    touch_publish_pending();
+}
+
+/* Delivers queued touch updates until the queue is empty. msg_send() runs
+ * this thread's message loop while it waits, so a wakeup can arrive while
+ * already publishing. That nested call returns immediately and the outer
+ * loop picks up whatever was queued.
+ */
+static void
+touch_publish_pending()
+{
+  touch_msg_t msg;
+
+  if (publishing)
+    return;
+
+  publishing = true;
+  while (1) {
+    chSysLock();
+    if (queue_len == 0) {
+      chSysUnlock();
+      break;
+    }
+    msg = touch_queue[queue_head].msg;
+    queue_head = (queue_head + 1) % TOUCH_QUEUE_LEN;
+    queue_len--;
+    chSysUnlock();
+
+    msg_send(MSG_TOUCH_INPUT, &msg);
+
+    chSysLock();
+    touch_stats.delivered++;
+    chSysUnlock();
+  }
+  publishing = false;
 }
 
 void
+touch_get_stats(touch_stats_t* stats)
+{
+  chSysLock();
+  *stats = touch_stats;
+  chSysUnlock();
+}
+
+/* Fits a new calibration to the sampled points and starts using it. The
+ * residuals are measured with the fixed point mapping which is applied to
+ * every sample, so they reflect what the user will actually see.
+ */
+bool
 touch_set_calib(
     const point_t* ref_pts,
-    const point_t* sampled_pts)
+    const point_t* sampled_pts,
+    int num_pts,
+    calib_residuals_t* residuals)
 {
-  setCalibrationMatrix(ref_pts, sampled_pts, &calib_matrix);
+  matrix_t matrix;
+  matrix_fixed_t fixed;
+
+  if ((fitCalibrationMatrix(ref_pts, sampled_pts, num_pts, &matrix) != OK) ||
+      (setFixedPointMatrix(&matrix, &fixed) != OK))
+    return false;
+
+  if (residuals != NULL)
+    getCalibrationResiduals(ref_pts, sampled_pts, num_pts, &fixed, residuals);
+
+  chSysLock();
+  calib_matrix = matrix;
+  calib_fixed = fixed;
+  chSysUnlock();
+
+  return true;
 }
 
 void
@@ -217,55 +395,168 @@ touch_thread(void* arg)
   chRegSetThreadName("touch");
 
   while (1) {
-    uint32_t z1 = read_axis(&z1_axis);
-    uint32_t z2 = read_axis(&z2_axis);
-    uint32_t x = read_axis(&x_axis);
-    uint32_t y = read_axis(&y_axis);
-
-    /* Calculate pressure of touch based on equations from TI Application Note SBAA155A */
-    /* Prevent divide by zero */
-    z1 = MAX(1, z1);
-    /* Modified form of equation 8 with rx = 1 */
-    uint32_t rz = (((x * z2) / z1) - x) / Q;
-    /* Modified form of equation 9 with a = 1024, b = 1 */
-    uint32_t p = Q - rz;
-
-    if (p > TOUCH_THRESHOLD) {
+    /* Idle scan: sleep until the panel shows contact */
+    touch_detect_setup();
+    do {
+      chThdSleep(IDLE_SCAN_PERIOD);
+    } while (!touch_detected());
+
+    filter_reset(&x_filter);
+    filter_reset(&y_filter);
+
+    /* Active: sample at a fixed rate until the touch is released and no
+     * contact has been seen for a while.
+     */
+    systime_t last_contact = chTimeNow();
+    while (touch_down ||
+           chTimeIsWithin(last_contact, last_contact + IDLE_HOLDOFF)) {
+      systime_t start = chTimeNow();
+
+      if (touch_sample())
+        last_contact = start;
+
+      systime_t elapsed = chTimeNow() - start;
+      if (elapsed < ACTIVE_SAMPLE_PERIOD)
+        chThdSleep(ACTIVE_SAMPLE_PERIOD - elapsed);
+    }
+  }
+
+  return 0;
+}
+
+/* Sets up the pads to check for contact between the panel layers without
+ * using the ADC. The X layer is pulled up and the Y layer is driven low, so
+ * the X layer reads low only while something is pressing the layers
+ * together. The pads stay in this state for the whole idle scan so the
+ * pull-up has plenty of time to settle.
+ */
+static void
+touch_detect_setup()
+{
+  palSetPadMode(GPIOA, XP, PAL_MODE_INPUT_PULLUP);
+  palSetPadMode(GPIOA, XN, PAL_MODE_INPUT_ANALOG);
+  palSetPadMode(GPIOA, YP, PAL_MODE_INPUT_ANALOG);
+  palSetPadMode(GPIOA, YN, PAL_MODE_OUTPUT_PUSHPULL);
+  palClearPad(GPIOA, YN);
+}
+
+static bool
+touch_detected()
+{
+  return !palReadPad(GPIOA, XP);
+}
+
+/* Takes one full sample of the panel and updates the touch state. Returns
+ * true if the pressure was over the touch threshold.
+ */
+static bool
+touch_sample()
+{
+  uint32_t z1 = read_axis(&z1_axis);
+  uint32_t z2 = read_axis(&z2_axis);
+  uint32_t x = read_axis(&x_axis);
+  uint32_t y = read_axis(&y_axis);
+
+  /* Calculate pressure of touch based on equations from TI Application Note SBAA155A */
+  /* Prevent divide by zero */
+  z1 = MAX(1, z1);
+  /* Modified form of equation 8 with rx = 1 */
+  uint32_t rz = (((x * z2) / z1) - x) / Q;
+  /* Modified form of equation 9 with a = 1024, b = 1 */
+  uint32_t p = Q - rz;
+
+  if (p > TOUCH_THRESHOLD) {
+    x = filter_axis(&x_filter, x);
+    y = filter_axis(&y_filter, y);
+
 #if (DISP_ORIENT == LANDSCAPE)
-      /* swap the coordinates since the screen is rotated */
-      touch_coord_raw[sample_idx].x = y;
-      touch_coord_raw[sample_idx].y = x;
+    /* swap the coordinates since the screen is rotated */
+    touch_coord_raw[sample_idx].x = y;
+    touch_coord_raw[sample_idx].y = x;
 #else
-      touch_coord_raw[sample_idx].x = x;
-      touch_coord_raw[sample_idx].y = y;
+    touch_coord_raw[sample_idx].x = x;
+    touch_coord_raw[sample_idx].y = y;
 #endif
 
-      /* calibrate the raw touch coordinate */
-      getDisplayPoint(
-          &touch_coord_calib[sample_idx],
-          &touch_coord_raw[sample_idx],
-          &calib_matrix);
+    /* calibrate the raw touch coordinate */
+    getDisplayPointFixed(
+        &touch_coord_calib[sample_idx],
+        &touch_coord_raw[sample_idx],
+        &calib_fixed);
 
-      touch_down = 1;
-      last_touch_time = chTimeNow();
-      sample_idx = (sample_idx + 1) % SAMPLE_DELAY;
+    touch_down = 1;
+    last_touch_time = chTimeNow();
+    sample_idx = (sample_idx + 1) % SAMPLE_DELAY;
 
-      if (down_samples < SAMPLE_DELAY)
-        down_samples++;
-      else
-        touch_dispatch();
-    }
-    else {
-      if (touch_down &&
-          !chTimeIsWithin(last_touch_time, last_touch_time + DEBOUNCE_TIME)) {
-        touch_down = 0;
-        down_samples = 0;
-        touch_dispatch();
-      }
-    }
+    if (down_samples < SAMPLE_DELAY)
+      down_samples++;
+    else
+      touch_dispatch();
+
+    return true;
   }
 
-  return 0;
+  if (touch_down &&
+      !chTimeIsWithin(last_touch_time, last_touch_time + DEBOUNCE_TIME)) {
+    touch_down = 0;
+    down_samples = 0;
+    touch_dispatch();
+  }
+
+  return false;
+}
+
+static void
+filter_reset(axis_filter_t* f)
+{
+  f->count = 0;
+  f->idx = 0;
+}
+
+static int32_t
+filter_axis(axis_filter_t* f, int32_t sample)
+{
+  int32_t m;
+
+  f->history[f->idx] = sample;
+  f->idx = (f->idx + 1) % MEDIAN_LEN;
+
+  if (f->count < MEDIAN_LEN)
+    f->count++;
+
+  if (f->count < MEDIAN_LEN)
+    m = sample;
+  else
+    m = median3(f->history[0], f->history[1], f->history[2]);
+
+  if (f->count == 1) {
+    f->value = m << FILTER_FRAC_BITS;
+  }
+  else {
+    int32_t delta = (m << FILTER_FRAC_BITS) - f->value;
+    int32_t speed = abs(delta) >> FILTER_FRAC_BITS;
+
+    if (speed <= JITTER_THRESHOLD)
+      f->value += delta / 8;
+    else if (speed <= FAST_THRESHOLD)
+      f->value += delta / 2;
+    else
+      f->value += delta;
+  }
+
+  return (f->value + (1 << (FILTER_FRAC_BITS - 1))) >> FILTER_FRAC_BITS;
+}
+
+static int32_t
+median3(int32_t a, int32_t b, int32_t c)
+{
+  if (a > b) {
+    int32_t t = a;
+    a = b;
+    b = t;
+  }
+
+  return (c < a) ? a : ((c > b) ? b : c);
 }
 
 adcsample_t
@@ -3,6 +3,7 @@
 #define TOUCH_H
 
 #include "types.h"
+#include "touch_calib.h"
 
 
 typedef struct {
@@ -11,14 +12,27 @@ typedef struct {
   point_t calib;
 } touch_msg_t;
 
+/* Samples are the touch updates produced by the sampling thread. Coalesced
+ * samples were replaced by a newer position before being delivered, and
+ * dropped samples were discarded because the delivery queue was full.
+ */
+typedef struct {
+  uint32_t samples;
+  uint32_t delivered;
+  uint32_t coalesced;
+  uint32_t dropped;
+} touch_stats_t;
+
 
 void
 touch_init(void);
 
-void
+bool
 touch_set_calib(
     const point_t* ref_pts,
-    const point_t* sampled_pts);
+    const point_t* sampled_pts,
+    int num_pts,
+    calib_residuals_t* residuals);
 
 void
 touch_save_calib(void);
@@ -26,4 +40,7 @@ touch_save_calib(void);
 void
 touch_calib_reset(void);
 
+void
+touch_get_stats(touch_stats_t* stats);
+
 #endif
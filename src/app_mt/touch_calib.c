@@ -23,6 +23,11 @@
  *   File Name:  calibrate.c
  *
  *
+ *   Modified: added fitCalibrationMatrix(),
+ *    setFixedPointMatrix(), getDisplayPointFixed() and
+ *    getCalibrationResiduals().
+ *
+ *
  *   This file contains functions that implement calculations
  *    necessary to obtain calibration factors for a touch screen
  *    that suffers from multiple distortion effects: namely,
@@ -85,6 +90,15 @@
  *                                    raw screen points into values
  *                                    scaled to the desired display
  *                                    resolution.
+ *          fitCalibrationMatrix() - calculates the factors which best
+ *                                    fit any number of test points,
+ *                                    in the least squares sense.
+ *           setFixedPointMatrix() - converts a set of factors into
+ *                                    Q16 fixed point values.
+ *          getDisplayPointFixed() - same as getDisplayPoint(), using
+ *                                    the fixed point factors.
+ *       getCalibrationResiduals() - measures how far the test points
+ *                                    land from where they should.
  *
  *
  */
@@ -92,6 +106,12 @@
 
 #include "touch_calib.h"
 
+#include <math.h>
+
+
+#define FIXED_SHIFT     16
+#define FIXED_ONE       (1 << FIXED_SHIFT)
+
 /**********************************************************************
  *
  *     Function: setCalibrationMatrix()
@@ -320,3 +340,204 @@ getDisplayPoint(
   return retValue;
 }
 
+
+
+/**********************************************************************
+ *
+ *     Function: fitCalibrationMatrix()
+ *
+ *  Description: Calculates the calibration factors which minimize the
+ *                sum of the squared distances between the display
+ *                points and the mapped screen points. With three
+ *                points this gives the same result as
+ *                setCalibrationMatrix(). With more, errors in any
+ *                one sample are spread across the whole panel
+ *                instead of being absorbed by the other two points.
+ *
+ *               Each row of the matrix is solved separately. The
+ *                screen points are centered on their mean first,
+ *                which decouples the offset from the scale terms and
+ *                leaves a 2x2 system to solve.
+ *
+ *               The factors are returned with a Divider of 65536,
+ *                so the matrix is also usable by getDisplayPoint().
+ *
+ *       Return: OK - the calibration matrix was correctly
+ *                     calculated and its value is in the
+ *                     output argument.
+ *               NOT_OK - fewer than three points were given or all
+ *                         of the screen points lie on a line.
+ *
+ */
+int
+fitCalibrationMatrix(
+    const point_t* displayPtr,
+    const point_t* screenPtr,
+    int numPoints,
+    matrix_t* matrixPtr)
+{
+  int i;
+  float xs_mean = 0, ys_mean = 0, xd_mean = 0, yd_mean = 0;
+  float sxx = 0, sxy = 0, syy = 0;
+  float sx_xd = 0, sy_xd = 0, sx_yd = 0, sy_yd = 0;
+
+  if (numPoints < 3)
+    return NOT_OK;
+
+  for (i = 0; i < numPoints; ++i) {
+    xs_mean += screenPtr[i].x;
+    ys_mean += screenPtr[i].y;
+    xd_mean += displayPtr[i].x;
+    yd_mean += displayPtr[i].y;
+  }
+  xs_mean /= numPoints;
+  ys_mean /= numPoints;
+  xd_mean /= numPoints;
+  yd_mean /= numPoints;
+
+  for (i = 0; i < numPoints; ++i) {
+    float xs = screenPtr[i].x - xs_mean;
+    float ys = screenPtr[i].y - ys_mean;
+    float xd = displayPtr[i].x - xd_mean;
+    float yd = displayPtr[i].y - yd_mean;
+
+    sxx += xs * xs;
+    sxy += xs * ys;
+    syy += ys * ys;
+    sx_xd += xs * xd;
+    sy_xd += ys * xd;
+    sx_yd += xs * yd;
+    sy_yd += ys * yd;
+  }
+
+  float det = (sxx * syy) - (sxy * sxy);
+  if (fabsf(det) <= 1e-3f * (sxx * syy))
+    return NOT_OK;
+
+  float a = ((sx_xd * syy) - (sy_xd * sxy)) / det;
+  float b = ((sy_xd * sxx) - (sx_xd * sxy)) / det;
+  float c = xd_mean - (a * xs_mean) - (b * ys_mean);
+  float d = ((sx_yd * syy) - (sy_yd * sxy)) / det;
+  float e = ((sy_yd * sxx) - (sx_yd * sxy)) / det;
+  float f = yd_mean - (d * xs_mean) - (e * ys_mean);
+
+  matrixPtr->An = lroundf(a * FIXED_ONE);
+  matrixPtr->Bn = lroundf(b * FIXED_ONE);
+  matrixPtr->Cn = lroundf(c * FIXED_ONE);
+  matrixPtr->Dn = lroundf(d * FIXED_ONE);
+  matrixPtr->En = lroundf(e * FIXED_ONE);
+  matrixPtr->Fn = lroundf(f * FIXED_ONE);
+  matrixPtr->Divider = FIXED_ONE;
+
+  return OK;
+}
+
+
+
+/**********************************************************************
+ *
+ *     Function: setFixedPointMatrix()
+ *
+ *  Description: Divides each factor by the Divider once, so that the
+ *                mapping for every sample is three multiplies and a
+ *                shift per axis. Works with matrices from either
+ *                setCalibrationMatrix() or fitCalibrationMatrix().
+ *
+ *       Return: OK - the fixed point factors are in the output
+ *                     argument.
+ *               NOT_OK - the matrix has a Divider of 0.
+ *
+ */
+int
+setFixedPointMatrix(
+    const matrix_t* matrixPtr,
+    matrix_fixed_t* fixedPtr)
+{
+  int64_t divider = matrixPtr->Divider;
+
+  if (divider == 0)
+    return NOT_OK;
+
+  fixedPtr->a = ((int64_t)matrixPtr->An << FIXED_SHIFT) / divider;
+  fixedPtr->b = ((int64_t)matrixPtr->Bn << FIXED_SHIFT) / divider;
+  fixedPtr->c = ((int64_t)matrixPtr->Cn << FIXED_SHIFT) / divider;
+  fixedPtr->d = ((int64_t)matrixPtr->Dn << FIXED_SHIFT) / divider;
+  fixedPtr->e = ((int64_t)matrixPtr->En << FIXED_SHIFT) / divider;
+  fixedPtr->f = ((int64_t)matrixPtr->Fn << FIXED_SHIFT) / divider;
+
+  return OK;
+}
+
+
+
+/**********************************************************************
+ *
+ *     Function: getDisplayPointFixed()
+ *
+ *  Description: Same as getDisplayPoint(), using the factors from
+ *                setFixedPointMatrix(). The result is rounded to the
+ *                nearest pixel.
+ *
+ *               With a 10 bit digitizer and scale factors below 16
+ *                the products fit comfortably in 32 bits.
+ *
+ */
+void
+getDisplayPointFixed(
+    point_t* displayPtr,
+    const point_t* screenPtr,
+    const matrix_fixed_t* fixedPtr)
+{
+  displayPtr->x =
+      ((fixedPtr->a * screenPtr->x) +
+       (fixedPtr->b * screenPtr->y) +
+       fixedPtr->c + (FIXED_ONE / 2)) >> FIXED_SHIFT;
+
+  displayPtr->y =
+      ((fixedPtr->d * screenPtr->x) +
+       (fixedPtr->e * screenPtr->y) +
+       fixedPtr->f + (FIXED_ONE / 2)) >> FIXED_SHIFT;
+}
+
+
+
+/**********************************************************************
+ *
+ *     Function: getCalibrationResiduals()
+ *
+ *  Description: Maps each screen point through the fixed point factors
+ *                and reports the RMS and maximum distance, in pixels,
+ *                from the display point it should have landed on.
+ *
+ */
+void
+getCalibrationResiduals(
+    const point_t* displayPtr,
+    const point_t* screenPtr,
+    int numPoints,
+    const matrix_fixed_t* fixedPtr,
+    calib_residuals_t* residualsPtr)
+{
+  int i;
+  float sum_sq = 0;
+
+  residualsPtr->rms = 0;
+  residualsPtr->max = 0;
+
+  if (numPoints <= 0)
+    return;
+
+  for (i = 0; i < numPoints; ++i) {
+    point_t p;
+    getDisplayPointFixed(&p, &screenPtr[i], fixedPtr);
+
+    float dx = p.x - displayPtr[i].x;
+    float dy = p.y - displayPtr[i].y;
+    float dist_sq = (dx * dx) + (dy * dy);
+
+    sum_sq += dist_sq;
+    residualsPtr->max = fmaxf(residualsPtr->max, sqrtf(dist_sq));
+  }
+
+  residualsPtr->rms = sqrtf(sum_sq / numPoints);
+}
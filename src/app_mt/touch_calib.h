@@ -42,7 +42,7 @@
   #define     NOT_OK   0
 #endif
 
-#define NUM_CALIB_POINTS     3
+#define NUM_CALIB_POINTS     5
 
 
 /* This arrangement of values facilitates
@@ -58,6 +58,26 @@ typedef struct {
   int32_t Divider;
 } matrix_t;
 
+/* The same factors as a matrix_t, pre-divided and stored as Q16 fixed point
+ * values so that mapping a sample needs no division.
+ */
+typedef struct {
+  int32_t a;
+  int32_t b;
+  int32_t c;
+  int32_t d;
+  int32_t e;
+  int32_t f;
+} matrix_fixed_t;
+
+/* Distance in pixels between each reference point and where its sampled
+ * point maps to.
+ */
+typedef struct {
+  float rms;
+  float max;
+} calib_residuals_t;
+
 
 int
 setCalibrationMatrix(
@@ -73,4 +93,34 @@ getDisplayPoint(
     const matrix_t* matrix);
 
 
+int
+fitCalibrationMatrix(
+    const point_t* display,
+    const point_t* screen,
+    int numPoints,
+    matrix_t* matrix);
+
+
+int
+setFixedPointMatrix(
+    const matrix_t* matrix,
+    matrix_fixed_t* fixed);
+
+
+void
+getDisplayPointFixed(
+    point_t* display,
+    const point_t* screen,
+    const matrix_fixed_t* fixed);
+
+
+void
+getCalibrationResiduals(
+    const point_t* display,
+    const point_t* screen,
+    int numPoints,
+    const matrix_fixed_t* fixed,
+    calib_residuals_t* residuals);
+
+
 #endif
@@ -7,9 +7,11 @@
 #include <stdio.h>
 
 #include <pb_encode.h>
-#include <pb_decode.h>
 
 #include "web_api.h"
+#include "web_api_msg.h"
+#include "web_api_backlog.h"
+#include "web_api_report.h"
 #include "bbmt.pb.h"
 #include "message.h"
 #include "net.h"
@@ -18,7 +20,6 @@
 #include "temp_control.h"
 #include "app_cfg.h"
 #include "ota_update.h"
-#include "sxfs.h"
 #include "pid.h"
 
 #ifndef WEB_API_HOST
@@ -33,34 +34,34 @@
 #define WEB_API_PORT 31337
 #endif
 
-#define SENSOR_REPORT_INTERVAL S2ST(30)
 #define SETTINGS_UPDATE_DELAY  S2ST(1 * 60)
-#define MIN_SEND_INTERVAL      S2ST(10)
-#define RECV_TIMEOUT           S2ST(20)
 #define MAX_SEND_ERRS          25
 
+/* Reports keep the connection alive while they are going out. When none
+ * has gone out for KEEPALIVE_INTERVAL, as during a stable hold, a keepalive
+ * goes in its place. The server answers it, so it is not heard from for at
+ * most a keepalive interval and a round trip.
+ */
+#define KEEPALIVE_INTERVAL     S2ST(60)
+#define RECV_TIMEOUT           (KEEPALIVE_INTERVAL + S2ST(20))
+
+/* Connection upkeep and periodic reports run at least this often. Incoming
+ * data and settings changes are handled as soon as they arrive.
+ */
+#define SERVICE_INTERVAL_MS    500
+
+/* The CC3000 does not report DNS TTLs, so resolved server addresses are
+ * reused for a fixed time. The last address is kept with the settings, and
+ * is taken as fresh when the device starts.
+ */
+#define DNS_CACHE_TTL          S2ST(60 * 60)
 
-typedef enum {
-  RECV_LEN,
-  RECV_DATA
-} parser_state_t;
 
 typedef struct {
-  bool new_sample;
   bool new_settings;
-  quantity_t last_sample;
+  web_api_report_t report;
 } api_controller_status_t;
 
-typedef struct {
-  parser_state_t state;
-
-  uint8_t* recv_buf;
-  uint32_t bytes_remaining;
-
-  uint32_t data_len;
-  uint8_t data_buf[ApiMessage_size];
-} msg_parser_t;
-
 typedef struct {
   int socket;
   api_status_t status;
@@ -71,13 +72,15 @@ typedef struct {
 
   bool new_device_settings;
   api_controller_status_t controller_status[NUM_SENSORS];
-  systime_t last_sensor_report_time;
   systime_t last_send_time;
   systime_t last_recv_time;
+  systime_t last_report_time;
+  systime_t last_service_time;
+  uint32_t server_addr;
+  systime_t server_addr_time;
   uint32_t send_errors;
-  msg_parser_t parser;
+  web_api_msg_reader_t parser;
   msg_listener_t* msg_listener;
-  uint32_t backlog_pos;
 } web_api_t;
 
 
@@ -88,7 +91,10 @@ static void
 web_api_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data);
 
 static void
-web_api_idle(web_api_t* api);
+web_api_service(web_api_t* api);
+
+static void
+dispatch_socket_ready(web_api_t* api, int32_t* sd);
 
 static bool
 was_authenticated(void);
@@ -105,14 +111,17 @@ send_data_to_server(web_api_t* api);
 static void
 send_backlog(web_api_t* api);
 
+static bool
+send_backlog_msg(uint8_t* msg, uint32_t msg_len, void* arg);
+
 static void
-socket_message_rx(web_api_t* api, const uint8_t* data, uint32_t data_len);
+send_api_msg(web_api_t* api, ApiMessage* msg, backlog_kind_t backlog_kind);
 
 static void
-send_api_msg(web_api_t* api, ApiMessage* msg, bool can_backlog);
+prepare_api_msg(ApiMessage* msg);
 
 static void
-dispatch_api_msg(web_api_t* api, ApiMessage* msg);
+dispatch_api_msg(ApiMessage* msg, void* arg);
 
 static void
 dispatch_net_status(web_api_t* api, net_status_t* ns);
@@ -120,6 +129,9 @@ dispatch_net_status(web_api_t* api, net_status_t* ns);
 static void
 dispatch_sensor_sample(web_api_t* api, sensor_msg_t* sample);
 
+static void
+dispatch_sensor_timeout(web_api_t* api, sensor_timeout_msg_t* timeout);
+
 static void
 dispatch_device_settings_from_device(
     web_api_t* api,
@@ -155,11 +167,11 @@ dispatch_firmware_rqst(web_api_t* api, firmware_update_t* firmware_data);
 static void
 send_sensor_report(web_api_t* api);
 
-static void
-dispatch_device_settings_from_server(DeviceSettings* settings);
+static backlog_kind_t
+get_report_kind(web_api_t* api, temp_controller_id_t controller);
 
-static void
-dispatch_controller_settings_from_server(ControllerSettings* settings);
+static uint8_t
+get_output_states(temp_controller_id_t controller);
 
 static void
 dispatch_server_time(web_api_t* api, ServerTime* server_time);
@@ -167,11 +179,11 @@ dispatch_server_time(web_api_t* api, ServerTime* server_time);
 static bool
 socket_connect(web_api_t* api, const char* hostname, uint16_t port);
 
-static void
-socket_poll(web_api_t* api);
+static bool
+resolve_server(web_api_t* api, const char* hostname, uint32_t* hostaddr);
 
 static bool
-send_or_store(web_api_t* api, void* buf, uint32_t buf_len, bool can_backlog);
+socket_poll(web_api_t* api);
 
 static bool
 socket_send(web_api_t* api, void* buf, uint32_t buf_len);
@@ -186,25 +198,22 @@ web_api_init()
 {
   api = calloc(1, sizeof(web_api_t));
   api->status.state = AS_AWAITING_NET_CONNECTION;
+  api->server_addr = app_cfg_get_server_addr();
+  api->server_addr_time = chTimeNow();
 
-  api->backlog_pos = 0;
-  while (1) {
-    uint32_t msg_len = 0xFFFFFFFF;
-    bool ret = sxfs_read(SP_WEB_API_BACKLOG, api->backlog_pos, (uint8_t*)&msg_len, sizeof(msg_len));
-    if (!ret || msg_len == 0xFFFFFFFF)
-      break;
-
-    api->backlog_pos += msg_len;
-  }
+  web_api_backlog_init();
 
   api->msg_listener = msg_listener_create("web_api", 2048, web_api_dispatch, api);
-  msg_listener_set_idle_timeout(api->msg_listener, 100);
+  msg_listener_set_idle_timeout(api->msg_listener, SERVICE_INTERVAL_MS);
   msg_listener_enable_watchdog(api->msg_listener, 3 * 60 * 1000);
+  msg_listener_set_priority(api->msg_listener, MSG_PRIO_LOW);
 
   msg_subscribe(api->msg_listener, MSG_NET_STATUS, NULL);
   msg_subscribe(api->msg_listener, MSG_API_FW_UPDATE_CHECK, NULL);
   msg_subscribe(api->msg_listener, MSG_API_FW_DNLD_RQST, NULL);
-  msg_subscribe(api->msg_listener, MSG_SENSOR_SAMPLE, NULL);
+  msg_subscribe_lossy(api->msg_listener, MSG_SENSOR_SAMPLE, NULL, sizeof(sensor_msg_t));
+  msg_subscribe_coalesced(api->msg_listener, MSG_SENSOR_TIMEOUT, NULL, sizeof(sensor_timeout_msg_t));
+  msg_subscribe_coalesced(api->msg_listener, MSG_WLAN_SOCKET_READY, NULL, sizeof(int32_t));
   msg_subscribe(api->msg_listener, MSG_CONTROLLER_SETTINGS, NULL);
 }
 
@@ -237,8 +246,12 @@ web_api_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_dat
       dispatch_sensor_sample(api, msg_data);
       break;
 
-    case MSG_IDLE:
-      web_api_idle(api);
+    case MSG_SENSOR_TIMEOUT:
+      dispatch_sensor_timeout(api, msg_data);
+      break;
+
+    case MSG_WLAN_SOCKET_READY:
+      dispatch_socket_ready(api, msg_data);
       break;
 
     default:
@@ -262,12 +275,19 @@ web_api_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_dat
 
       case MSG_CONTROLLER_SETTINGS:
         dispatch_controller_settings_from_device(api, msg_data);
+        send_data_to_server(api);
         break;
 
       default:
         break;
     }
   }
+
+  /* A steady stream of messages keeps MSG_IDLE from being dispatched, so
+   * service the connection on elapsed time rather than on idle.
+   */
+  if ((chTimeNow() - api->last_service_time) >= MS2ST(SERVICE_INTERVAL_MS))
+    web_api_service(api);
 }
 
 static void
@@ -284,8 +304,10 @@ set_state(web_api_t* api, api_state_t state)
 }
 
 static void
-web_api_idle(web_api_t* api)
+web_api_service(web_api_t* api)
 {
+  api->last_service_time = chTimeNow();
+
   if (api->status.state == AS_CONNECTING)
     connect_to_server(api);
   else if (api->status.state > AS_CONNECTING) {
@@ -309,11 +331,11 @@ connect_to_server(web_api_t* api)
   printf("Connecting to: %s:%d\r\n", WEB_API_HOST_STR, WEB_API_PORT);
   if (socket_connect(api, WEB_API_HOST_STR, WEB_API_PORT)) {
     api->last_recv_time = chTimeNow();
+    api->last_report_time = chTimeNow();
     api->send_errors = 0;
 
-    api->parser.state = RECV_LEN;
-    api->parser.bytes_remaining = 4;
-    api->parser.recv_buf = (uint8_t*)&api->parser.data_len;
+    web_api_msg_reader_init(&api->parser, api->socket);
+    web_api_msg_reader_set_prepare(&api->parser, prepare_api_msg);
 
     if (was_authenticated()) {
       set_state(api, AS_REQUESTING_AUTH);
@@ -338,10 +360,11 @@ monitor_connection(web_api_t* api)
     return;
   }
 
-  /* If we haven't sent anything to the server in a while, send a keepalive */
-  if ((chTimeNow() - api->last_send_time) > MIN_SEND_INTERVAL) {
+  /* If we haven't sent a report in a while, send a keepalive instead */
+  if ((chTimeNow() - api->last_report_time) > KEEPALIVE_INTERVAL) {
     uint32_t keepalive = 0;
-    socket_send(api, &keepalive, 4);
+    if (socket_send(api, &keepalive, 4))
+      api->last_report_time = chTimeNow();
   }
 }
 
@@ -349,14 +372,11 @@ static void
 send_data_to_server(web_api_t* api)
 {
   if ((api->status.state == AS_CONNECTED) &&
-      (api->backlog_pos > 0))
+      !web_api_backlog_empty())
     send_backlog(api);
 
   if (was_authenticated()) {
-    if ((chTimeNow() - api->last_sensor_report_time) > SENSOR_REPORT_INTERVAL) {
-      send_sensor_report(api);
-      api->last_sensor_report_time = chTimeNow();
-    }
+    send_sensor_report(api);
 
     if (api->new_device_settings) {
       send_device_settings(api);
@@ -367,61 +387,40 @@ send_data_to_server(web_api_t* api)
   }
 }
 
+/* If sending fails part way, the rest is sent on a later pass */
 static void
 send_backlog(web_api_t* api)
 {
-  uint32_t backlog_read_pos = 0;
-  uint32_t data_left_to_send = api->backlog_pos;
-  uint8_t* send_buf = malloc(1024);
-
-  printf("Sending %d bytes from backlog\r\n", (int)data_left_to_send);
+  printf("Sending backlog\r\n");
 
-  while (data_left_to_send > 0) {
-    uint32_t send_len = MIN(1024, data_left_to_send);
-    if (!sxfs_read(SP_WEB_API_BACKLOG, backlog_read_pos, send_buf, send_len)) {
-      printf("Backlog read failed!\r\n");
-      break;
-    }
-
-    if (!socket_send(api, send_buf, send_len)) {
-      printf("Backlog send failed!\r\n");
-      break;
-    }
+  if (!web_api_backlog_send(send_backlog_msg, api))
+    printf("Backlog send failed!\r\n");
+}
 
-    backlog_read_pos += send_len;
-    data_left_to_send -= send_len;
-  }
-  free(send_buf);
+static bool
+send_backlog_msg(uint8_t* msg, uint32_t msg_len, void* arg)
+{
+  web_api_t* api = arg;
+  uint32_t buf_len = htonl(msg_len);
 
-  sxfs_erase_all(SP_WEB_API_BACKLOG);
-  api->backlog_pos = 0;
+  return socket_send(api, &buf_len, sizeof(buf_len)) &&
+         socket_send(api, msg, msg_len);
 }
 
 static bool
 socket_connect(web_api_t* api, const char* hostname, uint16_t port)
 {
   uint32_t hostaddr;
-  int ret = gethostbyname(hostname, strlen(hostname), &hostaddr);
-  if (ret < 0) {
-    printf("gethostbyname failed %d\r\n", ret);
+  if (!resolve_server(api, hostname, &hostaddr))
     return false;
-  }
 
+  int ret;
   api->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
   if (api->socket < 0) {
     printf("Connect failed %d\r\n", api->socket);
     return false;
   }
 
-  int optval = SOCK_ON;
-  ret = setsockopt(api->socket, SOL_SOCKET, SOCKOPT_RECV_NONBLOCK, (char *)&optval, sizeof(optval));
-  if (ret < 0) {
-    closesocket(api->socket);
-    api->socket = -1;
-    printf("setsockopt failed %d\r\n", ret);
-    return false;
-  }
-
   sockaddr_in addr = {
     .sin_family = AF_INET,
     .sin_port = htons(port),
@@ -432,109 +431,114 @@ socket_connect(web_api_t* api, const char* hostname, uint16_t port)
     closesocket(api->socket);
     api->socket = -1;
     printf("connect failed %d\r\n", ret);
+
+    /* The server may have moved, so look it up again next time */
+    api->server_addr = 0;
     return false;
   }
 
   return true;
 }
 
-static void
-socket_poll(web_api_t* api)
+/* Looks up the server address, reusing the last answer while it is fresh.
+ * If the lookup fails, a stale answer is still better than none.
+ */
+static bool
+resolve_server(web_api_t* api, const char* hostname, uint32_t* hostaddr)
 {
-  int ret = recv(api->socket, api->parser.recv_buf, api->parser.bytes_remaining, 0);
-  if (ret < 0) {
-    if (errno != EAGAIN && errno != EWOULDBLOCK) {
-      printf("recv failed %d %d\r\n", ret, errno);
-      printf("socket disconnected\r\n");
-      closesocket(api->socket);
-      api->socket = -1;
-      set_state(api, AS_CONNECTING);
-    }
+  if ((api->server_addr != 0) &&
+      (chTimeNow() - api->server_addr_time) < DNS_CACHE_TTL) {
+    *hostaddr = api->server_addr;
+    return true;
   }
-  else {
-    api->parser.bytes_remaining -= ret;
-    api->parser.recv_buf += ret;
-    if (ret > 0)
-      api->last_recv_time = chTimeNow();
-
-    if (api->parser.bytes_remaining == 0) {
-      switch (api->parser.state) {
-        case RECV_LEN:
-          api->parser.data_len = ntohl(api->parser.data_len);
-          if (api->parser.data_len > 0) {
-            api->parser.state = RECV_DATA;
-            api->parser.bytes_remaining = api->parser.data_len;
-            api->parser.recv_buf = api->parser.data_buf;
-          }
-          else {
-            api->parser.state = RECV_LEN;
-            api->parser.bytes_remaining = 4;
-            api->parser.recv_buf = (uint8_t*)&api->parser.data_len;
-          }
-          break;
-
-        case RECV_DATA:
-          api->parser.bytes_remaining = 4;
-          api->parser.recv_buf = (uint8_t*)&api->parser.data_len;
-          api->parser.state = RECV_LEN;
-
-          socket_message_rx(api, api->parser.data_buf, api->parser.data_len);
-          break;
-      }
-    }
+
+  int ret = gethostbyname(hostname, strlen(hostname), hostaddr);
+  if (ret < 0 || *hostaddr == 0) {
+    printf("gethostbyname failed %d\r\n", ret);
+    if (api->server_addr == 0)
+      return false;
+
+    *hostaddr = api->server_addr;
+    return true;
   }
+
+  api->server_addr = *hostaddr;
+  api->server_addr_time = chTimeNow();
+  app_cfg_set_server_addr(*hostaddr);
+
+  return true;
 }
 
 static void
-populate_output_status(ControllerReport* pr, sensor_id_t controller, output_id_t output)
+dispatch_socket_ready(web_api_t* api, int32_t* sd)
 {
-  const controller_settings_t* controller_settings = app_cfg_get_controller_settings(controller);
-
-  if (controller_settings->output_settings[output].enabled) {
-    output_ctrl_t control_mode = app_cfg_get_control_mode();
-    temp_control_status_t output_status = temp_control_get_status(controller, output);
+  if ((api->status.state <= AS_CONNECTING) ||
+      (*sd != api->socket))
+    return;
 
-    pr->output_status[pr->output_status_count].output_index = output;
-    pr->output_status[pr->output_status_count].has_output_index = true;
+  /* Read until the data select reported has been consumed */
+  while (socket_poll(api)) {
+  }
+}
 
-    pr->output_status[pr->output_status_count].status = output_status.output_enabled;
-    pr->output_status[pr->output_status_count].has_status = true;
+/* Reads what is available from the server. Returns true if data was read
+ * and the socket is still open.
+ */
+static bool
+socket_poll(web_api_t* api)
+{
+  web_api_msg_read_t ret = web_api_msg_read(&api->parser, dispatch_api_msg, api);
+  if (ret == WMR_DISCONNECTED) {
+    printf("socket disconnected\r\n");
+    closesocket(api->socket);
+    api->socket = -1;
+    set_state(api, AS_CONNECTING);
+    return false;
+  }
 
-    if (control_mode == PID) {
-      pr->output_status[pr->output_status_count].kp = output_status.kp;
-      pr->output_status[pr->output_status_count].has_kp = true;
+  if (ret == WMR_NO_DATA)
+    return false;
 
-      pr->output_status[pr->output_status_count].ki = output_status.ki;
-      pr->output_status[pr->output_status_count].has_ki = true;
+  api->last_recv_time = chTimeNow();
 
-      pr->output_status[pr->output_status_count].kd = output_status.kd;
-      pr->output_status[pr->output_status_count].has_kd = true;
-    }
-    pr->output_status_count++;
-  }
+  return (api->socket >= 0);
 }
 
 static void
 send_sensor_report(web_api_t* api)
 {
   int i;
+
+  backlog_kind_t backlog_kind = BACKLOG_NONE;
+
+  for (i = 0; i < NUM_SENSORS; ++i) {
+    if (get_report_kind(api, i) != BACKLOG_NONE)
+      break;
+  }
+  if (i == NUM_SENSORS)
+    return;
+
   ApiMessage* msg = calloc(1, sizeof(ApiMessage));
   msg->type = ApiMessage_Type_DEVICE_REPORT;
   msg->has_deviceReport = true;
   msg->deviceReport.controller_reports_count = 0;
 
   for (i = 0; i < NUM_SENSORS; ++i) {
-    if (api->controller_status[i].new_sample) {
-      api->controller_status[i].new_sample = false;
+    api_controller_status_t* s = &api->controller_status[i];
+
+    backlog_kind_t kind = get_report_kind(api, i);
+    if (kind != BACKLOG_NONE) {
+      backlog_kind = MAX(backlog_kind, kind);
+
+      web_api_report_sent(&s->report,
+          temp_control_get_current_setpoint(i),
+          get_output_states(i),
+          chTimeNow());
+
       ControllerReport* pr = &msg->deviceReport.controller_reports[msg->deviceReport.controller_reports_count];
       msg->deviceReport.controller_reports_count++;
 
-      pr->controller_index = i;
-      pr->sensor_reading = api->controller_status[i].last_sample.value;
-      pr->setpoint = temp_control_get_current_setpoint(i);
-
-      populate_output_status(pr, i, OUTPUT_1);
-      populate_output_status(pr, i, OUTPUT_2);
+      web_api_msg_controller_report(pr, i, s->report.last_sample.value);
 
       if (api->server_time_available) {
         pr->has_timestamp = true;
@@ -545,12 +549,43 @@ send_sensor_report(web_api_t* api)
 
   if (msg->deviceReport.controller_reports_count > 0) {
     printf("sending sensor report %d\r\n", msg->deviceReport.controller_reports_count);
-    send_api_msg(api, msg, api->server_time_available);
+    /* Reports can only be replayed later if they carry the time */
+    if (!api->server_time_available)
+      backlog_kind = BACKLOG_NONE;
+
+    send_api_msg(api, msg, backlog_kind);
+    api->last_report_time = chTimeNow();
   }
 
   free(msg);
 }
 
+/* Reports are written to the backlog under the same policy that decides
+ * when they are sent, see web_api_report.c.
+ */
+static backlog_kind_t
+get_report_kind(web_api_t* api, temp_controller_id_t controller)
+{
+  return web_api_report_kind(&api->controller_status[controller].report,
+      temp_control_get_current_setpoint(controller),
+      get_output_states(controller),
+      chTimeNow());
+}
+
+static uint8_t
+get_output_states(temp_controller_id_t controller)
+{
+  uint8_t states = 0;
+  int i;
+
+  for (i = 0; i < NUM_OUTPUTS; ++i) {
+    if (temp_control_get_status(controller, i).output_enabled)
+      states |= (1 << i);
+  }
+
+  return states;
+}
+
 static time_t
 get_server_time(web_api_t* api)
 {
@@ -565,7 +600,7 @@ request_activation_token(web_api_t* api)
   msg->has_activationTokenRequest = true;
   strcpy(msg->activationTokenRequest.device_id, device_id);
 
-  send_api_msg(api, msg, false);
+  send_api_msg(api, msg, BACKLOG_NONE);
 
   free(msg);
 }
@@ -582,7 +617,7 @@ request_auth(web_api_t* api)
   msg->authRequest.has_firmware_version = true;
   strncpy(msg->authRequest.firmware_version, VERSION_STR, sizeof(msg->authRequest.firmware_version));
 
-  send_api_msg(api, msg, false);
+  send_api_msg(api, msg, BACKLOG_NONE);
 
   free(msg);
 }
@@ -607,8 +642,26 @@ dispatch_sensor_sample(web_api_t* api, sensor_msg_t* sample)
     return;
 
   api_controller_status_t* s = &api->controller_status[sample->sensor];
-  s->new_sample = true;
-  s->last_sample = sample->sample;
+  web_api_report_sample(&s->report, sample->sample);
+
+  if (was_authenticated())
+    send_sensor_report(api);
+}
+
+/* The last reading before the sensor dropped out goes out at once, and so
+ * does the first one after it comes back.
+ */
+static void
+dispatch_sensor_timeout(web_api_t* api, sensor_timeout_msg_t* timeout)
+{
+  if (timeout->sensor >= NUM_SENSORS)
+    return;
+
+  api_controller_status_t* s = &api->controller_status[timeout->sensor];
+
+  web_api_report_timeout(&s->report);
+  if (was_authenticated())
+    send_sensor_report(api);
 }
 
 static void
@@ -641,25 +694,10 @@ send_device_settings(
   msg->type = ApiMessage_Type_DEVICE_SETTINGS;
   msg->has_deviceSettings = true;
 
-  msg->deviceSettings.name[0] = 0;
-
-  output_ctrl_t control_mode = app_cfg_get_control_mode();
-  switch (control_mode) {
-    case PID:
-      msg->deviceSettings.control_mode = DeviceSettings_ControlMode_PID;
-      break;
-
-    case ON_OFF:
-      msg->deviceSettings.control_mode = DeviceSettings_ControlMode_ON_OFF;
-      break;
-
-    default:
-      printf("Invalid output control mode: %d\r\n", control_mode);
-      break;
-  }
+  web_api_msg_device_settings(&msg->deviceSettings);
 
   printf("Sending device settings\r\n");
-  send_api_msg(api, msg, true);
+  send_api_msg(api, msg, BACKLOG_SETTINGS);
 
   free(msg);
 }
@@ -676,50 +714,10 @@ send_controller_settings(
   for (i = 0; i < NUM_CONTROLLERS; ++i) {
     if (api->controller_status[i].new_settings) {
       api->controller_status[i].new_settings = false;
-      const controller_settings_t* ssl = app_cfg_get_controller_settings(i);
-      ControllerSettings* ss = &msg->controllerSettings;
-
-      ss->has_session_action = true;
-      ss->session_action = ssl->session_action;
-
-      ss->sensor_index = i;
-      switch (ssl->setpoint_type) {
-        case SP_STATIC:
-          ss->setpoint_type = ControllerSettings_SetpointType_STATIC;
-          ss->has_static_setpoint = true;
-          ss->static_setpoint = ssl->static_setpoint.value;
-          break;
-
-        case SP_TEMP_PROFILE:
-          ss->setpoint_type = ControllerSettings_SetpointType_TEMP_PROFILE;
-          ss->has_temp_profile_id = true;
-          ss->temp_profile_id = ssl->temp_profile.id;
-          ss->has_temp_profile_completion_action = true;
-          ss->temp_profile_completion_action = ControllerSettings_CompletionAction_HOLD_LAST;
-          ss->has_temp_profile_start_point = true;
-          ss->temp_profile_start_point = 0;
-          break;
-
-        default:
-          printf("Invalid setpoint type: %d\r\n", ssl->setpoint_type);
-          break;
-      }
-
-      int j;
-      for (j = 0; j < NUM_OUTPUTS; ++j) {
-        const output_settings_t* osl = &ssl->output_settings[j];
-        if (osl->enabled) {
-          OutputSettings* os = &msg->controllerSettings.output_settings[msg->controllerSettings.output_settings_count];
-          msg->controllerSettings.output_settings_count++;
-
-          os->index = j;
-          os->function = osl->function;
-          os->cycle_delay = osl->cycle_delay.value;
-        }
-      }
+      web_api_msg_controller_settings(&msg->controllerSettings, i);
 
       printf("Sending controller settings\r\n");
-      send_api_msg(api, msg, true);
+      send_api_msg(api, msg, BACKLOG_SETTINGS);
     }
   }
 
@@ -735,7 +733,7 @@ check_for_update(web_api_t* api)
   msg->has_firmwareUpdateCheckRequest = true;
   sprintf(msg->firmwareUpdateCheckRequest.current_version, "%d.%d.%d", MAJOR_VERSION, MINOR_VERSION, PATCH_VERSION);
 
-  send_api_msg(api, msg, false);
+  send_api_msg(api, msg, BACKLOG_NONE);
 
   free(msg);
 }
@@ -752,54 +750,50 @@ dispatch_firmware_rqst(web_api_t* api, firmware_update_t* firmware_data)
       firmware_data->version,
       sizeof(msg->firmwareDownloadRequest.requested_version));
 
-  send_api_msg(api, msg, false);
+  send_api_msg(api, msg, BACKLOG_NONE);
 
   free(msg);
 }
 
 static void
-send_api_msg(web_api_t* api, ApiMessage* msg, bool can_backlog)
+send_api_msg(web_api_t* api, ApiMessage* msg, backlog_kind_t backlog_kind)
 {
-  uint8_t* buffer = malloc(ApiMessage_size);
+  uint8_t* buffer = malloc(WEB_API_MSG_MAX_SIZE);
 
-  pb_ostream_t stream = pb_ostream_from_buffer(buffer, ApiMessage_size);
+  pb_ostream_t stream = pb_ostream_from_buffer(buffer, WEB_API_MSG_MAX_SIZE);
   bool encoded_ok = pb_encode(&stream, ApiMessage_fields, msg);
 
   if (encoded_ok) {
-    uint32_t buf_len = htonl(stream.bytes_written);
-    if (send_or_store(api, &buf_len, sizeof(buf_len), can_backlog)) {
-      if (!send_or_store(api, buffer, stream.bytes_written, can_backlog)) {
-        printf("buffer send failed!\r\n");
+    if (api->status.state > AS_CONNECTING) {
+      uint32_t buf_len = htonl(stream.bytes_written);
+      if (socket_send(api, &buf_len, sizeof(buf_len))) {
+        if (!socket_send(api, buffer, stream.bytes_written)) {
+          printf("buffer send failed!\r\n");
+        }
       }
+      else {
+        printf("message length send failed!\r\n");
+      }
+    }
+    else if (backlog_kind == BACKLOG_NONE) {
+      printf("Unable to save message to backlog!\r\n");
     }
     else {
-      printf("message length send failed!\r\n");
+      uint8_t key = 0;
+      if (msg->type == ApiMessage_Type_DEVICE_SETTINGS)
+        key = BACKLOG_KEY_DEVICE;
+      else if (msg->type == ApiMessage_Type_CONTROLLER_SETTINGS)
+        key = msg->controllerSettings.sensor_index;
+
+      printf("Not connected. Saving to backlog\r\n");
+      if (!web_api_backlog_store(backlog_kind, key, buffer, stream.bytes_written))
+        printf("Backlog write failed!\r\n");
     }
   }
 
   free(buffer);
 }
 
-static bool
-send_or_store(web_api_t* api, void* buf, uint32_t buf_len, bool can_backlog)
-{
-  if (api->status.state > AS_CONNECTING) {
-    return socket_send(api, buf, buf_len);
-  }
-  else {
-    if (!can_backlog) {
-      printf("Unable to save message to backlog!\r\n");
-      return false;
-    }
-
-    printf("Not connected. Saving to backlog %d\r\n", (int)api->backlog_pos);
-    bool ret = sxfs_write(SP_WEB_API_BACKLOG, api->backlog_pos, buf, buf_len);
-    if (ret)
-      api->backlog_pos += buf_len;
-    return ret;
-  }
-}
-
 static bool
 socket_send(web_api_t* api, void* buf, uint32_t buf_len)
 {
@@ -825,25 +819,19 @@ socket_send(web_api_t* api, void* buf, uint32_t buf_len)
   return true;
 }
 
+/* Firmware chunks are written to flash as they are decoded */
 static void
-socket_message_rx(web_api_t* api, const uint8_t* data, uint32_t data_len)
+prepare_api_msg(ApiMessage* msg)
 {
-  ApiMessage* msg = malloc(sizeof(ApiMessage));
-
-  pb_istream_t stream = pb_istream_from_buffer((const uint8_t*)data, data_len);
-  bool status = pb_decode(&stream, ApiMessage_fields, msg);
-
-  if (status)
-    dispatch_api_msg(api, msg);
-  else
-    printf("Fucked up message received!\r\n");
-
-  free(msg);
+  msg->firmwareDownloadResponse.data.funcs.decode = ota_update_write_chunk;
+  msg->firmwareDownloadResponse.data.arg = &msg->firmwareDownloadResponse;
 }
 
 static void
-dispatch_api_msg(web_api_t* api, ApiMessage* msg)
+dispatch_api_msg(ApiMessage* msg, void* arg)
 {
+  web_api_t* api = arg;
+
   switch (msg->type) {
   case ApiMessage_Type_ACTIVATION_TOKEN_RESPONSE:
     printf("got activation token: %s\r\n", msg->activationTokenResponse.activation_token);
@@ -881,11 +869,11 @@ dispatch_api_msg(web_api_t* api, ApiMessage* msg)
     break;
 
   case ApiMessage_Type_DEVICE_SETTINGS:
-    dispatch_device_settings_from_server(&msg->deviceSettings);
+    web_api_msg_apply_device_settings(&msg->deviceSettings);
     break;
 
   case ApiMessage_Type_CONTROLLER_SETTINGS:
-    dispatch_controller_settings_from_server(&msg->controllerSettings);
+    web_api_msg_apply_controller_settings(&msg->controllerSettings, SS_SERVER);
     break;
 
   case ApiMessage_Type_SERVER_TIME:
@@ -898,123 +886,6 @@ dispatch_api_msg(web_api_t* api, ApiMessage* msg)
   }
 }
 
-static void
-dispatch_device_settings_from_server(DeviceSettings* settings)
-{
-  printf("got device settings from server\r\n");
-  printf("  control mode %d\r\n", settings->control_mode);
-  printf("  hysteresis %f\r\n", settings->hysteresis);
-
-  app_cfg_set_control_mode(settings->control_mode);
-
-  quantity_t hysteresis;
-  hysteresis.value = settings->hysteresis;
-  hysteresis.unit = UNIT_TEMP_DEG_F;
-  app_cfg_set_hysteresis(hysteresis);
-}
-
-static void
-dispatch_controller_settings_from_server(ControllerSettings* settings)
-{
-  int i;
-
-  printf("got controller settings from server\r\n");
-
-  controller_settings_t* csl = calloc(1, sizeof(controller_settings_t));
-  memcpy(csl, app_cfg_get_controller_settings(settings->sensor_index), sizeof(controller_settings_t));
-
-  csl->controller = settings->sensor_index;
-
-  printf("  got %d temp profiles\r\n", settings->temp_profiles_count);
-  printf("  got %d output settings\r\n", settings->output_settings_count);
-  csl->output_settings[OUTPUT_1].enabled = false;
-  csl->output_settings[OUTPUT_2].enabled = false;
-  for (i = 0; i < (int)settings->output_settings_count; ++i) {
-    OutputSettings* osm = &settings->output_settings[i];
-    output_settings_t* os = &csl->output_settings[osm->index];
-
-    os->cycle_delay.value = osm->cycle_delay;
-    os->cycle_delay.unit = UNIT_TIME_MIN;
-    os->function = osm->function;
-    os->enabled = true;
-
-    printf("    output %d\r\n", i);
-    printf("      delay %f\r\n", os->cycle_delay.value);
-    printf("      function %d\r\n", os->function);
-  }
-
-  printf("  got sensor settings\r\n");
-
-  switch (settings->setpoint_type) {
-    case ControllerSettings_SetpointType_STATIC:
-      if (!settings->has_static_setpoint)
-        printf("Sensor settings specified static setpoint, but none provided!\r\n");
-      else {
-        csl->setpoint_type = SP_STATIC;
-        csl->static_setpoint.value = settings->static_setpoint;
-        csl->static_setpoint.unit = UNIT_TEMP_DEG_F;
-      }
-      break;
-
-    case ControllerSettings_SetpointType_TEMP_PROFILE:
-      if (!settings->has_temp_profile_id)
-        printf("Sensor settings specified temp profile, but no provided!\r\n");
-      else {
-        csl->setpoint_type = SP_TEMP_PROFILE;
-
-        TempProfile* tpm = &settings->temp_profiles[0];
-        csl->temp_profile.id = tpm->id;
-        strncpy(csl->temp_profile.name, tpm->name, sizeof(csl->temp_profile.name));
-        csl->temp_profile.num_steps = tpm->steps_count;
-        csl->temp_profile.start_value.value = tpm->start_value;
-        csl->temp_profile.start_value.unit = UNIT_TEMP_DEG_F;
-        csl->temp_profile.start_point = settings->temp_profile_start_point;
-        csl->temp_profile.completion_action = settings->temp_profile_completion_action;
-
-        printf("    profile '%s' (%d)\r\n", csl->temp_profile.name, (int)csl->temp_profile.id);
-        printf("      steps %d\r\n", (int)csl->temp_profile.num_steps);
-        printf("      start temp %f\r\n", csl->temp_profile.start_value.value);
-        printf("      start point %d\r\n", csl->temp_profile.start_point);
-        printf("      completion action %d\r\n", csl->temp_profile.completion_action);
-
-        for (i = 0; i < (int)tpm->steps_count; ++i) {
-          temp_profile_step_t* step = &csl->temp_profile.steps[i];
-          TempProfileStep* stepm = &tpm->steps[i];
-
-          step->duration = stepm->duration;
-          step->value.value = stepm->value;
-          step->value.unit = UNIT_TEMP_DEG_F;
-          switch(stepm->type) {
-            case TempProfileStep_TempProfileStepType_HOLD:
-              step->type = STEP_HOLD;
-              break;
-
-            case TempProfileStep_TempProfileStepType_RAMP:
-              step->type = STEP_RAMP;
-              break;
-
-            default:
-              printf("Invalid step type: %d\r\n", stepm->type);
-              break;
-          }
-        }
-      }
-      break;
-
-    default:
-      printf("Invalid setpoint type: %d\r\n", settings->setpoint_type);
-      break;
-  }
-
-  printf("    sensor %d\r\n", csl->controller);
-  printf("      setpoint_type %d\r\n", csl->setpoint_type);
-  printf("      static %f\r\n", csl->static_setpoint.value);
-  printf("      temp profile %d\r\n", (int)csl->temp_profile.id);
-
-  app_cfg_set_controller_settings(csl->controller, SS_SERVER, csl);
-  free(csl);
-}
-
 static void
 dispatch_server_time(web_api_t* api, ServerTime* server_time)
 {
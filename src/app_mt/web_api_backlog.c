@@ -0,0 +1,595 @@
+
+#include "ch.h"
+#include "web_api_backlog.h"
+#include "web_api_msg.h"
+#include "bbmt.pb.h"
+#include "sxfs.h"
+#include "xflash.h"
+#include "common.h"
+#include "crc/crc32.h"
+
+#include <pb_encode.h>
+#include <pb_decode.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+
+/* Messages which could not be sent to the server are kept in a ring of flash
+ * sectors. Each sector starts with a header holding a sequence number,
+ * followed by records which each hold one encoded ApiMessage.
+ *
+ * One sector is always kept erased. When the newest sector fills and the
+ * spare is opened, the oldest sector is folded into it and erased:
+ *  - periodic reports are replaced by the lowest, highest and average
+ *    reading of each controller in each hour, so a long outage keeps its
+ *    shape
+ *  - settings are replaced by the current settings, once each, so replaying
+ *    the backlog still leaves the server with the latest settings
+ *  - events and earlier summaries are copied as they are
+ * At most CARRY_BUDGET bytes of events and summaries are copied. Beyond that
+ * the oldest summaries are dropped first, then the oldest events. So the
+ * backlog never refuses new data, and what it loses is the oldest and least
+ * important. Records which have already been sent are not copied, so a send
+ * which failed part way resumes without repeating them.
+ *
+ * A record is damaged if a power cut interrupts its write. Reading a sector
+ * stops at the first damaged record, and after a reboot the writer moves on
+ * to the next sector if the last one was left damaged.
+ */
+#define BACKLOG_MAGIC           0x314C4B42 // "BKL1"
+#define SECTOR_SIZE             XFLASH_SECTOR_SIZE
+#define MAX_SECTORS             16
+#define RECORDS_START           sizeof(sector_header_t)
+#define MAX_RECORD_LEN          512
+#define CARRY_BUDGET            (SECTOR_SIZE / 2)
+#define SUMMARY_PERIOD          (60 * 60)
+#define MAX_SUMMARY_REPORTS     (sizeof(((DeviceReport*)0)->controller_reports) / sizeof(ControllerReport))
+
+
+typedef enum {
+  RECORD_OK,
+  RECORD_END,
+  RECORD_BAD
+} record_result_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t crc;
+} sector_header_t;
+
+typedef struct {
+  uint16_t len;
+  uint8_t kind;
+  uint8_t key;
+  uint32_t crc;
+} record_header_t;
+
+typedef struct {
+  bool valid;
+  bool erased;
+  uint32_t seq;
+} sector_info_t;
+
+typedef struct {
+  bool active;
+  uint32_t period;
+  ControllerReport min;
+  ControllerReport max;
+  float reading_total;
+  uint64_t timestamp_total;
+  uint32_t num_readings;
+} summary_t;
+
+typedef struct {
+  ApiMessage msg;
+  DeviceReport report;
+  uint8_t body[MAX_RECORD_LEN];
+  uint8_t buf[MAX_RECORD_LEN];
+  summary_t summaries[NUM_CONTROLLERS];
+  bool device_settings;
+  bool controller_settings[NUM_CONTROLLERS];
+} reclaim_t;
+
+
+static void read_sector_info(uint8_t sector, sector_info_t* info);
+static uint32_t find_write_offset(uint8_t sector);
+static bool open_sector(void);
+static bool write_record(backlog_kind_t kind, uint8_t key, uint8_t* msg, uint32_t msg_len);
+static record_result_t read_record(uint8_t sector, uint32_t offset, record_header_t* hdr, uint8_t* body);
+static void reclaim_sector(uint8_t sector);
+static void summarize_report(reclaim_t* r, uint8_t* body, uint32_t len);
+static void write_summary(reclaim_t* r, summary_t* s);
+static void write_settings(reclaim_t* r, uint8_t key);
+static bool write_msg(reclaim_t* r, backlog_kind_t kind, uint8_t key);
+static bool erase_sector(uint8_t sector);
+static uint32_t header_crc(sector_header_t* hdr);
+static uint32_t record_crc(record_header_t* hdr, uint8_t* body);
+static uint32_t sector_offset(uint8_t sector);
+
+
+static sector_info_t sectors[MAX_SECTORS];
+static uint8_t num_sectors;
+
+static bool have_sector;
+static uint8_t write_sector;
+static uint32_t write_offset;
+
+static bool send_pos_valid;
+static uint8_t send_sector;
+static uint32_t send_offset;
+
+
+void
+web_api_backlog_init()
+{
+  int i;
+  int newest = -1;
+
+  num_sectors = MIN(sxfs_get_size(SP_WEB_API_BACKLOG) / SECTOR_SIZE, MAX_SECTORS);
+
+  for (i = 0; i < num_sectors; ++i) {
+    read_sector_info(i, &sectors[i]);
+    if (sectors[i].valid &&
+        ((newest < 0) || (sectors[i].seq > sectors[newest].seq)))
+      newest = i;
+  }
+
+  if (newest >= 0) {
+    have_sector = true;
+    write_sector = newest;
+    write_offset = find_write_offset(newest);
+  }
+}
+
+static void
+read_sector_info(uint8_t sector, sector_info_t* info)
+{
+  sector_header_t hdr;
+
+  sxfs_read(SP_WEB_API_BACKLOG, sector_offset(sector), (uint8_t*)&hdr, sizeof(hdr));
+
+  info->valid = (hdr.magic == BACKLOG_MAGIC) && (hdr.crc == header_crc(&hdr));
+  info->erased = false;
+  info->seq = hdr.seq;
+}
+
+/* Finds the end of the records in a sector. Appending continues there only
+ * if every record before it is intact.
+ */
+static uint32_t
+find_write_offset(uint8_t sector)
+{
+  record_header_t hdr;
+  record_result_t result;
+  uint32_t offset = RECORDS_START;
+  uint8_t* body = malloc(MAX_RECORD_LEN);
+
+  while ((result = read_record(sector, offset, &hdr, body)) == RECORD_OK)
+    offset += sizeof(hdr) + hdr.len;
+
+  free(body);
+
+  return (result == RECORD_END) ? offset : SECTOR_SIZE;
+}
+
+bool
+web_api_backlog_store(backlog_kind_t kind, uint8_t key, uint8_t* msg, uint32_t msg_len)
+{
+  if ((num_sectors < 2) ||
+      (kind == BACKLOG_NONE) ||
+      (msg_len > MAX_RECORD_LEN))
+    return false;
+
+  if (!have_sector ||
+      (write_offset + sizeof(record_header_t) + msg_len > SECTOR_SIZE)) {
+    if (!open_sector())
+      return false;
+  }
+
+  return write_record(kind, key, msg, msg_len);
+}
+
+/* Passes each stored message to send(), oldest first, starting after the
+ * last one which was sent. Once everything has been sent the backlog is
+ * erased. Returns false if send() failed.
+ */
+bool
+web_api_backlog_send(web_api_backlog_send_t send, void* arg)
+{
+  bool ret = true;
+
+  if (!have_sector)
+    return true;
+
+  if (!send_pos_valid) {
+    send_sector = (write_sector + 1) % num_sectors;
+    send_offset = RECORDS_START;
+    send_pos_valid = true;
+  }
+
+  uint8_t* body = malloc(MAX_RECORD_LEN);
+  while (1) {
+    record_header_t hdr;
+
+    if (sectors[send_sector].valid &&
+        (read_record(send_sector, send_offset, &hdr, body) == RECORD_OK)) {
+      if (!send(body, hdr.len, arg)) {
+        ret = false;
+        break;
+      }
+
+      send_offset += sizeof(hdr) + hdr.len;
+      continue;
+    }
+
+    if (send_sector == write_sector)
+      break;
+
+    send_sector = (send_sector + 1) % num_sectors;
+    send_offset = RECORDS_START;
+  }
+  free(body);
+
+  if (ret)
+    web_api_backlog_clear();
+
+  return ret;
+}
+
+bool
+web_api_backlog_empty()
+{
+  return !have_sector;
+}
+
+void
+web_api_backlog_clear()
+{
+  int i;
+
+  for (i = 0; i < num_sectors; ++i) {
+    if (sectors[i].valid)
+      erase_sector(i);
+  }
+
+  have_sector = false;
+  send_pos_valid = false;
+}
+
+/* Opens the spare sector, then folds the oldest sector into it so that
+ * there is a spare again.
+ */
+static bool
+open_sector()
+{
+  uint8_t sector = have_sector ? ((write_sector + 1) % num_sectors) : 0;
+  sector_header_t hdr = {
+      .magic = BACKLOG_MAGIC,
+      .seq = have_sector ? (sectors[write_sector].seq + 1) : 1,
+  };
+  hdr.crc = header_crc(&hdr);
+
+  /* Only happens if a reclaim was cut short by a reset */
+  if (sectors[sector].valid)
+    printf("Backlog overwriting sector %d\r\n", sector);
+
+  if (!sectors[sector].erased && !erase_sector(sector))
+    return false;
+
+  sectors[sector].erased = false;
+  if (!sxfs_write(SP_WEB_API_BACKLOG, sector_offset(sector), (uint8_t*)&hdr, sizeof(hdr)))
+    return false;
+
+  sectors[sector].valid = true;
+  sectors[sector].seq = hdr.seq;
+
+  have_sector = true;
+  write_sector = sector;
+  write_offset = RECORDS_START;
+
+  uint8_t oldest = (sector + 1) % num_sectors;
+  if (sectors[oldest].valid)
+    reclaim_sector(oldest);
+
+  return true;
+}
+
+/* Programs a record at the end of the newest sector. If the write fails the
+ * rest of the sector is abandoned, since it can no longer be trusted to be
+ * erased.
+ */
+static bool
+write_record(backlog_kind_t kind, uint8_t key, uint8_t* msg, uint32_t msg_len)
+{
+  record_header_t hdr = {
+      .len = msg_len,
+      .kind = kind,
+      .key = key
+  };
+
+  if (write_offset + sizeof(hdr) + msg_len > SECTOR_SIZE)
+    return false;
+
+  hdr.crc = record_crc(&hdr, msg);
+
+  uint32_t offset = sector_offset(write_sector) + write_offset;
+  uint32_t next_offset = write_offset + sizeof(hdr) + msg_len;
+
+  write_offset = SECTOR_SIZE;
+  if (!sxfs_write(SP_WEB_API_BACKLOG, offset, (uint8_t*)&hdr, sizeof(hdr)) ||
+      !sxfs_write(SP_WEB_API_BACKLOG, offset + sizeof(hdr), msg, msg_len))
+    return false;
+
+  write_offset = next_offset;
+  return true;
+}
+
+static record_result_t
+read_record(uint8_t sector, uint32_t offset, record_header_t* hdr, uint8_t* body)
+{
+  if (offset + sizeof(record_header_t) > SECTOR_SIZE)
+    return RECORD_END;
+
+  sxfs_read(SP_WEB_API_BACKLOG, sector_offset(sector) + offset, (uint8_t*)hdr, sizeof(record_header_t));
+
+  if ((hdr->len == 0xFFFF) && (hdr->kind == 0xFF) &&
+      (hdr->key == 0xFF) && (hdr->crc == 0xFFFFFFFF))
+    return RECORD_END;
+
+  if ((hdr->len > MAX_RECORD_LEN) ||
+      (offset + sizeof(record_header_t) + hdr->len > SECTOR_SIZE))
+    return RECORD_BAD;
+
+  sxfs_read(SP_WEB_API_BACKLOG, sector_offset(sector) + offset + sizeof(record_header_t), body, hdr->len);
+
+  if (record_crc(hdr, body) != hdr->crc)
+    return RECORD_BAD;
+
+  return RECORD_OK;
+}
+
+static void
+reclaim_sector(uint8_t sector)
+{
+  int i;
+  record_header_t hdr;
+  uint32_t offset;
+  uint32_t start = RECORDS_START;
+  uint32_t event_bytes = 0;
+  uint32_t summary_bytes = 0;
+
+  /* Sending works from the oldest sector forwards, so if it is not part way
+   * through this one it has sent all of it.
+   */
+  if (send_pos_valid)
+    start = (send_sector == sector) ? send_offset : SECTOR_SIZE;
+
+  reclaim_t* r = calloc(1, sizeof(reclaim_t));
+
+  /* Work out how much has to be dropped to stay within the budget */
+  for (offset = start;
+       read_record(sector, offset, &hdr, r->body) == RECORD_OK;
+       offset += sizeof(hdr) + hdr.len) {
+    if (hdr.kind == BACKLOG_EVENT)
+      event_bytes += sizeof(hdr) + hdr.len;
+    else if (hdr.kind == BACKLOG_SUMMARY)
+      summary_bytes += sizeof(hdr) + hdr.len;
+  }
+
+  uint32_t excess = 0;
+  if (event_bytes + summary_bytes > CARRY_BUDGET)
+    excess = event_bytes + summary_bytes - CARRY_BUDGET;
+
+  uint32_t drop_summary_bytes = MIN(excess, summary_bytes);
+  uint32_t drop_event_bytes = excess - drop_summary_bytes;
+
+  for (offset = start;
+       read_record(sector, offset, &hdr, r->body) == RECORD_OK;
+       offset += sizeof(hdr) + hdr.len) {
+    uint32_t rec_len = sizeof(hdr) + hdr.len;
+
+    switch (hdr.kind) {
+      case BACKLOG_REPORT:
+        summarize_report(r, r->body, hdr.len);
+        break;
+
+      case BACKLOG_SETTINGS:
+        if (hdr.key == BACKLOG_KEY_DEVICE)
+          r->device_settings = true;
+        else if (hdr.key < NUM_CONTROLLERS)
+          r->controller_settings[hdr.key] = true;
+        break;
+
+      case BACKLOG_SUMMARY:
+        if (drop_summary_bytes > 0)
+          drop_summary_bytes -= MIN(rec_len, drop_summary_bytes);
+        else
+          write_record(hdr.kind, hdr.key, r->body, hdr.len);
+        break;
+
+      case BACKLOG_EVENT:
+        if (drop_event_bytes > 0)
+          drop_event_bytes -= MIN(rec_len, drop_event_bytes);
+        else
+          write_record(hdr.kind, hdr.key, r->body, hdr.len);
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    if (r->summaries[i].active)
+      write_summary(r, &r->summaries[i]);
+  }
+
+  if (r->device_settings)
+    write_settings(r, BACKLOG_KEY_DEVICE);
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    if (r->controller_settings[i])
+      write_settings(r, i);
+  }
+
+  free(r);
+
+  erase_sector(sector);
+
+  /* What was left to send here now follows the newest records, and is
+   * reached by carrying on from the next sector.
+   */
+  if (send_pos_valid && (send_sector == sector)) {
+    send_sector = (sector + 1) % num_sectors;
+    send_offset = RECORDS_START;
+  }
+}
+
+/* Folds the readings in a periodic report into the summaries */
+static void
+summarize_report(reclaim_t* r, uint8_t* body, uint32_t len)
+{
+  int i;
+
+  memset(&r->msg, 0, sizeof(r->msg));
+  pb_istream_t stream = pb_istream_from_buffer(body, len);
+  if (!pb_decode(&stream, ApiMessage_fields, &r->msg) ||
+      !r->msg.has_deviceReport)
+    return;
+
+  /* Writing a summary reuses r->msg, so the report is taken out of it first */
+  r->report = r->msg.deviceReport;
+  for (i = 0; i < (int)r->report.controller_reports_count; ++i) {
+    ControllerReport* cr = &r->report.controller_reports[i];
+    if (!cr->has_timestamp || (cr->controller_index >= NUM_CONTROLLERS))
+      continue;
+
+    summary_t* s = &r->summaries[cr->controller_index];
+    uint32_t period = cr->timestamp / SUMMARY_PERIOD;
+
+    if (s->active && (s->period != period))
+      write_summary(r, s);
+
+    if (!s->active) {
+      memset(s, 0, sizeof(*s));
+      s->active = true;
+      s->period = period;
+      s->min = *cr;
+      s->max = *cr;
+    }
+    else if (cr->sensor_reading < s->min.sensor_reading)
+      s->min = *cr;
+    else if (cr->sensor_reading > s->max.sensor_reading)
+      s->max = *cr;
+
+    s->reading_total += cr->sensor_reading;
+    s->timestamp_total += cr->timestamp;
+    s->num_readings++;
+  }
+}
+
+/* Writes the lowest, highest and average readings of the period as a
+ * report, in time order. The average is timed at the mean time of the
+ * readings, and is left out when the low and high are all of them.
+ */
+static void
+write_summary(reclaim_t* r, summary_t* s)
+{
+  ControllerReport reports[3];
+  uint32_t num_reports = 0;
+  uint32_t i, j;
+
+  s->active = false;
+
+  reports[num_reports++] = s->min;
+  if (s->max.timestamp != s->min.timestamp)
+    reports[num_reports++] = s->max;
+
+  if ((s->num_readings > num_reports) && (num_reports < MAX_SUMMARY_REPORTS)) {
+    ControllerReport avg = s->min;
+    avg.sensor_reading = s->reading_total / s->num_readings;
+    avg.timestamp = s->timestamp_total / s->num_readings;
+    reports[num_reports++] = avg;
+  }
+
+  memset(&r->msg, 0, sizeof(r->msg));
+  r->msg.type = ApiMessage_Type_DEVICE_REPORT;
+  r->msg.has_deviceReport = true;
+
+  DeviceReport* dr = &r->msg.deviceReport;
+  for (i = 0; i < num_reports; ++i) {
+    for (j = dr->controller_reports_count;
+         (j > 0) && (dr->controller_reports[j - 1].timestamp > reports[i].timestamp);
+         --j)
+      dr->controller_reports[j] = dr->controller_reports[j - 1];
+    dr->controller_reports[j] = reports[i];
+    dr->controller_reports_count++;
+  }
+
+  write_msg(r, BACKLOG_SUMMARY, s->min.controller_index);
+}
+
+static void
+write_settings(reclaim_t* r, uint8_t key)
+{
+  memset(&r->msg, 0, sizeof(r->msg));
+
+  if (key == BACKLOG_KEY_DEVICE) {
+    r->msg.type = ApiMessage_Type_DEVICE_SETTINGS;
+    r->msg.has_deviceSettings = true;
+    web_api_msg_device_settings(&r->msg.deviceSettings);
+  }
+  else {
+    r->msg.type = ApiMessage_Type_CONTROLLER_SETTINGS;
+    r->msg.has_controllerSettings = true;
+    web_api_msg_controller_settings(&r->msg.controllerSettings, key);
+  }
+
+  write_msg(r, BACKLOG_SETTINGS, key);
+}
+
+static bool
+write_msg(reclaim_t* r, backlog_kind_t kind, uint8_t key)
+{
+  pb_ostream_t stream = pb_ostream_from_buffer(r->buf, sizeof(r->buf));
+  if (!pb_encode(&stream, ApiMessage_fields, &r->msg)) {
+    printf("Backlog encode failed\r\n");
+    return false;
+  }
+
+  return write_record(kind, key, r->buf, stream.bytes_written);
+}
+
+static bool
+erase_sector(uint8_t sector)
+{
+  sectors[sector].valid = false;
+
+  if (!sxfs_erase(SP_WEB_API_BACKLOG, sector_offset(sector), SECTOR_SIZE))
+    return false;
+
+  sectors[sector].erased = true;
+  return true;
+}
+
+static uint32_t
+header_crc(sector_header_t* hdr)
+{
+  return crc32_block(0, hdr, offsetof(sector_header_t, crc));
+}
+
+static uint32_t
+record_crc(record_header_t* hdr, uint8_t* body)
+{
+  uint32_t crc = crc32_block(0, hdr, offsetof(record_header_t, crc));
+  return crc32_block(crc, body, hdr->len);
+}
+
+static uint32_t
+sector_offset(uint8_t sector)
+{
+  return sector * SECTOR_SIZE;
+}
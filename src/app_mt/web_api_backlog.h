@@ -0,0 +1,37 @@
+
+#ifndef WEB_API_BACKLOG_H
+#define WEB_API_BACKLOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+  BACKLOG_NONE,       // not worth keeping if it can't be sent
+  BACKLOG_REPORT,     // periodic sensor report, summarized as it ages
+  BACKLOG_SUMMARY,    // summary of an hour of periodic reports
+  BACKLOG_EVENT,      // report of a relay switching, a setpoint change or a sensor timeout
+  BACKLOG_SETTINGS,   // device or controller settings, only the latest is kept
+} backlog_kind_t;
+
+/* Key of device settings. Controller settings are keyed by controller. */
+#define BACKLOG_KEY_DEVICE 0xFF
+
+typedef bool (*web_api_backlog_send_t)(uint8_t* msg, uint32_t msg_len, void* arg);
+
+
+void
+web_api_backlog_init(void);
+
+bool
+web_api_backlog_store(backlog_kind_t kind, uint8_t key, uint8_t* msg, uint32_t msg_len);
+
+bool
+web_api_backlog_send(web_api_backlog_send_t send, void* arg);
+
+bool
+web_api_backlog_empty(void);
+
+void
+web_api_backlog_clear(void);
+
+#endif
@@ -0,0 +1,521 @@
+
+#include <ch.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <pb_decode.h>
+
+#include "web_api_msg.h"
+#include "app_cfg.h"
+#include "temp_control.h"
+#include "temp_profile.h"
+#include "net.h"
+#include "common.h"
+
+
+
+static void
+populate_output_status(ControllerReport* pr, temp_controller_id_t controller, output_id_t output);
+
+static void
+convert_step(const TempProfileStep* stepm, temp_profile_step_t* step);
+
+static void
+store_temp_profile(const TempProfile* tpm, const temp_profile_t* profile);
+
+static bool
+stored_profile_matches(const TempProfile* tpm);
+
+static void
+reader_reset(web_api_msg_reader_t* r);
+
+static web_api_msg_read_t
+message_rx(web_api_msg_reader_t* r, uint32_t data_len,
+    web_api_msg_handler_t handler, void* arg);
+
+static bool
+reader_istream_read(pb_istream_t* stream, uint8_t* buf, size_t count);
+
+
+static void
+populate_output_status(ControllerReport* pr, temp_controller_id_t controller, output_id_t output)
+{
+  const controller_settings_t* controller_settings = app_cfg_get_controller_settings(controller);
+
+  if (controller_settings->output_settings[output].enabled) {
+    output_ctrl_t control_mode = app_cfg_get_control_mode();
+    temp_control_status_t output_status = temp_control_get_status(controller, output);
+
+    pr->output_status[pr->output_status_count].output_index = output;
+    pr->output_status[pr->output_status_count].has_output_index = true;
+
+    pr->output_status[pr->output_status_count].status = output_status.output_enabled;
+    pr->output_status[pr->output_status_count].has_status = true;
+
+    if (control_mode == PID) {
+      pr->output_status[pr->output_status_count].kp = output_status.kp;
+      pr->output_status[pr->output_status_count].has_kp = true;
+
+      pr->output_status[pr->output_status_count].ki = output_status.ki;
+      pr->output_status[pr->output_status_count].has_ki = true;
+
+      pr->output_status[pr->output_status_count].kd = output_status.kd;
+      pr->output_status[pr->output_status_count].has_kd = true;
+    }
+    pr->output_status_count++;
+  }
+}
+
+void
+web_api_msg_controller_report(ControllerReport* pr,
+    temp_controller_id_t controller, float sensor_reading)
+{
+  pr->controller_index = controller;
+  pr->sensor_reading = sensor_reading;
+  pr->setpoint = temp_control_get_current_setpoint(controller);
+
+  populate_output_status(pr, controller, OUTPUT_1);
+  populate_output_status(pr, controller, OUTPUT_2);
+}
+
+void
+web_api_msg_device_settings(DeviceSettings* ds)
+{
+  ds->name[0] = 0;
+
+  output_ctrl_t control_mode = app_cfg_get_control_mode();
+  switch (control_mode) {
+    case PID:
+      ds->control_mode = DeviceSettings_ControlMode_PID;
+      break;
+
+    case ON_OFF:
+      ds->control_mode = DeviceSettings_ControlMode_ON_OFF;
+      break;
+
+    default:
+      printf("Invalid output control mode: %d\r\n", control_mode);
+      break;
+  }
+}
+
+void
+web_api_msg_controller_settings(ControllerSettings* ss,
+    temp_controller_id_t controller)
+{
+  controller_settings_t* ssl = calloc(1, sizeof(controller_settings_t));
+  app_cfg_read_controller_settings(controller, ssl);
+
+  memset(ss, 0, sizeof(ControllerSettings));
+
+  ss->has_session_action = true;
+  ss->session_action = ssl->session_action;
+
+  ss->sensor_index = controller;
+  switch (ssl->setpoint_type) {
+    case SP_STATIC:
+      ss->setpoint_type = ControllerSettings_SetpointType_STATIC;
+      ss->has_static_setpoint = true;
+      ss->static_setpoint = ssl->static_setpoint.value;
+      break;
+
+    case SP_TEMP_PROFILE:
+      ss->setpoint_type = ControllerSettings_SetpointType_TEMP_PROFILE;
+      ss->has_temp_profile_id = true;
+      ss->temp_profile_id = ssl->temp_profile.id;
+      ss->has_temp_profile_completion_action = true;
+      ss->temp_profile_completion_action = ControllerSettings_CompletionAction_HOLD_LAST;
+      ss->has_temp_profile_start_point = true;
+      ss->temp_profile_start_point = 0;
+      break;
+
+    default:
+      printf("Invalid setpoint type: %d\r\n", ssl->setpoint_type);
+      break;
+  }
+
+  int j;
+  for (j = 0; j < NUM_OUTPUTS; ++j) {
+    const output_settings_t* osl = &ssl->output_settings[j];
+    if (osl->enabled) {
+      OutputSettings* os = &ss->output_settings[ss->output_settings_count];
+      ss->output_settings_count++;
+
+      os->index = j;
+      os->function = osl->function;
+      os->cycle_delay = osl->cycle_delay.value;
+    }
+  }
+
+  free(ssl);
+}
+
+void
+web_api_msg_apply_device_settings(DeviceSettings* settings)
+{
+  printf("got device settings\r\n");
+  printf("  control mode %d\r\n", settings->control_mode);
+  printf("  hysteresis %f\r\n", settings->hysteresis);
+
+  app_cfg_set_control_mode((output_ctrl_t)settings->control_mode);
+
+  quantity_t hysteresis;
+  hysteresis.value = settings->hysteresis;
+  hysteresis.unit = UNIT_TEMP_DEG_F;
+  app_cfg_set_hysteresis(hysteresis);
+}
+
+void
+web_api_msg_apply_controller_settings(ControllerSettings* settings,
+    settings_source_t source)
+{
+  int i;
+
+  printf("got controller settings\r\n");
+
+  if (settings->sensor_index >= NUM_CONTROLLERS) {
+    printf("Invalid controller: %d\r\n", (int)settings->sensor_index);
+    return;
+  }
+
+  controller_settings_t* csl = calloc(1, sizeof(controller_settings_t));
+  app_cfg_read_controller_settings(settings->sensor_index, csl);
+
+  csl->controller = settings->sensor_index;
+
+  printf("  got %d temp profiles\r\n", settings->temp_profiles_count);
+  printf("  got %d output settings\r\n", settings->output_settings_count);
+  csl->output_settings[OUTPUT_1].enabled = false;
+  csl->output_settings[OUTPUT_2].enabled = false;
+  for (i = 0; i < (int)settings->output_settings_count; ++i) {
+    OutputSettings* osm = &settings->output_settings[i];
+    if (osm->index >= NUM_OUTPUTS) {
+      printf("Invalid output: %d\r\n", (int)osm->index);
+      continue;
+    }
+
+    output_settings_t* os = &csl->output_settings[osm->index];
+
+    os->cycle_delay.value = osm->cycle_delay;
+    os->cycle_delay.unit = UNIT_TIME_MIN;
+    os->function = osm->function;
+    os->enabled = true;
+
+    printf("    output %d\r\n", i);
+    printf("      delay %f\r\n", os->cycle_delay.value);
+    printf("      function %d\r\n", os->function);
+  }
+
+  printf("  got sensor settings\r\n");
+
+  switch (settings->setpoint_type) {
+    case ControllerSettings_SetpointType_STATIC:
+      if (!settings->has_static_setpoint)
+        printf("Sensor settings specified static setpoint, but none provided!\r\n");
+      else {
+        csl->setpoint_type = SP_STATIC;
+        csl->static_setpoint.value = settings->static_setpoint;
+        csl->static_setpoint.unit = UNIT_TEMP_DEG_F;
+      }
+      break;
+
+    case ControllerSettings_SetpointType_TEMP_PROFILE:
+      if (!settings->has_temp_profile_id)
+        printf("Sensor settings specified temp profile, but no provided!\r\n");
+      else {
+        csl->setpoint_type = SP_TEMP_PROFILE;
+
+        TempProfile* tpm = &settings->temp_profiles[0];
+        csl->temp_profile.id = tpm->id;
+        strncpy(csl->temp_profile.name, tpm->name, sizeof(csl->temp_profile.name));
+        csl->temp_profile.num_steps = MIN(tpm->steps_count, TEMP_PROFILE_INLINE_STEPS);
+        csl->temp_profile.start_value.value = tpm->start_value;
+        csl->temp_profile.start_value.unit = UNIT_TEMP_DEG_F;
+        csl->temp_profile.start_point = settings->temp_profile_start_point;
+        csl->temp_profile.completion_action = settings->temp_profile_completion_action;
+
+        printf("    profile '%s' (%d)\r\n", csl->temp_profile.name, (int)csl->temp_profile.id);
+        printf("      steps %d\r\n", (int)csl->temp_profile.num_steps);
+        printf("      start temp %f\r\n", csl->temp_profile.start_value.value);
+        printf("      start point %d\r\n", csl->temp_profile.start_point);
+        printf("      completion action %d\r\n", csl->temp_profile.completion_action);
+
+        for (i = 0; i < (int)csl->temp_profile.num_steps; ++i)
+          convert_step(&tpm->steps[i], &csl->temp_profile.steps[i]);
+
+        store_temp_profile(tpm, &csl->temp_profile);
+      }
+      break;
+
+    default:
+      printf("Invalid setpoint type: %d\r\n", settings->setpoint_type);
+      break;
+  }
+
+  printf("    sensor %d\r\n", csl->controller);
+  printf("      setpoint_type %d\r\n", csl->setpoint_type);
+  printf("      static %f\r\n", csl->static_setpoint.value);
+  printf("      temp profile %d\r\n", (int)csl->temp_profile.id);
+
+  app_cfg_set_controller_settings(csl->controller, source, csl);
+  free(csl);
+}
+
+static void
+convert_step(const TempProfileStep* stepm, temp_profile_step_t* step)
+{
+  step->duration = stepm->duration;
+  step->value.value = stepm->value;
+  step->value.unit = UNIT_TEMP_DEG_F;
+  switch(stepm->type) {
+    case TempProfileStep_TempProfileStepType_HOLD:
+      step->type = STEP_HOLD;
+      break;
+
+    case TempProfileStep_TempProfileStepType_RAMP:
+      step->type = STEP_RAMP;
+      break;
+
+    default:
+      printf("Invalid step type: %d\r\n", stepm->type);
+      break;
+  }
+}
+
+/* Profiles with more steps than the controller settings hold are written to
+ * the profile store, which the controller runs them from. Shorter profiles
+ * run from the settings, so any stored copy of them is removed. This must
+ * happen before the settings are applied, since applying them restarts the
+ * profile.
+ */
+static void
+store_temp_profile(const TempProfile* tpm, const temp_profile_t* profile)
+{
+  uint32_t i;
+  uint32_t n = 0;
+  temp_profile_writer_t w;
+  temp_profile_step_t steps[8];
+
+  if (tpm->steps_count <= TEMP_PROFILE_INLINE_STEPS) {
+    temp_profile_store_delete(tpm->id);
+    return;
+  }
+
+  if (stored_profile_matches(tpm))
+    return;
+
+  if (!temp_profile_store_begin(&w, tpm->id)) {
+    printf("Profile store begin failed\r\n");
+    return;
+  }
+
+  for (i = 0; i < tpm->steps_count; ++i) {
+    convert_step(&tpm->steps[i], &steps[n++]);
+
+    if ((n == (sizeof(steps) / sizeof(steps[0]))) || ((i + 1) == tpm->steps_count)) {
+      if (!temp_profile_store_append(&w, steps, n)) {
+        printf("Profile store append failed\r\n");
+        temp_profile_store_abort(&w);
+        return;
+      }
+      n = 0;
+    }
+  }
+
+  if (!temp_profile_store_commit(&w, profile->name, profile->start_value, profile->completion_action))
+    printf("Profile store commit failed\r\n");
+}
+
+/* The server sends the settings again on every connect, so the profile is
+ * only rewritten if it differs from the stored copy.
+ */
+static bool
+stored_profile_matches(const TempProfile* tpm)
+{
+  uint32_t i;
+  temp_profile_info_t info;
+
+  if (!temp_profile_store_find(tpm->id, &info) ||
+      (info.num_steps != tpm->steps_count))
+    return false;
+
+  for (i = 0; i < tpm->steps_count; ++i) {
+    temp_profile_step_t stored;
+    temp_profile_step_t step;
+
+    convert_step(&tpm->steps[i], &step);
+    if (!temp_profile_store_read_step(&info, i, &stored, NULL) ||
+        (stored.duration != step.duration) ||
+        (stored.value.value != step.value.value) ||
+        (stored.type != step.type))
+      return false;
+  }
+
+  return true;
+}
+
+void
+web_api_msg_reader_init(web_api_msg_reader_t* r, int32_t sd)
+{
+  r->sd = sd;
+  r->max_len = WEB_API_MSG_MAX_SIZE;
+  r->prepare = NULL;
+  r->timeout = MS2ST(WEB_API_MSG_RECV_TIMEOUT_MS);
+  reader_reset(r);
+}
+
+/* Messages longer than max_len are refused, and the socket treated as
+ * disconnected. The body of each message must arrive within timeout of its
+ * length prefix.
+ */
+void
+web_api_msg_reader_set_limits(web_api_msg_reader_t* r, uint32_t max_len, systime_t timeout)
+{
+  r->max_len = MIN(max_len, WEB_API_MSG_MAX_SIZE);
+  r->timeout = timeout;
+}
+
+/* Messages are decoded with their callback fields cleared, so those fields
+ * are skipped, unless prepare sets them up.
+ */
+void
+web_api_msg_reader_set_prepare(web_api_msg_reader_t* r, web_api_msg_prepare_t prepare)
+{
+  r->prepare = prepare;
+}
+
+/* Reads what is available on the socket and passes each complete message to
+ * the handler. Call again while it returns WMR_DATA or WMR_BAD_MSG.
+ */
+web_api_msg_read_t
+web_api_msg_read(web_api_msg_reader_t* r, web_api_msg_handler_t handler, void* arg)
+{
+  int ret = recv_timeout(r->sd, r->recv_buf, r->bytes_remaining, 0, TIME_IMMEDIATE);
+  if (ret < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return WMR_NO_DATA;
+
+    printf("recv failed %d %d\r\n", ret, errno);
+    return WMR_DISCONNECTED;
+  }
+
+  /* select only reports a socket with nothing to read once it is closed */
+  if (ret == 0)
+    return WMR_DISCONNECTED;
+
+  r->bytes_remaining -= ret;
+  r->recv_buf += ret;
+
+  /* Once the length prefix is in, the message body is decoded directly
+   * from the socket
+   */
+  if (r->bytes_remaining == 0) {
+    uint32_t data_len = ntohl(r->data_len);
+
+    reader_reset(r);
+    if (data_len > r->max_len) {
+      printf("message too long %d\r\n", (int)data_len);
+      return WMR_DISCONNECTED;
+    }
+
+    if (data_len > 0)
+      return message_rx(r, data_len, handler, arg);
+  }
+
+  return WMR_DATA;
+}
+
+static void
+reader_reset(web_api_msg_reader_t* r)
+{
+  r->bytes_remaining = 4;
+  r->recv_buf = (uint8_t*)&r->data_len;
+}
+
+static web_api_msg_read_t
+message_rx(web_api_msg_reader_t* r, uint32_t data_len,
+    web_api_msg_handler_t handler, void* arg)
+{
+  web_api_msg_read_t ret;
+  ApiMessage* msg = calloc(1, sizeof(ApiMessage));
+
+  if (r->prepare != NULL)
+    r->prepare(msg);
+
+  r->msg_bytes_remaining = data_len;
+  r->msg_start = chTimeNow();
+  r->window_pos = 0;
+  r->window_len = 0;
+
+  pb_istream_t stream = {
+    .callback = reader_istream_read,
+    .state = r,
+    .bytes_left = data_len
+  };
+
+  if (pb_decode(&stream, ApiMessage_fields, msg)) {
+    handler(msg, arg);
+    ret = WMR_DATA;
+  }
+  else if (r->msg_bytes_remaining > 0) {
+    /* Part of the message is still on the socket, so the framing is lost */
+    printf("message truncated\r\n");
+    ret = WMR_DISCONNECTED;
+  }
+  else {
+    printf("bad message received\r\n");
+    ret = WMR_BAD_MSG;
+  }
+
+  free(msg);
+  return ret;
+}
+
+/* nanopb input callback which pulls the message body from the socket. Data
+ * is received into a small window and never past the end of the message,
+ * so the next length prefix is left on the socket. The rest of the message
+ * is normally already on its way, so this waits for it rather than
+ * returning to the caller part way through a decode, but only until the
+ * reader's timeout runs out for the message as a whole. A peer trickling a
+ * byte at a time can't hold the caller any longer than that.
+ */
+static bool
+reader_istream_read(pb_istream_t* stream, uint8_t* buf, size_t count)
+{
+  web_api_msg_reader_t* r = stream->state;
+
+  while (count > 0) {
+    if (r->window_pos == r->window_len) {
+      if (r->msg_bytes_remaining == 0)
+        return false;
+
+      systime_t elapsed = chTimeNow() - r->msg_start;
+      if (elapsed >= r->timeout) {
+        printf("message recv timed out\r\n");
+        return false;
+      }
+
+      int ret = recv_timeout(r->sd, r->window,
+          MIN(WEB_API_MSG_RECV_WINDOW, r->msg_bytes_remaining), 0,
+          r->timeout - elapsed);
+      if (ret <= 0) {
+        printf("message recv failed %d %d\r\n", ret, errno);
+        return false;
+      }
+
+      r->msg_bytes_remaining -= ret;
+      r->window_pos = 0;
+      r->window_len = ret;
+    }
+
+    uint32_t n = MIN(count, r->window_len - r->window_pos);
+    memcpy(buf, r->window + r->window_pos, n);
+    r->window_pos += n;
+    buf += n;
+    count -= n;
+  }
+
+  return true;
+}
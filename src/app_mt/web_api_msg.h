@@ -0,0 +1,86 @@
+
+#ifndef WEB_API_MSG_H
+#define WEB_API_MSG_H
+
+#include "bbmt.pb.h"
+#include "app_cfg.h"
+#include "temp_control.h"
+
+/* Conversions between the device's settings and status and the ApiMessage
+ * types, shared by everything which speaks the web API protocol.
+ */
+
+#define WEB_API_MSG_RECV_WINDOW      128
+#define WEB_API_MSG_RECV_TIMEOUT_MS  5000
+
+/* Firmware chunks are decoded through a callback (see bbmt.options), so
+ * nanopb can't give a bound for ApiMessage. Messages are held to this
+ * instead, which leaves room for a 1KB chunk.
+ */
+#define WEB_API_MSG_MAX_SIZE         2048
+
+/* Sets up the callback fields of a message before it is decoded into */
+typedef void (*web_api_msg_prepare_t)(ApiMessage* msg);
+
+/* Reads length prefixed ApiMessages from a socket. Messages are decoded
+ * straight from the socket through a small window, rather than being
+ * buffered whole before decoding. Once its length prefix is in, the body of
+ * a message has to arrive within the reader's timeout.
+ */
+typedef struct {
+  int32_t sd;
+  uint32_t max_len;
+  web_api_msg_prepare_t prepare;
+  systime_t timeout;
+  systime_t msg_start;
+
+  uint8_t* recv_buf;
+  uint32_t bytes_remaining;
+  uint32_t data_len;
+
+  uint32_t msg_bytes_remaining;
+  uint32_t window_pos;
+  uint32_t window_len;
+  uint8_t window[WEB_API_MSG_RECV_WINDOW];
+} web_api_msg_reader_t;
+
+typedef enum {
+  WMR_NO_DATA,      // nothing was waiting on the socket
+  WMR_DATA,         // data was read and there may be more
+  WMR_BAD_MSG,      // a message was skipped, the next can still be read
+  WMR_DISCONNECTED  // the socket failed or closed, or the framing was lost
+} web_api_msg_read_t;
+
+typedef void (*web_api_msg_handler_t)(ApiMessage* msg, void* arg);
+
+void
+web_api_msg_controller_report(ControllerReport* pr,
+    temp_controller_id_t controller, float sensor_reading);
+
+void
+web_api_msg_device_settings(DeviceSettings* ds);
+
+void
+web_api_msg_controller_settings(ControllerSettings* ss,
+    temp_controller_id_t controller);
+
+void
+web_api_msg_apply_device_settings(DeviceSettings* settings);
+
+void
+web_api_msg_apply_controller_settings(ControllerSettings* settings,
+    settings_source_t source);
+
+void
+web_api_msg_reader_init(web_api_msg_reader_t* r, int32_t sd);
+
+void
+web_api_msg_reader_set_limits(web_api_msg_reader_t* r, uint32_t max_len, systime_t timeout);
+
+void
+web_api_msg_reader_set_prepare(web_api_msg_reader_t* r, web_api_msg_prepare_t prepare);
+
+web_api_msg_read_t
+web_api_msg_read(web_api_msg_reader_t* r, web_api_msg_handler_t handler, void* arg);
+
+#endif
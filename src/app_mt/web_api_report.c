@@ -0,0 +1,88 @@
+
+#include <math.h>
+
+#include "web_api_report.h"
+
+/* A controller is reported when its reading has moved by REPORT_DEADBAND
+ * since it was last reported, but no more often than REPORT_MIN_INTERVAL,
+ * and at least every REPORT_MAX_INTERVAL while samples are arriving.
+ *
+ * Relay switches and setpoint moves are reported at once, whether or not a
+ * new sample has arrived. So is a sensor timeout, carrying the last reading
+ * taken since a report must hold one, and the first sample after it.
+ */
+#define REPORT_MIN_INTERVAL    S2ST(10)
+#define REPORT_MAX_INTERVAL    S2ST(5 * 60)
+#define REPORT_DEADBAND        0.5f  // degrees F
+#define SETPOINT_DEADBAND      0.1f  // degrees F
+
+
+void
+web_api_report_sample(web_api_report_t* r, quantity_t sample)
+{
+  r->has_sample = true;
+  r->new_sample = true;
+  r->last_sample = sample;
+}
+
+void
+web_api_report_timeout(web_api_report_t* r)
+{
+  r->report_now = true;
+  r->report_next_sample = true;
+}
+
+/* Returns BACKLOG_EVENT if something changed which must not be lost,
+ * BACKLOG_REPORT for a routine report and BACKLOG_NONE if no report is due.
+ */
+backlog_kind_t
+web_api_report_kind(const web_api_report_t* r, float setpoint, uint8_t outputs, systime_t now)
+{
+  /* There is nothing to put in a report until a reading has been taken */
+  if (!r->has_sample)
+    return BACKLOG_NONE;
+
+  if (r->report_now || !r->reported)
+    return BACKLOG_EVENT;
+
+  if (outputs != r->reported_outputs)
+    return BACKLOG_EVENT;
+
+  if (fabsf(setpoint - r->reported_setpoint) >= SETPOINT_DEADBAND)
+    return BACKLOG_EVENT;
+
+  if (!r->new_sample)
+    return BACKLOG_NONE;
+
+  if (r->report_next_sample)
+    return BACKLOG_EVENT;
+
+  systime_t elapsed = now - r->last_report_time;
+  if (elapsed >= REPORT_MAX_INTERVAL)
+    return BACKLOG_REPORT;
+
+  float sample = quantity_convert(r->last_sample, UNIT_TEMP_DEG_F).value;
+  if ((elapsed >= REPORT_MIN_INTERVAL) &&
+      (fabsf(sample - r->reported_sample) >= REPORT_DEADBAND))
+    return BACKLOG_REPORT;
+
+  return BACKLOG_NONE;
+}
+
+void
+web_api_report_sent(web_api_report_t* r, float setpoint, uint8_t outputs, systime_t now)
+{
+  /* A timeout report carries the old reading, the next new one still goes
+   * out as an event.
+   */
+  if (r->new_sample && !r->report_now)
+    r->report_next_sample = false;
+
+  r->new_sample = false;
+  r->report_now = false;
+  r->reported = true;
+  r->reported_sample = quantity_convert(r->last_sample, UNIT_TEMP_DEG_F).value;
+  r->reported_setpoint = setpoint;
+  r->reported_outputs = outputs;
+  r->last_report_time = now;
+}
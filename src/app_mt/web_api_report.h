@@ -0,0 +1,41 @@
+
+#ifndef WEB_API_REPORT_H
+#define WEB_API_REPORT_H
+
+#include <ch.h>
+
+#include "types.h"
+#include "web_api_backlog.h"
+
+/* Decides when a controller's status is worth reporting to the server, and
+ * whether a report must survive a lost connection.
+ */
+typedef struct {
+  bool has_sample;
+  bool new_sample;
+  bool report_now;
+  bool report_next_sample;
+  quantity_t last_sample;
+
+  /* What the server was last told */
+  bool reported;
+  float reported_sample;
+  float reported_setpoint;
+  uint8_t reported_outputs;
+  systime_t last_report_time;
+} web_api_report_t;
+
+
+void
+web_api_report_sample(web_api_report_t* r, quantity_t sample);
+
+void
+web_api_report_timeout(web_api_report_t* r);
+
+backlog_kind_t
+web_api_report_kind(const web_api_report_t* r, float setpoint, uint8_t outputs, systime_t now);
+
+void
+web_api_report_sent(web_api_report_t* r, float setpoint, uint8_t outputs, systime_t now);
+
+#endif
@@ -94,11 +94,14 @@ consume_buf(int sd)
   if (SOCKET_STATUS_ACTIVE != get_socket_active_status(sd))
     return -1;
 
-  //If there are no available buffers, return -2. It is recommended to use
-  // select or receive to see if there is any buffer occupied with received data
-  // If so, call receive() to release the buffer.
-  if (!hci_claim_buffer())
+  // Wait for the CC3000 to release a TX buffer. If none is released in time,
+  // return -2. It is recommended to use select or receive to see if there is
+  // any buffer occupied with received data. If so, call receive() to release
+  // the buffer.
+  if (!hci_claim_buffer()) {
+    errno = EAGAIN;
     return -2;
+  }
 
   return 0;
 }
@@ -834,8 +837,6 @@ simple_link_send(long sd, const void *buf, long len, long flags,
   uint8_t *pDataPtr, *args;
   uint32_t addr_offset = 0;
   int res;
-  tBsdReadReturnParams tSocketSendEvent;
-  uint16_t rx_opcode;
 
   // Check the bsd_arguments
   if ((res = consume_buf(sd)) != 0)
@@ -883,14 +884,9 @@ simple_link_send(long sd, const void *buf, long len, long flags,
     ARRAY_TO_STREAM(pDataPtr, ((uint8_t *)to), tolen);
   }
 
-  if (opcode == HCI_CMND_SENDTO)
-    rx_opcode = HCI_EVNT_SENDTO;
-  else
-    rx_opcode = HCI_EVNT_SEND;
-
-  // Initiate a HCI command
-  hci_data_send(opcode, uArgSize, len, (uint8_t*)to, tolen,
-      rx_opcode, &tSocketSendEvent);
+  // Initiate a HCI command. Completion is not waited for, so several sends
+  // can be in flight, up to the number of free buffers in the CC3000.
+  hci_data_send(opcode, uArgSize, len, (uint8_t*)to, tolen);
 
   return  (len);
 }
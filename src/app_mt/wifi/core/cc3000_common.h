@@ -229,8 +229,10 @@ typedef struct {
 
 typedef uint32_t socklen_t;
 
-// The wfd_set member is required to be an array of longs.
-typedef long int __wfd_mask;
+// The CC3000 takes descriptor sets as 32 bit words, which c_select()
+// copies straight in and out of the wfd_set, so its members are 32 bits
+// whatever the size of a long.
+typedef int32_t __wfd_mask;
 
 // It's easier to assume 8-bit bytes than to get CHAR_BIT.
 #define __NWFDBITS               (8 * sizeof (__wfd_mask))
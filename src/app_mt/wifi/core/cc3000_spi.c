@@ -1,4 +1,3 @@
-
 #include "ch.h"
 #include "hal.h"
 
@@ -21,10 +20,33 @@
 #define SPI_WRITE_OP 1
 #define SPI_READ_OP  3
 
+/* How often the IRQ line is checked for an edge which was missed. The line
+ * has to be low at two checks in a row with no transfer between them before
+ * it counts, since the CC3000 can hold it low for a moment after CS is
+ * released.
+ */
+#define IRQ_LEVEL_CHECK_PERIOD  MS2ST(10)
+
+/* Packets are built in one buffer of the pool while the ones before them
+ * are queued or going out over the SPI, so a caller only waits for the bus
+ * when all the others are in use.
+ */
+#define TX_POOL_SIZE            3
+
 
+/* Transfers are started from the IRQ edges and chained from the end of each
+ * DMA transfer, so a transaction runs entirely in interrupts. The I/O
+ * thread only runs to hand a received packet to the HCI layer.
+ */
 typedef enum {
   SPI_STATE_POWERUP,
   SPI_STATE_IDLE,
+  SPI_STATE_WRITE_RELEASE,
+  SPI_STATE_WRITE_IRQ,
+  SPI_STATE_WRITE,
+  SPI_STATE_READ_HEADER,
+  SPI_STATE_READ_PAYLOAD,
+  SPI_STATE_READ_DONE,
 } spi_state_t;
 
 
@@ -32,7 +54,31 @@ static void
 wifi_irq_cb(EXTDriver *extp, expchannel_t channel);
 
 static void
-wait_io_ready(void);
+spi_end_cb(SPIDriver *spip);
+
+static void
+irq_check_cb(void* arg);
+
+static void
+irq_event_i(void);
+
+static void
+irq_released_i(void);
+
+static void
+start_next_i(void);
+
+static void
+start_read_i(void);
+
+static void
+start_write_i(void);
+
+static void
+end_transfer_i(void);
+
+static void
+end_read_i(void);
 
 static bool
 irq_asserted(void);
@@ -43,23 +89,41 @@ spi_io_thread(void* arg);
 static void
 spi_first_write(uint8_t *ucBuf, uint16_t usLength);
 
+static void
+tx_pool_reset(void);
+
 
-static spi_state_t spiState;
-static uint8_t* txPacket;
-static uint16_t txPacketLength;
+static volatile spi_state_t spiState;
 static uint16_t rxPacketLength;
+static bool irq_pending;
+static bool irq_was_low;
+static uint32_t num_transfers;
+static uint32_t checked_transfers;
+static VirtualTimer irq_check_timer;
 static Semaphore sem_init;
 Semaphore sem_io_ready;
-Semaphore sem_write_complete;
 Thread* io_thread;
 
-int irq_count, missed_irq_count, irq_timeout_count;
+int irq_count, missed_irq_count, irq_timeout_count, tx_pool_wait_count;
 
 uint8_t wlan_rx_buffer[CC3000_RX_BUFFER_SIZE];
-uint8_t wlan_tx_buffer[CC3000_TX_BUFFER_SIZE];
+
+/* The buffer being built, the queue of those waiting to be written in the
+ * order they were written, and a stack of free ones. sem_tx_free counts
+ * the free ones.
+ */
+static uint8_t wlan_tx_pool[TX_POOL_SIZE][CC3000_TX_BUFFER_SIZE];
+static uint16_t tx_length[TX_POOL_SIZE];
+static uint8_t tx_queue[TX_POOL_SIZE];
+static uint8_t tx_queue_head;
+static uint8_t tx_queue_count;
+static uint8_t tx_free[TX_POOL_SIZE];
+static uint8_t tx_free_count;
+static uint8_t tx_build;
+static Semaphore sem_tx_free;
 
 static const SPIConfig wlan_spi_cfg = {
-    .end_cb = NULL,
+    .end_cb = spi_end_cb,
     .ssport = PORT_WIFI_CS,
     .sspad = PAD_WIFI_CS,
     .cr1 = SPI_CR1_CPHA
@@ -68,14 +132,14 @@ static const SPIConfig wlan_spi_cfg = {
 static const EXTConfig extcfg = {
     .channels = {
         [12] = {
-            .mode = EXT_CH_MODE_FALLING_EDGE | EXT_MODE_GPIOD,
+            .mode = EXT_CH_MODE_BOTH_EDGES | EXT_MODE_GPIOD,
             .cb = wifi_irq_cb
         },
     },
 };
 
-// Static buffer for 5 bytes of SPI HEADER
-static const uint8_t tSpiReadHeader[] = {SPI_READ_OP, 0, 0, 0, 0};
+// Read header, followed by the first bytes of the event, sent in one go
+static const uint8_t tSpiReadHeader[HEADERS_SIZE_EVNT] = {SPI_READ_OP, 0, 0, 0, 0};
 
 //*****************************************************************************
 //
@@ -100,6 +164,17 @@ spi_close(void)
     io_thread = NULL;
   }
 
+  chSysLock();
+  if (chVTIsArmedI(&irq_check_timer))
+    chVTResetI(&irq_check_timer);
+  spiState = SPI_STATE_POWERUP;
+
+  // Queued packets are dropped, and a writer waiting for a buffer is
+  // woken with the pool back to its initial state
+  tx_pool_reset();
+  chSemResetI(&sem_tx_free, TX_POOL_SIZE - 1);
+  chSysUnlock();
+
   // Disable Interrupt
   if (EXTD1.state == EXT_ACTIVE)
     extChannelDisable(&EXTD1, 12);
@@ -131,105 +206,161 @@ spi_open()
 
   chSemInit(&sem_init, 0);
   chSemInit(&sem_io_ready, 0);
-  chSemInit(&sem_write_complete, 0);
+  chSemInit(&sem_tx_free, TX_POOL_SIZE - 1);
 
   spiState = SPI_STATE_POWERUP;
-  txPacketLength = 0;
-  txPacket = NULL;
+  tx_pool_reset();
   rxPacketLength = 0;
+  irq_pending = false;
+  irq_was_low = false;
 
   // Enable interrupt on WLAN IRQ pin
   extChannelEnable(&EXTD1, 12);
 
+  chSysLock();
+  chVTSetI(&irq_check_timer, IRQ_LEVEL_CHECK_PERIOD, irq_check_cb, NULL);
+  chSysUnlock();
+
   io_thread = chThdCreateFromHeap(NULL, 1024, NORMALPRIO, spi_io_thread, NULL);
 
   // Set the device enable pin
   palSetPad(PORT_WIFI_EN, PAD_WIFI_EN);
 }
 
+static bool
+irq_asserted()
+{
+  return (palReadPad(PORT_WIFI_IRQ, PAD_WIFI_IRQ) == 0);
+}
+
+/* Acts on the CC3000 asserting IRQ. While idle that means it has data for
+ * us, and after CS has been asserted for a write it means it is ready to
+ * take it. An edge in the middle of a transaction is remembered until the
+ * bus is idle again.
+ */
 static void
-wait_io_ready()
+irq_event_i()
 {
-  while (1) {
-    /* Wait for the I/O ready semaphore to be signalled. We need to include
-     * a timeout because occasionally we seem to be missing IRQ edges. We
-     * handle this by checking the IRQ line manually when the semaphore wait
-     * times out.
-     */
-    msg_t rdy = chSemWaitTimeout(&sem_io_ready, S2ST(2));
+  switch (spiState) {
+  case SPI_STATE_POWERUP:
+    chSemSignalI(&sem_init);
+    break;
 
-    /* If the semaphore has been signalled, we are ready to read or write */
-    if (rdy == RDY_OK) {
-      break;
-    }
-    /* Check if IRQ is asserted */
-    else if (irq_asserted()) {
-      irq_timeout_count++;
-      break;
+  case SPI_STATE_IDLE:
+  case SPI_STATE_WRITE_RELEASE:
+    start_read_i();
+    break;
+
+  case SPI_STATE_WRITE_IRQ:
+    {
+      uint8_t i = tx_queue[tx_queue_head];
+
+      spiState = SPI_STATE_WRITE;
+      spiStartSendI(SPI_WLAN, tx_length[i], wlan_tx_pool[i]);
     }
+    break;
+
+  default:
+    irq_pending = true;
+    break;
   }
 }
 
-static bool
-irq_asserted()
+/* Acts on the CC3000 releasing IRQ at the end of a transaction */
+static void
+irq_released_i()
 {
-  return (palReadPad(PORT_WIFI_IRQ, PAD_WIFI_IRQ) == 0);
+  if (spiState == SPI_STATE_WRITE_RELEASE)
+    start_write_i();
 }
 
-static msg_t
-spi_io_thread(void* arg)
+/* Starts whatever is waiting once the bus is idle. Data the CC3000 has
+ * signalled is read before a write is started. The IRQ level is only
+ * trusted here because the edge was seen after CS was last released.
+ */
+static void
+start_next_i()
 {
-  (void)arg;
-
-  chRegSetThreadName("spi_read");
+  if (irq_pending) {
+    irq_pending = false;
+    if (irq_asserted()) {
+      start_read_i();
+      return;
+    }
+  }
 
-  while (TRUE) {
-    wait_io_ready();
+  if (tx_queue_count > 0)
+    start_write_i();
+}
 
-    if (chThdShouldTerminate())
-      break;
+/* The header and the first bytes of the packet are read in one DMA
+ * exchange. Events are at least that long, so the rest follows in one more.
+ */
+static void
+start_read_i()
+{
+  spiState = SPI_STATE_READ_HEADER;
+  spiSelectI(SPI_WLAN);
+  spiStartExchangeI(SPI_WLAN, HEADERS_SIZE_EVNT, tSpiReadHeader, wlan_rx_buffer);
+}
 
-    /* If a write is pending, handle that first */
-    if (txPacket != NULL && txPacketLength > 0) {
-      /* Assert the CS line to indicate to the CC3000 that we have data to send */
-      ASSERT_CS();
+/* Asserts CS and leaves the transfer to the CC3000's IRQ in response. The
+ * CC3000 holds IRQ for a moment after CS is released, and CS asserted in
+ * that time would get no edge, so a write right after a transaction waits
+ * for IRQ to be released first.
+ */
+static void
+start_write_i()
+{
+  if (irq_asserted()) {
+    spiState = SPI_STATE_WRITE_RELEASE;
+    return;
+  }
 
-      /* Wait for the CC3000 to respond by asserting the IRQ line */
-      wait_io_ready();
+  spiState = SPI_STATE_WRITE_IRQ;
+  spiSelectI(SPI_WLAN);
+}
 
-      /* Commence write operation */
-      spiSend(SPI_WLAN, txPacketLength, txPacket);
+static void
+end_transfer_i()
+{
+  spiUnselectI(SPI_WLAN);
+  num_transfers++;
+}
 
-      DEASSERT_CS();
+/* Hands the packet to the I/O thread, which frees the RX buffer again */
+static void
+end_read_i()
+{
+  end_transfer_i();
 
-      /* Clear the pending write vars */
-      txPacket = NULL;
-      txPacketLength = 0;
-      
-      /* Signal the waiting thread that the write is complete */
-      chSemSignal(&sem_write_complete);
-    }
-    else {
-      /* Assert CS to start read */
-      ASSERT_CS();
+  spiState = SPI_STATE_READ_DONE;
+  chSemSignalI(&sem_io_ready);
+}
 
-      /* Read header */
-      spiExchange(SPI_WLAN, SPI_HEADER_SIZE, tSpiReadHeader, wlan_rx_buffer);
+static msg_t
+spi_io_thread(void* arg)
+{
+  (void)arg;
 
-      /* Read payload */
-      uint16_t payload_size = (wlan_rx_buffer[3] << 8) | (wlan_rx_buffer[4]);
-      if ((payload_size & 1) == 0)
-        payload_size++;
+  chRegSetThreadName("spi_read");
 
-      if (payload_size)
-        spiReceive(SPI_WLAN, payload_size, wlan_rx_buffer + SPI_HEADER_SIZE);
+  while (TRUE) {
+    chSemWait(&sem_io_ready);
 
-      DEASSERT_CS();
+    if (chThdShouldTerminate())
+      break;
 
+    if (spiState == SPI_STATE_READ_DONE) {
       /* Dispatch the data to the HCI module */
-      hci_dispatch_packet(wlan_rx_buffer + SPI_HEADER_SIZE, payload_size);
+      hci_dispatch_packet(wlan_rx_buffer + SPI_HEADER_SIZE, rxPacketLength);
+
+      /* The RX buffer is free again, so the next transaction can start */
+      chSysLock();
+      spiState = SPI_STATE_IDLE;
+      start_next_i();
+      chSysUnlock();
     }
-    chThdSleepMilliseconds(5);
   }
 
   return 0;
@@ -262,16 +393,35 @@ spi_first_write(uint8_t *ucBuf, uint16_t usLength)
 
   spiSend(SPI_WLAN, usLength - 4, ucBuf + 4);
 
-  // From this point on - operate in a regular way
+  DEASSERT_CS();
+
+  // From this point on - operate in a regular way. CS is already released
+  // so an edge from here on starts a read.
+  chSysLock();
   spiState = SPI_STATE_IDLE;
+  chSysUnlock();
+}
 
-  DEASSERT_CS();
+static void
+tx_pool_reset()
+{
+  uint8_t i;
+
+  tx_build = 0;
+  tx_queue_head = 0;
+  tx_queue_count = 0;
+  tx_free_count = 0;
+  for (i = 1; i < TX_POOL_SIZE; ++i)
+    tx_free[tx_free_count++] = i;
 }
 
+/* Returns the buffer the next packet is built in. It stays the same until
+ * that packet is passed to spi_write().
+ */
 uint8_t*
 spi_get_buffer(void)
 {
-  return wlan_tx_buffer + SPI_HEADER_SIZE;
+  return wlan_tx_pool[tx_build] + SPI_HEADER_SIZE;
 }
 
 //*****************************************************************************
@@ -282,20 +432,24 @@ spi_get_buffer(void)
 //!
 //!  @return none
 //!
-//!  @brief  Spi write operation
+//!  @brief  Spi write operation. Queues the packet built in the buffer from
+//!          spi_get_buffer() and returns once there is a free buffer for
+//!          the next one, which may be before this one has been written.
 //
 //*****************************************************************************
 void
 spi_write(uint16_t usLength)
 {
+  uint8_t* tx_buffer = wlan_tx_pool[tx_build];
+
   if((usLength & 1) == 0)
     usLength++;
 
-  wlan_tx_buffer[0] = SPI_WRITE_OP;
-  wlan_tx_buffer[1] = (usLength >> 8) & 0xFF;
-  wlan_tx_buffer[2] = (usLength) & 0xFF;
-  wlan_tx_buffer[3] = 0;
-  wlan_tx_buffer[4] = 0;
+  tx_buffer[0] = SPI_WRITE_OP;
+  tx_buffer[1] = (usLength >> 8) & 0xFF;
+  tx_buffer[2] = (usLength) & 0xFF;
+  tx_buffer[3] = 0;
+  tx_buffer[4] = 0;
 
   usLength += SPI_HEADER_SIZE;
 
@@ -304,17 +458,100 @@ spi_write(uint16_t usLength)
 
     // This is time for first TX/RX transactions over SPI: the IRQ is down -
     // so need to send read buffer size command
-    spi_first_write(wlan_tx_buffer, usLength);
+    spi_first_write(tx_buffer, usLength);
   }
   else {
-    txPacketLength = usLength;
-    txPacket = wlan_tx_buffer;
+    chSysLock();
+
+    tx_length[tx_build] = usLength;
+    tx_queue[(tx_queue_head + tx_queue_count) % TX_POOL_SIZE] = tx_build;
+    tx_queue_count++;
+
+    /* Start it now if the bus is free, otherwise the end of the current
+     * transaction will
+     */
+    if (spiState == SPI_STATE_IDLE)
+      start_next_i();
+
+    if (chSemGetCounterI(&sem_tx_free) <= 0)
+      tx_pool_wait_count++;
+
+    /* A reset means the transport was closed, which has reset the pool */
+    if (chSemWaitS(&sem_tx_free) == RDY_OK)
+      tx_build = tx_free[--tx_free_count];
 
-    /* Signal the I/O thread to handle the write */
-    chSemSignalWait(&sem_io_ready, &sem_write_complete);
+    chSysUnlock();
   }
 }
 
+//*****************************************************************************
+//
+//!  spi_end_cb
+//!
+//!  @param  spip  the SPI driver
+//!
+//!  @return none
+//!
+//!  @brief  Called from the DMA interrupt at the end of each transfer.
+//!          Chains the payload read after the header and releases CS at
+//!          the end of a transaction.
+//
+//*****************************************************************************
+static void
+spi_end_cb(SPIDriver *spip)
+{
+  (void)spip;
+
+  chSysLockFromIsr();
+
+  switch (spiState) {
+  case SPI_STATE_WRITE:
+    end_transfer_i();
+
+    tx_free[tx_free_count++] = tx_queue[tx_queue_head];
+    tx_queue_head = (tx_queue_head + 1) % TX_POOL_SIZE;
+    tx_queue_count--;
+    spiState = SPI_STATE_IDLE;
+    chSemSignalI(&sem_tx_free);
+
+    start_next_i();
+    break;
+
+  case SPI_STATE_READ_HEADER:
+    {
+      uint16_t payload_size = (wlan_rx_buffer[3] << 8) | (wlan_rx_buffer[4]);
+      if ((payload_size & 1) == 0)
+        payload_size++;
+
+      // Never read past the end of the buffer, whatever the header says
+      if (payload_size > (CC3000_RX_BUFFER_SIZE - SPI_HEADER_SIZE))
+        payload_size = CC3000_RX_BUFFER_SIZE - SPI_HEADER_SIZE;
+      rxPacketLength = payload_size;
+
+      if (payload_size > (HEADERS_SIZE_EVNT - SPI_HEADER_SIZE)) {
+        spiState = SPI_STATE_READ_PAYLOAD;
+        spiStartReceiveI(SPI_WLAN,
+            payload_size - (HEADERS_SIZE_EVNT - SPI_HEADER_SIZE),
+            wlan_rx_buffer + HEADERS_SIZE_EVNT);
+      }
+      else {
+        end_read_i();
+      }
+    }
+    break;
+
+  case SPI_STATE_READ_PAYLOAD:
+    end_read_i();
+    break;
+
+  default:
+    // Transfers made during power up are waited on by the caller
+    break;
+  }
+
+  chSysUnlockFromIsr();
+}
+
 //*****************************************************************************
 //
 //!  wifi_irq_cb
@@ -337,20 +574,46 @@ wifi_irq_cb(EXTDriver *extp, expchannel_t channel)
 
   chSysLockFromIsr();
 
-  irq_count++;
+  if (irq_asserted()) {
+    irq_count++;
+    irq_event_i();
+  }
+  else {
+    irq_released_i();
+  }
 
-  switch (spiState) {
-  case SPI_STATE_POWERUP:
-    chSemSignalI(&sem_init);
-    break;
+  chSysUnlockFromIsr();
+}
 
-  case SPI_STATE_IDLE:
-    chSemSignalI(&sem_io_ready);
-    break;
+/* Runs every IRQ_LEVEL_CHECK_PERIOD from the system tick. Edges are
+ * occasionally missed, so an IRQ line which has stayed low across two
+ * checks without a transfer is handled as though its edge had been seen,
+ * and a write waiting for a release it missed is started.
+ */
+static void
+irq_check_cb(void* arg)
+{
+  (void)arg;
 
-  default:
-    break;
+  chSysLockFromIsr();
+
+  if (!irq_asserted())
+    irq_released_i();
+
+  bool low = irq_asserted() && (num_transfers == checked_transfers);
+
+  if (low && irq_was_low &&
+      (spiState == SPI_STATE_IDLE || spiState == SPI_STATE_WRITE_RELEASE ||
+       spiState == SPI_STATE_WRITE_IRQ)) {
+    irq_timeout_count++;
+    irq_event_i();
+    low = false;
   }
 
+  irq_was_low = low;
+  checked_transfers = num_transfers;
+
+  chVTSetI(&irq_check_timer, IRQ_LEVEL_CHECK_PERIOD, irq_check_cb, NULL);
+
   chSysUnlockFromIsr();
 }
@@ -56,6 +56,9 @@
 
 #define SL_PATCH_PORTION_SIZE                     (1000)
 
+// How long a data send waits for the CC3000 to release a TX buffer
+#define HCI_TX_CREDIT_TIMEOUT                     MS2ST(500)
+
 #define FLOW_CONTROL_EVENT_HANDLE_OFFSET           (0)
 #define FLOW_CONTROL_EVENT_BLOCK_MODE_OFFSET       (1)
 #define FLOW_CONTROL_EVENT_FREE_BUFFS_OFFSET       (2)
@@ -113,6 +116,7 @@ typedef struct {
 
 typedef struct {
   Semaphore sem_recv;
+  Semaphore sem_tx_credit;
   systime_t cmd_timeout;
   hci_stats_t stats;
 } hci_t;
@@ -144,10 +148,12 @@ hci_init()
   hci.stats.num_free_buffers = 0;
   hci.stats.buffer_len = 0;
   hci.stats.num_timeouts = 0;
+  hci.stats.num_credit_stalls = 0;
 
   hci.cmd_timeout = S2ST(20);
 
   chSemInit(&hci.sem_recv, 0);
+  chSemInit(&hci.sem_tx_credit, 0);
 }
 
 void
@@ -220,7 +226,10 @@ hci_command_send(
 //!
 //!  @return none
 //!
-//!  @brief              Initiate an HCI data write operation
+//!  @brief              Initiate an HCI data write operation. This does not
+//!                      wait for the send to complete: the caller must have
+//!                      claimed a device buffer with hci_claim_buffer(), and
+//!                      errors are reported later through the socket status.
 //
 //*****************************************************************************
 void
@@ -229,9 +238,7 @@ hci_data_send(
     uint16_t usArgsLength,
     uint16_t usDataLength,
     const uint8_t *ucTail,
-    uint16_t usTailLength,
-    uint16_t rx_opcode,
-    void* params)
+    uint16_t usTailLength)
 {
   uint8_t *stream;
 
@@ -244,15 +251,9 @@ hci_data_send(
   UINT8_TO_STREAM(stream, usArgsLength);
   stream = UINT16_TO_STREAM(stream, usArgsLength + usDataLength + usTailLength);
 
-  // Update the opcode of the event we will be waiting for
-  pending_cmd.params = params;
-  pending_cmd.opcode = rx_opcode;
-  pending_cmd.data_expected = false;
-
-  // Send the packet over the SPI
+  // Queue the packet for the SPI. The next packet is built in another
+  // buffer while this one goes out and is in flight in the CC3000.
   spi_write(HCI_DATA_HEADER_SIZE + usArgsLength + usDataLength + usTailLength);
-
-  wait_for_response();
 }
 
 
@@ -360,6 +361,8 @@ hci_patch_send(
         usDataLength -= usTransLength;
       }
 
+      // Each portion is built in the buffer the SPI has ready for it
+      data_ptr = spi_get_buffer();
       *(uint16_t *)data_ptr = usTransLength;
       memcpy(data_ptr + HCI_PATCH_PORTION_HEADER_SIZE, patch, usTransLength);
       patch += usTransLength;
@@ -535,15 +538,10 @@ hci_dispatch_event(
       }
       break;
 
+    // Sends are not waited on, so only the status of the completed send
+    // is of interest here
     case HCI_EVNT_SEND:
     case HCI_EVNT_SENDTO:
-      {
-        tBsdReadReturnParams* params = pending_cmd.params;
-        params->iSocketDescriptor = STREAM_TO_UINT32(pucReceivedParams, SL_RECEIVE_SD_OFFSET);
-        params->iNumberOfBytes = STREAM_TO_UINT32(pucReceivedParams, SL_RECEIVE_NUM_BYTES_OFFSET);
-      }
-      /* Intentional fall-through */
-
     case HCI_EVNT_WRITE:
       {
         int32_t sd = STREAM_TO_UINT32(pucReceivedParams, BSD_RSP_PARAMS_SOCKET_OFFSET);
@@ -561,8 +559,11 @@ hci_dispatch_event(
 
     case HCI_CMND_READ_BUFFER_SIZE:
       {
-        hci.stats.num_free_buffers = STREAM_TO_UINT8(pucReceivedParams, 0);
+        uint8_t num_free_buffers = STREAM_TO_UINT8(pucReceivedParams, 0);
+
+        hci.stats.num_free_buffers = num_free_buffers;
         hci.stats.buffer_len = STREAM_TO_UINT16(pucReceivedParams, 1);
+        chSemReset(&hci.sem_tx_credit, num_free_buffers);
       }
       break;
 
@@ -773,8 +774,15 @@ hci_event_unsol_flowcontrol_handler(
     pReadPayload += FLOW_CONTROL_EVENT_SIZE;
   }
 
+  // Each released buffer is a credit for one more data packet
+  chSysLock();
   hci.stats.num_free_buffers += temp;
   hci.stats.num_released_packets += temp;
+  if (temp > 0) {
+    chSemAddCounterI(&hci.sem_tx_credit, temp);
+    chSchRescheduleS();
+  }
+  chSysUnlock();
 
   return(ESUCCESS);
 }
@@ -804,17 +812,36 @@ hci_wait_for_data(
   wait_for_response();
 }
 
+//*****************************************************************************
+//
+//!  hci_claim_buffer
+//!
+//!  @return  true if a CC3000 TX buffer was claimed, false if none was
+//!           released within HCI_TX_CREDIT_TIMEOUT
+//!
+//!  @brief   Claims one of the CC3000's free TX buffers for a data packet.
+//!           Up to num_free_buffers packets can be in flight at once; after
+//!           that this blocks until the device releases one through the
+//!           HCI_EVNT_DATA_UNSOL_FREE_BUFF event.
+//
+//*****************************************************************************
 bool
 hci_claim_buffer()
 {
-  if (hci.stats.num_free_buffers > 0) {
+  chSysLock();
+
+  if (chSemGetCounterI(&hci.sem_tx_credit) <= 0)
+    hci.stats.num_credit_stalls++;
+
+  msg_t rdy = chSemWaitTimeoutS(&hci.sem_tx_credit, HCI_TX_CREDIT_TIMEOUT);
+  if (rdy == RDY_OK) {
     hci.stats.num_free_buffers--;
     hci.stats.num_sent_packets++;
-
-    return true;
   }
 
-  return false;
+  chSysUnlock();
+
+  return (rdy == RDY_OK);
 }
 
 //*****************************************************************************
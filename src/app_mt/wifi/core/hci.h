@@ -69,6 +69,7 @@ typedef struct {
   uint32_t num_sent_packets;
   uint32_t num_released_packets;
   uint32_t num_timeouts;
+  uint32_t num_credit_stalls;
 } hci_stats_t;
 
 
@@ -122,7 +123,8 @@ hci_command_send(
 //!
 //!  @return none
 //!
-//!  @brief              Initiate an HCI data write operation
+//!  @brief              Initiate an HCI data write operation without waiting
+//!                      for it to complete
 //
 //*****************************************************************************
 void
@@ -131,9 +133,7 @@ hci_data_send(
     uint16_t usArgsLength,
     uint16_t usDataLength,
     const uint8_t *ucTail,
-    uint16_t usTailLength,
-    uint16_t rx_opcode,
-    void* params);
+    uint16_t usTailLength);
 
 
 //*****************************************************************************
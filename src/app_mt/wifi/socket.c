@@ -42,6 +42,7 @@
 #include "socket.h"
 #include "core/c_socket.h"
 #include "wlan.h"
+#include "message.h"
 
 #include <string.h>
 #include <stdbool.h>
@@ -49,6 +50,27 @@
 
 #define MAX_NUM_OF_SOCKETS 4
 
+/* How long each select() holds g_main_mutex for, which bounds how long a
+ * send or other socket call waits behind it. Incoming data ends the select
+ * early.
+ */
+#define SELECT_TIMEOUT_MS 5
+
+/* How long the select thread leaves the CC3000 alone between selects which
+ * found nothing. A socket being opened or its data being consumed ends the
+ * wait early, so this only adds latency to data arriving on an idle socket
+ * and to new connections.
+ */
+#define SELECT_IDLE_MS 20
+
+/* The CC3000 has no event for data arriving, so readiness can only come
+ * from select. After data is sent or received a reply is likely, so for
+ * this long the select thread selects back to back instead of idling in
+ * between. Other socket calls still get g_main_mutex after at most one
+ * select, since it goes to its waiters when the select thread unlocks it.
+ */
+#define SELECT_BUSY_MS 250
+
 
 typedef struct {
   int sd;
@@ -59,12 +81,22 @@ typedef struct {
   long nonblock;
 } wlan_socket_t;
 
-
+
 static msg_t
 socket_io_thread(void* arg);
 
+static void
+select_wakeup(void);
+
+static bool
+socket_data_pending(wlan_socket_t* s);
+
+static systime_t
+socket_recv_timeout(long sd);
+
 static int
-common_recv(long sd, void *buf, long len, long flags, sockaddr *from, socklen_t *fromlen);
+common_recv(long sd, void *buf, long len, long flags, sockaddr *from, socklen_t *fromlen,
+    systime_t timeout);
 
 static int
 common_send(long sd, const void *buf, long len, long flags, const sockaddr *to, socklen_t tolen);
@@ -84,7 +116,7 @@ extern int g_wlan_stopped;
 
 static wlan_socket_t sockets[MAX_NUM_OF_SOCKETS];
 static Semaphore accept_semaphore;
-static Semaphore select_sleep_semaphore;
+static BinarySemaphore select_wakeup_semaphore;
 static Thread* select_thread;
 
 static int accept_new_sd;
@@ -92,7 +124,8 @@ static int accept_socket;
 static int accept_addrlen;
 static int should_poll_accept;
 static sockaddr accept_sock_addr;
-
+static systime_t last_activity_time;
+
 
 void
 socket_start()
@@ -104,11 +137,12 @@ socket_start()
     sockets[i].status = SOCKET_STATUS_INACTIVE;
     sockets[i].recv_timeout = TIME_INFINITE;
     sockets[i].nonblock = SOCK_OFF;
-    chBSemInit(&sockets[i].sd_semaphore, FALSE);
+    /* Taken means no data is waiting, so the select thread watches it */
+    chBSemInit(&sockets[i].sd_semaphore, TRUE);
   }
 
   chSemInit(&accept_semaphore, 0);
-  chSemInit(&select_sleep_semaphore, 0);
+  chBSemInit(&select_wakeup_semaphore, TRUE);
   should_poll_accept = 0;
   accept_socket = -1;
 
@@ -122,7 +156,7 @@ socket_stop()
 
   if (select_thread != NULL) {
     chThdTerminate(select_thread);
-    chSemSignal(&select_sleep_semaphore);
+    select_wakeup();
     chThdWait(select_thread);
     select_thread = NULL;
   }
@@ -199,6 +233,7 @@ find_add_next_free_socket(int sd)
       sockets[i].sd = sd;
       sockets[i].recv_timeout = TIME_INFINITE;
       sockets[i].nonblock = SOCK_OFF;
+      chBSemReset(&sockets[i].sd_semaphore, TRUE);
       return;
     }
   }
@@ -212,6 +247,10 @@ find_clear_socket(int sd)
     if (sockets[i].sd == sd){
       sockets[i].status = SOCKET_STATUS_INACTIVE;
       sockets[i].sd = -1;
+      /* Drop any data reported for the old socket, and wake a recv which
+       * is still waiting on it
+       */
+      chBSemReset(&sockets[i].sd_semaphore, TRUE);
     }
   }
 }
@@ -229,6 +268,30 @@ find_socket_by_sd(long sd)
   return NULL;
 }
 
+/* Wakes the select thread so that it picks up a change in the set of
+ * sockets it should be watching.
+ */
+static void
+select_wakeup()
+{
+  chBSemSignal(&select_wakeup_semaphore);
+}
+
+/* Returns true if select has reported data on the socket which has not yet
+ * been consumed by a recv.
+ */
+static bool
+socket_data_pending(wlan_socket_t* s)
+{
+  bool pending;
+
+  chSysLock();
+  pending = !chBSemGetStateI(&s->sd_semaphore);
+  chSysUnlock();
+
+  return pending;
+}
+
 //*****************************************************************************
 //
 //! socket
@@ -264,6 +327,8 @@ socket(long domain, long type, long protocol)
         find_add_next_free_socket(ret);
     chMtxUnlock();
 
+    select_wakeup();
+
     return(ret);
 }
 
@@ -356,8 +421,8 @@ accept(long sd, sockaddr *addr, socklen_t *addrlen)
 
     should_poll_accept = 1;
     /* wakeup select thread if needed, and go to sleep until polling succeeds */
-    chSemSignalWait(&select_sleep_semaphore, &accept_semaphore);
-    chSemWait(&select_sleep_semaphore); /* suspend select thread until waiting for more data */
+    select_wakeup();
+    chSemWait(&accept_semaphore);
 
     if (g_wlan_stopped) { /* if wlan_stop then return */
         should_poll_accept = 0;
@@ -366,8 +431,10 @@ accept(long sd, sockaddr *addr, socklen_t *addrlen)
 
     /* New socket created and accept success or SOC_ERROR
        If sock error do not take an empty place in the sockets array */
-    if (accept_new_sd != SOC_ERROR)
+    if (accept_new_sd != SOC_ERROR) {
         find_add_next_free_socket(accept_new_sd);
+        select_wakeup();
+    }
 
     memcpy(addr, &accept_sock_addr, accept_addrlen);
     memcpy(addrlen, &accept_addrlen, sizeof(socklen_t));
@@ -748,7 +815,13 @@ getsockopt(long sd, long level, long optname, void *optval, socklen_t *optlen)
 int
 recv(long sd, void *buf, long len, long flags)
 {
-  return common_recv(sd, buf, len, flags, NULL, NULL);
+  return common_recv(sd, buf, len, flags, NULL, NULL, socket_recv_timeout(sd));
+}
+
+int
+recv_timeout(long sd, void *buf, long len, long flags, systime_t timeout)
+{
+  return common_recv(sd, buf, len, flags, NULL, NULL, timeout);
 }
 
 //*****************************************************************************
@@ -788,15 +861,28 @@ recvfrom(long sd, void *buf, long len, long flags,
     return -1;
   }
 
-  return common_recv(sd, buf, len, flags, from, fromlen);
+  return common_recv(sd, buf, len, flags, from, fromlen, socket_recv_timeout(sd));
+}
+
+/* Returns how long recv waits on the socket, as set by setsockopt */
+static systime_t
+socket_recv_timeout(long sd)
+{
+  wlan_socket_t* s = find_socket_by_sd(sd);
+  if (s == NULL)
+    return TIME_IMMEDIATE;
+
+  if (s->nonblock == SOCK_ON)
+    return TIME_IMMEDIATE;
+
+  return s->recv_timeout;
 }
 
 static int
 common_recv(long sd, void *buf, long len, long flags,
-    sockaddr *from, socklen_t *fromlen)
+    sockaddr *from, socklen_t *fromlen, systime_t timeout)
 {
   int ret = -1;
-  systime_t timeout;
 
   wlan_socket_t* s = find_socket_by_sd(sd);
   if (s == NULL) {
@@ -815,17 +901,8 @@ common_recv(long sd, void *buf, long len, long flags,
     return -1;
   }
 
-  if (s->nonblock == SOCK_ON)
-    timeout = TIME_IMMEDIATE;
-  else
-    timeout = s->recv_timeout;
-
-  /* wakeup select thread if needed */
-  chSemSignal(&select_sleep_semaphore);
-  /* wait for data to become available */
+  /* wait for the select thread to report data */
   msg_t rdy = chBSemWaitTimeout(&s->sd_semaphore, timeout);
-  /* suspend select thread until waiting for more data */
-  chSemWait(&select_sleep_semaphore);
 
   if (rdy == RDY_TIMEOUT) {
     errno = EWOULDBLOCK;
@@ -845,6 +922,9 @@ common_recv(long sd, void *buf, long len, long flags,
     else
       ret = c_recvfrom(sd, buf, len, flags, from, fromlen);
     chMtxUnlock();
+
+    /* the data has been consumed, so watch the socket again */
+    select_wakeup();
   }
 
   return ret;
@@ -957,6 +1037,10 @@ common_send(long sd, const void *buf, long len, long flags,
     ret = c_send(sd, buf, len, flags);
   chMtxUnlock();
 
+  /* Watch closely for the reply */
+  last_activity_time = chTimeNow();
+  select_wakeup();
+
   return ret;
 }
 
@@ -970,20 +1054,16 @@ socket_io_thread(void *arg)
 
   int ret = 0;
   int maxFD = 0;
+  int num_watched = 0;
   int i = 0;
 
   chRegSetThreadName("socket_io");
 
   memset(&timeout, 0, sizeof(struct timeval));
   timeout.tv_sec = 0;
-  timeout.tv_usec = (200 * 1000);          /* 200 msecs */
+  timeout.tv_usec = (SELECT_TIMEOUT_MS * 1000);
 
   while (1) {
-    /* first check if recv/recvfrom/accept was called */
-    chSemWait(&select_sleep_semaphore);
-    /* increase the count back by one to be decreased by the original caller */
-    chSemSignal(&select_sleep_semaphore);
-
     if (chThdShouldTerminate()) {
       /* Wlan_stop will terminate the thread and by that all
          sync objects owned by it will be released */
@@ -991,25 +1071,45 @@ socket_io_thread(void *arg)
     }
 
     WFD_ZERO(&readsds);
+    maxFD = 0;
+    num_watched = 0;
 
-    /* ping correct socket descriptor param for select */
+    /* Watch every open socket whose last reported data has been consumed */
     for (i = 0; i < MAX_NUM_OF_SOCKETS; i++){
-      if (sockets[i].status == SOCKET_STATUS_ACTIVE){
+      if (sockets[i].status == SOCKET_STATUS_ACTIVE &&
+          sockets[i].sd != accept_socket &&
+          !socket_data_pending(&sockets[i])) {
         WFD_SET(sockets[i].sd, &readsds);
         if (maxFD <= sockets[i].sd)
           maxFD = sockets[i].sd + 1;
+        num_watched++;
       }
     }
 
+    /* Sleep until a socket is opened, data is consumed or accept is called */
+    if (num_watched == 0 && !should_poll_accept) {
+      chBSemWait(&select_wakeup_semaphore);
+      continue;
+    }
+
     ret = wfd_select(maxFD, &readsds, NULL, NULL, &timeout); /* Polling instead of blocking here\
                                                               to process "accept" below */
 
     if (ret>0) {
+      last_activity_time = chTimeNow();
+
       for (i = 0; i < MAX_NUM_OF_SOCKETS; i++) {
         if (sockets[i].status == SOCKET_STATUS_ACTIVE && //check that the socket is valid
             sockets[i].sd != accept_socket &&    //verify this is not an accept socket
             WFD_ISSET(sockets[i].sd, &readsds)) {    //and has pending data
+          int32_t sd = sockets[i].sd;
+
           chBSemSignal(&sockets[i].sd_semaphore); //release the semaphore
+
+          /* Subscribers should be coalesced so that this never blocks
+             waiting for a listener which may itself be waiting on a socket
+             call, and the notification is never dropped */
+          msg_send_keyed(MSG_WLAN_SOCKET_READY, sd, &sd);
         }
       }
     }
@@ -1031,6 +1131,12 @@ socket_io_thread(void *arg)
       if (accept_new_sd != SOC_IN_PROGRESS)
         chSemSignal(&accept_semaphore);
     }
+
+    /* Unless data has just been sent or received, leave the CC3000 alone
+     * for a while before selecting again */
+    if ((ret <= 0) &&
+        ((chTimeNow() - last_activity_time) >= MS2ST(SELECT_BUSY_MS)))
+      chBSemWaitTimeout(&select_wakeup_semaphore, MS2ST(SELECT_IDLE_MS));
   }
 
   return 0;
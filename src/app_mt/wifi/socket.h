@@ -445,6 +445,33 @@ extern int getsockopt(long sd, long level, long optname, void *optval,
 //*****************************************************************************
 extern int recv(long sd, void *buf, long len, long flags);
 
+//*****************************************************************************
+//
+//!  recv_timeout
+//!
+//!  @param[in]  sd       socket handle
+//!  @param[out] buf      Points to the buffer where the message should be stored
+//!  @param[in]  len      Specifies the length in bytes of the buffer pointed to
+//!                       by the buffer argument.
+//!  @param[in]  flags    Specifies the type of message reception.
+//!                       On this version, this parameter is not supported.
+//!  @param[in]  timeout  How long to wait for data. TIME_IMMEDIATE returns
+//!                       at once and TIME_INFINITE waits forever.
+//!
+//!  @return         Return the number of bytes received, or -1 if an error
+//!                  occurred. errno is EWOULDBLOCK if no data arrived in time.
+//!
+//!  @brief          Like recv, but waits for the given time instead of the
+//!                  socket's SOCKOPT_RECV_TIMEOUT and SOCKOPT_RECV_NONBLOCK
+//!                  settings. The wait is done on the host, so switching
+//!                  between blocking and non-blocking reads costs nothing.
+//!
+//!  @sa recv
+//
+//*****************************************************************************
+extern int recv_timeout(long sd, void *buf, long len, long flags,
+                        systime_t timeout);
+
 //*****************************************************************************
 //
 //!  recvfrom
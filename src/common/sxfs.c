@@ -38,6 +38,14 @@ static const part_info_t part_info[NUM_SXFS_PARTS] = {
         .offset = 0x00320000,
         .size   = 0x00010000 // 64 KB
     },
+    [SP_TEMP_HISTORY] = {
+        .offset = 0x00330000,
+        .size   = 0x00080000 // 512 KB
+    },
+    [SP_TEMP_PROFILES] = {
+        .offset = 0x003B0000,
+        .size   = 0x00040000 // 256 KB
+    },
 };
 
 
@@ -111,6 +119,15 @@ sxfs_read(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_
   return true;
 }
 
+uint32_t
+sxfs_get_size(sxfs_part_id_t part_id)
+{
+  if (part_id >= NUM_SXFS_PARTS)
+    return 0;
+
+  return part_info[part_id].size;
+}
+
 bool
 sxfs_crc(sxfs_part_id_t part_id, uint32_t offset, uint32_t size, uint32_t* crc)
 {
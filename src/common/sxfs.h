@@ -20,6 +20,8 @@ typedef enum {
   SP_WEB_API_BACKLOG,
   SP_APP_CFG_1,
   SP_APP_CFG_2,
+  SP_TEMP_HISTORY,
+  SP_TEMP_PROFILES,
 
   NUM_SXFS_PARTS
 } sxfs_part_id_t;
@@ -40,6 +42,9 @@ sxfs_erase_all(sxfs_part_id_t part_id);
 bool
 sxfs_is_erased(sxfs_part_id_t part_id, uint32_t offset, uint32_t data_len);
 
+uint32_t
+sxfs_get_size(sxfs_part_id_t part_id);
+
 bool
 sxfs_crc(sxfs_part_id_t part_id, uint32_t offset, uint32_t size, uint32_t* crc);
 
@@ -0,0 +1,429 @@
+
+#include "test.h"
+
+/* The codec is private to app_cfg.c, so the tests build it directly */
+#include "app_cfg.c"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+
+/* Tests the tagged settings record in app_cfg.c: round trips through the
+ * encoder and decoder, damaged and truncated records, records from newer
+ * firmware, loading from flash including the legacy raw struct, and readers
+ * copying settings while another thread writes them.
+ */
+
+#define TEST_PART_SIZE 8192
+#define STRESS_READS   200000
+
+systime_t test_time;
+int test_failures;
+
+static uint8_t flash[NUM_SXFS_PARTS][TEST_PART_SIZE];
+
+
+bool
+sxfs_write(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  if (offset + data_len > TEST_PART_SIZE)
+    return false;
+  memcpy(&flash[part_id][offset], data, data_len);
+  return true;
+}
+
+bool
+sxfs_read(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  if (offset + data_len > TEST_PART_SIZE)
+    return false;
+  memcpy(data, &flash[part_id][offset], data_len);
+  return true;
+}
+
+bool
+sxfs_erase_all(sxfs_part_id_t part_id)
+{
+  memset(flash[part_id], 0xFF, TEST_PART_SIZE);
+  return true;
+}
+
+void
+touch_calib_reset(void)
+{
+}
+
+void
+msg_send(msg_id_t id, void* msg_data)
+{
+  (void)id;
+  (void)msg_data;
+}
+
+void
+msg_send_keyed(msg_id_t id, uint32_t key, void* msg_data)
+{
+  (void)id;
+  (void)key;
+  (void)msg_data;
+}
+
+/* Defaults with every kind of record filled in */
+static void
+make_settings(app_cfg_data_t* data)
+{
+  int i;
+
+  app_cfg_set_defaults();
+  app_cfg_local.data.reset_count = 1234;
+  app_cfg_local.data.temp_unit = UNIT_TEMP_DEG_C;
+  app_cfg_local.data.hysteresis.value = 0.5;
+
+  for (i = 0; i < 3; ++i) {
+    sensor_config_t* config = &app_cfg_local.data.sensor_configs[i];
+    memset(config->sensor_serial, 0x10 + i, sizeof(sensor_serial_t));
+    config->offset.value = i - 1;
+    config->offset.unit = UNIT_TEMP_DEG_C;
+  }
+
+  temp_profile_t* profile = &app_cfg_local.data.controller_settings[CONTROLLER_2].temp_profile;
+  app_cfg_local.data.controller_settings[CONTROLLER_2].setpoint_type = SP_TEMP_PROFILE;
+  profile->id = 42;
+  strcpy(profile->name, "Lager");
+  profile->start_value.value = 50;
+  profile->completion_action = TEMP_PROFILE_COMPLETION_ACTION_START_OVER;
+  profile->num_steps = 5;
+  for (i = 0; i < (int)profile->num_steps; ++i) {
+    profile->steps[i].duration = 3600 * (i + 1);
+    profile->steps[i].value.value = 50 + i;
+    profile->steps[i].type = (i & 1) ? STEP_RAMP : STEP_HOLD;
+  }
+
+  app_cfg_local.data.temp_profile_checkpoints[CONTROLLER_2].temp_profile_id = 42;
+  app_cfg_local.data.temp_profile_checkpoints[CONTROLLER_2].current_step = 3;
+
+  strcpy(app_cfg_local.data.auth_token, "0123456789abcdef");
+  strcpy(app_cfg_local.data.net_settings.ssid, "brewery");
+  strcpy(app_cfg_local.data.net_settings.passphrase, "hunter22");
+  app_cfg_local.data.net_settings.security_mode = 3;
+  app_cfg_local.data.net_settings.ip_config = IP_CFG_STATIC;
+  app_cfg_local.data.net_settings.ip = 0xC0A80164;
+
+  app_cfg_local.data.fault.type = BUS_FAULT;
+  app_cfg_local.data.fault.data[0] = 0xAA;
+  app_cfg_local.data.fault.data[9] = 0x55;
+
+  strcpy(app_cfg_local.data.net_lease.ssid, "brewery");
+  app_cfg_local.data.net_lease.ip = 0x2A01A8C0;
+  app_cfg_local.data.net_lease.subnet_mask = 0x00FFFFFF;
+  app_cfg_local.data.net_lease.gateway = 0x0101A8C0;
+  app_cfg_local.data.net_lease.dns_server = 0x0101A8C0;
+  app_cfg_local.data.server_addr = 0x341F0A0B;
+
+  *data = app_cfg_local.data;
+}
+
+static uint32_t
+encode(const app_cfg_data_t* data, uint8_t* rec)
+{
+  uint32_t rec_len = app_cfg_encode(data, rec, APP_CFG_MAX_ENCODED);
+  CHECK(rec_len > sizeof(app_cfg_header_t) + sizeof(uint32_t));
+  return rec_len;
+}
+
+/* Decodes a payload on top of the defaults, as app_cfg_load_from() does */
+static bool
+decode(const uint8_t* payload, uint32_t len, app_cfg_data_t* out)
+{
+  app_cfg_set_defaults();
+  bool ret = app_cfg_decode(&app_cfg_local.data, payload, len);
+  *out = app_cfg_local.data;
+  return ret;
+}
+
+/* Returns the payload of the first tag record starting with first_byte */
+static uint8_t*
+find_record(uint8_t* payload, uint32_t len, cfg_tag_t tag, uint8_t first_byte)
+{
+  uint32_t pos = 0;
+  while (pos + 3 <= len) {
+    uint32_t rec_len = payload[pos + 1] | (payload[pos + 2] << 8);
+    if (payload[pos] == tag && rec_len > 0 && payload[pos + 3] == first_byte)
+      return payload + pos + 3;
+    pos += 3 + rec_len;
+  }
+  return NULL;
+}
+
+static void
+test_round_trip(void)
+{
+  app_cfg_data_t data;
+  app_cfg_data_t decoded;
+  uint8_t* rec = malloc(APP_CFG_MAX_ENCODED);
+
+  make_settings(&data);
+  uint32_t rec_len = encode(&data, rec);
+
+  /* Unused sensor configs, profile steps and fault data are not stored */
+  CHECK(rec_len < sizeof(app_cfg_data_t) / 4);
+
+  app_cfg_header_t hdr;
+  memcpy(&hdr, rec, sizeof(hdr));
+  CHECK_EQ(hdr.magic, APP_CFG_MAGIC);
+  CHECK_EQ(hdr.version, APP_CFG_FORMAT_VERSION);
+  CHECK_EQ(hdr.length, rec_len - sizeof(hdr) - sizeof(uint32_t));
+
+  CHECK(decode(rec + sizeof(hdr), hdr.length, &decoded));
+  CHECK(memcmp(&decoded, &data, sizeof(data)) == 0);
+
+  free(rec);
+}
+
+static void
+test_truncated_record(void)
+{
+  app_cfg_data_t data;
+  app_cfg_data_t decoded;
+  uint8_t* rec = malloc(APP_CFG_MAX_ENCODED);
+
+  make_settings(&data);
+  uint32_t payload_len = encode(&data, rec) - sizeof(app_cfg_header_t) - sizeof(uint32_t);
+  const uint8_t* payload = rec + sizeof(app_cfg_header_t);
+
+  /* Cutting a record short is rejected, cutting between records is not */
+  uint32_t len;
+  uint32_t boundary = 0;
+  for (len = 0; len < payload_len; ++len) {
+    bool at_boundary = (len == boundary);
+    if (at_boundary)
+      boundary += 3 + (payload[boundary + 1] | (payload[boundary + 2] << 8));
+
+    CHECK_EQ(decode(payload, len, &decoded), at_boundary);
+  }
+  CHECK_EQ(boundary, payload_len);
+
+  free(rec);
+}
+
+static void
+test_newer_records(void)
+{
+  app_cfg_data_t data;
+  app_cfg_data_t decoded;
+  uint8_t* rec = malloc(APP_CFG_MAX_ENCODED);
+  uint8_t* payload = malloc(APP_CFG_MAX_ENCODED);
+
+  make_settings(&data);
+  uint32_t len = encode(&data, rec) - sizeof(app_cfg_header_t) - sizeof(uint32_t);
+
+  /* An unknown tag and an OTA checkpoint with fields added after it */
+  static const uint8_t unknown[] = { 200, 3, 0, 1, 2, 3 };
+  uint32_t ota_len = sizeof(ota_update_checkpoint_t) + 4;
+  memcpy(payload, unknown, sizeof(unknown));
+  payload[sizeof(unknown)] = CFG_TAG_OTA_CHECKPOINT;
+  payload[sizeof(unknown) + 1] = ota_len;
+  payload[sizeof(unknown) + 2] = 0;
+  memset(payload + sizeof(unknown) + 3, 0, ota_len);
+  memcpy(payload + sizeof(unknown) + 3 + ota_len, rec + sizeof(app_cfg_header_t), len);
+  len += sizeof(unknown) + 3 + ota_len;
+
+  CHECK(decode(payload, len, &decoded));
+  CHECK(memcmp(&decoded, &data, sizeof(data)) == 0);
+
+  /* A short blob record keeps the defaults past its end */
+  float value = 2.5;
+  uint8_t short_hysteresis[3 + sizeof(float)] = { CFG_TAG_HYSTERESIS, sizeof(float), 0 };
+  memcpy(short_hysteresis + 3, &value, sizeof(float));
+  CHECK(decode(short_hysteresis, sizeof(short_hysteresis), &decoded));
+  CHECK_NEAR(decoded.hysteresis.value, 2.5, 0.001);
+  CHECK_EQ(decoded.hysteresis.unit, UNIT_TEMP_DEG_F);
+
+  free(payload);
+  free(rec);
+}
+
+static void
+test_profile_steps_limit(void)
+{
+  app_cfg_data_t data;
+  app_cfg_data_t decoded;
+  uint8_t* rec = malloc(APP_CFG_MAX_ENCODED);
+
+  make_settings(&data);
+  data.controller_settings[CONTROLLER_1].temp_profile.num_steps = 40;
+  uint32_t rec_len = encode(&data, rec);
+
+  CHECK(decode(rec + sizeof(app_cfg_header_t),
+      rec_len - sizeof(app_cfg_header_t) - sizeof(uint32_t), &decoded));
+  CHECK_EQ(decoded.controller_settings[CONTROLLER_1].temp_profile.num_steps, 32);
+
+  /* A step count past the inline steps is corrupt */
+  uint8_t* cs = find_record(rec + sizeof(app_cfg_header_t),
+      rec_len - sizeof(app_cfg_header_t) - sizeof(uint32_t),
+      CFG_TAG_CONTROLLER_SETTINGS, CONTROLLER_2);
+  CHECK(cs != NULL);
+  uint8_t* num_steps = cs + 2 + sizeof(quantity_t) +
+      (NUM_OUTPUTS * (2 + sizeof(quantity_t))) + 1 + 4 +
+      1 + strlen("Lager") + sizeof(quantity_t) + 4 + 1;
+  CHECK_EQ(*num_steps, 5);
+  *num_steps = 33;
+  CHECK(!decode(rec + sizeof(app_cfg_header_t),
+      rec_len - sizeof(app_cfg_header_t) - sizeof(uint32_t), &decoded));
+
+  free(rec);
+}
+
+static void
+test_flush_and_load(void)
+{
+  app_cfg_data_t data;
+  sxfs_part_id_t part;
+
+  sxfs_erase_all(SP_APP_CFG_1);
+  sxfs_erase_all(SP_APP_CFG_2);
+  app_cfg_part = SP_APP_CFG_1;
+
+  make_settings(&data);
+  app_cfg_flush();
+  CHECK_EQ(app_cfg_part, SP_APP_CFG_2);
+
+  /* An unchanged flush leaves the flash alone */
+  app_cfg_flush();
+  CHECK_EQ(app_cfg_part, SP_APP_CFG_2);
+
+  memset(&app_cfg_local, 0, sizeof(app_cfg_local));
+  CHECK(app_cfg_load(&part));
+  CHECK_EQ(part, SP_APP_CFG_2);
+  CHECK(memcmp(&app_cfg_local.data, &data, sizeof(data)) == 0);
+
+  /* A damaged record fails its CRC */
+  flash[SP_APP_CFG_2][sizeof(app_cfg_header_t) + 10] ^= 0x01;
+  CHECK(!app_cfg_load(&part));
+}
+
+static void
+test_load_legacy(void)
+{
+  sxfs_part_id_t part;
+  app_cfg_rec_t* legacy = calloc(1, sizeof(app_cfg_rec_t));
+
+  sxfs_erase_all(SP_APP_CFG_1);
+  sxfs_erase_all(SP_APP_CFG_2);
+
+  /* The legacy record has none of the fields added since */
+  make_settings(&legacy->data);
+  memset((uint8_t*)&legacy->data + APP_CFG_LEGACY_LEN, 0,
+      sizeof(app_cfg_data_t) - APP_CFG_LEGACY_LEN);
+  uint32_t crc = crc32_block(0, &legacy->data, APP_CFG_LEGACY_LEN);
+  sxfs_write(SP_APP_CFG_1, 0, (uint8_t*)&legacy->data, APP_CFG_LEGACY_LEN);
+  sxfs_write(SP_APP_CFG_1, APP_CFG_LEGACY_LEN, (uint8_t*)&crc, sizeof(crc));
+
+  memset(&app_cfg_local, 0xA5, sizeof(app_cfg_local));
+  CHECK(app_cfg_load(&part));
+  CHECK_EQ(part, SP_APP_CFG_1);
+  CHECK(memcmp(&app_cfg_local.data, &legacy->data, sizeof(app_cfg_data_t)) == 0);
+
+  /* The next flush converts it to the tagged format */
+  app_cfg_part = part;
+  app_cfg_flush();
+  CHECK(app_cfg_load_from(SP_APP_CFG_2));
+  CHECK(memcmp(&app_cfg_local.data, &legacy->data, sizeof(app_cfg_data_t)) == 0);
+
+  free(legacy);
+}
+
+static volatile bool stop_writer;
+static uint32_t num_writes;
+
+/* Writes controller settings whose bytes all hold the write number */
+static void*
+settings_writer(void* arg)
+{
+  controller_settings_t* settings = malloc(sizeof(controller_settings_t));
+
+  (void)arg;
+  while (!stop_writer) {
+    num_writes++;
+    memset(settings, num_writes & 0xFF, sizeof(controller_settings_t));
+    app_cfg_set_controller_settings(CONTROLLER_1, SS_SERVER, settings);
+  }
+
+  free(settings);
+  return NULL;
+}
+
+static bool
+is_uniform(const uint8_t* p, uint32_t len)
+{
+  uint32_t i;
+  for (i = 1; i < len; ++i) {
+    if (p[i] != p[0])
+      return false;
+  }
+  return true;
+}
+
+/* The writer and reader run on separate host threads, so unlike on the
+ * device the reader can catch the writer part way through at any point.
+ */
+static void
+test_concurrent_read(void)
+{
+  pthread_t writer;
+  uint32_t reads;
+  uint32_t torn = 0;
+  uint32_t start_version = app_cfg_get_version();
+  uint32_t last_version = start_version;
+  controller_settings_t* copy = malloc(sizeof(controller_settings_t));
+  controller_settings_t* again = malloc(sizeof(controller_settings_t));
+
+  memset(&app_cfg_local.data.controller_settings[CONTROLLER_1], 0, sizeof(controller_settings_t));
+  CHECK_EQ(pthread_create(&writer, NULL, settings_writer, NULL), 0);
+
+  for (reads = 0; reads < STRESS_READS; ++reads) {
+    uint32_t version = app_cfg_read_controller_settings(CONTROLLER_1, copy);
+
+    if (!is_uniform((uint8_t*)copy, sizeof(controller_settings_t)))
+      torn++;
+
+    /* Versions are even and never go backwards */
+    CHECK_EQ(version & 1, 0);
+    CHECK(version >= last_version);
+
+    /* An unchanged version means unchanged settings */
+    if ((app_cfg_read_controller_settings(CONTROLLER_1, again) == version) &&
+        (memcmp(copy, again, sizeof(controller_settings_t)) != 0))
+      torn++;
+
+    last_version = version;
+  }
+
+  stop_writer = true;
+  pthread_join(writer, NULL);
+  CHECK_EQ(torn, 0);
+
+  /* Every write moves the version on, and the last one is read back */
+  CHECK_EQ(app_cfg_get_version(), start_version + (2 * num_writes));
+  CHECK_EQ(app_cfg_read_controller_settings(CONTROLLER_1, copy), app_cfg_get_version());
+  CHECK_EQ(*(uint8_t*)copy, num_writes & 0xFF);
+
+  free(again);
+  free(copy);
+}
+
+int
+main(void)
+{
+  chMtxInit(&app_cfg_mtx);
+
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_truncated_record);
+  RUN_TEST(test_newer_records);
+  RUN_TEST(test_profile_steps_limit);
+  RUN_TEST(test_flush_and_load);
+  RUN_TEST(test_load_legacy);
+  RUN_TEST(test_concurrent_read);
+
+  TEST_MAIN_END();
+}
@@ -0,0 +1,889 @@
+
+#define TEST_THREADS
+
+#include "cc3000_emu.h"
+#include "hal.h"
+
+/* Nothing here includes the CC3000 headers, which usually define clock_t */
+typedef long clock_t;
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define SPI_HEADER_SIZE  5
+#define SPI_WRITE_OP     1
+#define SPI_READ_OP      3
+
+#define IRQ_CHANNEL      12
+#define QUEUE_LEN        64
+#define MAX_TIMERS       8
+
+/* Waits shorter than this are spun, since a timed wait oversleeps by
+ * about as much
+ */
+#define SPIN_US          200
+
+
+typedef struct {
+  uint8_t data[EMU_MAX_PACKET];
+  uint16_t len;
+  uint32_t due_us;
+} emu_packet_t;
+
+typedef struct {
+  emu_packet_t packets[QUEUE_LEN];
+  int head;
+  int count;
+} emu_queue_t;
+
+typedef struct {
+  Thread thread;
+  tfunc_t fn;
+  void* arg;
+} thread_start_t;
+
+
+SPIDriver SPID2;
+EXTDriver EXTD1;
+
+static bool ext_enabled[EXT_MAX_CHANNELS];
+
+static pthread_mutex_t sys_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sys_cond = PTHREAD_COND_INITIALIZER;
+static __thread Thread* self_thread;
+static Thread main_thread;
+static VirtualTimer* timers[MAX_TIMERS];
+
+/* The device. Callbacks into the driver are made with the lock released,
+ * since they take the system lock, which may be held when the driver calls
+ * in here.
+ */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  pthread_t tick_thread;
+  volatile bool running;
+  emu_config_t config;
+  emu_stats_t stats;
+
+  bool powered;
+  bool init_irq;
+  bool cs_low;
+  volatile bool irq_low;
+  uint32_t irq_release_at;
+  int num_edges;
+
+  /* The transaction in progress while CS is asserted. The first byte the
+   * host sends says whether it is a read or a write.
+   */
+  int op;
+  bool read_has_packet;
+  uint8_t written[EMU_MAX_PACKET + SPI_HEADER_SIZE];
+  uint16_t written_len;
+  uint16_t read_pos;
+
+  /* A transfer started from an interrupt, finished by the thread */
+  bool dma_busy;
+  uint32_t dma_done_at;
+  size_t dma_n;
+  const uint8_t* dma_tx;
+  uint8_t* dma_rx;
+
+  emu_queue_t outbox;
+  emu_queue_t inbox;
+} emu = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+
+uint32_t
+emu_now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static void
+deadline_after_us(struct timespec* ts, uint32_t us)
+{
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += us / 1000000;
+  ts->tv_nsec += (us % 1000000) * 1000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+/* ChibiOS ************************************************************/
+
+void
+chSysLock(void)
+{
+  pthread_mutex_lock(&sys_mutex);
+}
+
+void
+chSysUnlock(void)
+{
+  pthread_mutex_unlock(&sys_mutex);
+}
+
+void
+chSysLockFromIsr(void)
+{
+  chSysLock();
+}
+
+void
+chSysUnlockFromIsr(void)
+{
+  chSysUnlock();
+}
+
+void
+chSchRescheduleS(void)
+{
+}
+
+static void*
+thread_main(void* arg)
+{
+  thread_start_t* start = arg;
+
+  self_thread = &start->thread;
+  start->fn(start->arg);
+  start->thread.exited = true;
+  return NULL;
+}
+
+Thread*
+chThdCreateFromHeap(void* heap, size_t size, int prio, tfunc_t fn, void* arg)
+{
+  pthread_t t;
+  thread_start_t* start = calloc(1, sizeof(thread_start_t));
+
+  start->fn = fn;
+  start->arg = arg;
+  pthread_create(&t, NULL, thread_main, start);
+  pthread_detach(t);
+  return &start->thread;
+}
+
+Thread*
+chThdSelf(void)
+{
+  return (self_thread != NULL) ? self_thread : &main_thread;
+}
+
+void
+chThdSetPriority(tprio_t prio)
+{
+}
+
+void
+chThdSleepMilliseconds(uint32_t msec)
+{
+  usleep(msec * 1000);
+}
+
+void
+chThdTerminate(Thread* tp)
+{
+  tp->terminate = true;
+}
+
+bool
+chThdShouldTerminate(void)
+{
+  return chThdSelf()->terminate;
+}
+
+/* The Thread is the first member of its start record, which is freed here
+ * as ChibiOS frees a heap thread once it has been waited for
+ */
+msg_t
+chThdWait(Thread* tp)
+{
+  while (!tp->exited)
+    usleep(100);
+  free(tp);
+  return 0;
+}
+
+void
+chSemInit(Semaphore* sp, int n)
+{
+  sp->cnt = n;
+  sp->resets = 0;
+}
+
+void
+chSemResetI(Semaphore* sp, int n)
+{
+  sp->cnt = n;
+  sp->resets++;
+  pthread_cond_broadcast(&sys_cond);
+}
+
+void
+chSemReset(Semaphore* sp, int n)
+{
+  chSysLock();
+  chSemResetI(sp, n);
+  chSysUnlock();
+}
+
+/* Waiting releases the system lock, as it does on ChibiOS */
+msg_t
+chSemWaitTimeoutS(Semaphore* sp, systime_t time)
+{
+  struct timespec deadline;
+  uint32_t resets = sp->resets;
+
+  if (time != TIME_INFINITE)
+    deadline_after_us(&deadline, time * (1000000 / CH_FREQUENCY));
+
+  while (sp->cnt <= 0) {
+    if (time == TIME_IMMEDIATE)
+      return RDY_TIMEOUT;
+
+    if (time == TIME_INFINITE)
+      pthread_cond_wait(&sys_cond, &sys_mutex);
+    else if ((pthread_cond_timedwait(&sys_cond, &sys_mutex, &deadline) == ETIMEDOUT) &&
+        (sp->cnt <= 0))
+      return RDY_TIMEOUT;
+
+    if (sp->resets != resets)
+      return RDY_RESET;
+  }
+
+  sp->cnt--;
+  return RDY_OK;
+}
+
+msg_t
+chSemWaitS(Semaphore* sp)
+{
+  return chSemWaitTimeoutS(sp, TIME_INFINITE);
+}
+
+msg_t
+chSemWaitTimeout(Semaphore* sp, systime_t time)
+{
+  chSysLock();
+  msg_t ret = chSemWaitTimeoutS(sp, time);
+  chSysUnlock();
+  return ret;
+}
+
+msg_t
+chSemWait(Semaphore* sp)
+{
+  return chSemWaitTimeout(sp, TIME_INFINITE);
+}
+
+void
+chSemSignalI(Semaphore* sp)
+{
+  sp->cnt++;
+  pthread_cond_broadcast(&sys_cond);
+}
+
+void
+chSemSignal(Semaphore* sp)
+{
+  chSysLock();
+  chSemSignalI(sp);
+  chSysUnlock();
+}
+
+msg_t
+chSemSignalWait(Semaphore* sps, Semaphore* spw)
+{
+  chSysLock();
+  chSemSignalI(sps);
+  msg_t ret = chSemWaitS(spw);
+  chSysUnlock();
+  return ret;
+}
+
+void
+chSemAddCounterI(Semaphore* sp, int n)
+{
+  sp->cnt += n;
+  pthread_cond_broadcast(&sys_cond);
+}
+
+int
+chSemGetCounterI(Semaphore* sp)
+{
+  return sp->cnt;
+}
+
+void
+chBSemInit(BinarySemaphore* bsp, bool taken)
+{
+  chSemInit(&bsp->sem, taken ? 0 : 1);
+}
+
+msg_t
+chBSemWaitTimeout(BinarySemaphore* bsp, systime_t time)
+{
+  return chSemWaitTimeout(&bsp->sem, time);
+}
+
+msg_t
+chBSemWait(BinarySemaphore* bsp)
+{
+  return chSemWait(&bsp->sem);
+}
+
+void
+chBSemSignal(BinarySemaphore* bsp)
+{
+  chSysLock();
+  if (bsp->sem.cnt < 1)
+    chSemSignalI(&bsp->sem);
+  chSysUnlock();
+}
+
+void
+chBSemReset(BinarySemaphore* bsp, bool taken)
+{
+  chSemReset(&bsp->sem, taken ? 0 : 1);
+}
+
+bool
+chBSemGetStateI(BinarySemaphore* bsp)
+{
+  return (bsp->sem.cnt <= 0);
+}
+
+void
+chVTSetI(VirtualTimer* vtp, systime_t time, vtfunc_t vtfunc, void* par)
+{
+  int i;
+
+  vtp->func = vtfunc;
+  vtp->par = par;
+  vtp->due = test_time + time;
+  for (i = 0; i < MAX_TIMERS; ++i) {
+    if (timers[i] == NULL) {
+      timers[i] = vtp;
+      return;
+    }
+  }
+}
+
+void
+chVTResetI(VirtualTimer* vtp)
+{
+  int i;
+
+  vtp->func = NULL;
+  for (i = 0; i < MAX_TIMERS; ++i) {
+    if (timers[i] == vtp)
+      timers[i] = NULL;
+  }
+}
+
+bool
+chVTIsArmedI(VirtualTimer* vtp)
+{
+  return (vtp->func != NULL);
+}
+
+static void*
+tick_main(void* arg)
+{
+  while (emu.running) {
+    vtfunc_t fired[MAX_TIMERS];
+    void* fired_par[MAX_TIMERS];
+    int num_fired = 0;
+    int i;
+
+    usleep(1000);
+
+    chSysLock();
+    test_time++;
+    for (i = 0; i < MAX_TIMERS; ++i) {
+      VirtualTimer* vtp = timers[i];
+      if ((vtp != NULL) && ((int32_t)(test_time - vtp->due) >= 0)) {
+        fired[num_fired] = vtp->func;
+        fired_par[num_fired++] = vtp->par;
+        chVTResetI(vtp);
+      }
+    }
+    chSysUnlock();
+
+    for (i = 0; i < num_fired; ++i)
+      fired[i](fired_par[i]);
+  }
+  return NULL;
+}
+
+/* The device ********************************************************/
+
+static void
+queue_push(emu_queue_t* q, const uint8_t* data, uint16_t len, uint32_t due_us)
+{
+  emu_packet_t* p;
+
+  if (q->count == QUEUE_LEN)
+    return;
+  if (len > EMU_MAX_PACKET)
+    len = EMU_MAX_PACKET;
+
+  p = &q->packets[(q->head + q->count++) % QUEUE_LEN];
+  memcpy(p->data, data, len);
+  p->len = len;
+  p->due_us = due_us;
+}
+
+static emu_packet_t*
+queue_peek(emu_queue_t* q)
+{
+  return (q->count > 0) ? &q->packets[q->head] : NULL;
+}
+
+static void
+queue_pop(emu_queue_t* q)
+{
+  q->head = (q->head + 1) % QUEUE_LEN;
+  q->count--;
+}
+
+/* The bytes the host clocks in on a read: a header giving the length of the
+ * packet, then the packet, then padding
+ */
+static uint8_t
+read_byte(uint16_t pos)
+{
+  emu_packet_t* p = emu.read_has_packet ? queue_peek(&emu.outbox) : NULL;
+  uint16_t len = (p != NULL) ? p->len : 0;
+
+  switch (pos) {
+    case 0:  return 0x02;
+    case 3:  return len >> 8;
+    case 4:  return len & 0xFF;
+    default: break;
+  }
+
+  if ((pos >= SPI_HEADER_SIZE) && (pos < (SPI_HEADER_SIZE + len)))
+    return p->data[pos - SPI_HEADER_SIZE];
+  return 0;
+}
+
+static void
+transfer_locked(size_t n, const uint8_t* tx, uint8_t* rx)
+{
+  size_t i;
+
+  for (i = 0; i < n; ++i) {
+    uint8_t out = 0;
+
+    if (emu.op == 0) {
+      emu.op = (tx != NULL) ? tx[i] : 0xFF;
+      if (emu.op == SPI_READ_OP) {
+        emu_packet_t* p = queue_peek(&emu.outbox);
+        emu.read_has_packet = (p != NULL) && ((int32_t)(emu_now_us() - p->due_us) >= 0);
+        if (!emu.read_has_packet)
+          emu.stats.empty_reads++;
+      }
+    }
+
+    if (emu.op == SPI_READ_OP) {
+      out = read_byte(emu.read_pos++);
+    }
+    else if (emu.written_len < sizeof(emu.written)) {
+      emu.written[emu.written_len++] = (tx != NULL) ? tx[i] : 0xFF;
+    }
+
+    if (rx != NULL)
+      rx[i] = out;
+  }
+}
+
+static uint32_t
+wire_time_us(size_t n)
+{
+  return ((n * emu.config.spi_ns_per_byte) + 999) / 1000;
+}
+
+static void
+select_locked(void)
+{
+  if (emu.irq_release_at != 0)
+    emu.stats.early_selects++;
+
+  emu.cs_low = true;
+  emu.op = 0;
+  emu.written_len = 0;
+  emu.read_pos = 0;
+  pthread_cond_signal(&emu.cond);
+}
+
+static void
+unselect_locked(void)
+{
+  if (emu.op == SPI_WRITE_OP && emu.written_len > SPI_HEADER_SIZE) {
+    uint16_t len = (emu.written[1] << 8) | emu.written[2];
+    if (len > emu.written_len - SPI_HEADER_SIZE)
+      len = emu.written_len - SPI_HEADER_SIZE;
+
+    queue_push(&emu.inbox, emu.written + SPI_HEADER_SIZE, len, 0);
+    emu.stats.packets_written++;
+    emu.stats.bytes_written += len;
+  }
+  else if (emu.op == SPI_READ_OP && emu.read_has_packet) {
+    emu.stats.packets_read++;
+    emu.stats.bytes_read += queue_peek(&emu.outbox)->len;
+    queue_pop(&emu.outbox);
+  }
+
+  emu.cs_low = false;
+  emu.init_irq = false;
+  emu.op = 0;
+  emu.read_has_packet = false;
+  if (emu.irq_low)
+    emu.irq_release_at = emu_now_us() + emu.config.irq_release_us;
+  pthread_cond_signal(&emu.cond);
+}
+
+/* IRQ goes low while the host has CS asserted for a write, while there is a
+ * packet to read, and after power up until the first transaction
+ */
+static bool
+irq_wanted_locked(uint32_t now)
+{
+  emu_packet_t* p = queue_peek(&emu.outbox);
+
+  if (!emu.powered)
+    return false;
+  return emu.init_irq || emu.cs_low ||
+      ((p != NULL) && ((int32_t)(now - p->due_us) >= 0));
+}
+
+static void
+call_unlocked(void (*fn)(void))
+{
+  pthread_mutex_unlock(&emu.lock);
+  fn();
+  pthread_mutex_lock(&emu.lock);
+}
+
+static void
+dma_done(void)
+{
+  SPID2.config->end_cb(&SPID2);
+}
+
+static void
+irq_edge(void)
+{
+  if ((EXTD1.state == EXT_ACTIVE) && ext_enabled[IRQ_CHANNEL])
+    EXTD1.config->channels[IRQ_CHANNEL].cb(&EXTD1, IRQ_CHANNEL);
+}
+
+/* The EXT channel interrupts on both edges */
+static void
+edge_locked(void)
+{
+  emu.num_edges++;
+  emu.stats.edges++;
+  if ((emu.config.drop_edge_every > 0) &&
+      ((emu.num_edges % emu.config.drop_edge_every) == 0))
+    emu.stats.edges_dropped++;
+  else
+    call_unlocked(irq_edge);
+}
+
+static const uint8_t* handler_packet;
+static uint16_t handler_len;
+
+static void
+run_handler(void)
+{
+  emu.config.on_packet(handler_packet, handler_len);
+}
+
+static void*
+emu_main(void* arg)
+{
+  static emu_packet_t packet;
+
+  pthread_mutex_lock(&emu.lock);
+
+  while (emu.running) {
+    uint32_t now = emu_now_us();
+    uint32_t next = now + 1000000;
+    emu_packet_t* p;
+
+    if (emu.dma_busy && ((int32_t)(now - emu.dma_done_at) >= 0)) {
+      transfer_locked(emu.dma_n, emu.dma_tx, emu.dma_rx);
+      emu.dma_busy = false;
+      call_unlocked(dma_done);
+      continue;
+    }
+
+    if (emu.inbox.count > 0) {
+      packet = *queue_peek(&emu.inbox);
+      queue_pop(&emu.inbox);
+      if (emu.config.on_packet != NULL) {
+        handler_packet = packet.data;
+        handler_len = packet.len;
+        call_unlocked(run_handler);
+      }
+      continue;
+    }
+
+    if ((emu.irq_release_at != 0) && !emu.cs_low &&
+        ((int32_t)(now - emu.irq_release_at) >= 0)) {
+      emu.irq_low = false;
+      emu.irq_release_at = 0;
+      edge_locked();
+      continue;
+    }
+
+    if (!emu.irq_low && (emu.irq_release_at == 0) && irq_wanted_locked(now)) {
+      emu.irq_low = true;
+      edge_locked();
+      continue;
+    }
+
+    /* Sleep until the next thing due, or until the host does something */
+    if (emu.dma_busy)
+      next = emu.dma_done_at;
+    if ((emu.irq_release_at != 0) && ((int32_t)(emu.irq_release_at - next) < 0))
+      next = emu.irq_release_at;
+    p = queue_peek(&emu.outbox);
+    if ((p != NULL) && !emu.irq_low && ((int32_t)(p->due_us - next) < 0))
+      next = p->due_us;
+
+    if ((int32_t)(next - now) < SPIN_US) {
+      pthread_mutex_unlock(&emu.lock);
+      sched_yield();
+      pthread_mutex_lock(&emu.lock);
+    }
+    else {
+      struct timespec deadline;
+      deadline_after_us(&deadline, next - now);
+      pthread_cond_timedwait(&emu.cond, &emu.lock, &deadline);
+    }
+  }
+
+  pthread_mutex_unlock(&emu.lock);
+  return NULL;
+}
+
+void
+emu_start(const emu_config_t* config)
+{
+  pthread_mutex_lock(&emu.lock);
+  emu.config = *config;
+  memset(&emu.stats, 0, sizeof(emu.stats));
+  emu.outbox.count = 0;
+  emu.inbox.count = 0;
+  emu.num_edges = 0;
+  emu.running = true;
+  pthread_mutex_unlock(&emu.lock);
+
+  pthread_create(&emu.thread, NULL, emu_main, NULL);
+  pthread_create(&emu.tick_thread, NULL, tick_main, NULL);
+}
+
+void
+emu_stop(void)
+{
+  pthread_mutex_lock(&emu.lock);
+  emu.running = false;
+  pthread_cond_signal(&emu.cond);
+  pthread_mutex_unlock(&emu.lock);
+
+  pthread_join(emu.thread, NULL);
+  pthread_join(emu.tick_thread, NULL);
+}
+
+void
+emu_send(const uint8_t* packet, uint16_t len, uint32_t delay_us)
+{
+  pthread_mutex_lock(&emu.lock);
+  queue_push(&emu.outbox, packet, len, emu_now_us() + delay_us);
+  pthread_cond_signal(&emu.cond);
+  pthread_mutex_unlock(&emu.lock);
+}
+
+void
+emu_get_stats(emu_stats_t* stats)
+{
+  pthread_mutex_lock(&emu.lock);
+  *stats = emu.stats;
+  pthread_mutex_unlock(&emu.lock);
+}
+
+/* The lines and drivers the transport uses **************************/
+
+void
+palSetPadMode(ioportid_t port, uint16_t pad, int mode)
+{
+}
+
+void
+palSetPad(ioportid_t port, uint16_t pad)
+{
+  if ((port != PORT_WIFI_EN) || (pad != PAD_WIFI_EN))
+    return;
+
+  pthread_mutex_lock(&emu.lock);
+  emu.powered = true;
+  emu.init_irq = true;
+  pthread_cond_signal(&emu.cond);
+  pthread_mutex_unlock(&emu.lock);
+}
+
+void
+palClearPad(ioportid_t port, uint16_t pad)
+{
+  if ((port != PORT_WIFI_EN) || (pad != PAD_WIFI_EN))
+    return;
+
+  pthread_mutex_lock(&emu.lock);
+  emu.powered = false;
+  emu.init_irq = false;
+  emu.irq_low = false;
+  emu.irq_release_at = 0;
+  emu.outbox.count = 0;
+  emu.inbox.count = 0;
+  pthread_mutex_unlock(&emu.lock);
+}
+
+uint8_t
+palReadPad(ioportid_t port, uint16_t pad)
+{
+  if ((port == PORT_WIFI_IRQ) && (pad == PAD_WIFI_IRQ))
+    return emu.irq_low ? 0 : 1;
+  return 1;
+}
+
+void
+extStart(EXTDriver* extp, const EXTConfig* config)
+{
+  extp->config = config;
+  extp->state = EXT_ACTIVE;
+}
+
+void
+extChannelEnable(EXTDriver* extp, expchannel_t channel)
+{
+  ext_enabled[channel] = true;
+}
+
+void
+extChannelDisable(EXTDriver* extp, expchannel_t channel)
+{
+  ext_enabled[channel] = false;
+}
+
+void
+spiStart(SPIDriver* spip, const SPIConfig* config)
+{
+  spip->config = config;
+}
+
+void
+spiSelectI(SPIDriver* spip)
+{
+  pthread_mutex_lock(&emu.lock);
+  select_locked();
+  pthread_mutex_unlock(&emu.lock);
+}
+
+void
+spiUnselectI(SPIDriver* spip)
+{
+  pthread_mutex_lock(&emu.lock);
+  unselect_locked();
+  pthread_mutex_unlock(&emu.lock);
+}
+
+void
+spiSelect(SPIDriver* spip)
+{
+  spiSelectI(spip);
+}
+
+void
+spiUnselect(SPIDriver* spip)
+{
+  spiUnselectI(spip);
+}
+
+static void
+start_dma(size_t n, const void* txbuf, void* rxbuf)
+{
+  pthread_mutex_lock(&emu.lock);
+  emu.dma_busy = true;
+  emu.dma_n = n;
+  emu.dma_tx = txbuf;
+  emu.dma_rx = rxbuf;
+  emu.dma_done_at = emu_now_us() + wire_time_us(n);
+  pthread_cond_signal(&emu.cond);
+  pthread_mutex_unlock(&emu.lock);
+}
+
+void
+spiStartSendI(SPIDriver* spip, size_t n, const void* txbuf)
+{
+  start_dma(n, txbuf, NULL);
+}
+
+void
+spiStartReceiveI(SPIDriver* spip, size_t n, void* rxbuf)
+{
+  start_dma(n, NULL, rxbuf);
+}
+
+void
+spiStartExchangeI(SPIDriver* spip, size_t n, const void* txbuf, void* rxbuf)
+{
+  start_dma(n, txbuf, rxbuf);
+}
+
+/* The waiting calls run the transfer on the caller's thread */
+void
+spiExchange(SPIDriver* spip, size_t n, const void* txbuf, void* rxbuf)
+{
+  uint32_t done_at = emu_now_us() + wire_time_us(n);
+
+  pthread_mutex_lock(&emu.lock);
+  transfer_locked(n, txbuf, rxbuf);
+  pthread_mutex_unlock(&emu.lock);
+
+  while ((int32_t)(emu_now_us() - done_at) < 0)
+    sched_yield();
+
+  if (spip->config->end_cb != NULL)
+    spip->config->end_cb(spip);
+}
+
+void
+spiSend(SPIDriver* spip, size_t n, const void* txbuf)
+{
+  spiExchange(spip, n, txbuf, NULL);
+}
+
+void
+spiReceive(SPIDriver* spip, size_t n, void* rxbuf)
+{
+  spiExchange(spip, n, NULL, rxbuf);
+}
@@ -0,0 +1,59 @@
+#ifndef CC3000_EMU_H
+#define CC3000_EMU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* An emulated CC3000 on the far side of the SPI, CS and IRQ lines, for host
+ * tests of the wifi driver. It follows the CC3000 SPI protocol: it pulls
+ * IRQ low when it has a packet for the host or when the host asserts CS to
+ * write, and lets IRQ go some time after CS is released. Transfers started
+ * from interrupts complete on the emulator's own thread after the time
+ * they would take on the wire, and end with the driver's end callback as
+ * the DMA interrupt would.
+ *
+ * test/cc3000_emu.c also provides the threads, semaphores, virtual timers
+ * and critical sections which test/stubs/ch.h declares for TEST_THREADS,
+ * with a tick thread advancing test_time at 1 kHz.
+ */
+
+#define EMU_MAX_PACKET  1600
+
+/* Called on the emulator's thread with each packet the host writes, from
+ * its HCI header on. May queue replies with emu_send().
+ */
+typedef void (*emu_packet_handler_t)(const uint8_t* packet, uint16_t len);
+
+typedef struct {
+  /* Time on the wire per byte. 500 ns is a 16 MHz SPI clock. */
+  uint32_t spi_ns_per_byte;
+  /* How long IRQ stays low after CS is released */
+  uint32_t irq_release_us;
+  /* Every nth edge on IRQ is lost, 0 to lose none */
+  int drop_edge_every;
+  emu_packet_handler_t on_packet;
+} emu_config_t;
+
+typedef struct {
+  uint32_t packets_written;
+  uint32_t bytes_written;
+  uint32_t packets_read;
+  uint32_t bytes_read;
+  uint32_t edges;
+  uint32_t edges_dropped;
+  /* Reads started while the device had nothing to send */
+  uint32_t empty_reads;
+  /* CS asserted while IRQ was still held from the last transaction */
+  uint32_t early_selects;
+} emu_stats_t;
+
+void emu_start(const emu_config_t* config);
+void emu_stop(void);
+
+/* Queues an HCI packet for the host to read, delay_us from now */
+void emu_send(const uint8_t* packet, uint16_t len, uint32_t delay_us);
+
+void emu_get_stats(emu_stats_t* stats);
+uint32_t emu_now_us(void);
+
+#endif
@@ -0,0 +1,312 @@
+
+#define TEST_THREADS
+
+#include "test.h"
+#include "cc3000_emu.h"
+
+#define printf(...) ((void)0)
+#include "core/cc3000_spi.c"
+#include "core/hci.c"
+#undef printf
+
+
+/* Tests data sends through hci.c and the SPI transport against the
+ * emulated CC3000 in test/cc3000_emu.c. The emulated device holds each
+ * data packet in one of its buffers until it has gone out over the air and
+ * then releases it with an HCI_EVNT_DATA_UNSOL_FREE_BUFF event, so sends
+ * are paced by the credits those events give back. Checks that the device
+ * is never sent more packets than it has buffers, that sends return
+ * without waiting for the SPI, and measures upload throughput with one
+ * device buffer against several.
+ */
+
+#define SPI_NS_PER_BYTE     500
+#define IRQ_RELEASE_US      20
+
+/* Each packet takes this long on the air, one at a time, and its buffer
+ * is released this long after that
+ */
+#define AIR_US              1000
+#define RELEASE_US          2000
+
+#define DEVICE_BUFFERS      6
+#define DEVICE_BUFFER_LEN   1500
+#define NUM_PACKETS         300
+#define DATA_LEN            1024
+#define SEND_ARGS_LEN       16
+
+#define PATCH_LEN           2500
+#define PATCH_PORTION       1000
+
+systime_t test_time;
+int test_failures;
+
+static struct {
+  int num_buffers;
+  uint32_t air_free_at;
+  uint32_t release_at[64];
+  uint32_t num_packets;
+  uint32_t num_bad;
+  uint32_t max_in_use;
+  uint32_t num_overflows;
+
+  uint8_t patch[PATCH_LEN];
+  uint32_t patch_len;
+} device;
+
+
+
+void
+msg_send(msg_id_t id, void* msg_data)
+{
+}
+
+void
+set_socket_active_status(int32_t sd, wlan_socket_status_t status, int error)
+{
+}
+
+static void
+send_event(uint16_t opcode, const uint8_t* params, uint8_t len, uint32_t delay_us)
+{
+  uint8_t event[32] = {
+      HCI_TYPE_EVNT, opcode & 0xFF, opcode >> 8, len + 1, 0
+  };
+
+  memcpy(event + HCI_EVENT_HEADER_SIZE, params, len);
+  emu_send(event, HCI_EVENT_HEADER_SIZE + len, delay_us);
+}
+
+/* A data packet takes a device buffer until its release time */
+static void
+device_data(const uint8_t* packet, uint16_t len)
+{
+  uint32_t now = emu_now_us();
+  uint32_t in_use = 0;
+  uint32_t i;
+  uint8_t args = packet[HCI_PACKET_ARGSIZE_OFFSET];
+  uint16_t data_len = (packet[3] | (packet[4] << 8)) - args;
+  const uint8_t* data = packet + HCI_DATA_HEADER_SIZE + args;
+
+  for (i = (device.num_packets > 64) ? device.num_packets - 64 : 0;
+      i < device.num_packets; ++i) {
+    if ((int32_t)(device.release_at[i % 64] - now) > 0)
+      in_use++;
+  }
+  if (in_use >= (uint32_t)device.num_buffers)
+    device.num_overflows++;
+  if (in_use + 1 > device.max_in_use)
+    device.max_in_use = in_use + 1;
+
+  bool good = (data_len == DATA_LEN);
+  for (i = 0; good && (i < data_len); ++i)
+    good = (data[i] == (uint8_t)(device.num_packets + i));
+  if (!good)
+    device.num_bad++;
+
+  if ((int32_t)(device.air_free_at - now) < 0)
+    device.air_free_at = now;
+  device.air_free_at += AIR_US;
+
+  uint32_t release_at = device.air_free_at + RELEASE_US;
+  device.release_at[device.num_packets % 64] = release_at;
+  device.num_packets++;
+
+  /* One handle with one buffer freed */
+  uint8_t params[] = {1, 0, 0, 0, 1, 0};
+  send_event(HCI_EVNT_DATA_UNSOL_FREE_BUFF, params, sizeof(params), release_at - now);
+}
+
+/* The first portion of a patch follows the patch header, and each portion
+ * after that has its own length in front
+ */
+static void
+device_patch(const uint8_t* packet, uint16_t len)
+{
+  const uint8_t* data;
+  uint16_t n;
+
+  if ((device.patch_len == 0) && (packet[0] == HCI_TYPE_PATCH)) {
+    data = packet + HCI_PATCH_HEADER_SIZE;
+    n = PATCH_PORTION;
+  }
+  else {
+    data = packet + HCI_PATCH_PORTION_HEADER_SIZE;
+    n = packet[0] | (packet[1] << 8);
+  }
+
+  if (device.patch_len + n <= PATCH_LEN)
+    memcpy(device.patch + device.patch_len, data, n);
+  device.patch_len += n;
+
+  if (device.patch_len >= PATCH_LEN)
+    send_event(HCI_CMND_SIMPLE_LINK_START, NULL, 0, 0);
+}
+
+static void
+device_packet(const uint8_t* packet, uint16_t len)
+{
+  if (device.patch_len > 0 || packet[0] == HCI_TYPE_PATCH) {
+    device_patch(packet, len);
+  }
+  else if (packet[0] == HCI_TYPE_CMND) {
+    uint16_t opcode = packet[1] | (packet[2] << 8);
+
+    if (opcode == HCI_CMND_READ_BUFFER_SIZE) {
+      uint8_t params[] = {
+          device.num_buffers, DEVICE_BUFFER_LEN & 0xFF, DEVICE_BUFFER_LEN >> 8
+      };
+      send_event(opcode, params, sizeof(params), 0);
+    }
+    else {
+      send_event(opcode, NULL, 0, 0);
+    }
+  }
+  else if (packet[0] == HCI_TYPE_DATA) {
+    device_data(packet, len);
+  }
+}
+
+/* Starts the device and reads its buffer count, as wlan_start() does */
+static void
+open_device(int num_buffers)
+{
+  emu_config_t config = {
+      .spi_ns_per_byte = SPI_NS_PER_BYTE,
+      .irq_release_us = IRQ_RELEASE_US,
+      .on_packet = device_packet,
+  };
+
+  memset(&device, 0, sizeof(device));
+  device.num_buffers = num_buffers;
+  device.air_free_at = emu_now_us();
+  tx_pool_wait_count = 0;
+
+  emu_start(&config);
+  hci_init();
+  spi_open();
+
+  hci_command_send(HCI_CMND_SIMPLE_LINK_START, 0, HCI_CMND_SIMPLE_LINK_START, NULL);
+  hci_command_send(HCI_CMND_READ_BUFFER_SIZE, 0, HCI_CMND_READ_BUFFER_SIZE, NULL);
+
+  CHECK_EQ(hci_get_stats()->num_free_buffers, num_buffers);
+  CHECK_EQ(hci_get_stats()->num_timeouts, 0);
+}
+
+static void
+close_device(void)
+{
+  spi_close();
+  emu_stop();
+}
+
+/* Sends NUM_PACKETS data packets as simple_link_send() does, and returns
+ * the throughput in KB/s. Also reports the average time spent in
+ * hci_data_send().
+ */
+static double
+upload(uint32_t* send_us)
+{
+  uint32_t i, j;
+  uint32_t in_send = 0;
+  uint32_t start = emu_now_us();
+
+  for (i = 0; i < NUM_PACKETS; ++i) {
+    CHECK(hci_claim_buffer());
+
+    uint8_t* data = hci_get_data_buffer() + SEND_ARGS_LEN;
+    memset(hci_get_data_buffer(), 0, SEND_ARGS_LEN);
+    for (j = 0; j < DATA_LEN; ++j)
+      data[j] = (uint8_t)(i + j);
+
+    uint32_t t = emu_now_us();
+    hci_data_send(HCI_CMND_SEND, SEND_ARGS_LEN, DATA_LEN, NULL, 0);
+    in_send += emu_now_us() - t;
+  }
+
+  /* Wait for the device to release every buffer */
+  const hci_stats_t* stats = hci_get_stats();
+  for (i = 0; (i < 2000) && (stats->num_released_packets < stats->num_sent_packets); ++i)
+    chThdSleepMilliseconds(1);
+
+  uint32_t elapsed = emu_now_us() - start;
+  *send_us = in_send / NUM_PACKETS;
+  return (NUM_PACKETS * DATA_LEN) / (elapsed / 1000.0);
+}
+
+static void
+test_credits(void)
+{
+  uint32_t send_us;
+  const hci_stats_t* stats = hci_get_stats();
+
+  open_device(1);
+  double single = upload(&send_us);
+  CHECK_EQ(device.num_packets, NUM_PACKETS);
+  CHECK_EQ(device.num_overflows, 0);
+  CHECK_EQ(device.num_bad, 0);
+  CHECK_EQ(device.max_in_use, 1);
+  close_device();
+
+  open_device(DEVICE_BUFFERS);
+  double pipelined = upload(&send_us);
+  CHECK_EQ(device.num_packets, NUM_PACKETS);
+  CHECK_EQ(device.num_overflows, 0);
+  CHECK_EQ(device.num_bad, 0);
+  CHECK_EQ(device.max_in_use, DEVICE_BUFFERS);
+  CHECK(stats->num_credit_stalls > 0);
+  CHECK_EQ(stats->num_released_packets, stats->num_sent_packets);
+
+  /* The device can take a packet every AIR_US, and with a buffer per
+   * packet in flight should be sent them that fast
+   */
+  double air_limit = DATA_LEN / (AIR_US / 1000.0);
+
+  fprintf(stdout, "Upload: %.0f KB/s with 1 device buffer, %.0f KB/s with %d, "
+      "air limit %.0f KB/s\n", single, pipelined, DEVICE_BUFFERS, air_limit);
+  CHECK(pipelined > 3 * single);
+  CHECK(pipelined > 0.8 * air_limit);
+
+  /* A packet is only queued for the SPI by hci_data_send(), which returns
+   * before the packet has gone over the wire
+   */
+  uint32_t wire_us = (SPI_HEADER_SIZE + HCI_DATA_HEADER_SIZE + SEND_ARGS_LEN + DATA_LEN) *
+      SPI_NS_PER_BYTE / 1000;
+  fprintf(stdout, "hci_data_send: %u us on average, %u us on the wire, "
+      "%d waits for a TX buffer\n", send_us, wire_us, tx_pool_wait_count);
+  CHECK(send_us < wire_us / 2);
+
+  close_device();
+}
+
+/* A patch goes out in portions, each built in the buffer the SPI has ready
+ * while the one before it may still be queued
+ */
+static void
+test_patch(void)
+{
+  static char patch[PATCH_LEN];
+  int i;
+
+  for (i = 0; i < PATCH_LEN; ++i)
+    patch[i] = (char)(i * 7);
+
+  open_device(DEVICE_BUFFERS);
+
+  hci_patch_send(0, patch, PATCH_LEN, HCI_CMND_SIMPLE_LINK_START, NULL);
+
+  CHECK_EQ(hci_get_stats()->num_timeouts, 0);
+  CHECK_EQ(device.patch_len, PATCH_LEN);
+  CHECK(memcmp(device.patch, patch, PATCH_LEN) == 0);
+
+  close_device();
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_credits);
+  RUN_TEST(test_patch);
+
+  TEST_MAIN_END();
+}
@@ -0,0 +1,281 @@
+
+#define TEST_THREADS
+
+#include "test.h"
+#include "cc3000_emu.h"
+
+/* The transport state is private to cc3000_spi.c, so the tests build it
+ * directly
+ */
+#include "core/cc3000_spi.c"
+
+
+/* Tests the CC3000 SPI transport in cc3000_spi.c against the emulated
+ * CC3000 in test/cc3000_emu.c, on a 16 MHz SPI clock. Measures the HCI
+ * command round trip and sustained write throughput, checks that packets
+ * arrive intact in both directions while reads and writes interleave, that
+ * no transfer is started before the CC3000 asks for it, and that lost IRQ
+ * edges are recovered by the level check.
+ */
+
+#define SPI_NS_PER_BYTE     500
+#define IRQ_RELEASE_US      20
+
+#define NUM_ROUND_TRIPS     300
+#define NUM_DATA_PACKETS    400
+#define DATA_LEN            1024
+#define EVENT_EVERY         8
+#define TEST_OPCODE         0x1234
+
+systime_t test_time;
+int test_failures;
+
+static Semaphore sem_event;
+static uint8_t last_event[32];
+static volatile uint32_t num_events;
+
+static volatile uint32_t num_data_packets;
+static volatile uint32_t num_data_bad;
+
+
+/* The HCI layer, as the transport's I/O thread calls it */
+void
+hci_dispatch_packet(uint8_t* buffer, uint16_t buffer_size)
+{
+  if (buffer[0] == HCI_TYPE_EVNT) {
+    memcpy(last_event, buffer, sizeof(last_event));
+    num_events++;
+    chSemSignal(&sem_event);
+  }
+}
+
+static void
+send_event(uint16_t opcode, uint32_t seq)
+{
+  uint8_t event[] = {
+      HCI_TYPE_EVNT, opcode & 0xFF, opcode >> 8, 5, 0,
+      seq & 0xFF, (seq >> 8) & 0xFF, (seq >> 16) & 0xFF, seq >> 24
+  };
+  emu_send(event, sizeof(event), 0);
+}
+
+/* The device answers each command with an event carrying the command's
+ * sequence number, checks each data packet, and every few data packets
+ * sends an event of its own
+ */
+static void
+device_packet(const uint8_t* packet, uint16_t len)
+{
+  uint16_t i;
+
+  if (packet[0] == HCI_TYPE_CMND) {
+    uint32_t seq;
+    memcpy(&seq, packet + HCI_CMND_HEADER_SIZE, sizeof(seq));
+    send_event(packet[1] | (packet[2] << 8), seq);
+  }
+  else if (packet[0] == HCI_TYPE_DATA) {
+    uint16_t data_len = packet[3] | (packet[4] << 8);
+    bool good = (data_len == DATA_LEN) && (len >= HCI_DATA_HEADER_SIZE + DATA_LEN);
+
+    for (i = 0; good && (i < data_len); ++i)
+      good = (packet[HCI_DATA_HEADER_SIZE + i] == (uint8_t)(num_data_packets + i));
+    if (!good)
+      num_data_bad++;
+
+    if ((++num_data_packets % EVENT_EVERY) == 0)
+      send_event(HCI_EVNT_DATA_UNSOL_FREE_BUFF, num_data_packets);
+  }
+}
+
+static void
+send_command(uint16_t opcode, uint32_t seq)
+{
+  uint8_t* p = spi_get_buffer();
+
+  p[0] = HCI_TYPE_CMND;
+  p[1] = opcode & 0xFF;
+  p[2] = opcode >> 8;
+  p[3] = sizeof(seq);
+  memcpy(p + HCI_CMND_HEADER_SIZE, &seq, sizeof(seq));
+  spi_write(HCI_CMND_HEADER_SIZE + sizeof(seq));
+}
+
+static void
+send_data(uint32_t seq)
+{
+  uint8_t* p = spi_get_buffer();
+  int i;
+
+  p[0] = HCI_TYPE_DATA;
+  p[1] = HCI_CMND_SEND;
+  p[2] = 0;
+  p[3] = DATA_LEN & 0xFF;
+  p[4] = DATA_LEN >> 8;
+  for (i = 0; i < DATA_LEN; ++i)
+    p[HCI_DATA_HEADER_SIZE + i] = (uint8_t)(seq + i);
+  spi_write(HCI_DATA_HEADER_SIZE + DATA_LEN);
+}
+
+static bool
+wait_event(uint32_t ms)
+{
+  return chSemWaitTimeout(&sem_event, MS2ST(ms)) == RDY_OK;
+}
+
+static uint32_t
+event_seq(void)
+{
+  return last_event[5] | (last_event[6] << 8) | (last_event[7] << 16) | (last_event[8] << 24);
+}
+
+/* Powers up the CC3000 and sends the first command, which goes out on the
+ * power up path
+ */
+static void
+open_transport(int drop_edge_every)
+{
+  emu_config_t config = {
+      .spi_ns_per_byte = SPI_NS_PER_BYTE,
+      .irq_release_us = IRQ_RELEASE_US,
+      .drop_edge_every = drop_edge_every,
+      .on_packet = device_packet,
+  };
+
+  chSemInit(&sem_event, 0);
+  num_events = 0;
+  num_data_packets = 0;
+  num_data_bad = 0;
+  irq_timeout_count = 0;
+
+  emu_start(&config);
+  spi_open();
+
+  send_command(HCI_CMND_SIMPLE_LINK_START, 0);
+  CHECK(wait_event(1000));
+}
+
+/* Nothing was read that wasn't there and CS was never asserted while the
+ * CC3000 was still finishing the last transaction
+ */
+static void
+close_transport(void)
+{
+  emu_stats_t stats;
+
+  spi_close();
+  emu_get_stats(&stats);
+  emu_stop();
+
+  CHECK_EQ(stats.empty_reads, 0);
+  CHECK_EQ(stats.early_selects, 0);
+}
+
+static void
+test_round_trip(void)
+{
+  uint32_t i;
+  uint32_t total = 0;
+  uint32_t worst = 0;
+
+  open_transport(0);
+
+  for (i = 1; i <= NUM_ROUND_TRIPS; ++i) {
+    uint32_t start = emu_now_us();
+    send_command(TEST_OPCODE, i);
+    CHECK(wait_event(1000));
+    uint32_t elapsed = emu_now_us() - start;
+
+    CHECK_EQ(event_seq(), i);
+    total += elapsed;
+    if (elapsed > worst)
+      worst = elapsed;
+  }
+
+  printf("HCI round trip: %u us average, %u us worst\n",
+      total / NUM_ROUND_TRIPS, worst);
+
+  /* The transport used to sleep 5 ms after each transaction */
+  CHECK(total / NUM_ROUND_TRIPS < 1000);
+
+  close_transport();
+}
+
+/* Back to back data packets, with the CC3000 sending events in between */
+static void
+test_throughput(void)
+{
+  uint32_t i;
+  emu_stats_t stats;
+
+  open_transport(0);
+
+  uint32_t start = emu_now_us();
+  for (i = 0; i < NUM_DATA_PACKETS; ++i)
+    send_data(i);
+  uint32_t elapsed = emu_now_us() - start;
+
+  /* Each packet also carries the SPI and HCI headers and a pad byte */
+  double wire_us = NUM_DATA_PACKETS * (DATA_LEN + 11) * (SPI_NS_PER_BYTE / 1000.0);
+  printf("Sustained writes: %.0f KB/s, %.0f%% of the SPI clock\n",
+      (NUM_DATA_PACKETS * DATA_LEN) / (elapsed / 1000.0),
+      (100 * wire_us) / elapsed);
+  CHECK(wire_us / elapsed > 0.5);
+
+  for (i = 0; (i < 1000) && (num_events < 1 + (NUM_DATA_PACKETS / EVENT_EVERY)); ++i)
+    chThdSleepMilliseconds(1);
+
+  emu_get_stats(&stats);
+  CHECK_EQ(stats.packets_written, 1 + NUM_DATA_PACKETS);
+  CHECK_EQ(num_data_packets, NUM_DATA_PACKETS);
+  CHECK_EQ(num_data_bad, 0);
+  CHECK_EQ(num_events, 1 + (NUM_DATA_PACKETS / EVENT_EVERY));
+  CHECK_EQ(stats.packets_read, num_events);
+
+  close_transport();
+}
+
+/* With every third IRQ edge lost, every command still gets its answer, each
+ * within a few level checks
+ */
+static void
+test_lost_edges(void)
+{
+  uint32_t i;
+  uint32_t total = 0;
+  uint32_t worst = 0;
+  emu_stats_t stats;
+
+  open_transport(3);
+
+  for (i = 1; i <= 60; ++i) {
+    uint32_t start = emu_now_us();
+    send_command(TEST_OPCODE, i);
+    CHECK(wait_event(1000));
+    uint32_t elapsed = emu_now_us() - start;
+
+    CHECK_EQ(event_seq(), i);
+    total += elapsed;
+    if (elapsed > worst)
+      worst = elapsed;
+  }
+
+  emu_get_stats(&stats);
+  printf("With lost edges: %u us average, %u us worst, %u edges recovered\n",
+      total / 60, worst, irq_timeout_count);
+
+  CHECK(stats.edges_dropped > 0);
+  CHECK(irq_timeout_count > 0);
+  CHECK(worst < 100000);
+
+  close_transport();
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_throughput);
+  RUN_TEST(test_lost_edges);
+
+  TEST_MAIN_END();
+}
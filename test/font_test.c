@@ -0,0 +1,155 @@
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Allocations in font.c go through the test, which can make them fail */
+static int fail_allocs;
+
+static void*
+test_malloc(size_t size)
+{
+  if (fail_allocs > 0) {
+    fail_allocs--;
+    return NULL;
+  }
+  return malloc(size);
+}
+
+#define malloc test_malloc
+#include "font.c"
+#undef malloc
+
+
+/* Tests the text layout cache in font.c: cached extents and substring widths
+ * agree with measuring the glyphs directly, and a layout whose glyph
+ * positions can't be allocated still measures correctly and is cached once
+ * memory is available again.
+ */
+
+int test_failures;
+
+static glyph_t glyphs[128];
+static font_t font;
+
+
+/* Glyphs of assorted advances and heights, some reaching below the line */
+static void
+make_font(void)
+{
+  int i;
+
+  memset(&font, 0, sizeof(font));
+  font.line_height = 20;
+  for (i = 0; i < 128; ++i) {
+    glyphs[i].advance = 4 + (i % 9);
+    glyphs[i].width = glyphs[i].advance - 1;
+    glyphs[i].height = 8 + (i % 5);
+    glyphs[i].yoffset = (i % 4) - 2;
+    font.glyphs[i] = &glyphs[i];
+  }
+}
+
+static int
+measure(const char* str, int start, int end)
+{
+  int width = 0;
+
+  while (start < end)
+    width += font_find_glyph(&font, str[start++])->advance;
+  return width;
+}
+
+static void
+check_layout(const text_layout_t* layout, const char* str)
+{
+  int a;
+  int b;
+  int len = strlen(str);
+  Extents_t e = font_text_extents(&font, str);
+
+  CHECK_EQ(layout->len, len);
+  CHECK_EQ(layout->extents.width, e.width);
+  CHECK_EQ(layout->extents.height, e.height);
+
+  for (a = 0; a <= len; ++a) {
+    for (b = a; b <= len; ++b)
+      CHECK_EQ(text_layout_width(layout, &font, str, a, b), measure(str, a, b));
+  }
+}
+
+static void
+test_cached(void)
+{
+  text_layout_t layout;
+  const char* str = "Fermenter 1: 68.2 F";
+  text_layout_stats_t before = text_layout_get_stats();
+
+  make_font();
+  memset(&layout, 0, sizeof(layout));
+
+  CHECK(text_layout_update(&layout, &font, str));
+  CHECK(layout.glyph_x != NULL);
+  check_layout(&layout, str);
+
+  CHECK(!text_layout_update(&layout, &font, str));
+  CHECK(text_layout_update(&layout, &font, "Fermenter 2"));
+  check_layout(&layout, "Fermenter 2");
+
+  text_layout_stats_t after = text_layout_get_stats();
+  CHECK_EQ(after.layouts_computed - before.layouts_computed, 2);
+  CHECK_EQ(after.layout_hits - before.layout_hits, 1);
+
+  text_layout_release(&layout);
+}
+
+/* Without memory for the glyph positions the layout still reports the
+ * extents and widths, and is computed again on each update until the
+ * allocation succeeds.
+ */
+static void
+test_out_of_memory(void)
+{
+  text_layout_t layout;
+  const char* str = "Waiting for sensor";
+  text_layout_stats_t before = text_layout_get_stats();
+
+  make_font();
+  memset(&layout, 0, sizeof(layout));
+
+  fail_allocs = 2;
+  CHECK(text_layout_update(&layout, &font, str));
+  CHECK(layout.glyph_x == NULL);
+  CHECK(layout.font == NULL);
+  check_layout(&layout, str);
+
+  CHECK(text_layout_update(&layout, &font, str));
+  CHECK(layout.glyph_x == NULL);
+
+  CHECK(text_layout_update(&layout, &font, str));
+  CHECK(layout.glyph_x != NULL);
+  check_layout(&layout, str);
+  CHECK(!text_layout_update(&layout, &font, str));
+
+  /* A longer string needs a bigger buffer, which fails again */
+  fail_allocs = 1;
+  CHECK(text_layout_update(&layout, &font, "Waiting for sensor on probe 2"));
+  CHECK(layout.glyph_x == NULL);
+  check_layout(&layout, "Waiting for sensor on probe 2");
+
+  text_layout_stats_t after = text_layout_get_stats();
+  CHECK_EQ(after.layouts_uncached - before.layouts_uncached, 3);
+  CHECK_EQ(after.layouts_computed - before.layouts_computed, 1);
+
+  text_layout_release(&layout);
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_cached);
+  RUN_TEST(test_out_of_memory);
+
+  TEST_MAIN_END();
+}
@@ -0,0 +1,389 @@
+
+#include "test.h"
+
+/* Recovery works on the log's private state, so the tests build it directly */
+#include "history_log.c"
+
+
+/* Tests the persistent history log in history_log.c: reading records back,
+ * recovery after a power cut part way through a record, the page time
+ * index after the ring wraps, queries across a reclaimed sector, and the
+ * flash traffic per sample and per seek.
+ */
+
+#define TEST_SECTORS   3
+#define SECTOR_RECORDS (PAGES_PER_SECTOR * RECORDS_PER_PAGE)
+
+systime_t test_time;
+int test_failures;
+
+static uint8_t flash[TEST_SECTORS * SECTOR_SIZE];
+
+/* Flash traffic, and a byte count after which the power is cut */
+static uint32_t bytes_written;
+static uint32_t num_reads;
+static uint32_t num_erases;
+static bool power_cut_armed;
+static uint32_t power_cut_after;
+
+
+uint32_t
+sxfs_get_size(sxfs_part_id_t part_id)
+{
+  return sizeof(flash);
+}
+
+/* Programming can only clear bits, as on the real flash */
+bool
+sxfs_write(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  uint32_t i;
+
+  if (offset + data_len > sizeof(flash))
+    return false;
+
+  for (i = 0; i < data_len; ++i) {
+    if (power_cut_armed && (power_cut_after-- == 0))
+      return false;
+    flash[offset + i] &= data[i];
+    bytes_written++;
+  }
+  return true;
+}
+
+bool
+sxfs_read(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  if (offset + data_len > sizeof(flash))
+    return false;
+  memcpy(data, &flash[offset], data_len);
+  num_reads++;
+  return true;
+}
+
+bool
+sxfs_erase(sxfs_part_id_t part_id, uint32_t offset, uint32_t len)
+{
+  if (offset + len > sizeof(flash))
+    return false;
+  memset(&flash[offset], 0xFF, len);
+  num_erases++;
+  return true;
+}
+
+/* Starts the log again from what is in flash, as after a reset */
+static void
+reboot(void)
+{
+  memset(sectors, 0, sizeof(sectors));
+  have_sector = false;
+  write_sector = 0;
+  write_page = 0;
+  write_slot = 0;
+  page_open = false;
+  boot_pending = true;
+  memset(&last, 0, sizeof(last));
+  time_base = 0;
+  power_cut_armed = false;
+
+  history_log_init();
+  CHECK_EQ(num_sectors, TEST_SECTORS);
+}
+
+static void
+reset(void)
+{
+  memset(flash, 0xFF, sizeof(flash));
+  reboot();
+}
+
+/* The logged values at each second follow a slow sawtooth, with a jump now
+ * and then which needs a keyframe.
+ */
+static void
+make_record(uint32_t t, history_log_record_t* rec)
+{
+  memset(rec, 0, sizeof(*rec));
+  rec->time = t;
+  rec->temp[SENSOR_1] = 650 + (t % 40);
+  rec->temp[SENSOR_2] = ((t / 1000) & 1) ? HISTORY_LOG_NO_DATA : 400 - (t % 25);
+  rec->setpoint[CONTROLLER_1] = 680 + ((t / 600) * 10);
+  rec->setpoint[CONTROLLER_2] = HISTORY_LOG_NO_DATA;
+  rec->outputs = (t / 100) & 0x03;
+}
+
+static void
+append_range(uint32_t from, uint32_t to)
+{
+  uint32_t t;
+  history_log_record_t rec;
+
+  for (t = from; t < to; ++t) {
+    make_record(t, &rec);
+    CHECK(history_log_append(&rec));
+  }
+}
+
+static bool
+same_values(const history_log_record_t* a, const history_log_record_t* b)
+{
+  return (a->time == b->time) &&
+      (memcmp(a->temp, b->temp, sizeof(a->temp)) == 0) &&
+      (memcmp(a->setpoint, b->setpoint, sizeof(a->setpoint)) == 0) &&
+      (a->outputs == b->outputs);
+}
+
+/* Reads from the given time to the end of the log, checking each record
+ * against make_record(). Returns the number of records read.
+ */
+static uint32_t
+check_range(uint32_t from, uint32_t* first_time)
+{
+  uint32_t n = 0;
+  history_log_record_t rec;
+  history_log_record_t expected;
+  history_log_cursor_t* c = calloc(1, sizeof(history_log_cursor_t));
+
+  CHECK(history_log_seek(c, from));
+  while (history_log_next(c, &rec)) {
+    if (n == 0)
+      *first_time = rec.time;
+
+    make_record(*first_time + n, &expected);
+    if (!same_values(&rec, &expected)) {
+      printf("record %u at %u does not match\n", n, rec.time);
+      test_failures++;
+      break;
+    }
+    n++;
+  }
+
+  free(c);
+  return n;
+}
+
+static void
+test_round_trip(void)
+{
+  uint32_t first;
+
+  reset();
+  append_range(0, 5000);
+
+  CHECK_EQ(check_range(0, &first), 5000);
+  CHECK_EQ(first, 0);
+
+  CHECK_EQ(check_range(1234, &first), 5000 - 1234);
+  CHECK_EQ(first, 1234);
+
+  /* The log survives a reboot and carries on from where it left off */
+  reboot();
+  CHECK_EQ(last.time, 4999);
+  append_range(5000, 6000);
+  CHECK_EQ(check_range(0, &first), 6000);
+}
+
+/* Cuts the power at every byte of a record write, in a delta record and in
+ * a keyframe. Everything written before the cut must read back, the damaged
+ * record must not, and logging must carry on after it.
+ */
+static void
+test_torn_write(void)
+{
+  uint32_t cut;
+  uint32_t t;
+
+  for (t = 0; t < 2; ++t) {
+    /* Sensor 2 drops out at 1000 s, so record 1000 is a keyframe */
+    uint32_t torn_time = (t == 0) ? 300 : 1000;
+    uint32_t cut_bytes = (t == 0) ? sizeof(log_record_t) : 2 * sizeof(log_record_t);
+    history_log_record_t rec;
+    uint32_t first;
+
+    reset();
+    append_range(0, torn_time);
+    uint8_t slot = write_slot;
+    append_range(torn_time, torn_time + 1);
+    CHECK_EQ(write_slot - slot, cut_bytes / sizeof(log_record_t));
+
+    for (cut = 0; cut < cut_bytes; ++cut) {
+      reset();
+      append_range(0, torn_time);
+
+      power_cut_armed = true;
+      power_cut_after = cut;
+      make_record(torn_time, &rec);
+      CHECK(!history_log_append(&rec));
+
+      reboot();
+      CHECK_EQ(check_range(0, &first), torn_time);
+      CHECK_EQ(first, 0);
+
+      append_range(torn_time + 10, torn_time + 100);
+      CHECK_EQ(check_range(torn_time, &first), 90);
+      CHECK_EQ(first, torn_time + 10);
+
+      history_log_cursor_t* c = calloc(1, sizeof(history_log_cursor_t));
+      CHECK(history_log_seek(c, torn_time));
+      CHECK(history_log_next(c, &rec));
+      CHECK(rec.boot);
+      free(c);
+    }
+  }
+}
+
+/* Fills the ring more than once over and checks each sector's header and
+ * page time index against the records in its pages.
+ */
+static void
+test_page_index_after_wrap(void)
+{
+  uint32_t i;
+  uint32_t page;
+  uint32_t end = (TEST_SECTORS + 1) * SECTOR_RECORDS;
+
+  reset();
+  append_range(0, end);
+
+  for (i = 0; i < TEST_SECTORS; ++i) {
+    uint32_t prev_time = 0;
+
+    CHECK(sectors[i].valid);
+    if (!sectors[i].valid)
+      continue;
+
+    CHECK_EQ(read_page_time(i, 0), sectors[i].first_time);
+
+    history_log_cursor_t* c = calloc(1, sizeof(history_log_cursor_t));
+    c->sector = i;
+    c->seq = sectors[i].seq;
+    c->valid = true;
+
+    for (page = 0; page < PAGES_PER_SECTOR; ++page) {
+      uint32_t page_time = read_page_time(i, page);
+      if (page_time == ERASED_WORD)
+        break;
+
+      /* A page's index entry is the time of its first keyframe */
+      history_log_record_t rec;
+      CHECK(load_page(c, page));
+      CHECK(decode_record((const log_record_t*)c->page_buf, &c->slot, &c->state) == DECODE_OK);
+      rec = c->state;
+      CHECK_EQ(rec.time, page_time);
+      CHECK(page_time >= prev_time);
+      prev_time = page_time;
+    }
+
+    /* Only the sector being written has unopened pages */
+    if (i != write_sector)
+      CHECK_EQ(page, PAGES_PER_SECTOR);
+
+    free(c);
+  }
+
+  /* Sequence numbers run around the ring from the oldest sector */
+  uint8_t oldest = (write_sector + 1) % TEST_SECTORS;
+  CHECK_EQ(sectors[write_sector].seq, sectors[oldest].seq + TEST_SECTORS - 1);
+
+  /* A reboot finds the same place to carry on from */
+  uint8_t sector = write_sector;
+  uint8_t wpage = write_page;
+  uint8_t slot = write_slot;
+  reboot();
+  CHECK_EQ(write_sector, sector);
+  CHECK_EQ(write_page, wpage);
+  CHECK_EQ(write_slot, slot);
+}
+
+static void
+test_query_across_reclaim(void)
+{
+  uint32_t first;
+  uint32_t n;
+  uint32_t end = (TEST_SECTORS + 1) * SECTOR_RECORDS;
+  history_log_record_t rec;
+
+  reset();
+  append_range(0, end);
+
+  /* A query from before the oldest record starts at the oldest record, and
+   * runs through every sector to the newest.
+   */
+  uint8_t oldest = (write_sector + 1) % TEST_SECTORS;
+  n = check_range(0, &first);
+  CHECK_EQ(first, sectors[oldest].first_time);
+  CHECK_EQ(first + n, end);
+
+  /* A query from the last page of one sector runs on into the next */
+  uint8_t middle = (oldest + 1) % TEST_SECTORS;
+  uint32_t from = sectors[middle].first_time - 10;
+  CHECK_EQ(check_range(from, &first), end - from);
+  CHECK_EQ(first, from);
+
+  /* A cursor left in the oldest sector stops once that sector is reclaimed,
+   * rather than reading records from the next trip around the ring.
+   */
+  history_log_cursor_t* c = calloc(1, sizeof(history_log_cursor_t));
+  CHECK(history_log_seek(c, 0));
+  CHECK(history_log_next(c, &rec));
+
+  uint32_t written = end;
+  while (sectors[oldest].seq == c->seq) {
+    append_range(written, written + RECORDS_PER_PAGE);
+    written += RECORDS_PER_PAGE;
+  }
+
+  n = 0;
+  while (history_log_next(c, &rec)) {
+    CHECK(rec.time < sectors[oldest].first_time);
+    n++;
+  }
+  CHECK(n < (PAGES_PER_SECTOR * RECORDS_PER_PAGE));
+  free(c);
+}
+
+/* Each sample costs one 8 byte record and a share of the keyframes, page
+ * index entries and sector erases. A seek costs a fixed number of flash
+ * reads however much history there is.
+ */
+static void
+test_flash_cost(void)
+{
+  uint32_t samples = (TEST_SECTORS + 1) * SECTOR_RECORDS;
+  uint32_t t;
+
+  reset();
+  bytes_written = 0;
+  num_erases = 0;
+  append_range(0, samples);
+
+  float bytes_per_sample = (float)bytes_written / samples;
+  printf("  %.2f bytes programmed per sample, %u sector erases\n",
+      bytes_per_sample, num_erases);
+  CHECK(bytes_per_sample < 1.2f * sizeof(log_record_t));
+  CHECK(num_erases <= (samples / SECTOR_RECORDS) + 1);
+
+  uint32_t max_reads = 0;
+  history_log_cursor_t* c = calloc(1, sizeof(history_log_cursor_t));
+  for (t = 0; t < samples; t += 997) {
+    num_reads = 0;
+    history_log_seek(c, t);
+    max_reads = MAX(max_reads, num_reads);
+  }
+  free(c);
+
+  printf("  at most %u flash reads per seek\n", max_reads);
+  CHECK(max_reads <= 16);
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_torn_write);
+  RUN_TEST(test_page_index_after_wrap);
+  RUN_TEST(test_query_across_reclaim);
+  RUN_TEST(test_flash_cost);
+
+  TEST_MAIN_END();
+}
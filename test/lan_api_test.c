@@ -0,0 +1,712 @@
+
+#include "test.h"
+
+/* The LAN API uses more of the protocol than test/stubs/bbmt.pb.h holds, so
+ * its messages are defined here, with the auth request first so that a
+ * short copy of the struct carries it.
+ */
+#define BBMT_PB_H
+#include "pb.h"
+
+typedef enum {
+  ApiMessage_Type_DEVICE_REPORT,
+  ApiMessage_Type_DEVICE_SETTINGS,
+  ApiMessage_Type_CONTROLLER_SETTINGS,
+  ApiMessage_Type_AUTH_REQUEST,
+  ApiMessage_Type_AUTH_RESPONSE
+} ApiMessage_Type;
+
+typedef enum {
+  DeviceSettings_ControlMode_ON_OFF,
+  DeviceSettings_ControlMode_PID
+} DeviceSettings_ControlMode;
+
+typedef enum {
+  ControllerSettings_SetpointType_STATIC,
+  ControllerSettings_SetpointType_TEMP_PROFILE
+} ControllerSettings_SetpointType;
+
+typedef enum {
+  ControllerSettings_CompletionAction_HOLD_LAST
+} ControllerSettings_CompletionAction;
+
+typedef enum {
+  TempProfileStep_TempProfileStepType_HOLD,
+  TempProfileStep_TempProfileStepType_RAMP
+} TempProfileStep_TempProfileStepType;
+
+typedef struct {
+  char device_id[32];
+  char auth_token[64];
+  bool has_firmware_version;
+  char firmware_version[16];
+} AuthRequest;
+
+typedef struct {
+  bool authenticated;
+} AuthResponse;
+
+typedef struct {
+  bool has_output_index;
+  uint32_t output_index;
+  bool has_status;
+  bool status;
+  bool has_kp;
+  float kp;
+  bool has_ki;
+  float ki;
+  bool has_kd;
+  float kd;
+} OutputStatus;
+
+typedef struct {
+  uint32_t controller_index;
+  float sensor_reading;
+  float setpoint;
+  bool has_timestamp;
+  uint32_t timestamp;
+  pb_size_t output_status_count;
+  OutputStatus output_status[2];
+} ControllerReport;
+
+typedef struct {
+  pb_size_t controller_reports_count;
+  ControllerReport controller_reports[2];
+} DeviceReport;
+
+typedef struct {
+  char name[64];
+  DeviceSettings_ControlMode control_mode;
+  float hysteresis;
+} DeviceSettings;
+
+typedef struct {
+  uint32_t index;
+  uint32_t function;
+  float cycle_delay;
+} OutputSettings;
+
+typedef struct {
+  uint32_t duration;
+  float value;
+  TempProfileStep_TempProfileStepType type;
+} TempProfileStep;
+
+typedef struct {
+  uint32_t id;
+  char name[64];
+  float start_value;
+  pb_size_t steps_count;
+  TempProfileStep steps[4];
+} TempProfile;
+
+typedef struct {
+  uint32_t sensor_index;
+  ControllerSettings_SetpointType setpoint_type;
+  bool has_session_action;
+  uint32_t session_action;
+  bool has_static_setpoint;
+  float static_setpoint;
+  bool has_temp_profile_id;
+  uint32_t temp_profile_id;
+  bool has_temp_profile_completion_action;
+  uint32_t temp_profile_completion_action;
+  bool has_temp_profile_start_point;
+  uint32_t temp_profile_start_point;
+  pb_size_t output_settings_count;
+  OutputSettings output_settings[2];
+  pb_size_t temp_profiles_count;
+  TempProfile temp_profiles[1];
+} ControllerSettings;
+
+typedef struct {
+  ApiMessage_Type type;
+  bool has_authRequest;
+  AuthRequest authRequest;
+  bool has_authResponse;
+  AuthResponse authResponse;
+  bool has_deviceReport;
+  DeviceReport deviceReport;
+  bool has_deviceSettings;
+  DeviceSettings deviceSettings;
+  bool has_controllerSettings;
+  ControllerSettings controllerSettings;
+} ApiMessage;
+
+#define AuthRequest_size  sizeof(AuthRequest)
+#define ApiMessage_size   sizeof(ApiMessage)
+
+static const pb_field_t ApiMessage_fields[1] = { { sizeof(ApiMessage) } };
+
+/* The client state is private to lan_api.c, and the reader under it is in
+ * web_api_msg.c, so the tests build both directly, without their logging.
+ */
+#define printf(...) ((void)0)
+#include "web_api_msg.c"
+#include "lan_api.c"
+#undef printf
+
+#include <sys/time.h>
+
+
+/* Tests the LAN API server in lan_api.c, and the socket message reader in
+ * web_api_msg.c under it, by playing clients over in-memory sockets:
+ * authentication, the limits on clients which haven't authenticated, the
+ * lock out after failed attempts, and reports fanned out to several
+ * clients, one of which has stopped reading. The time each sample takes to
+ * reach the clients is measured for one and for two clients.
+ *
+ * Socket waits advance the test time rather than blocking.
+ */
+
+#define DEVICE_TOKEN     "5ee4b0c2a1d94c4f9e0b7d3a6c1f2e88"
+#define MAX_SOCKETS      8
+#define SOCKET_IN_SIZE   4096
+#define SOCKET_OUT_SIZE  (64 * 1024)
+#define FANOUT_SAMPLES   2000
+
+/* The device's end of a client connection */
+typedef struct {
+  bool open;
+  uint8_t in[SOCKET_IN_SIZE];
+  uint32_t in_len;
+  uint32_t in_pos;
+  systime_t byte_delay;
+  uint8_t out[SOCKET_OUT_SIZE];
+  uint32_t out_len;
+  uint32_t out_pos;
+  bool stalled;
+} fake_socket_t;
+
+systime_t test_time;
+int test_failures;
+
+static fake_socket_t sockets[MAX_SOCKETS];
+static controller_settings_t controller_settings[NUM_CONTROLLERS];
+static net_status_t net_status;
+
+
+int
+recv_timeout(long sd, void* buf, long len, long flags, systime_t timeout)
+{
+  fake_socket_t* s = &sockets[sd];
+  long n = 0;
+
+  if (!s->open)
+    return 0;
+
+  /* A trickling client sends one byte each byte_delay. Without a wait, the
+   * byte select reported is there.
+   */
+  if ((s->byte_delay > 0) && (s->in_pos < s->in_len)) {
+    if (s->byte_delay > timeout) {
+      if (timeout > 0) {
+        test_time += timeout;
+        errno = EWOULDBLOCK;
+        return -1;
+      }
+    }
+    else {
+      test_time += s->byte_delay;
+    }
+    len = 1;
+  }
+
+  if (s->in_pos == s->in_len) {
+    test_time += timeout;
+    errno = EWOULDBLOCK;
+    return -1;
+  }
+
+  while ((n < len) && (s->in_pos < s->in_len))
+    ((uint8_t*)buf)[n++] = s->in[s->in_pos++];
+  return n;
+}
+
+int
+send(long sd, const void* buf, long len, long flags)
+{
+  fake_socket_t* s = &sockets[sd];
+
+  if (s->stalled || (s->out_len + len > SOCKET_OUT_SIZE)) {
+    errno = EWOULDBLOCK;
+    return -1;
+  }
+
+  memcpy(s->out + s->out_len, buf, len);
+  s->out_len += len;
+  return len;
+}
+
+long
+closesocket(long sd)
+{
+  sockets[sd].open = false;
+  return 0;
+}
+
+int socket(long domain, long type, long protocol) { return -1; }
+long bind(long sd, const sockaddr* addr, long addrlen) { return -1; }
+long listen(long sd, long backlog) { return -1; }
+long accept(long sd, sockaddr* addr, socklen_t* addrlen) { return -1; }
+
+const net_status_t*
+net_get_status()
+{
+  return &net_status;
+}
+
+msg_listener_t*
+msg_listener_create(const char* name, int stack_size, thread_msg_dispatch_t dispatch, void* user_data)
+{
+  return NULL;
+}
+
+void msg_listener_set_idle_timeout(msg_listener_t* l, uint32_t idle_timeout) { }
+void msg_listener_set_priority(msg_listener_t* l, msg_priority_t prio) { }
+void msg_subscribe(msg_listener_t* l, msg_id_t id, void* user_data) { }
+void msg_subscribe_lossy(msg_listener_t* l, msg_id_t id, void* user_data, size_t msg_size) { }
+void msg_subscribe_coalesced(msg_listener_t* l, msg_id_t id, void* user_data, size_t msg_size) { }
+void msg_send(msg_id_t id, void* msg_data) { }
+
+const char*
+app_cfg_get_auth_token()
+{
+  return DEVICE_TOKEN;
+}
+
+output_ctrl_t
+app_cfg_get_control_mode()
+{
+  return ON_OFF;
+}
+
+void app_cfg_set_control_mode(output_ctrl_t control_mode) { }
+void app_cfg_set_hysteresis(quantity_t hysteresis) { }
+
+const controller_settings_t*
+app_cfg_get_controller_settings(temp_controller_id_t controller)
+{
+  return &controller_settings[controller];
+}
+
+uint32_t
+app_cfg_read_controller_settings(temp_controller_id_t controller, controller_settings_t* settings)
+{
+  *settings = controller_settings[controller];
+  return 0;
+}
+
+void
+app_cfg_set_controller_settings(temp_controller_id_t controller,
+    settings_source_t source, controller_settings_t* settings)
+{
+  controller_settings[controller] = *settings;
+}
+
+float
+temp_control_get_current_setpoint(temp_controller_id_t controller)
+{
+  return controller_settings[controller].static_setpoint.value;
+}
+
+temp_control_status_t
+temp_control_get_status(temp_controller_id_t controller, output_id_t output)
+{
+  temp_control_status_t status;
+  memset(&status, 0, sizeof(status));
+  return status;
+}
+
+bool temp_profile_store_find(uint32_t id, temp_profile_info_t* info) { return false; }
+bool temp_profile_store_read_step(const temp_profile_info_t* info, uint32_t index,
+    temp_profile_step_t* step, uint32_t* step_start) { return false; }
+bool temp_profile_store_begin(temp_profile_writer_t* w, uint32_t id) { return false; }
+bool temp_profile_store_append(temp_profile_writer_t* w,
+    const temp_profile_step_t* steps, uint32_t num_steps) { return false; }
+bool temp_profile_store_commit(temp_profile_writer_t* w, const char* name,
+    quantity_t start_value, temp_profile_completion_action_t completion_action) { return false; }
+void temp_profile_store_abort(temp_profile_writer_t* w) { }
+bool temp_profile_store_delete(uint32_t id) { return true; }
+
+static uint32_t
+now_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+/* Starts the server afresh, as lan_api_init() would without its threads */
+static void
+reset(void)
+{
+  int i;
+
+  memset(sockets, 0, sizeof(sockets));
+  memset(controller_settings, 0, sizeof(controller_settings));
+  for (i = 0; i < NUM_CONTROLLERS; ++i) {
+    controller_settings[i].controller = i;
+    controller_settings[i].setpoint_type = SP_STATIC;
+    controller_settings[i].static_setpoint.value = 64 + i;
+  }
+
+  free(lan);
+  lan = calloc(1, sizeof(lan_api_t));
+  lan->listen_sd = -1;
+  for (i = 0; i < LAN_API_MAX_CLIENTS; ++i)
+    lan->clients[i].sd = -1;
+
+  test_time = 1000;
+}
+
+/* Opens a connection, as accepted by the accept thread, on the first
+ * socket which is closed.
+ */
+static int32_t
+client_connect(void)
+{
+  int32_t sd;
+
+  for (sd = 1; sd < MAX_SOCKETS - 1; ++sd) {
+    if (!sockets[sd].open)
+      break;
+  }
+
+  memset(&sockets[sd], 0, sizeof(fake_socket_t));
+  sockets[sd].open = true;
+  dispatch_client_connect(lan, &sd);
+  return sd;
+}
+
+/* Writes data from the client, and lets the server know it is there */
+static void
+client_write(int32_t sd, const void* data, uint32_t len)
+{
+  fake_socket_t* s = &sockets[sd];
+
+  memcpy(s->in + s->in_len, data, len);
+  s->in_len += len;
+  dispatch_socket_ready(lan, &sd);
+}
+
+static void
+client_send(int32_t sd, const ApiMessage* msg, uint32_t len)
+{
+  uint8_t frame[4 + sizeof(ApiMessage)];
+  uint32_t prefix = htonl(len);
+
+  memcpy(frame, &prefix, 4);
+  memcpy(frame + 4, msg, len);
+  client_write(sd, frame, 4 + len);
+}
+
+/* Sends an auth request as it is encoded on the wire, cut off after the
+ * auth request itself.
+ */
+static void
+client_auth(int32_t sd, const char* token)
+{
+  ApiMessage msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.type = ApiMessage_Type_AUTH_REQUEST;
+  msg.has_authRequest = true;
+  strncpy(msg.authRequest.auth_token, token, sizeof(msg.authRequest.auth_token));
+  client_send(sd, &msg, offsetof(ApiMessage, has_authResponse));
+}
+
+/* Reads the next message the server sent the client. Returns false if there
+ * are none. Keepalives have no type and are returned with a zero length.
+ */
+static bool
+client_read(int32_t sd, ApiMessage* msg, uint32_t* len)
+{
+  fake_socket_t* s = &sockets[sd];
+  uint32_t prefix;
+
+  if (s->out_pos + 4 > s->out_len)
+    return false;
+
+  memcpy(&prefix, s->out + s->out_pos, 4);
+  *len = ntohl(prefix);
+  memset(msg, 0, sizeof(*msg));
+  memcpy(msg, s->out + s->out_pos + 4, *len);
+  s->out_pos += 4 + *len;
+  return true;
+}
+
+static bool
+is_connected(int32_t sd)
+{
+  return sockets[sd].open && (find_client(lan, sd) != NULL);
+}
+
+/* Authenticates a new client and reads the settings it is sent */
+static int32_t
+client_login(void)
+{
+  ApiMessage msg;
+  uint32_t len;
+  int32_t sd = client_connect();
+
+  client_auth(sd, DEVICE_TOKEN);
+  while (client_read(sd, &msg, &len)) {
+  }
+  return sd;
+}
+
+static void
+test_auth(void)
+{
+  ApiMessage msg;
+  uint32_t len;
+  int32_t sd;
+
+  reset();
+  sd = client_connect();
+  CHECK(is_connected(sd));
+  client_auth(sd, DEVICE_TOKEN);
+  CHECK(is_connected(sd));
+
+  CHECK(client_read(sd, &msg, &len));
+  CHECK_EQ(msg.type, ApiMessage_Type_AUTH_RESPONSE);
+  CHECK(msg.authResponse.authenticated);
+  CHECK(client_read(sd, &msg, &len));
+  CHECK_EQ(msg.type, ApiMessage_Type_DEVICE_SETTINGS);
+  CHECK(client_read(sd, &msg, &len));
+  CHECK_EQ(msg.type, ApiMessage_Type_CONTROLLER_SETTINGS);
+  CHECK(client_read(sd, &msg, &len));
+  CHECK_EQ(msg.type, ApiMessage_Type_CONTROLLER_SETTINGS);
+  CHECK_NEAR(msg.controllerSettings.static_setpoint, 65, 0.001);
+
+  /* Once in, a client may send full sized messages */
+  memset(&msg, 0, sizeof(msg));
+  msg.type = ApiMessage_Type_CONTROLLER_SETTINGS;
+  msg.has_controllerSettings = true;
+  msg.controllerSettings.sensor_index = 0;
+  msg.controllerSettings.setpoint_type = ControllerSettings_SetpointType_STATIC;
+  msg.controllerSettings.has_static_setpoint = true;
+  msg.controllerSettings.static_setpoint = 50;
+  client_send(sd, &msg, sizeof(msg));
+  CHECK(is_connected(sd));
+  CHECK_NEAR(controller_settings[0].static_setpoint.value, 50, 0.001);
+
+  /* A wrong token is refused, with a reply saying so */
+  sd = client_connect();
+  client_auth(sd, "5ee4b0c2a1d94c4f9e0b7d3a6c1f2e89");
+  CHECK(client_read(sd, &msg, &len));
+  CHECK_EQ(msg.type, ApiMessage_Type_AUTH_RESPONSE);
+  CHECK(!msg.authResponse.authenticated);
+  CHECK(!is_connected(sd));
+
+  /* As is anything else first */
+  lan->auth_backoff = 0;
+  sd = client_connect();
+  memset(&msg, 0, sizeof(msg));
+  msg.type = ApiMessage_Type_DEVICE_SETTINGS;
+  client_send(sd, &msg, offsetof(ApiMessage, has_authResponse));
+  CHECK(!is_connected(sd));
+}
+
+static void
+test_token_compare(void)
+{
+  char token[64];
+
+  memset(token, 'x', sizeof(token));
+  strcpy(token, DEVICE_TOKEN);
+  CHECK(token_matches(token, DEVICE_TOKEN, sizeof(token)));
+
+  CHECK(!token_matches("", DEVICE_TOKEN, sizeof(token)));
+  CHECK(!token_matches("5ee4b0c2", DEVICE_TOKEN, sizeof(token)));
+  CHECK(!token_matches(DEVICE_TOKEN "0", DEVICE_TOKEN, sizeof(token)));
+  CHECK(!token_matches("6ee4b0c2a1d94c4f9e0b7d3a6c1f2e88", DEVICE_TOKEN, sizeof(token)));
+
+  /* A token filling the field has no terminator */
+  memset(token, 'a', sizeof(token));
+  CHECK(!token_matches(token, DEVICE_TOKEN, sizeof(token)));
+  CHECK(token_matches(token, token, sizeof(token)));
+}
+
+/* A client which hasn't authenticated can't announce a message bigger than
+ * an auth request, and can't take longer than AUTH_RECV_TIMEOUT to send
+ * one, however slowly it trickles in.
+ */
+static void
+test_preauth_limits(void)
+{
+  ApiMessage msg;
+  uint32_t prefix;
+  int32_t sd;
+  systime_t start;
+
+  reset();
+  sd = client_connect();
+  prefix = htonl(AUTH_MSG_MAX_SIZE + 1);
+  start = test_time;
+  client_write(sd, &prefix, 4);
+  CHECK(!is_connected(sd));
+  CHECK_EQ(test_time - start, 0);
+
+  /* The largest allowed, a byte every 100 ms */
+  sd = client_connect();
+  memset(&msg, 0, sizeof(msg));
+  msg.type = ApiMessage_Type_AUTH_REQUEST;
+  msg.has_authRequest = true;
+  strcpy(msg.authRequest.auth_token, DEVICE_TOKEN);
+  sockets[sd].byte_delay = MS2ST(100);
+  start = test_time;
+  client_send(sd, &msg, AUTH_MSG_MAX_SIZE);
+  printf("  trickling client held the listener for %u ms\n",
+      (unsigned int)(test_time - start));
+  CHECK(test_time - start <= AUTH_RECV_TIMEOUT + MS2ST(100));
+  CHECK(!is_connected(sd));
+
+  /* A client which has authenticated may take longer */
+  sd = client_login();
+  sockets[sd].byte_delay = MS2ST(10);
+  start = test_time;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = ApiMessage_Type_DEVICE_SETTINGS;
+  msg.has_deviceSettings = true;
+  client_send(sd, &msg, 200);
+  CHECK(is_connected(sd));
+  CHECK(test_time - start > AUTH_RECV_TIMEOUT);
+}
+
+/* Each failed attempt locks out new ones for twice as long as the last.
+ * Until it has passed new clients are turned away, and the right token is
+ * refused. A success clears the lock out.
+ */
+static void
+test_auth_lockout(void)
+{
+  int i;
+  int32_t sd;
+  systime_t backoff = AUTH_BACKOFF_MIN;
+
+  reset();
+  for (i = 0; i < 8; ++i) {
+    sd = client_connect();
+    CHECK(is_connected(sd));
+    client_auth(sd, "guess");
+    CHECK(!is_connected(sd));
+    CHECK_EQ(lan->auth_backoff, backoff);
+
+    sd = client_connect();
+    CHECK(!is_connected(sd));
+
+    test_time += backoff - 1;
+    sd = client_connect();
+    CHECK(!is_connected(sd));
+
+    test_time += 1;
+    backoff = MIN(2 * backoff, AUTH_BACKOFF_MAX);
+  }
+  CHECK_EQ(lan->auth_backoff, AUTH_BACKOFF_MAX);
+
+  /* A client which connected before the lock out started */
+  sd = client_connect();
+  int32_t guesser = client_connect();
+  client_auth(guesser, "guess");
+  client_auth(sd, DEVICE_TOKEN);
+  CHECK(!is_connected(sd));
+
+  test_time += AUTH_BACKOFF_MAX;
+  sd = client_login();
+  CHECK(is_connected(sd));
+  CHECK_EQ(lan->auth_backoff, 0);
+}
+
+/* Every sample goes to every authenticated client, encoded once. A client
+ * which stops reading keeps the newest CLIENT_QUEUE_LEN messages and drops
+ * the rest, without holding up the others.
+ */
+static void
+test_fanout(void)
+{
+  int i;
+  int n;
+  int32_t sd[LAN_API_MAX_CLIENTS];
+  uint32_t elapsed_us[LAN_API_MAX_CLIENTS + 1];
+  ApiMessage msg;
+  uint32_t len;
+  sensor_msg_t sample = { .sensor = SENSOR_1, .sample = { .value = 0, .unit = UNIT_TEMP_DEG_F } };
+
+  for (n = 1; n <= LAN_API_MAX_CLIENTS; ++n) {
+    reset();
+    for (i = 0; i < n; ++i)
+      sd[i] = client_login();
+
+    uint32_t start = now_us();
+    for (i = 0; i < FANOUT_SAMPLES; ++i) {
+      sample.sample.value = i;
+      dispatch_sensor_sample(lan, &sample);
+
+      /* Drained as a client keeping up would */
+      int j;
+      for (j = 0; j < n; ++j)
+        sockets[sd[j]].out_len = sockets[sd[j]].out_pos = 0;
+    }
+    elapsed_us[n] = now_us() - start;
+    printf("  %d client(s): %.2f us from sample to queued on every socket\n",
+        n, (float)elapsed_us[n] / FANOUT_SAMPLES);
+  }
+
+  /* Every report arrives, in order */
+  reset();
+  sd[0] = client_login();
+  sd[1] = client_login();
+  for (i = 0; i < 20; ++i) {
+    sample.sample.value = i;
+    dispatch_sensor_sample(lan, &sample);
+  }
+  for (n = 0; n < 2; ++n) {
+    for (i = 0; i < 20; ++i) {
+      CHECK(client_read(sd[n], &msg, &len));
+      CHECK_EQ(msg.type, ApiMessage_Type_DEVICE_REPORT);
+      CHECK_NEAR(msg.deviceReport.controller_reports[0].sensor_reading, i, 0.001);
+    }
+    CHECK(!client_read(sd[n], &msg, &len));
+  }
+
+  /* One client stops reading */
+  sockets[sd[1]].stalled = true;
+  for (i = 20; i < 40; ++i) {
+    sample.sample.value = i;
+    dispatch_sensor_sample(lan, &sample);
+  }
+  for (i = 20; i < 40; ++i) {
+    CHECK(client_read(sd[0], &msg, &len));
+    CHECK_NEAR(msg.deviceReport.controller_reports[0].sensor_reading, i, 0.001);
+  }
+  lan_client_t* c = find_client(lan, sd[1]);
+  CHECK_EQ(c->queue_count, CLIENT_QUEUE_LEN);
+  CHECK_EQ(c->frames_dropped, 20 - CLIENT_QUEUE_LEN);
+
+  sockets[sd[1]].stalled = false;
+  client_flush(lan, c);
+  for (i = 40 - CLIENT_QUEUE_LEN; i < 40; ++i) {
+    CHECK(client_read(sd[1], &msg, &len));
+    CHECK_NEAR(msg.deviceReport.controller_reports[0].sensor_reading, i, 0.001);
+  }
+
+  /* A quiet client is sent keepalives */
+  test_time += KEEPALIVE_INTERVAL + 1;
+  lan_api_service(lan);
+  CHECK(client_read(sd[0], &msg, &len));
+  CHECK_EQ(len, 0);
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_auth);
+  RUN_TEST(test_token_compare);
+  RUN_TEST(test_preauth_limits);
+  RUN_TEST(test_auth_lockout);
+  RUN_TEST(test_fanout);
+
+  TEST_MAIN_END();
+}
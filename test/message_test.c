@@ -0,0 +1,468 @@
+
+#define TEST_THREADS
+#define MSG_STATS
+
+#include "test.h"
+
+/* The lossy queue is private to message.c, so the tests build it directly */
+#include "message.c"
+
+/* Nothing here includes the CC3000 headers, which usually define clock_t */
+typedef long clock_t;
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+
+/* Tests the lossy and coalesced queues in message.c: coalesced messages are
+ * never dropped to make room, and a listener flooded with lossy samples
+ * which it is slow to handle still gets urgent messages promptly. Listener
+ * threads run on pthreads, with the mailboxes and critical sections below,
+ * and a thread ticks the system time at 1 kHz as on the controller.
+ *
+ * If MSG_STATS_JSON is set in the environment the bus statistics are
+ * written there as JSON at exit.
+ */
+
+#define SLOW_DISPATCH_US  5000
+#define FLOOD_SAMPLES     2000
+#define URGENT_EVERY      100
+
+systime_t test_time;
+int test_failures;
+
+static volatile int sys_lock;
+static __thread Thread self_thread;
+
+typedef struct {
+  uint32_t seq;
+} sample_msg_t;
+
+/* What the listeners under test were dispatched */
+static int num_dispatched;
+static msg_id_t dispatched_id[16];
+static uint32_t dispatched_data[16];
+
+static volatile uint32_t num_samples;
+static volatile uint32_t last_sample;
+static volatile uint32_t num_urgent;
+static volatile uint32_t urgent_sent_at;
+static volatile uint32_t urgent_max_latency;
+
+
+static void*
+tick_main(void* arg)
+{
+  while (1) {
+    usleep(1000);
+    __atomic_add_fetch(&test_time, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+static void
+save_stats(void)
+{
+  const char* path = getenv("MSG_STATS_JSON");
+  FILE* f;
+
+  if (path == NULL)
+    return;
+
+  f = fopen(path, "w");
+  if (f != NULL) {
+    msg_stats_dump_json(f);
+    fclose(f);
+  }
+}
+
+void
+chSysLock(void)
+{
+  while (__sync_lock_test_and_set(&sys_lock, 1))
+    sched_yield();
+}
+
+void
+chSysUnlock(void)
+{
+  __sync_lock_release(&sys_lock);
+}
+
+void
+chSchRescheduleS(void)
+{
+}
+
+static void*
+thread_main(void* arg)
+{
+  void** start = arg;
+  tfunc_t fn = (tfunc_t)start[0];
+  void* fn_arg = start[1];
+
+  free(start);
+  fn(fn_arg);
+  return NULL;
+}
+
+Thread*
+chThdCreateFromHeap(void* heap, size_t size, int prio, tfunc_t fn, void* arg)
+{
+  pthread_t t;
+  void** start = malloc(2 * sizeof(void*));
+
+  start[0] = (void*)fn;
+  start[1] = arg;
+  pthread_create(&t, NULL, thread_main, start);
+  pthread_detach(t);
+  return calloc(1, sizeof(Thread));
+}
+
+Thread*
+chThdSelf(void)
+{
+  return &self_thread;
+}
+
+void
+chThdSetPriority(tprio_t prio)
+{
+}
+
+void
+chThdSleepMilliseconds(uint32_t msec)
+{
+  usleep(msec * 1000);
+}
+
+void
+chMBInit(Mailbox* mb, msg_t* buf, int size)
+{
+  mb->buf = buf;
+  mb->size = size;
+  mb->head = 0;
+  mb->count = 0;
+}
+
+msg_t
+chMBPostI(Mailbox* mb, msg_t msg)
+{
+  if (mb->count == mb->size)
+    return RDY_TIMEOUT;
+  mb->buf[(mb->head + mb->count++) % mb->size] = msg;
+  return RDY_OK;
+}
+
+static msg_t
+post_ahead_i(Mailbox* mb, msg_t msg)
+{
+  if (mb->count == mb->size)
+    return RDY_TIMEOUT;
+  mb->head = (mb->head + mb->size - 1) % mb->size;
+  mb->buf[mb->head] = msg;
+  mb->count++;
+  return RDY_OK;
+}
+
+/* Only waiting for ever or not at all is needed */
+static msg_t
+mb_wait(Mailbox* mb, msg_t* msg, systime_t timeout, msg_t (*op)(Mailbox*, msg_t*))
+{
+  while (1) {
+    chSysLock();
+    msg_t ret = op(mb, msg);
+    chSysUnlock();
+
+    if ((ret == RDY_OK) || (timeout != TIME_INFINITE))
+      return ret;
+    usleep(50);
+  }
+}
+
+static msg_t
+post_op(Mailbox* mb, msg_t* msg)
+{
+  return chMBPostI(mb, *msg);
+}
+
+static msg_t
+post_ahead_op(Mailbox* mb, msg_t* msg)
+{
+  return post_ahead_i(mb, *msg);
+}
+
+static msg_t
+fetch_op(Mailbox* mb, msg_t* msg)
+{
+  if (mb->count == 0)
+    return RDY_TIMEOUT;
+  *msg = mb->buf[mb->head];
+  mb->head = (mb->head + 1) % mb->size;
+  mb->count--;
+  return RDY_OK;
+}
+
+msg_t
+chMBPost(Mailbox* mb, msg_t msg, systime_t timeout)
+{
+  return mb_wait(mb, &msg, timeout, post_op);
+}
+
+msg_t
+chMBPostAhead(Mailbox* mb, msg_t msg, systime_t timeout)
+{
+  return mb_wait(mb, &msg, timeout, post_ahead_op);
+}
+
+msg_t
+chMBFetch(Mailbox* mb, msg_t* msg, systime_t timeout)
+{
+  return mb_wait(mb, msg, timeout, fetch_op);
+}
+
+int
+chMBGetUsedCountI(Mailbox* mb)
+{
+  return mb->count;
+}
+
+void
+thread_watchdog_enable(Thread* tp, systime_t period)
+{
+}
+
+void
+thread_watchdog_kick(void)
+{
+}
+
+static uint32_t
+now_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+static void
+record_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  if ((id == MSG_IDLE) || (num_dispatched >= 16))
+    return;
+
+  dispatched_id[num_dispatched] = id;
+  dispatched_data[num_dispatched] = *(uint32_t*)msg_data;
+  num_dispatched++;
+}
+
+/* A listener without a thread, which the test runs by hand */
+static msg_listener_t*
+make_manual_listener(void)
+{
+  msg_listener_t* l = calloc(1, sizeof(msg_listener_t));
+  l->name = "manual";
+  l->dispatch = record_dispatch;
+  l->timeout = TIME_IMMEDIATE;
+  chMBInit(&l->mb, l->mb_buf, MAX_MAILBOX_MSGS);
+  return l;
+}
+
+static void
+run_manual_listener(msg_listener_t* l)
+{
+  num_dispatched = 0;
+  while (l->lossy->count > 0)
+    msg_loop_exec(l);
+}
+
+static void
+send_socket_ready(int32_t sd)
+{
+  msg_send(MSG_WLAN_SOCKET_READY, &sd);
+}
+
+static void
+send_sample(uint32_t seq)
+{
+  sample_msg_t s = { .seq = seq };
+  msg_send(MSG_SENSOR_SAMPLE, &s);
+}
+
+/* A full queue drops its oldest lossy entry, and when it only holds
+ * coalesced entries it drops the new message instead.
+ */
+static void
+test_coalesced_kept(void)
+{
+  int i;
+  msg_listener_t* l = make_manual_listener();
+
+  msg_subscribe_coalesced(l, MSG_WLAN_SOCKET_READY, NULL, sizeof(int32_t));
+  msg_subscribe_lossy(l, MSG_SENSOR_SAMPLE, NULL, sizeof(sample_msg_t));
+
+  for (i = 0; i < LOSSY_QUEUE_LEN; ++i)
+    send_socket_ready(i);
+  CHECK_EQ(l->lossy->count, LOSSY_QUEUE_LEN);
+
+  send_sample(1);
+  send_socket_ready(3);
+  CHECK_EQ(l->stats.lossy_dropped, 1);
+  send_socket_ready(LOSSY_QUEUE_LEN);
+  CHECK_EQ(l->stats.lossy_dropped, 2);
+
+  run_manual_listener(l);
+  CHECK_EQ(num_dispatched, LOSSY_QUEUE_LEN);
+  for (i = 0; i < num_dispatched; ++i) {
+    CHECK_EQ(dispatched_id[i], MSG_WLAN_SOCKET_READY);
+    CHECK_EQ(dispatched_data[i], i);
+  }
+
+  /* With lossy entries queued, the oldest of those makes room */
+  for (i = 0; i < 5; ++i)
+    send_socket_ready(i);
+  for (i = 1; i <= 4; ++i)
+    send_sample(i);
+  CHECK_EQ(l->stats.lossy_dropped, 3);
+
+  run_manual_listener(l);
+  CHECK_EQ(num_dispatched, LOSSY_QUEUE_LEN);
+  for (i = 0; i < 5; ++i)
+    CHECK_EQ(dispatched_data[i], i);
+  for (i = 5; i < LOSSY_QUEUE_LEN; ++i) {
+    CHECK_EQ(dispatched_id[i], MSG_SENSOR_SAMPLE);
+    CHECK_EQ(dispatched_data[i], i - 3);
+  }
+
+  msg_unsubscribe(l, MSG_WLAN_SOCKET_READY, NULL);
+  msg_unsubscribe(l, MSG_SENSOR_SAMPLE, NULL);
+}
+
+static void
+slow_dispatch(msg_id_t id, void* msg_data, void* listener_data, void* sub_data)
+{
+  switch (id) {
+    case MSG_SENSOR_SAMPLE:
+      last_sample = ((sample_msg_t*)msg_data)->seq;
+      num_samples++;
+      usleep(SLOW_DISPATCH_US);
+      break;
+
+    case MSG_CONTROLLER_SETTINGS:
+      urgent_max_latency = MAX(urgent_max_latency, now_us() - urgent_sent_at);
+      num_urgent++;
+      break;
+
+    default:
+      break;
+  }
+}
+
+/* Samples are sent far faster than the listener handles them. The sender
+ * is never held up, every sample is either dispatched or counted as
+ * dropped, the newest one is always dispatched, and an urgent message
+ * waits for at most the one sample being handled when it arrives.
+ */
+static void
+test_flood_slow_subscriber(void)
+{
+  uint32_t i;
+  uint32_t settings = 0;
+  uint32_t send_max = 0;
+  msg_listener_t* l = msg_listener_create("slow", 1024, slow_dispatch, NULL);
+
+  msg_subscribe_lossy(l, MSG_SENSOR_SAMPLE, NULL, sizeof(sample_msg_t));
+  msg_subscribe(l, MSG_CONTROLLER_SETTINGS, NULL);
+
+  for (i = 1; i <= FLOOD_SAMPLES; ++i) {
+    uint32_t start = now_us();
+    send_sample(i);
+    send_max = MAX(send_max, now_us() - start);
+
+    if ((i % URGENT_EVERY) == 0) {
+      urgent_sent_at = now_us();
+      msg_send(MSG_CONTROLLER_SETTINGS, &settings);
+    }
+    usleep(100);
+  }
+
+  while ((l->lossy->count > 0) || l->lossy->pending)
+    usleep(1000);
+
+  printf("  %u of %u samples dispatched, %u dropped\n",
+      num_samples, FLOOD_SAMPLES, l->stats.lossy_dropped);
+  printf("  sample send at most %u us, urgent dispatch at most %u us late\n",
+      send_max, urgent_max_latency);
+
+  CHECK_EQ(num_urgent, FLOOD_SAMPLES / URGENT_EVERY);
+  CHECK_EQ(num_samples + l->stats.lossy_dropped, FLOOD_SAMPLES);
+  CHECK(l->stats.lossy_dropped > 0);
+  CHECK_EQ(last_sample, FLOOD_SAMPLES);
+  CHECK(send_max < SLOW_DISPATCH_US);
+  CHECK(urgent_max_latency < 2 * SLOW_DISPATCH_US);
+}
+
+/* The flood shows up in the stats: the slow listener's dispatches land in
+ * the 4-7 tick bucket, and the JSON dump carries it with the same counts.
+ */
+static void
+test_stats(void)
+{
+  int i;
+  int n;
+  uint32_t hist_total = 0;
+  msg_listener_stats_t stats[8];
+  msg_listener_stats_t* slow = NULL;
+  char json[2048];
+  char expected[64];
+  FILE* f = tmpfile();
+
+  n = msg_stats_get_listeners(stats, 8);
+  for (i = 0; i < n; ++i) {
+    if (strcmp(stats[i].name, "slow") == 0)
+      slow = &stats[i];
+  }
+  CHECK(slow != NULL);
+  if (slow == NULL)
+    return;
+
+  for (i = 0; i < MSG_STATS_NUM_BUCKETS; ++i)
+    hist_total += slow->dispatch_hist[i];
+  CHECK_EQ(hist_total, slow->dispatches);
+  CHECK(slow->dispatch_hist[3] > 0);
+  CHECK(slow->dispatch_max >= MS2ST(SLOW_DISPATCH_US / 1000));
+  CHECK_EQ(slow->lossy_dropped + num_samples, FLOOD_SAMPLES);
+  CHECK_EQ(msg_stats_get_publish_count(MSG_SENSOR_SAMPLE), FLOOD_SAMPLES + 5);
+
+  msg_stats_dump_json(f);
+  rewind(f);
+  n = fread(json, 1, sizeof(json) - 1, f);
+  json[n] = 0;
+  fclose(f);
+
+  CHECK(strstr(json, "\"tick_hz\": 1000") != NULL);
+  snprintf(expected, sizeof(expected), "{\"msg\": %d, \"count\": %u,",
+      MSG_SENSOR_SAMPLE, FLOOD_SAMPLES + 5);
+  CHECK(strstr(json, expected) != NULL);
+  snprintf(expected, sizeof(expected), "{\"name\": \"slow\", \"dispatches\": %u,",
+      slow->dispatches);
+  CHECK(strstr(json, expected) != NULL);
+  CHECK(strstr(json, "{\"name\": \"(other threads)\"") != NULL);
+  CHECK_EQ(json[n - 2], '}');
+}
+
+int
+main(void)
+{
+  pthread_t ticker;
+
+  pthread_create(&ticker, NULL, tick_main, NULL);
+  atexit(save_stats);
+
+  RUN_TEST(test_coalesced_kept);
+  RUN_TEST(test_flood_slow_subscriber);
+  RUN_TEST(test_stats);
+
+  TEST_MAIN_END();
+}
@@ -0,0 +1,594 @@
+#include "test.h"
+
+/* The connection state is private to net.c, so the tests build it directly,
+ * without its logging
+ */
+#define printf(...) ((void)0)
+#include "net.c"
+#undef printf
+
+#include <stdlib.h>
+
+
+/* Simulates WiFi link flaps against net.c and reports how long the device
+ * takes to get back to the API server once the access point returns. The
+ * CC3000 and the access point are simulated here: association takes a
+ * second or two, with a scan first when the CC3000 reconnects from its
+ * stored profile, and DHCP takes a few seconds more, sometimes with a lost
+ * exchange to retry. A static address is up as soon as the link is. Each
+ * kind of flap is run with DHCP every time, and with the last lease reused.
+ */
+
+#define STEP_MS           10
+#define IDLE_MS           500     // net's listener idle timeout
+#define START_MS          400     // wlan_start, with its patch version check
+#define STOP_MS           50
+#define BEACON_LOSS_MS    600     // access point gone to the disconnect event
+#define SCAN_MS           1000    // profile scan period while disconnected
+#define ASSOC_MIN_MS      800
+#define ASSOC_MAX_MS      2500
+#define DHCP_MIN_MS       1500
+#define DHCP_MAX_MS       6000
+#define DHCP_RETRY_MS     4000
+#define DHCP_LOSS_PCT     20
+#define STATIC_MS         50
+#define API_MS            400     // connect and auth, with the address cached
+
+#define NUM_FLAPS         100
+#define GIVE_UP_MS        (300 * 1000)
+
+#define SSID              "barn"
+#define SUBNET_A          0x0001A8C0
+#define SUBNET_B          0x0002A8C0
+#define HOST              0x2A000000
+#define NET_MASK          0x00FFFFFF
+
+systime_t test_time;
+int test_failures;
+
+/* The access point and the CC3000 */
+static struct {
+  bool ap_up;
+  uint32_t subnet;
+
+  bool running;
+  bool associated;
+  bool profile;
+  bool auto_connect;
+  bool explicit_connect;
+  uint32_t nvmem_ip;
+  uint32_t static_ip;
+  uint32_t ip;
+
+  bool connect_pending;
+  systime_t connect_at;
+  bool dhcp_pending;
+  systime_t dhcp_at;
+  bool disconnect_pending;
+  systime_t disconnect_at;
+
+  uint32_t num_starts;
+} cc;
+
+static api_status_t api_status;
+static bool api_pending;
+static systime_t api_up_at;
+
+static net_settings_t settings;
+static net_lease_t lease;
+static bool reuse_disabled;
+static systime_t next_idle;
+static uint32_t rnd_state = 1;
+
+
+static uint32_t
+rnd(uint32_t lo, uint32_t hi)
+{
+  rnd_state = rnd_state * 1103515245 + 12345;
+  return lo + ((rnd_state >> 8) % (hi - lo + 1));
+}
+
+static bool
+due(systime_t at)
+{
+  return (int32_t)(chTimeNow() - at) >= 0;
+}
+
+msg_listener_t*
+msg_listener_create(const char* name, int stack_size, thread_msg_dispatch_t dispatch, void* user_data)
+{
+  return NULL;
+}
+
+void msg_listener_set_idle_timeout(msg_listener_t* l, uint32_t idle_timeout) { }
+void msg_listener_set_priority(msg_listener_t* l, msg_priority_t prio) { }
+void msg_subscribe(msg_listener_t* l, msg_id_t id, void* user_data) { }
+void msg_send(msg_id_t id, void* msg_data) { }
+
+void
+chThdSleepMilliseconds(uint32_t msec)
+{
+  test_time += MS2ST(msec);
+}
+
+const net_settings_t*
+app_cfg_get_net_settings(void)
+{
+  return &settings;
+}
+
+/* With reuse disabled the device never finds a lease to reuse */
+const net_lease_t*
+app_cfg_get_net_lease(void)
+{
+  static const net_lease_t none;
+  return reuse_disabled ? &none : &lease;
+}
+
+void
+app_cfg_set_net_lease(const net_lease_t* l)
+{
+  lease = *l;
+}
+
+const api_status_t*
+web_api_get_status(void)
+{
+  return &api_status;
+}
+
+void wlan_init(void) { }
+bool wlan_apply_patch(void) { return true; }
+
+static void
+cancel_events(void)
+{
+  cc.connect_pending = false;
+  cc.dhcp_pending = false;
+  cc.disconnect_pending = false;
+}
+
+/* The IP configuration set with netapp_dhcp() takes effect on a start */
+void
+wlan_start(patch_load_command_t patch_load_cmd)
+{
+  test_time += MS2ST(START_MS);
+  cc.running = true;
+  cc.associated = false;
+  cc.explicit_connect = false;
+  cc.ip = 0;
+  cc.static_ip = cc.nvmem_ip;
+  cc.num_starts++;
+  cancel_events();
+}
+
+void
+wlan_stop(void)
+{
+  test_time += MS2ST(STOP_MS);
+  cc.running = false;
+  cc.associated = false;
+  cancel_events();
+}
+
+long
+wlan_disconnect(void)
+{
+  cc.associated = false;
+  cc.explicit_connect = false;
+  cancel_events();
+  return 0;
+}
+
+long
+wlan_connect(uint32_t ulSecType, const char *ssid, long ssid_len,
+    const uint8_t *bssid, const uint8_t *key, long key_len)
+{
+  cc.explicit_connect = true;
+  return 0;
+}
+
+long wlan_ioctl_del_profile(uint32_t ulIndex) { cc.profile = false; return 0; }
+
+long
+wlan_add_profile(uint32_t ulSecType, uint8_t* ucSsid, uint32_t ulSsidLen,
+    uint8_t *ucBssid, uint32_t ulPriority, uint32_t ulPairwiseCipher_Or_Key,
+    uint32_t ulGroupCipher_TxKeyLen, uint32_t ulKeyMgmt, uint8_t* ucPf_OrKey,
+    uint32_t ulPassPhraseLen)
+{
+  cc.profile = true;
+  return 0;
+}
+
+long
+wlan_ioctl_set_connection_policy(uint32_t should_connect_to_open_ap,
+    uint32_t should_use_fast_connect, uint32_t ulUseProfiles)
+{
+  cc.auto_connect = ulUseProfiles;
+  return 0;
+}
+
+long
+wlan_ioctl_set_scan_params(uint32_t uiEnable, uint32_t uiMinDwellTime,
+    uint32_t uiMaxDwellTime, uint32_t uiNumOfProbeRequests,
+    uint32_t uiChannelMask, long iRSSIThreshold,
+    uint32_t uiSNRThreshold, uint32_t uiDefaultTxPower,
+    const uint32_t *aiIntervalList)
+{
+  return 0;
+}
+
+void
+wlan_ioctl_get_scan_results(uint32_t ulScanTimeout, wlan_scan_results_t* results)
+{
+  memset(results, 0, sizeof(*results));
+}
+
+long
+netapp_dhcp(uint32_t const *aucIP, uint32_t const *aucSubnetMask,
+    uint32_t const *aucDefaultGateway, uint32_t const *aucDNSServer)
+{
+  cc.nvmem_ip = *aucIP;
+  return 0;
+}
+
+long
+netapp_timeout_values(uint32_t *aucDHCP, uint32_t *aucARP,
+    uint32_t *aucKeepalive, uint32_t *aucInactivity)
+{
+  return 0;
+}
+
+uint8_t
+nvmem_get_mac_address(uint8_t *mac)
+{
+  memset(mac, 0, 6);
+  return 0;
+}
+
+uint8_t
+nvmem_read_sp_version(nvmem_sp_version_t* sp_version)
+{
+  sp_version->package_id = 1;
+  sp_version->package_build = 32;
+  return 0;
+}
+
+static void
+send_dhcp_event(void)
+{
+  netapp_dhcp_params_t dhcp;
+  uint32_t mask = NET_MASK;
+
+  memset(&dhcp, 0, sizeof(dhcp));
+  memcpy(dhcp.ip_addr, &cc.ip, 4);
+  memcpy(dhcp.subnet_mask, &mask, 4);
+  memcpy(dhcp.default_gateway, &cc.subnet, 4);
+  memcpy(dhcp.dns_server, &cc.subnet, 4);
+
+  dispatch_net_msg(MSG_WLAN_DHCP, &dhcp, NULL, NULL);
+}
+
+/* Advances the simulation by one step */
+static void
+step(void)
+{
+  /* The CC3000 associates when asked to, or from its profile after a scan */
+  if (cc.running && !cc.associated && !cc.connect_pending && cc.ap_up &&
+      (cc.explicit_connect || (cc.auto_connect && cc.profile))) {
+    uint32_t delay = rnd(ASSOC_MIN_MS, ASSOC_MAX_MS);
+    if (!cc.explicit_connect)
+      delay += rnd(0, SCAN_MS);
+    cc.connect_pending = true;
+    cc.connect_at = chTimeNow() + MS2ST(delay);
+  }
+
+  if (cc.connect_pending && due(cc.connect_at)) {
+    cc.connect_pending = false;
+    if (cc.ap_up) {
+      cc.associated = true;
+      dispatch_net_msg(MSG_WLAN_CONNECT, NULL, NULL, NULL);
+
+      uint32_t delay = STATIC_MS;
+      if (cc.static_ip == 0) {
+        delay = rnd(DHCP_MIN_MS, DHCP_MAX_MS);
+        if (rnd(0, 99) < DHCP_LOSS_PCT)
+          delay += DHCP_RETRY_MS;
+      }
+      cc.dhcp_pending = true;
+      cc.dhcp_at = chTimeNow() + MS2ST(delay);
+    }
+  }
+
+  if (cc.dhcp_pending && due(cc.dhcp_at)) {
+    cc.dhcp_pending = false;
+    if (cc.associated) {
+      cc.ip = (cc.static_ip != 0) ? cc.static_ip : (cc.subnet | HOST);
+      send_dhcp_event();
+    }
+  }
+
+  if (cc.disconnect_pending && due(cc.disconnect_at)) {
+    cc.disconnect_pending = false;
+    cc.associated = false;
+    cc.ip = 0;
+    cc.dhcp_pending = false;
+    dispatch_net_msg(MSG_WLAN_DISCONNECT, NULL, NULL, NULL);
+  }
+
+  /* The API server is only reachable from an address on the network */
+  if ((net_status.net_state == NS_CONNECTED) && cc.associated) {
+    if ((api_status.state <= AS_CONNECTING) && !api_pending &&
+        ((cc.ip & NET_MASK) == cc.subnet)) {
+      api_pending = true;
+      api_up_at = chTimeNow() + MS2ST(API_MS);
+    }
+    if (api_pending && due(api_up_at)) {
+      api_pending = false;
+      api_status.state = AS_CONNECTED;
+    }
+  }
+  else {
+    api_status.state = AS_CONNECTING;
+    api_pending = false;
+  }
+
+  if (due(next_idle)) {
+    next_idle = chTimeNow() + MS2ST(IDLE_MS);
+    dispatch_net_msg(MSG_IDLE, NULL, NULL, NULL);
+  }
+
+  test_time += MS2ST(STEP_MS);
+}
+
+static void
+run_for(uint32_t ms)
+{
+  systime_t end = chTimeNow() + MS2ST(ms);
+  while (!due(end))
+    step();
+}
+
+/* Returns how long the device takes to get back to the API server */
+static uint32_t
+time_to_api(void)
+{
+  systime_t start = chTimeNow();
+
+  while ((api_status.state != AS_CONNECTED) &&
+         ((chTimeNow() - start) < MS2ST(GIVE_UP_MS)))
+    step();
+
+  CHECK_EQ(api_status.state, AS_CONNECTED);
+  return chTimeNow() - start;
+}
+
+static void
+ap_down(void)
+{
+  cc.ap_up = false;
+  if (cc.associated) {
+    cc.disconnect_pending = true;
+    cc.disconnect_at = chTimeNow() + MS2ST(BEACON_LOSS_MS);
+  }
+}
+
+/* The device starts, from power on or a reset */
+static uint32_t
+boot(void)
+{
+  memset(&net_status, 0, sizeof(net_status));
+  wifi_config_applied = false;
+  force_reconnect = false;
+  fast_reconnect = false;
+  lease_reused = false;
+  lease_confirmed = false;
+  lease_handback = false;
+
+  cc.running = false;
+  cc.associated = false;
+  cancel_events();
+  api_status.state = AS_AWAITING_NET_CONNECTION;
+  api_pending = false;
+  next_idle = chTimeNow() + MS2ST(IDLE_MS);
+
+  dispatch_net_msg(MSG_INIT, NULL, NULL, NULL);
+  return time_to_api();
+}
+
+static void
+setup(bool reuse)
+{
+  memset(&cc, 0, sizeof(cc));
+  memset(&settings, 0, sizeof(settings));
+  memset(&lease, 0, sizeof(lease));
+  strcpy(settings.ssid, SSID);
+  settings.security_mode = WLAN_SEC_WPA2;
+  settings.ip_config = IP_CFG_DHCP;
+  reuse_disabled = !reuse;
+
+  cc.ap_up = true;
+  cc.subnet = SUBNET_A;
+
+  /* The first connect on a network always goes through DHCP */
+  boot();
+  if (reuse)
+    CHECK_EQ(lease.ip, SUBNET_A | HOST);
+}
+
+static int
+compare_u32(const void* a, const void* b)
+{
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+typedef struct {
+  uint32_t samples[NUM_FLAPS];
+  uint32_t n;
+} dist_t;
+
+static void
+report(const char* name, dist_t* d)
+{
+  qsort(d->samples, d->n, sizeof(d->samples[0]), compare_u32);
+  fprintf(stdout, "  %-30s p50 %5.1f s  p90 %5.1f s  max %5.1f s\n", name,
+      d->samples[d->n / 2] / 1000.0,
+      d->samples[(d->n * 9) / 10] / 1000.0,
+      d->samples[d->n - 1] / 1000.0);
+}
+
+/* The access point goes away for down_min_ms to down_max_ms at a time.
+ * Returns the number of CC3000 restarts.
+ */
+static uint32_t
+flaps(bool reuse, uint32_t down_min_ms, uint32_t down_max_ms, dist_t* d)
+{
+  uint32_t i;
+
+  setup(reuse);
+
+  /* A reused lease only takes effect when the CC3000 is next started */
+  if (reuse)
+    boot();
+
+  uint32_t starts = cc.num_starts;
+  d->n = 0;
+  for (i = 0; i < NUM_FLAPS; ++i) {
+    run_for(rnd(10000, 30000));
+    ap_down();
+    run_for(rnd(down_min_ms, down_max_ms));
+    cc.ap_up = true;
+    d->samples[d->n++] = time_to_api();
+  }
+
+  return cc.num_starts - starts;
+}
+
+static void
+test_short_flaps(void)
+{
+  dist_t dhcp, reused;
+
+  fprintf(stdout, "Access point down 1-10 s, access point up to API connected:\n");
+  CHECK_EQ(flaps(false, 1000, 10000, &dhcp), 0);
+  report("DHCP", &dhcp);
+  CHECK_EQ(flaps(true, 1000, 10000, &reused), 0);
+  report("reused lease", &reused);
+
+  /* The CC3000 reassociates from its profile without a restart, and with a
+   * reused lease has no DHCP exchange to wait for
+   */
+  CHECK(reused.samples[NUM_FLAPS / 2] < dhcp.samples[NUM_FLAPS / 2]);
+  CHECK(reused.samples[NUM_FLAPS - 1] < (SCAN_MS + ASSOC_MAX_MS + API_MS + 1000));
+}
+
+static void
+test_long_outages(void)
+{
+  dist_t dhcp, reused;
+
+  fprintf(stdout, "Access point down 25-60 s, access point up to API connected:\n");
+  CHECK(flaps(false, 25000, 60000, &dhcp) >= NUM_FLAPS);
+  report("DHCP", &dhcp);
+  CHECK(flaps(true, 25000, 60000, &reused) >= NUM_FLAPS);
+  report("reused lease", &reused);
+
+  CHECK(reused.samples[NUM_FLAPS / 2] < dhcp.samples[NUM_FLAPS / 2]);
+  CHECK_EQ(lease.ip, SUBNET_A | HOST);
+}
+
+static void
+test_reboots(void)
+{
+  dist_t dhcp, reused;
+  uint32_t i;
+
+  fprintf(stdout, "Device reset, reset to API connected:\n");
+
+  setup(false);
+  for (i = 0; i < NUM_FLAPS; ++i) {
+    run_for(rnd(1000, 5000));
+    dhcp.samples[i] = boot();
+  }
+  dhcp.n = NUM_FLAPS;
+  report("DHCP", &dhcp);
+
+  setup(true);
+  for (i = 0; i < NUM_FLAPS; ++i) {
+    run_for(rnd(1000, 5000));
+    reused.samples[i] = boot();
+  }
+  reused.n = NUM_FLAPS;
+  report("reused lease", &reused);
+
+  CHECK(reused.samples[NUM_FLAPS / 2] < dhcp.samples[NUM_FLAPS / 2]);
+}
+
+/* The network comes back with other addresses, so the reused lease can't
+ * reach the API server and DHCP is used instead
+ */
+static void
+test_renumbered_network(void)
+{
+  dist_t d;
+  uint32_t i;
+
+  fprintf(stdout, "Access point down 30 s and back on another subnet:\n");
+
+  setup(true);
+  boot();
+  d.n = 0;
+  for (i = 0; i < NUM_FLAPS / 4; ++i) {
+    run_for(rnd(20000, 60000));
+    ap_down();
+    run_for(30000);
+    cc.subnet = (cc.subnet == SUBNET_A) ? SUBNET_B : SUBNET_A;
+    cc.ap_up = true;
+    d.samples[d.n++] = time_to_api();
+
+    CHECK_EQ(lease.ip, cc.subnet | HOST);
+    CHECK_EQ(cc.ip, cc.subnet | HOST);
+  }
+  report("reused lease, then DHCP", &d);
+
+  CHECK(d.samples[d.n - 1] < (LEASE_REUSE_TIMEOUT + FAST_CONNECT_TIMEOUT + S2ST(30)));
+}
+
+/* A reused lease is handed back to DHCP once, after LEASE_REUSE_PERIOD */
+static void
+test_lease_handback(void)
+{
+  setup(true);
+  boot();
+  CHECK(lease_reused);
+  CHECK_EQ(cc.static_ip, SUBNET_A | HOST);
+
+  uint32_t starts = cc.num_starts;
+  run_for((LEASE_REUSE_PERIOD * 1000 / CH_FREQUENCY) + 60000);
+  CHECK(!lease_reused);
+  CHECK_EQ(cc.static_ip, 0);
+  CHECK_EQ(api_status.state, AS_CONNECTED);
+  CHECK(cc.num_starts - starts <= 2);
+
+  starts = cc.num_starts;
+  run_for((LEASE_REUSE_PERIOD * 1000 / CH_FREQUENCY) + 60000);
+  CHECK_EQ(cc.num_starts, starts);
+
+  /* The next reset reuses the fresh lease */
+  boot();
+  CHECK(lease_reused);
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_short_flaps);
+  RUN_TEST(test_long_outages);
+  RUN_TEST(test_reboots);
+  RUN_TEST(test_renumbered_network);
+  RUN_TEST(test_lease_handback);
+
+  TEST_MAIN_END();
+}
@@ -0,0 +1,302 @@
+#include "test.h"
+
+/* The download state is private to ota_update.c, so the tests build it
+ * directly, without its logging
+ */
+#define printf(...) ((void)0)
+#include "ota_update.c"
+#undef printf
+
+
+/* Tests firmware downloads in ota_update.c, with the chunks decoded from a
+ * stream through the FirmwareDownloadResponse.data callback as the web API
+ * does. Checks the image lands in flash, that stale chunks and write
+ * failures leave the message stream intact, and measures how much of a
+ * chunk is held in RAM at once and how many bytes are moved per KB.
+ */
+
+#define FLASH_SIZE   (4 * UPDATE_BLOCK_SIZE)
+#define IMAGE_SIZE   (2 * UPDATE_BLOCK_SIZE + 20000 + 123)
+#define CHUNK_SIZE   1024
+
+systime_t test_time;
+int test_failures;
+
+static uint8_t flash[FLASH_SIZE];
+static uint8_t image[IMAGE_SIZE];
+
+static struct {
+  bool requested;
+  uint32_t offset;
+  uint32_t size;
+} request;
+
+static uint32_t num_checkpoints;
+static bool booted;
+static bool fail_writes;
+
+static struct {
+  uint32_t decoded;
+  uint32_t largest_read;
+  uint32_t written;
+  uint32_t read_back;
+} moved;
+
+static ota_update_checkpoint_t checkpoint;
+
+
+msg_listener_t*
+msg_listener_create(const char* name, int stack_size, thread_msg_dispatch_t dispatch, void* user_data)
+{
+  return NULL;
+}
+
+void msg_listener_set_idle_timeout(msg_listener_t* l, uint32_t idle_timeout) { }
+void msg_listener_set_priority(msg_listener_t* l, msg_priority_t prio) { }
+void msg_subscribe(msg_listener_t* l, msg_id_t id, void* user_data) { }
+
+void
+msg_send(msg_id_t id, void* msg_data)
+{
+  if (id == MSG_API_FW_DNLD_RQST) {
+    firmware_update_t* firmware_data = msg_data;
+
+    request.requested = true;
+    request.offset = firmware_data->offset;
+    request.size = firmware_data->size;
+    free(firmware_data);
+  }
+}
+
+const ota_update_checkpoint_t*
+app_cfg_get_ota_update_checkpoint(void)
+{
+  return &checkpoint;
+}
+
+void
+app_cfg_set_ota_update_checkpoint(const ota_update_checkpoint_t* cp)
+{
+  checkpoint = *cp;
+  num_checkpoints++;
+}
+
+void app_cfg_flush(void) { }
+
+dfu_parse_result_t
+dfuse_verify(sxfs_part_id_t part)
+{
+  return memcmp(flash, image, IMAGE_SIZE) ? DFU_INVALID_CRC : DFU_PARSE_OK;
+}
+
+void
+bootloader_load_update_img(void)
+{
+  booted = true;
+}
+
+/* Programming can only clear bits, as on the real flash */
+bool
+sxfs_write(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  uint32_t i;
+
+  if (fail_writes || (offset + data_len > sizeof(flash)))
+    return false;
+  for (i = 0; i < data_len; ++i)
+    flash[offset + i] &= data[i];
+  moved.written += data_len;
+  return true;
+}
+
+bool
+sxfs_read(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  if (offset + data_len > sizeof(flash))
+    return false;
+  memcpy(data, &flash[offset], data_len);
+  moved.read_back += data_len;
+  return true;
+}
+
+bool
+sxfs_erase(sxfs_part_id_t part_id, uint32_t offset, uint32_t len)
+{
+  if (offset + len > sizeof(flash))
+    return false;
+  memset(&flash[offset], 0xFF, len);
+  return true;
+}
+
+bool
+sxfs_is_erased(sxfs_part_id_t part_id, uint32_t offset, uint32_t data_len)
+{
+  uint32_t i;
+
+  for (i = 0; i < data_len; ++i) {
+    if (flash[offset + i] != 0xFF)
+      return false;
+  }
+  return true;
+}
+
+/* The socket the chunk is decoded from, counting what is copied out */
+static bool
+chunk_read(pb_istream_t* stream, uint8_t* buf, size_t count)
+{
+  const uint8_t** pos = stream->state;
+
+  memcpy(buf, *pos, count);
+  *pos += count;
+
+  moved.decoded += count;
+  if (count > moved.largest_read)
+    moved.largest_read = count;
+  return true;
+}
+
+/* The server sends a chunk of the image, which is decoded and dispatched as
+ * web_api does. Returns the bytes left unread in the message.
+ */
+static size_t
+server_chunk(uint32_t offset, uint32_t size)
+{
+  FirmwareDownloadResponse response;
+  const uint8_t* pos = &image[offset];
+
+  memset(&response, 0, sizeof(response));
+  response.offset = offset;
+  response.data.funcs.decode = ota_update_write_chunk;
+  response.data.arg = &response;
+
+  pb_istream_t stream = {
+    .callback = chunk_read,
+    .state = &pos,
+    .bytes_left = size
+  };
+
+  request.requested = false;
+  CHECK(response.data.funcs.decode(&stream, NULL, &response.data.arg));
+  ota_update_dispatch(MSG_API_FW_CHUNK, &response, NULL, NULL);
+
+  return stream.bytes_left;
+}
+
+static void
+reset(void)
+{
+  uint32_t i;
+
+  for (i = 0; i < IMAGE_SIZE; ++i)
+    image[i] = (uint8_t)((i * 7) ^ (i >> 9));
+  memset(flash, 0, sizeof(flash));
+  memset(&checkpoint, 0, sizeof(checkpoint));
+  memset(&moved, 0, sizeof(moved));
+  memset(&request, 0, sizeof(request));
+  num_checkpoints = 0;
+  booted = false;
+  fail_writes = false;
+
+  memset(&update, 0, sizeof(update));
+  ota_update_init();
+
+  FirmwareUpdateCheckResponse response = {
+    .update_available = true,
+    .version = "1.2.3",
+    .binary_size = IMAGE_SIZE
+  };
+  ota_update_dispatch(MSG_API_FW_UPDATE_CHECK_RESPONSE, &response, NULL, NULL);
+  CHECK_EQ(update.state, OU_UPDATE_AVAILABLE);
+
+  ota_update_dispatch(MSG_OTAU_START, NULL, NULL, NULL);
+  CHECK(request.requested);
+  CHECK_EQ(request.offset, 0);
+}
+
+static void
+test_download(void)
+{
+  uint32_t num_chunks = 0;
+
+  reset();
+
+  while (request.requested && (num_chunks < 1000)) {
+    CHECK_EQ(request.size, MIN(CHUNK_SIZE, IMAGE_SIZE - request.offset));
+    CHECK_EQ(server_chunk(request.offset, request.size), 0);
+    num_chunks++;
+  }
+
+  CHECK_EQ(update.state, OU_COMPLETE);
+  CHECK(booted);
+  CHECK(memcmp(flash, image, IMAGE_SIZE) == 0);
+  CHECK_EQ(num_chunks, (IMAGE_SIZE + CHUNK_SIZE - 1) / CHUNK_SIZE);
+
+  /* One checkpoint for each block started, and one when done */
+  CHECK_EQ(num_checkpoints, (IMAGE_SIZE + UPDATE_BLOCK_SIZE - 1) / UPDATE_BLOCK_SIZE + 1);
+  CHECK(!checkpoint.download_in_progress);
+
+  /* No more of a chunk than a piece is held at once */
+  CHECK(moved.largest_read <= CHUNK_WRITE_SIZE);
+  CHECK_EQ(moved.decoded, IMAGE_SIZE);
+
+  fprintf(stdout, "Chunk data held in RAM: %u bytes at most, against %u for a "
+      "static data field. Per KB: %u bytes decoded, %u written, %u read back\n",
+      moved.largest_read, CHUNK_SIZE,
+      (uint32_t)(1024ULL * moved.decoded / IMAGE_SIZE),
+      (uint32_t)(1024ULL * moved.written / IMAGE_SIZE),
+      (uint32_t)(1024ULL * moved.read_back / IMAGE_SIZE));
+}
+
+/* A chunk other than the one asked for is passed over, without touching
+ * the flash or asking for another
+ */
+static void
+test_stale_chunk(void)
+{
+  reset();
+
+  CHECK_EQ(server_chunk(0, CHUNK_SIZE), 0);
+  CHECK(request.requested);
+  CHECK_EQ(request.offset, CHUNK_SIZE);
+
+  uint8_t before[CHUNK_SIZE];
+  memcpy(before, &flash[CHUNK_SIZE], sizeof(before));
+
+  CHECK_EQ(server_chunk(0, CHUNK_SIZE), 0);
+  CHECK(!request.requested);
+  CHECK(memcmp(before, &flash[CHUNK_SIZE], sizeof(before)) == 0);
+  CHECK_EQ(update.state, OU_DOWNLOADING);
+  CHECK_EQ(update.update_downloaded, CHUNK_SIZE);
+
+  /* The chunk asked for still goes through */
+  CHECK_EQ(server_chunk(CHUNK_SIZE, CHUNK_SIZE), 0);
+  CHECK(request.requested);
+  CHECK_EQ(request.offset, 2 * CHUNK_SIZE);
+  CHECK(memcmp(flash, image, 2 * CHUNK_SIZE) == 0);
+}
+
+/* A chunk which fails to write is still read to its end, so the messages
+ * after it can be decoded
+ */
+static void
+test_write_failure(void)
+{
+  reset();
+
+  fail_writes = true;
+  CHECK_EQ(server_chunk(0, CHUNK_SIZE), 0);
+  CHECK(!request.requested);
+  CHECK_EQ(update.state, OU_FAILED);
+  CHECK_EQ(update.error_code, OU_ERR_WRITE);
+  CHECK_EQ(moved.decoded, CHUNK_SIZE);
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_download);
+  RUN_TEST(test_stale_chunk);
+  RUN_TEST(test_write_failure);
+
+  TEST_MAIN_END();
+}
@@ -0,0 +1,319 @@
+
+#define TEST_THREADS
+
+#include "test.h"
+#include "cc3000_emu.h"
+
+#include "socket.c"
+
+
+/* Measures how long data from the server takes to reach a reader of
+ * wifi/socket.c, from the moment it arrives at the CC3000 to the moment
+ * recv() returns it. The CC3000 socket calls are simulated here: select
+ * returns as soon as data arrives on a watched socket, or at its timeout,
+ * and each call takes about as long as an HCI round trip. The reader waits
+ * for MSG_WLAN_SOCKET_READY as web_api does.
+ *
+ * Commands the server sends unprompted are picked up by the select thread
+ * at its idle pace. Replies to something the device has just sent are
+ * watched for closely.
+ */
+
+#define HCI_ROUND_TRIP_US   100
+#define SERVER_SD           3
+#define MSG_LEN             16
+
+#define NUM_COMMANDS        25
+#define NUM_REPLIES         30
+#define REPLY_DELAY_US      40000
+
+systime_t test_time;
+int test_failures;
+
+Mutex g_main_mutex;
+int g_wlan_stopped;
+
+/* The CC3000's receive buffer for the server socket. Each message holds
+ * the time it arrived, which is when the reader's latency starts.
+ */
+static struct {
+  uint8_t buf[1024];
+  uint32_t len;
+  BinarySemaphore arrived;
+  uint32_t num_selects;
+  uint32_t reply_due;
+} cc3000;
+
+static Semaphore sem_ready;
+
+
+void
+msg_send_keyed(msg_id_t id, uint32_t key, void* msg_data)
+{
+  if (id == MSG_WLAN_SOCKET_READY)
+    chSemSignal(&sem_ready);
+}
+
+static void
+hci_round_trip(void)
+{
+  uint32_t start = emu_now_us();
+  while (emu_now_us() - start < HCI_ROUND_TRIP_US)
+    ;
+}
+
+/* The server's message reaches the CC3000 */
+static void
+server_send(void)
+{
+  uint32_t now = emu_now_us();
+
+  chSysLock();
+  if (cc3000.len + MSG_LEN <= sizeof(cc3000.buf)) {
+    memset(cc3000.buf + cc3000.len, 0, MSG_LEN);
+    memcpy(cc3000.buf + cc3000.len, &now, sizeof(now));
+    cc3000.len += MSG_LEN;
+  }
+  chSysUnlock();
+
+  chBSemSignal(&cc3000.arrived);
+}
+
+int
+c_socket(long domain, long type, long protocol)
+{
+  hci_round_trip();
+  return SERVER_SD;
+}
+
+long
+c_closesocket(long sd)
+{
+  hci_round_trip();
+  return 0;
+}
+
+long c_accept(long sd, sockaddr *addr, socklen_t *addrlen) { return SOC_ERROR; }
+long c_bind(long sd, const sockaddr *addr, long addrlen) { return 0; }
+long c_listen(long sd, long backlog) { return 0; }
+long c_connect(long sd, const sockaddr *addr, long addrlen) { return 0; }
+int c_getsockopt(long sd, long level, long optname, void *optval, socklen_t *optlen) { return 0; }
+int c_setsockopt(long sd, long level, long optname, const void *optval, socklen_t optlen) { return 0; }
+
+int
+c_gethostbyname(const char * hostname, uint16_t usNameLen, uint32_t* out_ip_addr)
+{
+  return 0;
+}
+
+static bool
+data_waiting(void)
+{
+  bool waiting;
+
+  chSysLock();
+  waiting = (cc3000.len > 0);
+  chSysUnlock();
+
+  return waiting;
+}
+
+/* Returns when data is waiting on a watched socket or at the timeout */
+int
+c_select(long nfds, wfd_set *readsds, wfd_set *writesds, wfd_set *exceptsds,
+    struct timeval *timeout)
+{
+  bool watched = WFD_ISSET(SERVER_SD, readsds);
+
+  cc3000.num_selects++;
+  hci_round_trip();
+
+  if (watched && !data_waiting()) {
+    chBSemReset(&cc3000.arrived, TRUE);
+    if (!data_waiting())
+      chBSemWaitTimeout(&cc3000.arrived, MS2ST(timeout->tv_usec / 1000));
+  }
+
+  WFD_ZERO(readsds);
+  if (watched && data_waiting()) {
+    WFD_SET(SERVER_SD, readsds);
+    return 1;
+  }
+  return 0;
+}
+
+int
+c_recv(long sd, void *buf, long len, long flags)
+{
+  int n;
+
+  hci_round_trip();
+
+  chSysLock();
+  n = (cc3000.len < (uint32_t)len) ? cc3000.len : (uint32_t)len;
+  memcpy(buf, cc3000.buf, n);
+  memmove(cc3000.buf, cc3000.buf + n, cc3000.len - n);
+  cc3000.len -= n;
+  chSysUnlock();
+
+  return n;
+}
+
+int
+c_recvfrom(long sd, void *buf, long len, long flags, sockaddr *from, socklen_t *fromlen)
+{
+  return c_recv(sd, buf, len, flags);
+}
+
+/* The server answers each message a little after it arrives */
+int
+c_send(long sd, const void *buf, long len, long flags)
+{
+  hci_round_trip();
+  cc3000.reply_due = emu_now_us() + REPLY_DELAY_US;
+  return len;
+}
+
+int
+c_sendto(long sd, const void *buf, long len, long flags, const sockaddr *to, socklen_t tolen)
+{
+  return c_send(sd, buf, len, flags);
+}
+
+/* Reads one message as web_api does, once it is told the socket is ready,
+ * and returns how long after its arrival at the CC3000 it was read
+ */
+static uint32_t
+read_message(int sd)
+{
+  uint8_t msg[MSG_LEN];
+  uint32_t arrived;
+  int got = 0;
+
+  while (got < MSG_LEN) {
+    if (chSemWaitTimeout(&sem_ready, MS2ST(1000)) != RDY_OK) {
+      CHECK(!"timed out waiting for data");
+      return 0;
+    }
+    int ret = recv(sd, msg + got, MSG_LEN - got, 0);
+    if (ret > 0)
+      got += ret;
+  }
+
+  memcpy(&arrived, msg, sizeof(arrived));
+  return emu_now_us() - arrived;
+}
+
+typedef struct {
+  uint32_t total;
+  uint32_t worst;
+  uint32_t n;
+} latency_t;
+
+static void
+add_latency(latency_t* l, uint32_t us)
+{
+  l->total += us;
+  l->n++;
+  if (us > l->worst)
+    l->worst = us;
+}
+
+static int
+open_socket(void)
+{
+  emu_config_t config = { .spi_ns_per_byte = 500 };
+
+  memset(&cc3000, 0, sizeof(cc3000));
+  chBSemInit(&cc3000.arrived, TRUE);
+  chSemInit(&sem_ready, 0);
+  chMtxInit(&g_main_mutex);
+
+  /* The emulated CC3000 is idle, it just runs the system tick */
+  emu_start(&config);
+  socket_start();
+
+  int sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  CHECK_EQ(sd, SERVER_SD);
+
+  /* Start out idle */
+  chThdSleepMilliseconds(SELECT_BUSY_MS + 50);
+  return sd;
+}
+
+static void
+close_socket(int sd)
+{
+  closesocket(sd);
+  socket_stop();
+  emu_stop();
+}
+
+/* The server sends commands unprompted, while the device is otherwise
+ * quiet
+ */
+static void
+test_commands(void)
+{
+  latency_t l = {0};
+  int i;
+  int sd = open_socket();
+
+  uint32_t selects = cc3000.num_selects;
+  chThdSleepMilliseconds(500);
+  uint32_t idle_selects = 2 * (cc3000.num_selects - selects);
+
+  for (i = 0; i < NUM_COMMANDS; ++i) {
+    /* Land at different points in the select thread's cycle */
+    chThdSleepMilliseconds(SELECT_BUSY_MS + 10 + (i % 7) * 3);
+    server_send();
+    add_latency(&l, read_message(sd));
+  }
+
+  printf("Server command to recv: %u us average, %u us worst, "
+      "%u selects a second when idle\n", l.total / l.n, l.worst, idle_selects);
+
+  /* Each select that finds nothing is followed by an idle wait */
+  CHECK(l.worst < (SELECT_IDLE_MS + 2 * SELECT_TIMEOUT_MS + 10) * 1000);
+  CHECK(idle_selects < 1000 / SELECT_IDLE_MS + 5);
+
+  close_socket(sd);
+}
+
+/* The device sends a request and the server answers it a few ms later */
+static void
+test_replies(void)
+{
+  latency_t l = {0};
+  uint8_t request[MSG_LEN] = {0};
+  int i;
+  int sd = open_socket();
+
+  for (i = 0; i < NUM_REPLIES; ++i) {
+    /* Let the socket go idle before some of the requests */
+    chThdSleepMilliseconds((i % 3 == 0) ? SELECT_BUSY_MS + 50 : 20);
+
+    CHECK_EQ(send(sd, request, sizeof(request), 0), sizeof(request));
+    while ((int32_t)(cc3000.reply_due - emu_now_us()) > 0)
+      ;
+    server_send();
+    add_latency(&l, read_message(sd));
+  }
+
+  printf("Server reply to recv: %u us average, %u us worst\n",
+      l.total / l.n, l.worst);
+
+  /* Replies are picked up by the next select, not after an idle wait */
+  CHECK(l.worst < (SELECT_TIMEOUT_MS + 5) * 1000);
+
+  close_socket(sd);
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_commands);
+  RUN_TEST(test_replies);
+
+  TEST_MAIN_END();
+}
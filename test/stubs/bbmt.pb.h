@@ -0,0 +1,60 @@
+#ifndef BBMT_PB_H
+#define BBMT_PB_H
+
+/* Host stand-in for the generated message definitions, holding only the
+ * messages and fields the modules under test use.
+ */
+
+#include "pb.h"
+
+typedef enum {
+  ApiMessage_Type_DEVICE_REPORT,
+  ApiMessage_Type_DEVICE_SETTINGS,
+  ApiMessage_Type_CONTROLLER_SETTINGS
+} ApiMessage_Type;
+
+typedef struct {
+  uint32_t controller_index;
+  float sensor_reading;
+  float setpoint;
+  bool has_timestamp;
+  uint32_t timestamp;
+} ControllerReport;
+
+typedef struct {
+  pb_size_t controller_reports_count;
+  ControllerReport controller_reports[3];
+} DeviceReport;
+
+typedef struct {
+  float hysteresis;
+} DeviceSettings;
+
+typedef struct {
+  uint32_t sensor_index;
+} ControllerSettings;
+
+typedef struct {
+  ApiMessage_Type type;
+  bool has_deviceReport;
+  DeviceReport deviceReport;
+  bool has_deviceSettings;
+  DeviceSettings deviceSettings;
+  bool has_controllerSettings;
+  ControllerSettings controllerSettings;
+} ApiMessage;
+
+typedef struct {
+  bool update_available;
+  char version[16];
+  uint32_t binary_size;
+} FirmwareUpdateCheckResponse;
+
+typedef struct {
+  uint32_t offset;
+  pb_callback_t data;
+} FirmwareDownloadResponse;
+
+static const pb_field_t ApiMessage_fields[1] = { { sizeof(ApiMessage) } };
+
+#endif
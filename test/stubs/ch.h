@@ -0,0 +1,177 @@
+#ifndef CH_H
+#define CH_H
+
+/* Host stand-in for the parts of ChibiOS used by the modules under test.
+ * Time is a counter the tests set and advance directly. Mutexes are real so
+ * that stress tests can run a second thread, and like ChibiOS's they are
+ * unlocked in the reverse order they were locked and go to their waiters
+ * in the order they queued. Critical sections do nothing.
+ *
+ * A test which defines TEST_THREADS before including this gets threads,
+ * mailboxes, semaphores, virtual timers and critical sections which it
+ * implements itself, or takes from test/cc3000_emu.c.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CH_FREQUENCY    1000
+
+#define S2ST(sec)       ((systime_t)((sec) * CH_FREQUENCY))
+#define MS2ST(msec)     ((systime_t)(((msec) * CH_FREQUENCY + 999) / 1000))
+
+#define TIME_IMMEDIATE  ((systime_t)0)
+#define TIME_INFINITE   ((systime_t)-1)
+
+#define LOWPRIO         1
+#define NORMALPRIO      64
+
+typedef uint32_t systime_t;
+/* Messages carry pointers, as on the target */
+typedef intptr_t msg_t;
+typedef int tprio_t;
+typedef struct Thread Thread;
+typedef msg_t (*tfunc_t)(void* arg);
+
+typedef struct {
+  volatile uint32_t next;
+  volatile uint32_t serving;
+} Mutex;
+
+#define TEST_MAX_LOCKS  4
+
+extern systime_t test_time;
+
+static __thread Mutex* test_locked[TEST_MAX_LOCKS];
+static __thread int test_num_locked;
+
+static inline systime_t chTimeNow(void) { return test_time; }
+
+/* sched.h would pull in time.h, whose clock_t clashes with the CC3000's */
+int sched_yield(void);
+
+static inline void chMtxInit(Mutex* m) { m->next = 0; m->serving = 0; }
+static inline void chMtxLock(Mutex* m)
+{
+  uint32_t ticket = __sync_fetch_and_add(&m->next, 1);
+  while (__atomic_load_n(&m->serving, __ATOMIC_ACQUIRE) != ticket)
+    sched_yield();
+  test_locked[test_num_locked++] = m;
+}
+static inline void chMtxUnlock(void)
+{ __atomic_fetch_add(&test_locked[--test_num_locked]->serving, 1, __ATOMIC_RELEASE); }
+
+static inline void chThdYield(void) { sched_yield(); }
+static inline void chRegSetThreadName(const char* name) { (void)name; }
+static inline void chThdSleepSeconds(uint32_t sec) { test_time += S2ST(sec); }
+static inline void chThdSleep(systime_t time) { test_time += time; }
+/* Shorter than a tick, so time stands still */
+static inline void chThdSleepMicroseconds(uint32_t usec) { (void)usec; }
+/* Defined by the tests that need it */
+void chThdSleepMilliseconds(uint32_t msec);
+static inline bool chTimeIsWithin(systime_t start, systime_t end)
+{ return (systime_t)(chTimeNow() - start) < (systime_t)(end - start); }
+
+#ifndef TEST_THREADS
+typedef struct {
+  bool taken;
+} BinarySemaphore;
+
+static inline void chSysLock(void) { }
+static inline void chSysUnlock(void) { }
+
+static inline void chBSemInit(BinarySemaphore* bsp, bool taken) { bsp->taken = taken; }
+static inline msg_t chBSemWait(BinarySemaphore* bsp) { bsp->taken = true; return 0; }
+static inline void chBSemSignal(BinarySemaphore* bsp) { bsp->taken = false; }
+
+static inline bool chThdShouldTerminate(void) { return true; }
+
+/* Threads are never started, the tests call the module functions directly */
+static inline Thread* chThdCreateFromHeap(void* heap, size_t size, int prio, tfunc_t fn, void* arg)
+{ (void)heap; (void)size; (void)prio; (void)fn; (void)arg; return NULL; }
+#else
+#define RDY_OK          0
+#define RDY_TIMEOUT     -1
+#define RDY_RESET       -2
+
+struct Thread {
+  void* msg_listener;
+  volatile bool terminate;
+  volatile bool exited;
+};
+
+/* A reset wakes the waiters with RDY_RESET, as in ChibiOS */
+typedef struct {
+  int cnt;
+  uint32_t resets;
+} Semaphore;
+
+typedef struct {
+  Semaphore sem;
+} BinarySemaphore;
+
+typedef void (*vtfunc_t)(void* par);
+
+typedef struct {
+  vtfunc_t func;
+  void* par;
+  systime_t due;
+} VirtualTimer;
+
+typedef struct {
+  msg_t* buf;
+  int size;
+  int head;
+  int count;
+} Mailbox;
+
+void chSysLock(void);
+void chSysUnlock(void);
+void chSysLockFromIsr(void);
+void chSysUnlockFromIsr(void);
+void chSchRescheduleS(void);
+
+Thread* chThdCreateFromHeap(void* heap, size_t size, int prio, tfunc_t fn, void* arg);
+Thread* chThdSelf(void);
+void chThdSetPriority(tprio_t prio);
+void chThdTerminate(Thread* tp);
+bool chThdShouldTerminate(void);
+msg_t chThdWait(Thread* tp);
+
+void chSemInit(Semaphore* sp, int n);
+void chSemReset(Semaphore* sp, int n);
+void chSemResetI(Semaphore* sp, int n);
+msg_t chSemWait(Semaphore* sp);
+msg_t chSemWaitS(Semaphore* sp);
+msg_t chSemWaitTimeout(Semaphore* sp, systime_t time);
+msg_t chSemWaitTimeoutS(Semaphore* sp, systime_t time);
+void chSemSignal(Semaphore* sp);
+void chSemSignalI(Semaphore* sp);
+msg_t chSemSignalWait(Semaphore* sps, Semaphore* spw);
+void chSemAddCounterI(Semaphore* sp, int n);
+int chSemGetCounterI(Semaphore* sp);
+
+void chBSemInit(BinarySemaphore* bsp, bool taken);
+msg_t chBSemWait(BinarySemaphore* bsp);
+msg_t chBSemWaitTimeout(BinarySemaphore* bsp, systime_t time);
+void chBSemSignal(BinarySemaphore* bsp);
+void chBSemReset(BinarySemaphore* bsp, bool taken);
+bool chBSemGetStateI(BinarySemaphore* bsp);
+
+/* Callbacks run at the tick, outside the lock, as on ChibiOS 2.6 */
+void chVTSetI(VirtualTimer* vtp, systime_t time, vtfunc_t vtfunc, void* par);
+void chVTResetI(VirtualTimer* vtp);
+bool chVTIsArmedI(VirtualTimer* vtp);
+
+void chMBInit(Mailbox* mb, msg_t* buf, int size);
+msg_t chMBPost(Mailbox* mb, msg_t msg, systime_t timeout);
+msg_t chMBPostAhead(Mailbox* mb, msg_t msg, systime_t timeout);
+msg_t chMBPostI(Mailbox* mb, msg_t msg);
+msg_t chMBFetch(Mailbox* mb, msg_t* msg, systime_t timeout);
+int chMBGetUsedCountI(Mailbox* mb);
+#endif
+
+#define chDbgAssert(c, func, msg) ((void)(c))
+
+#endif
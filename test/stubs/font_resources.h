@@ -0,0 +1,25 @@
+#ifndef __FONT_RESOURCES_H__
+#define __FONT_RESOURCES_H__
+
+/* Host stand-in for the header generated by scripts/fontconv. The types
+ * match the generated ones, and tests which draw text build their own
+ * fonts from them.
+ */
+
+#include <stdint.h>
+
+typedef struct {
+  uint8_t width;
+  uint8_t height;
+  int8_t xoffset;
+  int8_t yoffset;
+  uint8_t advance;
+  const uint8_t* data;
+} glyph_t;
+
+typedef struct {
+  uint8_t line_height;
+  const glyph_t* glyphs[256];
+} font_t;
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef HAL_H
+#define HAL_H
+
+#include "ch.h"
+
+typedef struct {
+  int unused;
+} SerialDriver;
+
+/* Just enough of the ADC and PAL drivers for touch.c. Conversion register
+ * settings are kept but mean nothing on the host, and the test supplies
+ * the driver functions.
+ */
+typedef uint16_t adcsample_t;
+typedef uint32_t ioportid_t;
+
+typedef struct {
+  bool circular;
+  uint16_t num_channels;
+  void* end_cb;
+  void* error_cb;
+  uint32_t cr1;
+  uint32_t cr2;
+  uint32_t smpr1;
+  uint32_t smpr2;
+  uint32_t sqr1;
+  uint32_t sqr2;
+  uint32_t sqr3;
+} ADCConversionGroup;
+
+typedef struct {
+  int unused;
+} ADCDriver;
+
+extern ADCDriver ADCD1;
+
+#define FALSE                     false
+#define TRUE                      true
+
+#define GPIOA                     ((ioportid_t)0)
+#define PAL_MODE_INPUT_ANALOG     0
+#define PAL_MODE_INPUT_PULLUP     1
+#define PAL_MODE_OUTPUT_PUSHPULL  2
+
+#define ADC_CR1_RES_0             0
+#define ADC_CR2_SWSTART           0
+#define ADC_SAMPLE_480            0
+#define ADC_SMPR2_SMP_AN4(n)      (n)
+#define ADC_SMPR2_SMP_AN5(n)      (n)
+#define ADC_SMPR2_SMP_AN7(n)      (n)
+#define ADC_SQR1_NUM_CH(n)        (n)
+#define ADC_SQR3_SQ1_N(n)         (n)
+#define ADC_CHANNEL_IN4           4
+#define ADC_CHANNEL_IN5           5
+#define ADC_CHANNEL_IN7           7
+
+/* The SPI and EXT drivers as the CC3000 transport uses them. In the wifi
+ * tests they are wired to the emulated CC3000 in test/cc3000_emu.c.
+ */
+typedef struct SPIDriver SPIDriver;
+typedef void (*spicallback_t)(SPIDriver* spip);
+
+typedef struct {
+  spicallback_t end_cb;
+  ioportid_t ssport;
+  uint16_t sspad;
+  uint16_t cr1;
+} SPIConfig;
+
+struct SPIDriver {
+  const SPIConfig* config;
+};
+
+extern SPIDriver SPID2;
+
+#define SPI_CR1_CPHA              0x0001
+
+typedef uint32_t expchannel_t;
+typedef struct EXTDriver EXTDriver;
+typedef void (*extcallback_t)(EXTDriver* extp, expchannel_t channel);
+
+typedef struct {
+  uint32_t mode;
+  extcallback_t cb;
+} EXTChannelConfig;
+
+#define EXT_MAX_CHANNELS          23
+
+typedef struct {
+  EXTChannelConfig channels[EXT_MAX_CHANNELS];
+} EXTConfig;
+
+typedef enum {
+  EXT_UNINIT,
+  EXT_STOP,
+  EXT_ACTIVE
+} extstate_t;
+
+struct EXTDriver {
+  extstate_t state;
+  const EXTConfig* config;
+};
+
+extern EXTDriver EXTD1;
+
+#define EXT_CH_MODE_FALLING_EDGE  0x02
+#define EXT_CH_MODE_BOTH_EDGES    0x03
+#define EXT_MODE_GPIOD            0x30
+
+/* From board.h */
+#define GPIOB                     ((ioportid_t)1)
+#define GPIOC                     ((ioportid_t)2)
+#define GPIOD                     ((ioportid_t)3)
+#define PORT_WIFI_EN              GPIOC
+#define PAD_WIFI_EN               8
+#define PORT_WIFI_IRQ             GPIOD
+#define PAD_WIFI_IRQ              12
+#define PORT_WIFI_CS              GPIOB
+#define PAD_WIFI_CS               12
+#define SPI_WLAN                  (&SPID2)
+
+void palSetPadMode(ioportid_t port, uint16_t pad, int mode);
+void palSetPad(ioportid_t port, uint16_t pad);
+void palClearPad(ioportid_t port, uint16_t pad);
+uint8_t palReadPad(ioportid_t port, uint16_t pad);
+
+void adcAcquireBus(ADCDriver* adcp);
+void adcReleaseBus(ADCDriver* adcp);
+msg_t adcConvert(ADCDriver* adcp, const ADCConversionGroup* grp, adcsample_t* samples, size_t depth);
+
+void spiStart(SPIDriver* spip, const SPIConfig* config);
+void spiSelect(SPIDriver* spip);
+void spiUnselect(SPIDriver* spip);
+void spiSend(SPIDriver* spip, size_t n, const void* txbuf);
+void spiReceive(SPIDriver* spip, size_t n, void* rxbuf);
+void spiExchange(SPIDriver* spip, size_t n, const void* txbuf, void* rxbuf);
+void spiSelectI(SPIDriver* spip);
+void spiUnselectI(SPIDriver* spip);
+void spiStartSendI(SPIDriver* spip, size_t n, const void* txbuf);
+void spiStartReceiveI(SPIDriver* spip, size_t n, void* rxbuf);
+void spiStartExchangeI(SPIDriver* spip, size_t n, const void* txbuf, void* rxbuf);
+
+void extStart(EXTDriver* extp, const EXTConfig* config);
+void extChannelEnable(EXTDriver* extp, expchannel_t channel);
+void extChannelDisable(EXTDriver* extp, expchannel_t channel);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef __IMAGE_RESOURCES_H__
+#define __IMAGE_RESOURCES_H__
+
+/* Host stand-in for the header generated by scripts/imgconv, without any
+ * of the images.
+ */
+
+#include <stdint.h>
+
+typedef struct {
+  const uint16_t width;
+  const uint16_t height;
+  const uint16_t* px;
+  const uint8_t* alpha;
+} Image_t;
+
+#endif
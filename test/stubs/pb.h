@@ -0,0 +1,44 @@
+#ifndef PB_H
+#define PB_H
+
+/* Host stand-in for nanopb. A message is "encoded" as a copy of its struct,
+ * which is enough for the tests to store messages and read them back.
+ * Streams read through a callback take a message cut short, leaving the
+ * fields past its end zero, so tests can send small messages.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef uint8_t pb_size_t;
+
+typedef struct {
+  size_t size;
+} pb_field_t;
+
+typedef struct pb_istream_s pb_istream_t;
+
+struct pb_istream_s {
+  bool (*callback)(pb_istream_t* stream, uint8_t* buf, size_t count);
+  void* state;
+  const uint8_t* buf;
+  size_t bytes_left;
+};
+
+typedef struct {
+  uint8_t* buf;
+  size_t max_size;
+  size_t bytes_written;
+} pb_ostream_t;
+
+typedef struct {
+  union {
+    bool (*decode)(pb_istream_t* stream, const pb_field_t* field, void** arg);
+    bool (*encode)(pb_ostream_t* stream, const pb_field_t* field, void* const* arg);
+  } funcs;
+  void* arg;
+} pb_callback_t;
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef PB_DECODE_H
+#define PB_DECODE_H
+
+#include "pb.h"
+
+static inline pb_istream_t
+pb_istream_from_buffer(const uint8_t* buf, size_t bufsize)
+{
+  pb_istream_t stream = { NULL, NULL, buf, bufsize };
+  return stream;
+}
+
+/* Reads count bytes, or passes over them if buf is NULL */
+static inline bool
+pb_read(pb_istream_t* stream, uint8_t* buf, size_t count)
+{
+  uint8_t tmp[16];
+
+  if (count > stream->bytes_left)
+    return false;
+
+  if (buf == NULL) {
+    while (count > 0) {
+      size_t n = (count < sizeof(tmp)) ? count : sizeof(tmp);
+      if (!pb_read(stream, tmp, n))
+        return false;
+      count -= n;
+    }
+    return true;
+  }
+
+  if (stream->callback != NULL) {
+    if (!stream->callback(stream, buf, count))
+      return false;
+  }
+  else {
+    memcpy(buf, stream->buf, count);
+    stream->buf += count;
+  }
+  stream->bytes_left -= count;
+  return true;
+}
+
+static inline bool
+pb_decode(pb_istream_t* stream, const pb_field_t fields[], void* dest_struct)
+{
+  if (stream->callback != NULL) {
+    if (stream->bytes_left > fields[0].size)
+      return false;
+
+    memset(dest_struct, 0, fields[0].size);
+    if (!stream->callback(stream, dest_struct, stream->bytes_left))
+      return false;
+    stream->bytes_left = 0;
+    return true;
+  }
+
+  if (stream->bytes_left != fields[0].size)
+    return false;
+
+  memcpy(dest_struct, stream->buf, fields[0].size);
+  stream->bytes_left = 0;
+  return true;
+}
+
+#endif
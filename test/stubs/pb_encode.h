@@ -0,0 +1,24 @@
+#ifndef PB_ENCODE_H
+#define PB_ENCODE_H
+
+#include "pb.h"
+
+static inline pb_ostream_t
+pb_ostream_from_buffer(uint8_t* buf, size_t bufsize)
+{
+  pb_ostream_t stream = { buf, bufsize, 0 };
+  return stream;
+}
+
+static inline bool
+pb_encode(pb_ostream_t* stream, const pb_field_t fields[], const void* src_struct)
+{
+  if (stream->bytes_written + fields[0].size > stream->max_size)
+    return false;
+
+  memcpy(stream->buf + stream->bytes_written, src_struct, fields[0].size);
+  stream->bytes_written += fields[0].size;
+  return true;
+}
+
+#endif
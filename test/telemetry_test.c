@@ -0,0 +1,415 @@
+
+#include "test.h"
+
+/* The sender state is private to telemetry.c, so the tests build it
+ * directly, without its logging.
+ */
+#define printf(...) ((void)0)
+#include "telemetry.c"
+#undef printf
+
+#include <sys/time.h>
+
+
+/* Tests the UDP telemetry in telemetry.c against a collector like the one a
+ * site would run: frames from a fleet of simulated devices are decoded and
+ * sorted by device, lost frames are counted from the sequence numbers, and
+ * damaged frames are refused. The time each device spends building and
+ * sending a frame, and the rate the collector decodes them, are measured.
+ */
+
+#define NUM_DEVICES      64
+#define MAX_DATAGRAMS    (NUM_DEVICES * 64)
+#define FRAME_HEADER_LEN offsetof(telemetry_frame_t, controllers)
+
+typedef struct {
+  uint32_t addr;
+  uint16_t port;
+  uint32_t len;
+  uint8_t data[sizeof(telemetry_frame_t) + 8];
+} datagram_t;
+
+/* What the collector knows about one device */
+typedef struct {
+  char device_id[sizeof(((telemetry_frame_t*)0)->device_id) + 1];
+  uint32_t frames;
+  uint32_t lost;
+  uint32_t last_seq;
+  uint32_t uptime;
+  telemetry_controller_t controllers[NUM_CONTROLLERS];
+} collector_device_t;
+
+typedef struct {
+  uint32_t num_devices;
+  uint32_t rejected;
+  collector_device_t devices[NUM_DEVICES];
+} collector_t;
+
+systime_t test_time;
+int test_failures;
+
+char device_id[32];
+
+static telemetry_t* devices[NUM_DEVICES];
+static telemetry_t* created;
+static int current_device;
+static bool output_on[NUM_DEVICES][NUM_CONTROLLERS];
+
+static datagram_t datagrams[MAX_DATAGRAMS];
+static uint32_t num_datagrams;
+static uint32_t drop_every;
+static uint32_t num_sent;
+static int open_sockets;
+
+
+int
+socket(long domain, long type, long protocol)
+{
+  open_sockets++;
+  return 3;
+}
+
+long
+closesocket(long sd)
+{
+  open_sockets--;
+  return 0;
+}
+
+/* The network, which loses one datagram in drop_every */
+int
+sendto(long sd, const void* buf, long len, long flags, const sockaddr* to, socklen_t tolen)
+{
+  const sockaddr_in* addr = (const sockaddr_in*)to;
+
+  num_sent++;
+  if ((drop_every > 0) && ((num_sent % drop_every) == 0))
+    return len;
+
+  if (num_datagrams < MAX_DATAGRAMS) {
+    datagram_t* d = &datagrams[num_datagrams++];
+    d->addr = ntohl(addr->sin_addr.s_addr);
+    d->port = ntohs(addr->sin_port);
+    d->len = len;
+    memcpy(d->data, buf, len);
+  }
+  return len;
+}
+
+msg_listener_t*
+msg_listener_create(const char* name, int stack_size, thread_msg_dispatch_t dispatch, void* user_data)
+{
+  created = user_data;
+  return NULL;
+}
+
+void msg_listener_set_idle_timeout(msg_listener_t* l, uint32_t idle_timeout) { }
+void msg_listener_set_priority(msg_listener_t* l, msg_priority_t prio) { }
+void msg_subscribe(msg_listener_t* l, msg_id_t id, void* user_data) { }
+void msg_subscribe_lossy(msg_listener_t* l, msg_id_t id, void* user_data, size_t msg_size) { }
+void msg_subscribe_coalesced(msg_listener_t* l, msg_id_t id, void* user_data, size_t msg_size) { }
+
+float
+temp_control_get_current_setpoint(temp_controller_id_t controller)
+{
+  return 60 + current_device + (controller * 0.5f);
+}
+
+temp_control_status_t
+temp_control_get_status(temp_controller_id_t controller, output_id_t output)
+{
+  temp_control_status_t status;
+
+  memset(&status, 0, sizeof(status));
+  status.output_enabled = (output == OUTPUT_1) && output_on[current_device][controller];
+  return status;
+}
+
+static uint32_t
+now_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+/* Decodes one datagram. Frames which are not telemetry, or are not whole,
+ * are counted and dropped.
+ */
+static bool
+collector_ingest(collector_t* col, const uint8_t* data, uint32_t len)
+{
+  uint32_t i;
+  telemetry_frame_t frame;
+  collector_device_t* dev = NULL;
+
+  if ((len < FRAME_HEADER_LEN) || (len > sizeof(frame))) {
+    col->rejected++;
+    return false;
+  }
+
+  memcpy(&frame, data, len);
+  if ((ntohs(frame.magic) != TELEMETRY_MAGIC) ||
+      (frame.version != TELEMETRY_VERSION) ||
+      (frame.num_controllers > NUM_CONTROLLERS) ||
+      (len != FRAME_HEADER_LEN + (frame.num_controllers * sizeof(telemetry_controller_t)))) {
+    col->rejected++;
+    return false;
+  }
+
+  for (i = 0; i < col->num_devices; ++i) {
+    if (strncmp(col->devices[i].device_id, frame.device_id, sizeof(frame.device_id)) == 0) {
+      dev = &col->devices[i];
+      break;
+    }
+  }
+
+  uint32_t seq = ntohl(frame.seq);
+  if (dev == NULL) {
+    if (col->num_devices == NUM_DEVICES) {
+      col->rejected++;
+      return false;
+    }
+    dev = &col->devices[col->num_devices++];
+    memset(dev, 0, sizeof(*dev));
+    memcpy(dev->device_id, frame.device_id, sizeof(frame.device_id));
+    dev->lost = seq;
+  }
+  else if (seq > dev->last_seq) {
+    dev->lost += seq - dev->last_seq - 1;
+  }
+
+  dev->frames++;
+  dev->last_seq = seq;
+  dev->uptime = ntohl(frame.uptime);
+  for (i = 0; i < frame.num_controllers; ++i) {
+    telemetry_controller_t* c = &dev->controllers[i];
+    *c = frame.controllers[i];
+    c->sensor_reading = ntohs(c->sensor_reading);
+    c->setpoint = ntohs(c->setpoint);
+  }
+  return true;
+}
+
+static void
+collect(collector_t* col)
+{
+  uint32_t i;
+
+  for (i = 0; i < num_datagrams; ++i) {
+    CHECK_EQ(datagrams[i].addr, 0xFFFFFFFF);
+    CHECK_EQ(datagrams[i].port, TELEMETRY_PORT);
+    collector_ingest(col, datagrams[i].data, datagrams[i].len);
+  }
+  num_datagrams = 0;
+}
+
+static void
+select_device(int i)
+{
+  current_device = i;
+  snprintf(device_id, sizeof(device_id), "bt-%08x-%04d", 0x5eed0000 + i, i);
+}
+
+static void
+start_fleet(void)
+{
+  int i;
+  net_status_t ns = { .net_state = NS_CONNECTED, .dhcp_resolved = true };
+
+  test_time = 0;
+  num_datagrams = 0;
+  num_sent = 0;
+  drop_every = 0;
+  memset(output_on, 0, sizeof(output_on));
+
+  for (i = 0; i < NUM_DEVICES; ++i) {
+    free(devices[i]);
+    select_device(i);
+    telemetry_init();
+    devices[i] = created;
+    telemetry_dispatch(MSG_NET_STATUS, &ns, devices[i], NULL);
+  }
+}
+
+static void
+send_sample(int i, sensor_id_t sensor, float value)
+{
+  sensor_msg_t msg = {
+      .sensor = sensor,
+      .sample = { .value = value, .unit = UNIT_TEMP_DEG_F },
+  };
+
+  select_device(i);
+  telemetry_dispatch(MSG_SENSOR_SAMPLE, &msg, devices[i], NULL);
+}
+
+/* Each device samples every second, so sends one frame each interval */
+static void
+run_fleet(int intervals)
+{
+  int t;
+  int i;
+
+  for (t = 0; t < intervals * TELEMETRY_INTERVAL_S; ++t) {
+    test_time += S2ST(1);
+    for (i = 0; i < NUM_DEVICES; ++i)
+      send_sample(i, SENSOR_1, 50 + i + (t * 0.01f));
+  }
+}
+
+static void
+test_fleet(void)
+{
+  int i;
+  collector_t col;
+
+  memset(&col, 0, sizeof(col));
+  start_fleet();
+  output_on[3][CONTROLLER_1] = true;
+
+  run_fleet(20);
+  CHECK_EQ(num_datagrams, NUM_DEVICES * 20);
+  CHECK_EQ(open_sockets, 0);
+  collect(&col);
+
+  CHECK_EQ(col.num_devices, NUM_DEVICES);
+  CHECK_EQ(col.rejected, 0);
+  for (i = 0; i < NUM_DEVICES; ++i) {
+    collector_device_t* dev = &col.devices[i];
+    char expected_id[32];
+
+    select_device(i);
+    strncpy(expected_id, device_id, 24);
+    expected_id[24] = 0;
+    CHECK(strcmp(dev->device_id, expected_id) == 0);
+    CHECK_EQ(dev->frames, 20);
+    CHECK_EQ(dev->lost, 0);
+    CHECK_EQ(dev->last_seq, 19);
+
+    telemetry_controller_t* c = &dev->controllers[CONTROLLER_1];
+    CHECK(c->flags & TELEMETRY_SENSOR_VALID);
+    CHECK_NEAR(c->sensor_reading / 100.0, 50 + i + ((20 * TELEMETRY_INTERVAL_S - 1) * 0.01), 0.02);
+    CHECK_NEAR(c->setpoint / 100.0, 60 + i, 0.01);
+    CHECK_EQ(!!(c->flags & TELEMETRY_OUTPUT_1_ON), i == 3);
+
+    /* The second probe never reported */
+    CHECK(!(dev->controllers[CONTROLLER_2].flags & TELEMETRY_SENSOR_VALID));
+    CHECK_NEAR(dev->controllers[CONTROLLER_2].setpoint / 100.0, 60.5 + i, 0.01);
+  }
+
+  /* A probe which times out is reported as such */
+  sensor_timeout_msg_t timeout = { .sensor = SENSOR_1 };
+  select_device(7);
+  telemetry_dispatch(MSG_SENSOR_TIMEOUT, &timeout, devices[7], NULL);
+  test_time += TELEMETRY_INTERVAL;
+  telemetry_dispatch(MSG_IDLE, NULL, devices[7], NULL);
+  collect(&col);
+  CHECK(!(col.devices[7].controllers[CONTROLLER_1].flags & TELEMETRY_SENSOR_VALID));
+  CHECK_EQ(col.devices[7].frames, 21);
+}
+
+/* Lost frames show up as gaps in the sequence numbers. Anything which is
+ * not a whole frame of the current version is refused.
+ */
+static void
+test_loss_and_damage(void)
+{
+  int i;
+  uint32_t lost = 0;
+  uint32_t frames = 0;
+  collector_t col;
+  telemetry_frame_t frame;
+
+  memset(&col, 0, sizeof(col));
+  start_fleet();
+  drop_every = 7;
+
+  run_fleet(10);
+  collect(&col);
+  /* A drop at the end of a device's run can't be seen yet */
+  for (i = 0; i < NUM_DEVICES; ++i) {
+    uint32_t seen = col.devices[i].frames + col.devices[i].lost;
+    CHECK((seen == 10) || (seen == 9));
+    frames += col.devices[i].frames;
+    lost += col.devices[i].lost + (10 - seen);
+  }
+  CHECK_EQ(frames, (NUM_DEVICES * 10) - ((NUM_DEVICES * 10) / 7));
+  CHECK_EQ(lost, (NUM_DEVICES * 10) / 7);
+
+  drop_every = 0;
+  select_device(0);
+  test_time += TELEMETRY_INTERVAL;
+  telemetry_dispatch(MSG_IDLE, NULL, devices[0], NULL);
+  CHECK_EQ(num_datagrams, 1);
+  memcpy(&frame, datagrams[0].data, sizeof(frame));
+  num_datagrams = 0;
+
+  CHECK(collector_ingest(&col, (uint8_t*)&frame, sizeof(frame)));
+  CHECK(!collector_ingest(&col, (uint8_t*)&frame, sizeof(frame) - 1));
+  CHECK(!collector_ingest(&col, (uint8_t*)&frame, 4));
+
+  frame.magic = htons(TELEMETRY_MAGIC + 1);
+  CHECK(!collector_ingest(&col, (uint8_t*)&frame, sizeof(frame)));
+  frame.magic = htons(TELEMETRY_MAGIC);
+  frame.version = TELEMETRY_VERSION + 1;
+  CHECK(!collector_ingest(&col, (uint8_t*)&frame, sizeof(frame)));
+  frame.version = TELEMETRY_VERSION;
+  frame.num_controllers = NUM_CONTROLLERS + 1;
+  CHECK(!collector_ingest(&col, (uint8_t*)&frame, sizeof(frame)));
+  CHECK_EQ(col.rejected, 5);
+}
+
+/* What a frame costs the device to build and send, apart from the radio,
+ * and how many frames a collector decodes each second.
+ */
+static void
+test_cost(void)
+{
+  int round;
+  int i;
+  uint32_t start;
+  uint32_t send_us = 0;
+  uint32_t collect_us = 0;
+  uint32_t frames = 0;
+  collector_t col;
+
+  memset(&col, 0, sizeof(col));
+  start_fleet();
+  for (i = 0; i < NUM_DEVICES; ++i)
+    send_sample(i, SENSOR_1, 50 + i);
+
+  for (round = 0; round < 50; ++round) {
+    test_time += TELEMETRY_INTERVAL;
+
+    start = now_us();
+    for (i = 0; i < NUM_DEVICES; ++i) {
+      select_device(i);
+      send_frame(devices[i]);
+    }
+    send_us += now_us() - start;
+    frames += num_datagrams;
+
+    start = now_us();
+    collect(&col);
+    collect_us += now_us() - start;
+  }
+
+  printf("  device: %.2f us per frame of %u bytes\n",
+      (float)send_us / frames, (unsigned int)sizeof(telemetry_frame_t));
+  printf("  collector: %u frames from %d devices, %.0f frames/s\n",
+      frames, NUM_DEVICES, frames / (collect_us / 1e6f));
+  CHECK_EQ(frames, NUM_DEVICES * 50);
+  CHECK_EQ(col.num_devices, NUM_DEVICES);
+  CHECK_EQ(col.rejected, 0);
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_fleet);
+  RUN_TEST(test_loss_and_damage);
+  RUN_TEST(test_cost);
+
+  TEST_MAIN_END();
+}
@@ -0,0 +1,269 @@
+
+#include "test.h"
+
+/* The bucket levels are private to temp_history.c, so the tests build it
+ * directly.
+ */
+#include "temp_history.c"
+
+#include <sys/time.h>
+
+
+/* Tests the bucket levels in temp_history.c: envelopes for each span, the
+ * resolution of the hour plot, replaying the flash log at boot, and the
+ * cost of recording samples and rendering a plot.
+ */
+
+#define PLOT_COLS  308
+
+systime_t test_time;
+int test_failures;
+
+static history_log_record_t log_recs[4];
+static int num_log_recs;
+static int next_log_rec;
+static uint32_t log_now;
+
+
+msg_listener_t*
+msg_listener_create(const char* name, int stack_size, thread_msg_dispatch_t dispatch, void* user_data)
+{
+  return NULL;
+}
+
+void
+msg_listener_set_idle_timeout(msg_listener_t* l, uint32_t idle_timeout)
+{
+}
+
+void
+msg_subscribe(msg_listener_t* l, msg_id_t id, void* user_data)
+{
+}
+
+float
+temp_control_get_current_setpoint(temp_controller_id_t controller)
+{
+  return (controller == CONTROLLER_1) ? 68.0f : NAN;
+}
+
+/* The flash log holds log_recs, and appending to it does nothing */
+uint32_t
+history_log_time()
+{
+  return log_now;
+}
+
+bool
+history_log_append(const history_log_record_t* rec)
+{
+  return true;
+}
+
+bool
+history_log_seek(history_log_cursor_t* c, uint32_t time)
+{
+  next_log_rec = 0;
+  return (num_log_recs > 0);
+}
+
+bool
+history_log_next(history_log_cursor_t* c, history_log_record_t* rec)
+{
+  if (next_log_rec >= num_log_recs)
+    return false;
+  *rec = log_recs[next_log_rec++];
+  return true;
+}
+
+static uint32_t
+now_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+static void
+reset(void)
+{
+  int i;
+  bucket_level_t* levels[] = { &hour_level, &day_level, &week_level };
+
+  for (i = 0; i < 3; ++i) {
+    levels[i]->head = 0;
+    levels[i]->count = 0;
+    levels[i]->seq = 0;
+  }
+  memset(&current, 0, sizeof(current));
+  test_time = 0;
+  temp_history_init();
+}
+
+/* Records one sample a second, with sensor 1 ramping up a tenth of a degree
+ * every second from 60.0 F.
+ */
+static void
+record_ramp(uint32_t seconds)
+{
+  uint32_t t;
+  sensor_msg_t msg = {
+      .sensor = SENSOR_1,
+      .sample = { 60, UNIT_TEMP_DEG_F }
+  };
+
+  for (t = 0; t < seconds; ++t) {
+    msg.sample.value = 60 + (t * 0.1f);
+    dispatch_sensor_sample(&msg);
+    test_time += SAMPLE_PERIOD;
+    record_samples();
+  }
+}
+
+static void
+test_hour_resolution(void)
+{
+  int c;
+  int distinct = 0;
+  history_envelope_t cols[PLOT_COLS];
+
+  reset();
+  record_ramp(60 * 60);
+
+  CHECK_EQ(temp_history_get_envelope(HISTORY_SPAN_HOUR, HISTORY_CH_TEMP_1, cols, PLOT_COLS), PLOT_COLS);
+
+  /* Every column of a ramp shows a different range */
+  for (c = 0; c < PLOT_COLS; ++c) {
+    CHECK(cols[c].min <= cols[c].max);
+    if ((c > 0) && (cols[c].max != cols[c - 1].max))
+      distinct++;
+  }
+  CHECK_EQ(distinct, PLOT_COLS - 1);
+
+  /* The plot spans the hour, ending at the newest sample */
+  CHECK(cols[0].min <= 600 + 20);
+  CHECK_EQ(cols[PLOT_COLS - 1].max, 600 + 3599);
+
+  /* The setpoint is flat and the unused sensor has no data */
+  CHECK_EQ(temp_history_get_envelope(HISTORY_SPAN_HOUR, HISTORY_CH_SETPOINT_1, cols, PLOT_COLS), PLOT_COLS);
+  CHECK_EQ(cols[PLOT_COLS / 2].min, 680);
+  CHECK_EQ(temp_history_get_envelope(HISTORY_SPAN_HOUR, HISTORY_CH_TEMP_2, cols, PLOT_COLS), 0);
+}
+
+static void
+test_spans(void)
+{
+  history_envelope_t cols[PLOT_COLS];
+
+  reset();
+  record_ramp(2 * 60 * 60);
+
+  /* Two hours fill 24 of the day's 288 buckets, at the right of the plot */
+  uint16_t n = temp_history_get_envelope(HISTORY_SPAN_DAY, HISTORY_CH_TEMP_1, cols, PLOT_COLS);
+  CHECK(n >= 24);
+  CHECK(n <= 27);
+  CHECK(cols[0].min > cols[0].max);
+  CHECK_EQ(cols[PLOT_COLS - 1].max, 600 + 7199);
+
+  /* and 4 of the week's 336, a little narrower than the plot */
+  n = temp_history_get_envelope(HISTORY_SPAN_WEEK, HISTORY_CH_TEMP_1, cols, PLOT_COLS);
+  CHECK(n >= 3);
+  CHECK(n <= 4);
+}
+
+/* A logged record holds for at most a log period, the rest of the time
+ * until the next record is a gap.
+ */
+static void
+test_replay_log(void)
+{
+  history_envelope_t cols[PLOT_COLS];
+
+  memset(log_recs, 0, sizeof(log_recs));
+  log_recs[0].time = 10000;
+  log_recs[0].temp[SENSOR_1] = 650;
+  log_recs[0].temp[SENSOR_2] = HISTORY_LOG_NO_DATA;
+  log_recs[0].setpoint[CONTROLLER_1] = 680;
+  log_recs[0].setpoint[CONTROLLER_2] = HISTORY_LOG_NO_DATA;
+  log_recs[1] = log_recs[0];
+  log_recs[1].time = 10000 + (30 * 60);
+  log_recs[1].temp[SENSOR_1] = 700;
+  num_log_recs = 2;
+  log_now = log_recs[1].time + 60;
+
+  reset();
+  num_log_recs = 0;
+
+  /* The last 31 minutes: a minute at 65.0, 29 without data and a minute at
+   * 70.0.
+   */
+  uint16_t n = temp_history_get_envelope(HISTORY_SPAN_HOUR, HISTORY_CH_TEMP_1, cols, PLOT_COLS);
+  CHECK(n >= 10);
+  CHECK(n <= 12);
+  CHECK_EQ(cols[PLOT_COLS - 1].max, 700);
+
+  int c;
+  int gap_cols = 0;
+  for (c = PLOT_COLS / 2; c < PLOT_COLS; ++c) {
+    if (cols[c].min > cols[c].max)
+      gap_cols++;
+  }
+  CHECK(gap_cols > PLOT_COLS / 3);
+
+  log_now = 0;
+}
+
+/* A bucket closing while an envelope is read makes the reader start over */
+static void
+test_envelope_retry(void)
+{
+  history_envelope_t cols[PLOT_COLS];
+  uint32_t seq;
+
+  reset();
+  record_ramp(60 * 60);
+
+  get_envelope(&hour_level, HISTORY_CH_TEMP_1, cols, PLOT_COLS, &seq);
+  CHECK_EQ(seq, hour_level.seq);
+
+  record_ramp(HOUR_BUCKET_SECONDS);
+  CHECK(seq != hour_level.seq);
+}
+
+static void
+test_benchmark(void)
+{
+  int i;
+  uint32_t samples = 7 * 24 * 60 * 60;
+  history_envelope_t cols[PLOT_COLS];
+
+  reset();
+
+  uint32_t start = now_us();
+  record_ramp(samples);
+  uint32_t record_us = now_us() - start;
+
+  printf("  record: %.3f us per sample\n", (float)record_us / samples);
+
+  for (i = 0; i < NUM_HISTORY_SPANS; ++i) {
+    int r;
+    start = now_us();
+    for (r = 0; r < 100; ++r)
+      temp_history_get_envelope(i, HISTORY_CH_TEMP_1, cols, PLOT_COLS);
+    printf("  render span %d: %.1f us per %d column envelope\n",
+        i, (float)(now_us() - start) / 100, PLOT_COLS);
+    CHECK(cols[PLOT_COLS - 1].min <= cols[PLOT_COLS - 1].max);
+  }
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_hour_resolution);
+  RUN_TEST(test_spans);
+  RUN_TEST(test_replay_log);
+  RUN_TEST(test_envelope_retry);
+  RUN_TEST(test_benchmark);
+
+  TEST_MAIN_END();
+}
@@ -0,0 +1,277 @@
+
+#include "test.h"
+
+/* Reboots reset the store's private slot table, so the tests build it
+ * directly.
+ */
+#include "temp_profile_store.c"
+#include "temp_profile.h"
+
+
+/* Tests the flash profile store in temp_profile_store.c: a profile far
+ * longer than the controller settings can hold is written, read back after
+ * a reboot and run by the profile timeline, and a replacement only takes
+ * over once it is committed.
+ */
+
+#define LONG_PROFILE_ID     4242
+#define LONG_PROFILE_STEPS  500
+
+systime_t test_time;
+int test_failures;
+
+static uint8_t flash[TEMP_PROFILE_STORE_SLOTS * SLOT_SIZE];
+static temp_profile_checkpoint_t saved_checkpoint;
+
+
+uint32_t
+sxfs_get_size(sxfs_part_id_t part_id)
+{
+  return sizeof(flash);
+}
+
+/* Programming can only clear bits, as on the real flash */
+bool
+sxfs_write(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  uint32_t i;
+
+  if (offset + data_len > sizeof(flash))
+    return false;
+
+  for (i = 0; i < data_len; ++i)
+    flash[offset + i] &= data[i];
+  return true;
+}
+
+bool
+sxfs_read(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  if (offset + data_len > sizeof(flash))
+    return false;
+  memcpy(data, &flash[offset], data_len);
+  return true;
+}
+
+bool
+sxfs_erase(sxfs_part_id_t part_id, uint32_t offset, uint32_t len)
+{
+  if (offset + len > sizeof(flash))
+    return false;
+  memset(&flash[offset], 0xFF, len);
+  return true;
+}
+
+const temp_profile_checkpoint_t*
+app_cfg_get_temp_profile_checkpoint(temp_controller_id_t controller)
+{
+  return &saved_checkpoint;
+}
+
+void
+app_cfg_set_temp_profile_checkpoint(temp_controller_id_t controller,
+    temp_profile_checkpoint_t* checkpoint)
+{
+  saved_checkpoint = *checkpoint;
+}
+
+/* Starts the store again from what is in flash, as after a reset */
+static void
+reboot(void)
+{
+  memset(slots, 0, sizeof(slots));
+  next_seq = 0;
+  temp_profile_store_init();
+}
+
+static void
+reset(void)
+{
+  memset(flash, 0xFF, sizeof(flash));
+  memset(&saved_checkpoint, 0, sizeof(saved_checkpoint));
+  reboot();
+}
+
+/* Alternating ramps and holds of varying lengths, wandering between 50 and
+ * 69 degrees.
+ */
+static void
+make_step(uint32_t i, temp_profile_step_t* step)
+{
+  memset(step, 0, sizeof(*step));
+  step->duration = 30 + ((i % 7) * 10);
+  step->value.value = 50 + ((i * 7) % 20);
+  step->value.unit = UNIT_TEMP_DEG_F;
+  step->type = (i & 1) ? STEP_HOLD : STEP_RAMP;
+}
+
+static uint32_t
+step_start(uint32_t index)
+{
+  uint32_t i;
+  uint32_t t = 0;
+  temp_profile_step_t step;
+
+  for (i = 0; i < index; ++i) {
+    make_step(i, &step);
+    t += step.duration;
+  }
+  return t;
+}
+
+/* Writes the profile in batches of 8 steps, as web_api_msg.c does with a
+ * downloaded profile.
+ */
+static bool
+write_profile(uint32_t id, uint32_t num_steps, bool commit)
+{
+  uint32_t i;
+  uint32_t n = 0;
+  temp_profile_writer_t w;
+  temp_profile_step_t steps[8];
+  quantity_t start_value = { .value = 60, .unit = UNIT_TEMP_DEG_F };
+
+  if (!temp_profile_store_begin(&w, id))
+    return false;
+
+  for (i = 0; i < num_steps; ++i) {
+    make_step(i, &steps[n++]);
+
+    if ((n == 8) || (i == (num_steps - 1))) {
+      if (!temp_profile_store_append(&w, steps, n))
+        return false;
+      n = 0;
+    }
+  }
+
+  if (!commit)
+    return true;
+
+  return temp_profile_store_commit(&w, "Long lager", start_value,
+      TEMP_PROFILE_COMPLETION_ACTION_HOLD_LAST);
+}
+
+static void
+test_round_trip(void)
+{
+  uint32_t i;
+  temp_profile_info_t info;
+  temp_profile_step_t step;
+  temp_profile_step_t expected;
+  uint32_t start;
+  uint32_t t = 0;
+
+  reset();
+  CHECK(temp_profile_store_max_steps() >= LONG_PROFILE_STEPS);
+  CHECK(write_profile(LONG_PROFILE_ID, LONG_PROFILE_STEPS, true));
+
+  reboot();
+  CHECK(temp_profile_store_find(LONG_PROFILE_ID, &info));
+  CHECK_EQ(info.num_steps, LONG_PROFILE_STEPS);
+  CHECK_EQ(info.duration, step_start(LONG_PROFILE_STEPS));
+  CHECK_NEAR(info.start_value.value, 60, 0.001);
+  CHECK_EQ(info.completion_action, TEMP_PROFILE_COMPLETION_ACTION_HOLD_LAST);
+
+  for (i = 0; i < LONG_PROFILE_STEPS; ++i) {
+    make_step(i, &expected);
+    CHECK(temp_profile_store_read_step(&info, i, &step, &start));
+    CHECK_EQ(step.duration, expected.duration);
+    CHECK_NEAR(step.value.value, expected.value.value, 0.001);
+    CHECK_EQ(step.type, expected.type);
+    CHECK_EQ(start, t);
+    t += expected.duration;
+  }
+  CHECK(!temp_profile_store_read_step(&info, LONG_PROFILE_STEPS, &step, &start));
+}
+
+/* The timeline finds the stored profile by id and follows it past the end
+ * of what the settings could hold.
+ */
+static void
+test_run_stored(void)
+{
+  temp_profile_t p;
+  temp_profile_run_t run;
+  temp_profile_step_t step;
+  temp_profile_step_t prev;
+  float sp = NAN;
+
+  reset();
+  CHECK(write_profile(LONG_PROFILE_ID, LONG_PROFILE_STEPS, true));
+  reboot();
+
+  /* The settings only carry the first steps of the profile */
+  memset(&p, 0, sizeof(p));
+  p.id = LONG_PROFILE_ID;
+  p.num_steps = TEMP_PROFILE_INLINE_STEPS;
+  p.start_value.value = 60;
+  p.completion_action = TEMP_PROFILE_COMPLETION_ACTION_HOLD_LAST;
+
+  test_time = 0;
+  memset(&run, 0, sizeof(run));
+  temp_profile_init(&run);
+  temp_profile_start(&run, CONTROLLER_1, &p);
+  temp_profile_update(&run, p.start_value);
+  CHECK_EQ(run.state, TPS_RUNNING);
+  CHECK(run.stored);
+
+  /* Half way along a hold, then a ramp, well past the inline steps */
+  make_step(437, &step);
+  test_time = S2ST(step_start(437) + (step.duration / 2));
+  CHECK(temp_profile_get_current_setpoint(&run, &sp));
+  CHECK_NEAR(sp, step.value.value, 0.001);
+  CHECK_EQ(run.current_step, 437);
+
+  make_step(437, &prev);
+  make_step(438, &step);
+  test_time = S2ST(step_start(438) + (step.duration / 2));
+  CHECK(temp_profile_get_current_setpoint(&run, &sp));
+  CHECK_NEAR(sp, (prev.value.value + step.value.value) / 2, 0.001);
+
+  make_step(LONG_PROFILE_STEPS - 1, &step);
+  test_time = S2ST(step_start(LONG_PROFILE_STEPS) + 60);
+  CHECK(temp_profile_get_current_setpoint(&run, &sp));
+  CHECK_NEAR(sp, step.value.value, 0.001);
+  CHECK_EQ(run.state, TPS_HOLD_LAST);
+}
+
+/* A new copy of a profile which has not been committed, even across a
+ * reboot, leaves the old copy in use. Once committed it replaces it.
+ */
+static void
+test_replace(void)
+{
+  temp_profile_info_t info;
+
+  reset();
+  CHECK(write_profile(LONG_PROFILE_ID, LONG_PROFILE_STEPS, true));
+
+  CHECK(write_profile(LONG_PROFILE_ID, 100, false));
+  CHECK(temp_profile_store_find(LONG_PROFILE_ID, &info));
+  CHECK_EQ(info.num_steps, LONG_PROFILE_STEPS);
+
+  reboot();
+  CHECK(temp_profile_store_find(LONG_PROFILE_ID, &info));
+  CHECK_EQ(info.num_steps, LONG_PROFILE_STEPS);
+
+  CHECK(write_profile(LONG_PROFILE_ID, 100, true));
+  CHECK(temp_profile_store_find(LONG_PROFILE_ID, &info));
+  CHECK_EQ(info.num_steps, 100);
+
+  reboot();
+  CHECK(temp_profile_store_find(LONG_PROFILE_ID, &info));
+  CHECK_EQ(info.num_steps, 100);
+
+  CHECK(temp_profile_store_delete(LONG_PROFILE_ID));
+  CHECK(!temp_profile_store_find(LONG_PROFILE_ID, &info));
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_run_stored);
+  RUN_TEST(test_replace);
+
+  TEST_MAIN_END();
+}
@@ -0,0 +1,313 @@
+
+#include "test.h"
+#include "temp_profile.h"
+#include "app_cfg.h"
+
+#include <string.h>
+
+
+/* Tests the profile timeline in temp_profile.c: setpoints along hold and
+ * ramp steps, seeking after gaps, completion actions, resuming from a
+ * checkpoint and wrapping of the tick count.
+ */
+
+#define STORED_PROFILE_ID     1000
+#define STORED_PROFILE_STEPS  200
+#define STORED_STEP_SECONDS   60
+
+systime_t test_time;
+int test_failures;
+
+static temp_profile_checkpoint_t saved_checkpoint;
+static bool use_stored_profile;
+
+
+const temp_profile_checkpoint_t*
+app_cfg_get_temp_profile_checkpoint(temp_controller_id_t controller)
+{
+  (void)controller;
+  return &saved_checkpoint;
+}
+
+void
+app_cfg_set_temp_profile_checkpoint(temp_controller_id_t controller,
+    temp_profile_checkpoint_t* checkpoint)
+{
+  (void)controller;
+  saved_checkpoint = *checkpoint;
+}
+
+/* The stored profile is a staircase of 1 minute holds, one degree apart. */
+bool
+temp_profile_store_find(uint32_t id, temp_profile_info_t* info)
+{
+  if (!use_stored_profile || (id != STORED_PROFILE_ID))
+    return false;
+
+  memset(info, 0, sizeof(*info));
+  info->id = id;
+  info->num_steps = STORED_PROFILE_STEPS;
+  info->duration = STORED_PROFILE_STEPS * STORED_STEP_SECONDS;
+  info->start_value.value = 0;
+  info->completion_action = TEMP_PROFILE_COMPLETION_ACTION_HOLD_LAST;
+  return true;
+}
+
+bool
+temp_profile_store_read_step(const temp_profile_info_t* info, uint32_t index,
+    temp_profile_step_t* step, uint32_t* step_start)
+{
+  if (index >= info->num_steps)
+    return false;
+
+  step->duration = STORED_STEP_SECONDS;
+  step->value.value = index;
+  step->value.unit = UNIT_TEMP_DEG_F;
+  step->type = STEP_HOLD;
+  if (step_start != NULL)
+    *step_start = index * STORED_STEP_SECONDS;
+  return true;
+}
+
+/* Starts at 60, ramps to 70 over 100 s, holds 70 for 50 s, then ramps down
+ * to 50 over 200 s.
+ */
+static void
+make_profile(temp_profile_t* p, temp_profile_completion_action_t action)
+{
+  memset(p, 0, sizeof(*p));
+  p->id = 7;
+  p->num_steps = 3;
+  p->start_value.value = 60;
+  p->start_point = 0;
+  p->completion_action = action;
+
+  p->steps[0].type = STEP_RAMP;
+  p->steps[0].duration = 100;
+  p->steps[0].value.value = 70;
+
+  p->steps[1].type = STEP_HOLD;
+  p->steps[1].duration = 50;
+  p->steps[1].value.value = 70;
+
+  p->steps[2].type = STEP_RAMP;
+  p->steps[2].duration = 200;
+  p->steps[2].value.value = 50;
+}
+
+static float
+expected_sp(float t)
+{
+  if (t < 100)
+    return 60 + (t / 10);
+  if (t < 150)
+    return 70;
+  return 70 - ((t - 150) / 10);
+}
+
+static float
+get_sp(temp_profile_run_t* run)
+{
+  float sp = NAN;
+  CHECK(temp_profile_get_current_setpoint(run, &sp));
+  return sp;
+}
+
+/* Starts the profile and brings it to the running state at test_time. */
+static void
+start_running(temp_profile_run_t* run, const temp_profile_t* p)
+{
+  memset(run, 0, sizeof(*run));
+  temp_profile_init(run);
+  temp_profile_start(run, CONTROLLER_1, p);
+  CHECK_EQ(run->state, TPS_SEEKING_START_VALUE);
+  CHECK_NEAR(get_sp(run), run->info.start_value.value, 0.001);
+
+  temp_profile_update(run, run->info.start_value);
+  CHECK_EQ(run->state, TPS_RUNNING);
+}
+
+static void
+test_hold_and_ramp(void)
+{
+  int t;
+  temp_profile_t p;
+  temp_profile_run_t run;
+
+  test_time = 5000;
+  make_profile(&p, TEMP_PROFILE_COMPLETION_ACTION_HOLD_LAST);
+  start_running(&run, &p);
+
+  /* Sub-second progress along a ramp */
+  test_time = 5000 + MS2ST(500);
+  CHECK_NEAR(get_sp(&run), 60.05, 0.001);
+
+  for (t = 5; t < 350; t += 5) {
+    test_time = 5000 + S2ST(t);
+    CHECK_NEAR(get_sp(&run), expected_sp(t), 0.01);
+  }
+
+  test_time = 5000 + S2ST(400);
+  CHECK_NEAR(get_sp(&run), 50, 0.001);
+  CHECK_EQ(run.state, TPS_HOLD_LAST);
+
+  test_time += S2ST(10000);
+  CHECK_NEAR(get_sp(&run), 50, 0.001);
+}
+
+static void
+test_gap_seeks_to_step(void)
+{
+  temp_profile_t p;
+  temp_profile_run_t run;
+
+  test_time = 0;
+  make_profile(&p, TEMP_PROFILE_COMPLETION_ACTION_HOLD_LAST);
+  start_running(&run, &p);
+
+  /* Skip straight over the hold into the middle of the last ramp */
+  test_time = S2ST(250);
+  CHECK_NEAR(get_sp(&run), 60, 0.001);
+  CHECK_EQ(run.current_step, 2);
+
+  /* Time only moves forward, a later lookup keeps going */
+  test_time = S2ST(300);
+  CHECK_NEAR(get_sp(&run), 55, 0.001);
+}
+
+static void
+test_start_over(void)
+{
+  temp_profile_t p;
+  temp_profile_run_t run;
+
+  test_time = 0;
+  make_profile(&p, TEMP_PROFILE_COMPLETION_ACTION_START_OVER);
+  start_running(&run, &p);
+
+  test_time = S2ST(350 + 50);
+  CHECK_NEAR(get_sp(&run), 65, 0.001);
+  CHECK_EQ(run.state, TPS_RUNNING);
+
+  test_time = S2ST((3 * 350) + 120);
+  CHECK_NEAR(get_sp(&run), 70, 0.001);
+}
+
+static void
+test_start_point(void)
+{
+  temp_profile_t p;
+  temp_profile_run_t run;
+
+  test_time = 0;
+  make_profile(&p, TEMP_PROFILE_COMPLETION_ACTION_HOLD_LAST);
+  p.start_point = 2;
+
+  memset(&run, 0, sizeof(run));
+  temp_profile_init(&run);
+  temp_profile_start(&run, CONTROLLER_1, &p);
+  CHECK_EQ(run.state, TPS_RUNNING);
+  CHECK_NEAR(get_sp(&run), 70, 0.001);
+
+  test_time = S2ST(100);
+  CHECK_NEAR(get_sp(&run), 60, 0.001);
+}
+
+static void
+test_resume_from_checkpoint(void)
+{
+  temp_profile_t p;
+  temp_profile_run_t run;
+  temp_profile_run_t resumed;
+
+  test_time = 0;
+  make_profile(&p, TEMP_PROFILE_COMPLETION_ACTION_HOLD_LAST);
+  start_running(&run, &p);
+
+  /* A checkpoint is written once the checkpoint period has passed */
+  test_time = S2ST(170);
+  CHECK_NEAR(get_sp(&run), expected_sp(170), 0.001);
+  run.last_checkpoint = test_time - S2ST(4 * 60 * 60);
+  temp_profile_update(&run, run.info.start_value);
+  CHECK_EQ(saved_checkpoint.temp_profile_id, 7);
+  CHECK_EQ(saved_checkpoint.current_step, 2);
+  CHECK_EQ(saved_checkpoint.current_step_time, S2ST(20));
+
+  /* After a reboot the tick count starts again from zero */
+  test_time = 0;
+  memset(&resumed, 0, sizeof(resumed));
+  temp_profile_init(&resumed);
+  temp_profile_resume(&resumed, CONTROLLER_1, &p);
+  CHECK_EQ(resumed.state, TPS_RUNNING);
+  CHECK_NEAR(get_sp(&resumed), expected_sp(170), 0.001);
+
+  test_time = S2ST(30);
+  CHECK_NEAR(get_sp(&resumed), expected_sp(200), 0.001);
+}
+
+static void
+test_tick_wrap(void)
+{
+  int t;
+  temp_profile_t p;
+  temp_profile_run_t run;
+  systime_t start = (systime_t)0 - S2ST(120) - MS2ST(250);
+
+  test_time = start;
+  make_profile(&p, TEMP_PROFILE_COMPLETION_ACTION_HOLD_LAST);
+  start_running(&run, &p);
+
+  /* systime_t wraps 120.25 s in, part way through the hold step */
+  for (t = 0; t < 340; ++t) {
+    test_time = start + S2ST(t);
+    CHECK_NEAR(get_sp(&run), expected_sp(t), 0.01);
+  }
+  CHECK(test_time < start);
+}
+
+static void
+test_stored_profile_seek(void)
+{
+  temp_profile_t p;
+  temp_profile_run_t run;
+
+  use_stored_profile = true;
+
+  test_time = 0;
+  make_profile(&p, TEMP_PROFILE_COMPLETION_ACTION_HOLD_LAST);
+  p.id = STORED_PROFILE_ID;
+  start_running(&run, &p);
+  CHECK(run.stored);
+  CHECK_EQ(run.info.num_steps, STORED_PROFILE_STEPS);
+
+  test_time = S2ST(30);
+  CHECK_NEAR(get_sp(&run), 0, 0.001);
+
+  test_time = S2ST(61);
+  CHECK_NEAR(get_sp(&run), 1, 0.001);
+
+  /* A long gap is found by search rather than walking the steps */
+  test_time = S2ST((137 * STORED_STEP_SECONDS) + 5);
+  CHECK_NEAR(get_sp(&run), 137, 0.001);
+  CHECK_EQ(run.current_step, 137);
+
+  test_time = S2ST(STORED_PROFILE_STEPS * STORED_STEP_SECONDS);
+  CHECK_NEAR(get_sp(&run), STORED_PROFILE_STEPS - 1, 0.001);
+  CHECK_EQ(run.state, TPS_HOLD_LAST);
+
+  use_stored_profile = false;
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_hold_and_ramp);
+  RUN_TEST(test_gap_seeks_to_step);
+  RUN_TEST(test_start_over);
+  RUN_TEST(test_start_point);
+  RUN_TEST(test_resume_from_checkpoint);
+  RUN_TEST(test_tick_wrap);
+  RUN_TEST(test_stored_profile_seek);
+
+  TEST_MAIN_END();
+}
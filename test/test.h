@@ -0,0 +1,55 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <math.h>
+
+/* Minimal checks for the host tests. A failed check is reported and counted
+ * but the test carries on, so one run shows every failure.
+ */
+
+extern int test_failures;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      test_failures++; \
+    } \
+  } while (0)
+
+#define CHECK_EQ(actual, expected) \
+  do { \
+    long long a_ = (long long)(actual); \
+    long long e_ = (long long)(expected); \
+    if (a_ != e_) { \
+      printf("%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, a_, e_); \
+      test_failures++; \
+    } \
+  } while (0)
+
+#define CHECK_NEAR(actual, expected, tol) \
+  do { \
+    double a_ = (actual); \
+    double e_ = (expected); \
+    if (!(fabs(a_ - e_) <= (tol))) { \
+      printf("%s:%d: %s is %f, expected %f\n", __FILE__, __LINE__, #actual, a_, e_); \
+      test_failures++; \
+    } \
+  } while (0)
+
+#define RUN_TEST(fn) \
+  do { \
+    int before_ = test_failures; \
+    fn(); \
+    printf("%s %s\n", (test_failures == before_) ? "PASS" : "FAIL", #fn); \
+  } while (0)
+
+#define TEST_MAIN_END() \
+  do { \
+    if (test_failures > 0) \
+      printf("%d check(s) failed\n", test_failures); \
+    return (test_failures > 0) ? 1 : 0; \
+  } while (0)
+
+#endif
@@ -0,0 +1,49 @@
+# Host tests for modules whose logic does not depend on the hardware. They
+# are built with the native compiler against the stand-in headers in
+# test/stubs. Run with "make test" from the top of the tree.
+
+TEST_BUILD = build/test
+
+TEST_CC     ?= gcc
+TEST_CFLAGS  = -std=gnu99 -Wall -Wextra -Wno-unused-parameter -g -pthread
+# The CC3000 headers define their own clock_t
+TEST_CFLAGS += -D__clock_t_defined
+TEST_INCDIR  = test/stubs test src/app_mt src/app_mt/gui src/app_mt/gui/controls \
+               src/app_mt/wifi src/common
+
+TESTS = temp_profile app_cfg web_api_report web_api_backlog history_log temp_history \
+        temp_profile_store message touch_calib touch widget font lan_api telemetry \
+        cc3000_spi cc3000_hci socket ota_update net
+
+temp_profile_SRC = test/temp_profile_test.c src/app_mt/temp_profile.c
+app_cfg_SRC      = test/app_cfg_test.c src/common/crc/crc32.c
+web_api_report_SRC = test/web_api_report_test.c src/app_mt/web_api_report.c
+web_api_backlog_SRC = test/web_api_backlog_test.c src/common/crc/crc32.c
+history_log_SRC     = test/history_log_test.c src/common/crc/crc32.c
+temp_history_SRC    = test/temp_history_test.c
+temp_profile_store_SRC = test/temp_profile_store_test.c src/app_mt/temp_profile.c src/common/crc/crc32.c
+message_SRC         = test/message_test.c
+message_ENV         = MSG_STATS_JSON=$(TEST_BUILD)/message_stats.json
+touch_calib_SRC     = test/touch_calib_test.c src/app_mt/touch_calib.c
+touch_SRC           = test/touch_test.c src/app_mt/touch_calib.c
+widget_SRC          = test/widget_test.c
+font_SRC            = test/font_test.c
+lan_api_SRC         = test/lan_api_test.c
+telemetry_SRC       = test/telemetry_test.c
+cc3000_spi_SRC      = test/cc3000_spi_test.c test/cc3000_emu.c
+cc3000_hci_SRC      = test/cc3000_hci_test.c test/cc3000_emu.c src/app_mt/wifi/core/cc3000_common.c
+socket_SRC          = test/socket_test.c test/cc3000_emu.c
+ota_update_SRC      = test/ota_update_test.c
+net_SRC             = test/net_test.c
+
+all: $(TESTS)
+
+$(TESTS): | $(TEST_BUILD)
+	@echo Running $@ tests
+	@$(TEST_CC) $(TEST_CFLAGS) $(addprefix -I,$(TEST_INCDIR)) $($@_SRC) -o $(TEST_BUILD)/$@_test -lm
+	@$($@_ENV) $(TEST_BUILD)/$@_test
+
+$(TEST_BUILD):
+	@mkdir -p $@
+
+.PHONY: all $(TESTS)
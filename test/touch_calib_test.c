@@ -0,0 +1,248 @@
+
+#include "test.h"
+#include "touch_calib.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/* Tests the touch calibration in touch_calib.c: the least squares fit over
+ * the five calibration points, the Q16 fixed point mapping and the
+ * residuals reported for it, against panels with known affine distortions
+ * with and without sampling noise, and point sets which can't be fitted.
+ */
+
+int test_failures;
+
+/* The reference points drawn by gui/calib.c */
+static const point_t ref_pts[NUM_CALIB_POINTS] = {
+    {  40,  40 },
+    { 280,  40 },
+    { 280, 200 },
+    {  40, 200 },
+    { 160, 120 },
+};
+
+/* How a panel maps a 10 bit digitizer reading to the display, as
+ * xd = a*xs + b*ys + c, yd = d*xs + e*ys + f
+ */
+typedef struct {
+  const char* name;
+  float a, b, c, d, e, f;
+} panel_t;
+
+static const panel_t panels[] = {
+    { "aligned",  0.3125f,  0,        0,     0,       0.2344f,  0 },
+    { "offset",   0.30f,    0,      -14,     0,       0.22f,   -9 },
+    { "flipped",  0.30f,    0,      -14,     0,      -0.22f,  235 },
+    { "rotated",  0.305f,   0.012f, -20,    -0.009f,  0.23f,   -4 },
+};
+
+static uint32_t noise_state;
+
+
+/* Repeatable noise in [-amplitude, amplitude] */
+static int32_t
+noise(int32_t amplitude)
+{
+  noise_state = (noise_state * 1103515245) + 12345;
+  return (int32_t)((noise_state >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+/* The digitizer reading for each reference point, by inverting the panel's
+ * mapping, plus up to noise_amplitude counts of noise on each axis.
+ */
+static void
+sample_panel(const panel_t* p, int32_t noise_amplitude, point_t* samples)
+{
+  int i;
+  float det = (p->a * p->e) - (p->b * p->d);
+
+  for (i = 0; i < NUM_CALIB_POINTS; ++i) {
+    float xd = ref_pts[i].x - p->c;
+    float yd = ref_pts[i].y - p->f;
+
+    samples[i].x = lroundf(((p->e * xd) - (p->b * yd)) / det);
+    samples[i].y = lroundf(((p->a * yd) - (p->d * xd)) / det);
+    if (noise_amplitude > 0) {
+      samples[i].x += noise(noise_amplitude);
+      samples[i].y += noise(noise_amplitude);
+    }
+  }
+}
+
+static void
+fit(const point_t* samples, int num_pts, matrix_fixed_t* fixed, calib_residuals_t* residuals)
+{
+  matrix_t matrix;
+
+  CHECK_EQ(fitCalibrationMatrix(ref_pts, samples, num_pts, &matrix), OK);
+  CHECK_EQ(setFixedPointMatrix(&matrix, fixed), OK);
+  getCalibrationResiduals(ref_pts, samples, num_pts, fixed, residuals);
+}
+
+/* Without noise the fit recovers each panel's factors, and every reference
+ * point maps to within the rounding of its sample.
+ */
+static void
+test_exact_fit(void)
+{
+  unsigned int i;
+  point_t samples[NUM_CALIB_POINTS];
+  matrix_fixed_t fixed;
+  calib_residuals_t residuals;
+
+  for (i = 0; i < sizeof(panels) / sizeof(panels[0]); ++i) {
+    const panel_t* p = &panels[i];
+
+    sample_panel(p, 0, samples);
+    fit(samples, NUM_CALIB_POINTS, &fixed, &residuals);
+
+    CHECK_NEAR(fixed.a / 65536.0, p->a, 0.002);
+    CHECK_NEAR(fixed.b / 65536.0, p->b, 0.002);
+    CHECK_NEAR(fixed.c / 65536.0, p->c, 1.0);
+    CHECK_NEAR(fixed.d / 65536.0, p->d, 0.002);
+    CHECK_NEAR(fixed.e / 65536.0, p->e, 0.002);
+    CHECK_NEAR(fixed.f / 65536.0, p->f, 1.0);
+    CHECK(residuals.max <= 1.0f);
+    printf("  %s: rms %.2f max %.2f px\n", p->name, residuals.rms, residuals.max);
+  }
+}
+
+/* With noisy samples the residuals stay in proportion to the noise, and
+ * over all five points they are no worse than those of the three point
+ * solution, which ignores the last two points.
+ */
+static void
+test_noisy_fit(void)
+{
+  unsigned int i;
+  int trial;
+  point_t samples[NUM_CALIB_POINTS];
+  matrix_fixed_t fixed;
+  matrix_fixed_t fixed3;
+  matrix_t matrix3;
+  calib_residuals_t residuals;
+  calib_residuals_t residuals3;
+
+  noise_state = 1;
+  for (i = 0; i < sizeof(panels) / sizeof(panels[0]); ++i) {
+    const panel_t* p = &panels[i];
+    float worst_rms = 0;
+    float worst_max = 0;
+
+    for (trial = 0; trial < 100; ++trial) {
+      sample_panel(p, 6, samples);
+      fit(samples, NUM_CALIB_POINTS, &fixed, &residuals);
+
+      /* 6 counts of noise is about 2 px on the display */
+      CHECK(residuals.rms < 3.0f);
+      CHECK(residuals.max < 4.5f);
+      worst_rms = fmaxf(worst_rms, residuals.rms);
+      worst_max = fmaxf(worst_max, residuals.max);
+
+      CHECK_EQ(setCalibrationMatrix(ref_pts, samples, &matrix3), OK);
+      CHECK_EQ(setFixedPointMatrix(&matrix3, &fixed3), OK);
+      getCalibrationResiduals(ref_pts, samples, NUM_CALIB_POINTS, &fixed3, &residuals3);
+      CHECK(residuals.rms <= residuals3.rms + 0.5f);
+    }
+    printf("  %s with noise: worst rms %.2f max %.2f px\n", p->name, worst_rms, worst_max);
+  }
+}
+
+/* The Q16 mapping agrees with the exact mapping to within a pixel across
+ * the whole digitizer range, and with getDisplayPoint() which truncates.
+ */
+static void
+test_fixed_mapping(void)
+{
+  unsigned int i;
+  point_t samples[NUM_CALIB_POINTS];
+  point_t s;
+  point_t d;
+  matrix_t matrix;
+  matrix_fixed_t fixed;
+
+  for (i = 0; i < sizeof(panels) / sizeof(panels[0]); ++i) {
+    const panel_t* p = &panels[i];
+    int errors = 0;
+
+    sample_panel(p, 0, samples);
+    CHECK_EQ(fitCalibrationMatrix(ref_pts, samples, NUM_CALIB_POINTS, &matrix), OK);
+    CHECK_EQ(setFixedPointMatrix(&matrix, &fixed), OK);
+
+    for (s.x = 0; s.x < 1024; s.x += 31) {
+      for (s.y = 0; s.y < 1024; s.y += 29) {
+        point_t d_slow;
+        float xd = (p->a * s.x) + (p->b * s.y) + p->c;
+        float yd = (p->d * s.x) + (p->e * s.y) + p->f;
+
+        getDisplayPointFixed(&d, &s, &fixed);
+        getDisplayPoint(&d_slow, &s, &matrix);
+
+        if ((fabsf(d.x - xd) > 1.5f) || (fabsf(d.y - yd) > 1.5f) ||
+            (abs(d.x - d_slow.x) > 1) || (abs(d.y - d_slow.y) > 1))
+          errors++;
+      }
+    }
+    CHECK_EQ(errors, 0);
+  }
+
+  /* Rounds to the nearest pixel */
+  memset(&fixed, 0, sizeof(fixed));
+  fixed.a = 65536 / 2;
+  fixed.e = 65536 / 4;
+  s.x = 3;
+  s.y = 6;
+  getDisplayPointFixed(&d, &s, &fixed);
+  CHECK_EQ(d.x, 2);
+  CHECK_EQ(d.y, 2);
+
+  matrix.Divider = 0;
+  CHECK_EQ(setFixedPointMatrix(&matrix, &fixed), NOT_OK);
+}
+
+/* Screen points on a line, as from a panel which only registers one axis,
+ * or too few points, can't be fitted.
+ */
+static void
+test_degenerate(void)
+{
+  int i;
+  point_t samples[NUM_CALIB_POINTS];
+  matrix_t matrix;
+
+  for (i = 0; i < NUM_CALIB_POINTS; ++i) {
+    samples[i].x = 100 + (i * 150);
+    samples[i].y = 200 + (i * 100);
+  }
+  CHECK_EQ(fitCalibrationMatrix(ref_pts, samples, NUM_CALIB_POINTS, &matrix), NOT_OK);
+
+  for (i = 0; i < NUM_CALIB_POINTS; ++i) {
+    samples[i].x = 100 + (i * 150);
+    samples[i].y = 512;
+  }
+  CHECK_EQ(fitCalibrationMatrix(ref_pts, samples, NUM_CALIB_POINTS, &matrix), NOT_OK);
+
+  /* All five presses landing on the same spot */
+  for (i = 0; i < NUM_CALIB_POINTS; ++i) {
+    samples[i].x = 512;
+    samples[i].y = 512;
+  }
+  CHECK_EQ(fitCalibrationMatrix(ref_pts, samples, NUM_CALIB_POINTS, &matrix), NOT_OK);
+
+  sample_panel(&panels[0], 0, samples);
+  CHECK_EQ(fitCalibrationMatrix(ref_pts, samples, 2, &matrix), NOT_OK);
+  CHECK_EQ(fitCalibrationMatrix(ref_pts, samples, 3, &matrix), OK);
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_exact_fit);
+  RUN_TEST(test_noisy_fit);
+  RUN_TEST(test_fixed_mapping);
+  RUN_TEST(test_degenerate);
+
+  TEST_MAIN_END();
+}
@@ -0,0 +1,285 @@
+
+#include "test.h"
+
+/* The sampling state and delivery queue are private to touch.c, so the
+ * tests build it directly.
+ */
+#include "touch.c"
+
+
+/* Tests touch sampling and delivery in touch.c by replaying scripted touch
+ * traces through the ADC: a press, a drag and a release, and a burst of
+ * quick taps, delivered to a listener which keeps up and to one which has
+ * fallen behind. A transition is never coalesced away, a listener which
+ * falls behind gets the latest position, and the sample counts add up.
+ */
+
+#define MAX_DELIVERED 256
+
+systime_t test_time;
+int test_failures;
+
+ADCDriver ADCD1;
+
+/* The panel as the ADC sees it */
+static bool pressed;
+static uint16_t panel_x;
+static uint16_t panel_y;
+static int adc_call;
+
+static touch_msg_t delivered[MAX_DELIVERED];
+static int num_delivered;
+static bool listener_keeps_up;
+
+
+void palSetPadMode(ioportid_t port, uint16_t pad, int mode) { }
+void palSetPad(ioportid_t port, uint16_t pad) { }
+void palClearPad(ioportid_t port, uint16_t pad) { }
+uint8_t palReadPad(ioportid_t port, uint16_t pad) { return !pressed; }
+void adcAcquireBus(ADCDriver* adcp) { }
+void adcReleaseBus(ADCDriver* adcp) { }
+
+/* touch_sample() reads z1, z2, x and y in turn. Equal z1 and z2 is full
+ * pressure, and a large z2 over a small z1 is none.
+ */
+msg_t
+adcConvert(ADCDriver* adcp, const ADCConversionGroup* grp, adcsample_t* samples, size_t depth)
+{
+  size_t i;
+  adcsample_t value;
+
+  switch (adc_call++ % 4) {
+    case 0:  value = pressed ? 512 : 1;    break;
+    case 1:  value = pressed ? 512 : 1023; break;
+    case 2:  value = panel_x;              break;
+    default: value = panel_y;              break;
+  }
+
+  for (i = 0; i < depth; ++i)
+    samples[i] = value;
+  return 0;
+}
+
+const matrix_t*
+app_cfg_get_touch_calib()
+{
+  static matrix_t identity = { .An = 1, .En = 1, .Divider = 1 };
+  return &identity;
+}
+
+void
+app_cfg_set_touch_calib(matrix_t* touch_calib)
+{
+}
+
+msg_listener_t*
+msg_listener_create(const char* name, int stack_size, thread_msg_dispatch_t dispatch, void* user_data)
+{
+  return NULL;
+}
+
+void
+msg_listener_wake(msg_listener_t* l)
+{
+  if (listener_keeps_up)
+    touch_publish_pending();
+}
+
+void
+msg_send(msg_id_t id, void* msg_data)
+{
+  CHECK_EQ(id, MSG_TOUCH_INPUT);
+  if (num_delivered < MAX_DELIVERED)
+    delivered[num_delivered++] = *(touch_msg_t*)msg_data;
+}
+
+static void
+reset(bool keeps_up)
+{
+  touch_down = 0;
+  down_samples = 0;
+  sample_idx = 0;
+  queue_head = 0;
+  queue_len = 0;
+  posted_down = false;
+  publishing = false;
+  memset(&touch_stats, 0, sizeof(touch_stats));
+  filter_reset(&x_filter);
+  filter_reset(&y_filter);
+
+  touch_init();
+  pressed = false;
+  adc_call = 0;
+  num_delivered = 0;
+  listener_keeps_up = keeps_up;
+  test_time = 0;
+}
+
+/* One sample period of the active loop in touch_thread() */
+static void
+sample(void)
+{
+  test_time += ACTIVE_SAMPLE_PERIOD;
+  touch_sample();
+}
+
+/* Presses at (x0, y0), drags to (x1, y1) over the given number of samples
+ * and lets go, then samples until the release has been debounced.
+ */
+static void
+drag(int x0, int y0, int x1, int y1, int samples)
+{
+  int i;
+
+  pressed = true;
+  for (i = 0; i <= samples; ++i) {
+    panel_x = x0 + (((x1 - x0) * i) / samples);
+    panel_y = y0 + (((y1 - y0) * i) / samples);
+    sample();
+  }
+
+  pressed = false;
+  for (i = 0; i < (int)(DEBOUNCE_TIME / ACTIVE_SAMPLE_PERIOD) + 2; ++i)
+    sample();
+}
+
+static bool
+same_msg(const touch_msg_t* a, const touch_msg_t* b)
+{
+  return (a->touch_down == b->touch_down) &&
+      (a->calib.x == b->calib.x) && (a->calib.y == b->calib.y);
+}
+
+/* Listeners are never left thinking the panel is still touched */
+static void
+check_released(const touch_msg_t* msgs, int n)
+{
+  CHECK(n > 0);
+  if (n > 0)
+    CHECK(!msgs[n - 1].touch_down);
+}
+
+static void
+check_stats(void)
+{
+  touch_stats_t stats;
+
+  touch_get_stats(&stats);
+  CHECK_EQ(stats.samples, stats.delivered + stats.coalesced + stats.dropped);
+  CHECK_EQ(stats.delivered, num_delivered);
+}
+
+/* A listener which keeps up sees every position. One which only catches up
+ * after the release sees the down, the position the drag ended at and the
+ * up.
+ */
+static void
+test_drag(void)
+{
+  touch_msg_t all[MAX_DELIVERED];
+  int num_all;
+  touch_stats_t stats;
+
+  reset(true);
+  drag(300, 400, 700, 600, 40);
+  num_all = num_delivered;
+  memcpy(all, delivered, sizeof(all));
+
+  check_released(all, num_all);
+  check_stats();
+  CHECK(num_all > 30);
+  CHECK(all[0].touch_down);
+  CHECK(all[num_all - 2].touch_down);
+  touch_get_stats(&stats);
+  CHECK_EQ(stats.coalesced, 0);
+
+  reset(false);
+  drag(300, 400, 700, 600, 40);
+  CHECK_EQ(num_delivered, 0);
+  touch_publish_pending();
+
+  CHECK_EQ(num_delivered, 3);
+  CHECK(same_msg(&delivered[0], &all[0]));
+  CHECK(same_msg(&delivered[1], &all[num_all - 2]));
+  CHECK(same_msg(&delivered[2], &all[num_all - 1]));
+  check_stats();
+  touch_get_stats(&stats);
+  CHECK_EQ(stats.coalesced, num_all - 3);
+  CHECK_EQ(stats.dropped, 0);
+}
+
+/* Quick taps pile up transitions faster than a stalled listener takes
+ * them. Older updates make way, but the final up always arrives.
+ */
+static void
+test_rapid_taps(void)
+{
+  int i;
+  touch_stats_t stats;
+
+  reset(false);
+  for (i = 0; i < 5; ++i)
+    drag(100 + (i * 100), 300, 150 + (i * 100), 350, 8);
+
+  touch_publish_pending();
+  CHECK(num_delivered <= TOUCH_QUEUE_LEN);
+  check_released(delivered, num_delivered);
+  check_stats();
+  touch_get_stats(&stats);
+  CHECK(stats.dropped > 0);
+
+  /* A listener which keeps up gets five of each transition */
+  int downs = 0;
+  int ups = 0;
+  reset(true);
+  for (i = 0; i < 5; ++i)
+    drag(100 + (i * 100), 300, 150 + (i * 100), 350, 8);
+  for (i = 0; i < num_delivered; ++i) {
+    if (!delivered[i].touch_down)
+      ups++;
+    else if ((i == 0) || !delivered[i - 1].touch_down)
+      downs++;
+  }
+  CHECK_EQ(downs, 5);
+  CHECK_EQ(ups, 5);
+  check_stats();
+}
+
+/* A release shorter than the debounce time is part of the same touch */
+static void
+test_debounce(void)
+{
+  int i;
+
+  reset(true);
+  pressed = true;
+  panel_x = 500;
+  panel_y = 500;
+  for (i = 0; i < 10; ++i)
+    sample();
+
+  pressed = false;
+  sample();
+  sample();
+  pressed = true;
+  for (i = 0; i < 10; ++i)
+    sample();
+
+  for (i = 0; i < num_delivered; ++i)
+    CHECK(delivered[i].touch_down);
+
+  pressed = false;
+  for (i = 0; i < 10; ++i)
+    sample();
+  check_released(delivered, num_delivered);
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_drag);
+  RUN_TEST(test_rapid_taps);
+  RUN_TEST(test_debounce);
+
+  TEST_MAIN_END();
+}
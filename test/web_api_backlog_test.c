@@ -0,0 +1,335 @@
+
+#include "test.h"
+
+/* Reclaiming is private to web_api_backlog.c, so the tests build it directly */
+#include "web_api_backlog.c"
+
+
+/* Tests the flash backlog in web_api_backlog.c: folding the oldest sector
+ * into summaries when the ring wraps, the budget for carried events, and
+ * resuming a send which failed part way without repeating what was sent.
+ */
+
+#define TEST_SECTORS   3
+#define MAX_SENT       4096
+#define RECORD_LEN     (sizeof(record_header_t) + sizeof(ApiMessage))
+
+systime_t test_time;
+int test_failures;
+
+static uint8_t flash[TEST_SECTORS * SECTOR_SIZE];
+
+static ApiMessage sent[MAX_SENT];
+static uint32_t num_sent;
+static uint32_t send_limit;
+
+
+uint32_t
+sxfs_get_size(sxfs_part_id_t part_id)
+{
+  return sizeof(flash);
+}
+
+/* Programming can only clear bits, as on the real flash */
+bool
+sxfs_write(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  uint32_t i;
+
+  if (offset + data_len > sizeof(flash))
+    return false;
+  for (i = 0; i < data_len; ++i)
+    flash[offset + i] &= data[i];
+  return true;
+}
+
+bool
+sxfs_read(sxfs_part_id_t part_id, uint32_t offset, uint8_t* data, uint32_t data_len)
+{
+  if (offset + data_len > sizeof(flash))
+    return false;
+  memcpy(data, &flash[offset], data_len);
+  return true;
+}
+
+bool
+sxfs_erase(sxfs_part_id_t part_id, uint32_t offset, uint32_t len)
+{
+  if (offset + len > sizeof(flash))
+    return false;
+  memset(&flash[offset], 0xFF, len);
+  return true;
+}
+
+/* Settings written during a reclaim are the current ones */
+void
+web_api_msg_device_settings(DeviceSettings* ds)
+{
+  ds->hysteresis = 1.5;
+}
+
+void
+web_api_msg_controller_settings(ControllerSettings* ss,
+    temp_controller_id_t controller)
+{
+  ss->sensor_index = controller;
+}
+
+static bool
+send_msg(uint8_t* msg, uint32_t msg_len, void* arg)
+{
+  if ((num_sent >= send_limit) || (num_sent >= MAX_SENT))
+    return false;
+
+  CHECK_EQ(msg_len, sizeof(ApiMessage));
+  memcpy(&sent[num_sent++], msg, sizeof(ApiMessage));
+  return true;
+}
+
+static bool
+send_backlog(uint32_t limit)
+{
+  send_limit = limit;
+  return web_api_backlog_send(send_msg, NULL);
+}
+
+static void
+reset(void)
+{
+  memset(flash, 0xFF, sizeof(flash));
+  memset(sectors, 0, sizeof(sectors));
+  have_sector = false;
+  send_pos_valid = false;
+  num_sent = 0;
+
+  web_api_backlog_init();
+  CHECK_EQ(num_sectors, TEST_SECTORS);
+  CHECK(web_api_backlog_empty());
+}
+
+static void
+store_report(backlog_kind_t kind, uint8_t controller, float reading, uint32_t timestamp)
+{
+  ApiMessage msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.type = ApiMessage_Type_DEVICE_REPORT;
+  msg.has_deviceReport = true;
+  msg.deviceReport.controller_reports_count = 1;
+  msg.deviceReport.controller_reports[0].controller_index = controller;
+  msg.deviceReport.controller_reports[0].sensor_reading = reading;
+  msg.deviceReport.controller_reports[0].has_timestamp = true;
+  msg.deviceReport.controller_reports[0].timestamp = timestamp;
+
+  CHECK(web_api_backlog_store(kind, controller, (uint8_t*)&msg, sizeof(msg)));
+}
+
+static bool
+sector_has_room(void)
+{
+  return (write_offset + RECORD_LEN <= SECTOR_SIZE);
+}
+
+/* Stores events numbered from first until the newest sector is full.
+ * Returns the number after the last one stored.
+ */
+static uint32_t
+fill_events(uint32_t first)
+{
+  uint32_t id = first;
+
+  do {
+    store_report(BACKLOG_EVENT, 0, id, id);
+    id++;
+  } while (sector_has_room());
+
+  return id;
+}
+
+static float
+reading(uint32_t i, uint32_t report)
+{
+  return sent[i].deviceReport.controller_reports[report].sensor_reading;
+}
+
+/* Checks every event below num_ids was sent exactly once */
+static void
+check_sent_once(uint32_t num_ids)
+{
+  uint32_t i;
+  uint8_t* count = calloc(num_ids, 1);
+
+  for (i = 0; i < num_sent; ++i) {
+    uint32_t id = reading(i, 0);
+    CHECK(id < num_ids);
+    if (id < num_ids)
+      count[id]++;
+  }
+
+  for (i = 0; i < num_ids; ++i) {
+    if (count[i] != 1) {
+      printf("event %u sent %u times\n", i, count[i]);
+      test_failures++;
+    }
+  }
+
+  free(count);
+}
+
+static void
+test_summarize(void)
+{
+  uint32_t i;
+  uint32_t n;
+  float total = 0;
+  uint64_t time_total = 0;
+  ApiMessage settings;
+
+  reset();
+
+  /* Hour 0 dips to 58 at 200 s and peaks at 63 at 300 s */
+  store_report(BACKLOG_REPORT, 0, 60, 100);
+  store_report(BACKLOG_REPORT, 0, 58, 200);
+  store_report(BACKLOG_REPORT, 0, 63, 300);
+  store_report(BACKLOG_REPORT, 0, 61, 400);
+  store_report(BACKLOG_EVENT, 0, 99, 450);
+
+  memset(&settings, 0, sizeof(settings));
+  settings.type = ApiMessage_Type_DEVICE_SETTINGS;
+  settings.has_deviceSettings = true;
+  settings.deviceSettings.hysteresis = 0.1;
+  CHECK(web_api_backlog_store(BACKLOG_SETTINGS, BACKLOG_KEY_DEVICE, (uint8_t*)&settings, sizeof(settings)));
+
+  /* Hour 1 swings between 70 and 73 until the first sector is full */
+  for (i = 0; sector_has_room(); ++i) {
+    store_report(BACKLOG_REPORT, 0, 70 + ((i % 7) * 0.5f), SUMMARY_PERIOD + i);
+    total += 70 + ((i % 7) * 0.5f);
+    time_total += SUMMARY_PERIOD + i;
+  }
+  uint32_t num_hour_1 = i;
+  CHECK_EQ(write_sector, 0);
+
+  /* The second sector is full of events, and one more wraps the ring */
+  n = fill_events(1000);
+  CHECK_EQ(write_sector, 1);
+  store_report(BACKLOG_EVENT, 1, 300, 5000);
+  CHECK_EQ(write_sector, 2);
+  CHECK(!sectors[0].valid);
+
+  CHECK(send_backlog(MAX_SENT));
+  CHECK(web_api_backlog_empty());
+  CHECK_EQ(num_sent, (n - 1000) + 5);
+
+  for (i = 0; i < n - 1000; ++i)
+    CHECK_NEAR(reading(i, 0), 1000 + i, 0.001);
+
+  /* The event is carried as it is */
+  CHECK_NEAR(reading(i, 0), 99, 0.001);
+  i++;
+
+  /* Each hour is summarized by its low, high and average, in time order,
+   * with the average at the mean time of the readings
+   */
+  CHECK_EQ(sent[i].deviceReport.controller_reports_count, 3);
+  CHECK_NEAR(reading(i, 0), 58, 0.001);
+  CHECK_EQ(sent[i].deviceReport.controller_reports[0].timestamp, 200);
+  CHECK_NEAR(reading(i, 1), 60.5, 0.001);
+  CHECK_EQ(sent[i].deviceReport.controller_reports[1].timestamp, 250);
+  CHECK_NEAR(reading(i, 2), 63, 0.001);
+  CHECK_EQ(sent[i].deviceReport.controller_reports[2].timestamp, 300);
+  i++;
+
+  CHECK_EQ(sent[i].deviceReport.controller_reports_count, 3);
+  CHECK_NEAR(reading(i, 0), 70, 0.001);
+  CHECK_EQ(sent[i].deviceReport.controller_reports[0].timestamp, SUMMARY_PERIOD);
+  CHECK_NEAR(reading(i, 1), 73, 0.001);
+  CHECK_EQ(sent[i].deviceReport.controller_reports[1].timestamp, SUMMARY_PERIOD + 6);
+  CHECK_NEAR(reading(i, 2), total / num_hour_1, 0.01);
+  CHECK_EQ(sent[i].deviceReport.controller_reports[2].timestamp, time_total / num_hour_1);
+  i++;
+
+  /* Settings are replaced by the current ones */
+  CHECK(sent[i].has_deviceSettings);
+  CHECK_NEAR(sent[i].deviceSettings.hysteresis, 1.5, 0.001);
+  i++;
+
+  CHECK_NEAR(reading(i, 0), 300, 0.001);
+}
+
+static void
+test_carry_budget(void)
+{
+  uint32_t n0;
+  uint32_t n;
+
+  reset();
+
+  n0 = fill_events(0);
+  n = fill_events(n0);
+  store_report(BACKLOG_EVENT, 0, n, n);
+
+  /* Only the newest events of the oldest sector fit in the budget */
+  uint32_t carried = CARRY_BUDGET / RECORD_LEN;
+  CHECK(send_backlog(MAX_SENT));
+  CHECK_EQ(num_sent, (n - n0) + carried + 1);
+  CHECK_NEAR(reading(n - n0, 0), n0 - carried, 0.001);
+}
+
+static void
+test_resume_after_reclaim(void)
+{
+  uint32_t n0;
+  uint32_t n;
+
+  reset();
+
+  /* Sending fails part way through the oldest sector */
+  n0 = fill_events(0);
+  store_report(BACKLOG_EVENT, 0, n0, n0);
+  CHECK(!send_backlog(n0 - 100));
+  CHECK_EQ(num_sent, n0 - 100);
+
+  /* Wrapping the ring carries only what was left to send */
+  n = fill_events(n0 + 1);
+  store_report(BACKLOG_EVENT, 0, n, n);
+  CHECK(!sectors[0].valid);
+  CHECK_EQ(write_offset, RECORDS_START + (101 * RECORD_LEN));
+
+  CHECK(send_backlog(MAX_SENT));
+  CHECK(web_api_backlog_empty());
+  check_sent_once(n + 1);
+}
+
+static void
+test_sent_sector_dropped(void)
+{
+  uint32_t n0;
+  uint32_t n;
+
+  reset();
+
+  /* Sending fails in the second sector, after all of the oldest */
+  n0 = fill_events(0);
+  store_report(BACKLOG_EVENT, 0, n0, n0);
+  store_report(BACKLOG_EVENT, 0, n0 + 1, n0 + 1);
+  CHECK(!send_backlog(n0 + 1));
+
+  n = fill_events(n0 + 2);
+  store_report(BACKLOG_EVENT, 0, n, n);
+  CHECK(!sectors[0].valid);
+  CHECK_EQ(write_offset, RECORDS_START + RECORD_LEN);
+
+  CHECK(send_backlog(MAX_SENT));
+  check_sent_once(n + 1);
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_summarize);
+  RUN_TEST(test_carry_budget);
+  RUN_TEST(test_resume_after_reclaim);
+  RUN_TEST(test_sent_sector_dropped);
+
+  TEST_MAIN_END();
+}
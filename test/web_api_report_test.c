@@ -0,0 +1,200 @@
+
+#include "test.h"
+#include "web_api_report.h"
+
+#include <string.h>
+
+
+/* Tests the report policy in web_api_report.c: routine reports under the
+ * deadband and interval limits, and events for relay switches, setpoint
+ * moves and sensor timeouts with or without a new sample.
+ */
+
+#define SETPOINT  68.0f
+#define OUTPUTS   0x01
+
+systime_t test_time;
+int test_failures;
+
+
+static quantity_t
+temp_f(float value)
+{
+  quantity_t q = { value, UNIT_TEMP_DEG_F };
+  return q;
+}
+
+static backlog_kind_t
+kind(web_api_report_t* r, float setpoint, uint8_t outputs)
+{
+  return web_api_report_kind(r, setpoint, outputs, test_time);
+}
+
+static void
+sent(web_api_report_t* r, float setpoint, uint8_t outputs)
+{
+  web_api_report_sent(r, setpoint, outputs, test_time);
+}
+
+/* Takes a first reading and reports it. */
+static void
+start(web_api_report_t* r)
+{
+  memset(r, 0, sizeof(*r));
+  test_time = 1000;
+
+  CHECK_EQ(kind(r, SETPOINT, OUTPUTS), BACKLOG_NONE);
+  web_api_report_sample(r, temp_f(65));
+  CHECK_EQ(kind(r, SETPOINT, OUTPUTS), BACKLOG_EVENT);
+  sent(r, SETPOINT, OUTPUTS);
+  CHECK_EQ(kind(r, SETPOINT, OUTPUTS), BACKLOG_NONE);
+}
+
+static void
+test_routine_reports(void)
+{
+  web_api_report_t r;
+  start(&r);
+
+  /* Too small a move is not reported until the maximum interval */
+  test_time += S2ST(20);
+  web_api_report_sample(&r, temp_f(65.2));
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_NONE);
+
+  test_time += S2ST(5 * 60);
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_REPORT);
+  sent(&r, SETPOINT, OUTPUTS);
+
+  /* A large move waits out the minimum interval */
+  test_time += S2ST(5);
+  web_api_report_sample(&r, temp_f(66));
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_NONE);
+
+  test_time += S2ST(5);
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_REPORT);
+  sent(&r, SETPOINT, OUTPUTS);
+
+  /* Nothing is reported without a new sample, however long it has been */
+  test_time += S2ST(60 * 60);
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_NONE);
+}
+
+static void
+test_celsius_deadband(void)
+{
+  web_api_report_t r;
+  quantity_t q = { 20, UNIT_TEMP_DEG_C };
+
+  memset(&r, 0, sizeof(r));
+  test_time = 0;
+  web_api_report_sample(&r, q);
+  sent(&r, SETPOINT, OUTPUTS);
+
+  /* 0.25 C is 0.45 F, under the deadband */
+  test_time += S2ST(20);
+  q.value = 20.25;
+  web_api_report_sample(&r, q);
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_NONE);
+
+  q.value = 20.3;
+  web_api_report_sample(&r, q);
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_REPORT);
+}
+
+static void
+test_events_without_sample(void)
+{
+  web_api_report_t r;
+  start(&r);
+
+  /* A relay switching is reported at once */
+  test_time += S2ST(1);
+  CHECK_EQ(kind(&r, SETPOINT, 0x03), BACKLOG_EVENT);
+  sent(&r, SETPOINT, 0x03);
+  CHECK_EQ(kind(&r, SETPOINT, 0x03), BACKLOG_NONE);
+
+  /* So is the setpoint moving, but not by less than its deadband */
+  CHECK_EQ(kind(&r, SETPOINT + 0.05f, 0x03), BACKLOG_NONE);
+  CHECK_EQ(kind(&r, SETPOINT + 0.5f, 0x03), BACKLOG_EVENT);
+  sent(&r, SETPOINT + 0.5f, 0x03);
+  CHECK_EQ(kind(&r, SETPOINT + 0.5f, 0x03), BACKLOG_NONE);
+}
+
+static void
+test_sensor_timeout(void)
+{
+  web_api_report_t r;
+  start(&r);
+
+  /* The timeout is reported once, carrying the last reading */
+  test_time += S2ST(1);
+  web_api_report_timeout(&r);
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_EVENT);
+  sent(&r, SETPOINT, OUTPUTS);
+  CHECK_NEAR(r.last_sample.value, 65, 0.001);
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_NONE);
+
+  test_time += S2ST(60);
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_NONE);
+
+  /* The first reading after the sensor comes back goes out at once, even
+   * though it has hardly moved.
+   */
+  test_time += S2ST(1);
+  web_api_report_sample(&r, temp_f(65.1));
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_EVENT);
+  sent(&r, SETPOINT, OUTPUTS);
+
+  test_time += S2ST(1);
+  web_api_report_sample(&r, temp_f(65.2));
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_NONE);
+}
+
+static void
+test_timeout_before_first_sample(void)
+{
+  web_api_report_t r;
+
+  memset(&r, 0, sizeof(r));
+  test_time = 0;
+
+  /* There is no reading to report yet, the first one is an event anyway */
+  web_api_report_timeout(&r);
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_NONE);
+
+  web_api_report_sample(&r, temp_f(70));
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_EVENT);
+  sent(&r, SETPOINT, OUTPUTS);
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_NONE);
+}
+
+static void
+test_tick_wrap(void)
+{
+  web_api_report_t r;
+
+  memset(&r, 0, sizeof(r));
+  test_time = (systime_t)0 - S2ST(5);
+  web_api_report_sample(&r, temp_f(65));
+  sent(&r, SETPOINT, OUTPUTS);
+
+  test_time += S2ST(8);
+  web_api_report_sample(&r, temp_f(67));
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_NONE);
+
+  test_time += S2ST(2);
+  CHECK_EQ(kind(&r, SETPOINT, OUTPUTS), BACKLOG_REPORT);
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_routine_reports);
+  RUN_TEST(test_celsius_deadband);
+  RUN_TEST(test_events_without_sample);
+  RUN_TEST(test_sensor_timeout);
+  RUN_TEST(test_timeout_before_first_sample);
+  RUN_TEST(test_tick_wrap);
+
+  TEST_MAIN_END();
+}
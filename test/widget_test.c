@@ -0,0 +1,258 @@
+
+#include "test.h"
+
+/* The hit list is private to widget.c, so the tests build it directly */
+#include "widget.c"
+
+
+/* Tests widget_hit_test() in widget.c against the recursive tree walk it
+ * replaced, on a deep tree of overlapping widgets, and checks that the
+ * cached hit list is rebuilt after widgets are added, removed, moved,
+ * hidden and shown.
+ */
+
+#define TREE_DEPTH   5
+#define TREE_FANOUT  3
+
+systime_t test_time;
+int test_failures;
+
+static uint32_t rand_state;
+
+
+void gfx_ctx_push(void) { }
+void gfx_ctx_pop(void) { }
+void gfx_push_translation(uint16_t x, uint16_t y) { }
+void gfx_clear_rect(rect_t rect) { }
+void gfx_set_bg_color(color_t color) { }
+void gui_request_paint(void) { }
+
+static uint32_t
+next_rand(uint32_t range)
+{
+  rand_state = (rand_state * 1103515245) + 12345;
+  return (rand_state >> 16) % range;
+}
+
+/* The hit test as it was before the hit list: children first, earlier
+ * siblings first, positions relative to the parent.
+ */
+static widget_t*
+reference_hit_test(widget_t* root, point_t p)
+{
+  widget_t* w;
+
+  for (w = root->first_child; w != NULL; w = w->next_sibling) {
+    point_t translated_p = {
+        .x = p.x - root->rect.x,
+        .y = p.y - root->rect.y,
+    };
+    widget_t* w_hit = reference_hit_test(w, translated_p);
+    if (w_hit != NULL)
+      return w_hit;
+  }
+
+  if (widget_is_visible(root) && rect_inside(root->rect, p))
+    return root;
+
+  return NULL;
+}
+
+/* Each widget gets a few children which overlap each other and may hang
+ * over the edges of their parent.
+ */
+static void
+build_tree(widget_t* parent, int depth)
+{
+  int i;
+
+  if (depth == 0)
+    return;
+
+  for (i = 0; i < TREE_FANOUT; ++i) {
+    rect_t r = {
+        .x = next_rand(parent->rect.width),
+        .y = next_rand(parent->rect.height),
+        .width = 10 + next_rand(parent->rect.width / 2 + 1),
+        .height = 10 + next_rand(parent->rect.height / 2 + 1),
+    };
+    widget_t* w = widget_create(parent, NULL, NULL, r);
+    build_tree(w, depth - 1);
+  }
+}
+
+static int
+count_widgets(widget_t* w)
+{
+  int i;
+  int n = 1;
+
+  for (i = 0; i < widget_num_children(w); ++i)
+    n += count_widgets(widget_get_child(w, i));
+  return n;
+}
+
+/* Picks a widget below the root by walking down a random path */
+static widget_t*
+pick_widget(widget_t* root)
+{
+  widget_t* w = root;
+
+  do {
+    w = widget_get_child(w, next_rand(widget_num_children(w)));
+  } while ((widget_num_children(w) > 0) && (next_rand(3) != 0));
+
+  return w;
+}
+
+/* Compares the two hit tests at every 3rd pixel of the screen. Returns the
+ * number of points where they differ.
+ */
+static int
+compare_hit_tests(widget_t* root)
+{
+  point_t p;
+  int mismatches = 0;
+
+  for (p.y = 0; p.y < 240; p.y += 3) {
+    for (p.x = 0; p.x < 320; p.x += 3) {
+      if (widget_hit_test(root, p) != reference_hit_test(root, p))
+        mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+static widget_t*
+make_screen(void)
+{
+  rect_t screen_rect = { 0, 0, 320, 240 };
+  widget_t* root = widget_create(NULL, NULL, NULL, screen_rect);
+
+  build_tree(root, TREE_DEPTH);
+  return root;
+}
+
+static void
+test_matches_recursive_walk(void)
+{
+  widget_t* root;
+
+  rand_state = 1;
+  root = make_screen();
+  CHECK_EQ(count_widgets(root), 1 + 3 + 9 + 27 + 81 + 243);
+  CHECK_EQ(compare_hit_tests(root), 0);
+
+  /* Every widget was visible, so every widget is in the list */
+  CHECK_EQ(root->hit_list->len, count_widgets(root));
+  CHECK(!root->hit_list->dirty);
+
+  widget_destroy(root);
+}
+
+/* Each change to the tree marks the list dirty, and the rebuilt list
+ * agrees with the tree walk again.
+ */
+static void
+test_invalidation(void)
+{
+  int i;
+  widget_t* root;
+  point_t origin = { 0, 0 };
+
+  rand_state = 7;
+  root = make_screen();
+  widget_hit_test(root, origin);
+
+  for (i = 0; i < 60; ++i) {
+    widget_t* w = pick_widget(root);
+    bool changed = true;
+    rect_t r;
+
+    switch (i % 6) {
+      case 0:
+        r.x = next_rand(100);
+        r.y = next_rand(100);
+        r.width = 20 + next_rand(100);
+        r.height = 20 + next_rand(100);
+        widget_create(w, NULL, NULL, r);
+        break;
+
+      case 1:
+        /* Leaving the top level in place so there is always a tree */
+        if (widget_get_parent(w) != root)
+          widget_destroy(w);
+        else
+          changed = false;
+        break;
+
+      case 2:
+        changed = w->visible;
+        widget_hide(w);
+        break;
+
+      case 3:
+        w = pick_widget(root);
+        changed = !w->visible;
+        widget_show(w);
+        break;
+
+      case 4:
+        r = widget_get_rect(w);
+        r.x += 7;
+        r.y -= 5;
+        widget_set_rect(w, r);
+        break;
+
+      default: {
+        /* Moving a subtree to another parent */
+        widget_t* to = pick_widget(root);
+        widget_t* up;
+        for (up = to; (up != NULL) && (up != w); up = widget_get_parent(up))
+          ;
+        if (up == NULL) {
+          widget_unparent(w);
+          widget_add_child(to, w);
+        }
+        else {
+          changed = false;
+        }
+        break;
+      }
+    }
+
+    /* Only a change to the tree rebuilds the list */
+    CHECK_EQ(root->hit_list->dirty, changed);
+    CHECK_EQ(compare_hit_tests(root), 0);
+    CHECK(!root->hit_list->dirty);
+  }
+
+  /* Hiding a parent takes its whole subtree out of the list */
+  widget_t* parent = widget_get_child(root, 0);
+  int before = root->hit_list->len;
+  int subtree = 0;
+  for (i = 0; i < root->hit_list->len; ++i) {
+    widget_t* w;
+    for (w = root->hit_list->entries[i].widget; w != NULL; w = widget_get_parent(w)) {
+      if (w == parent) {
+        subtree++;
+        break;
+      }
+    }
+  }
+  widget_hide(parent);
+  widget_hit_test(root, origin);
+  CHECK_EQ(root->hit_list->len, before - subtree);
+  CHECK_EQ(compare_hit_tests(root), 0);
+
+  widget_destroy(root);
+}
+
+int
+main(void)
+{
+  RUN_TEST(test_matches_recursive_walk);
+  RUN_TEST(test_invalidation);
+
+  TEST_MAIN_END();
+}